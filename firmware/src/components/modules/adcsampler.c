@@ -0,0 +1,332 @@
+/*
+Background ADC sampler for ESP32 to allow interfacing from Lua
+Authored by: ChiliPeppr (John Lauer) 2019
+
+adc.read() from Lua blocks the VM for every sample, so averaging a noisy sensor
+like the TMP36 on the motor meant a loop of reads right when motion refills
+needed the VM. Here an esp_timer samples an ADC1 channel in the background,
+oversamples each tick, and keeps a running filtered value plus min, max and a
+sample count. Reading it from Lua just copies those out.
+
+ESP-IDF docs for ADC
+https://docs.espressif.com/projects/esp-idf/en/latest/api-reference/peripherals/adc.html
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+
+Unless required by applicable law or agreed to in writing, this
+software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "module.h"
+#include "common.h"
+#include "lauxlib.h"
+#include "lmem.h"
+#include "platform.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lextra.h"
+#include "driver/adc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <string.h>
+#include <stdint.h>
+
+static const char* TAG = "AdcSampler";
+
+// the filtered value is kept with this many fraction bits so a small filterShift
+// doesn't round away changes of less than one count
+#define ADCSAMPLER_FRAC_BITS 8
+
+typedef struct{
+  esp_timer_handle_t timer;
+  adc1_channel_t channel;
+  uint32_t interval_us;
+  uint8_t oversample;     // reads averaged into each sample
+  uint8_t filter_shift;   // filter moves 1/2^shift of the way to each new sample
+  bool is_debug;
+  bool is_running;
+  bool is_primed;         // filter has had its first sample
+  bool is_stopping;       // set under the mux by unregister(), ticks that see it do nothing
+  bool is_ticking;        // a tick is reading the ADC
+  uint32_t filt;          // filtered value, raw counts << ADCSAMPLER_FRAC_BITS
+  uint16_t last;          // most recent sample
+  uint16_t min;           // since the last reset
+  uint16_t max;
+  uint32_t count;         // samples since the last reset
+  uint64_t sum;
+  uint32_t total;         // samples since create
+} adcsampler_struct_t;
+typedef adcsampler_struct_t *adcsampler_t;
+
+// Protects the running values between the sample timer and reads from Lua
+static portMUX_TYPE adcsampler_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static adcsampler_t adcsampler_get( lua_State *L, int stack )
+{
+  return (adcsampler_t)luaL_checkudata(L, stack, "adcsampler.sampler");
+}
+
+// Take one sample. The reads happen outside our lock, only the update is inside it.
+static void adcsampler_sample(adcsampler_t s)
+{
+  uint32_t acc = 0;
+  for (int i = 0; i < s->oversample; i++) {
+    int raw = adc1_get_raw(s->channel);
+    if (raw < 0) return;
+    acc += raw;
+  }
+  uint16_t val = (acc + s->oversample / 2) / s->oversample;
+  uint32_t scaled = (uint32_t)val << ADCSAMPLER_FRAC_BITS;
+
+  portENTER_CRITICAL(&adcsampler_mux);
+  if (!s->is_primed) {
+    s->filt = scaled;
+    s->is_primed = true;
+  } else {
+    // same as filt += (scaled - filt) / 2^shift, done signed so it can go down
+    s->filt = (uint32_t)((int32_t)s->filt + (((int32_t)scaled - (int32_t)s->filt) >> s->filter_shift));
+  }
+  s->last = val;
+  if (s->count == 0 || val < s->min) s->min = val;
+  if (s->count == 0 || val > s->max) s->max = val;
+  s->count++;
+  s->sum += val;
+  s->total++;
+  portEXIT_CRITICAL(&adcsampler_mux);
+}
+
+// Sample timer. Runs in the esp_timer task, not an ISR, since adc1_get_raw() takes
+// the driver's lock. is_ticking lets unregister() know when it's safe to delete the timer.
+static void adcsampler_tick(void *arg)
+{
+  adcsampler_t s = (adcsampler_t)arg;
+  portENTER_CRITICAL(&adcsampler_mux);
+  bool is_stopping = s->is_stopping;
+  if (!is_stopping) s->is_ticking = true;
+  portEXIT_CRITICAL(&adcsampler_mux);
+  if (is_stopping) return;
+
+  adcsampler_sample(s);
+
+  portENTER_CRITICAL(&adcsampler_mux);
+  s->is_ticking = false;
+  portEXIT_CRITICAL(&adcsampler_mux);
+}
+
+/*
+Lua sample code:
+s = adcsampler.create({
+  channel = 3, -- ADC1 channel 0 to 7. 0: GPIO36, 3: GPIO39, 6: GPIO34, ...
+  atten = adc.ATTEN_0db, -- Defaults to 0db, same values as the adc module
+  bits = 10, -- 9 to 12. Defaults to 12. Sets the width for all of ADC1.
+  intervalUs = 10000, -- Time between samples. Defaults to 10000, 100 per second.
+  oversample = 4, -- Reads averaged into each sample. Defaults to 4.
+  filterShift = 4, -- Filter moves 1/16th of the way to each sample. 0 is no filter. Defaults to 4.
+  isDebug = false,
+})
+s:start()
+avg, min, max, count = s:read()
+*/
+static int adcsampler_create( lua_State *L ) {
+
+  luaL_checkanytable(L, 1);
+  lua_settop(L, 1);
+
+  int channel = opt_checkint_range(L, "channel", 0, 0, ADC1_CHANNEL_MAX - 1);
+  int atten = opt_checkint_range(L, "atten", ADC_ATTEN_DB_0, ADC_ATTEN_DB_0, ADC_ATTEN_DB_11);
+  int bits = opt_checkint_range(L, "bits", 12, 9, 12);
+  int interval_us = opt_checkint_range(L, "intervalUs", 10000, 100, 60000000);
+  int oversample = opt_checkint_range(L, "oversample", 4, 1, 64);
+  int filter_shift = opt_checkint_range(L, "filterShift", 4, 0, 12);
+  bool is_debug = opt_checkbool(L, "isDebug", false);
+
+  if (adc1_config_width((adc_bits_width_t)(ADC_WIDTH_BIT_9 + (bits - 9))) != ESP_OK ||
+      adc1_config_channel_atten((adc1_channel_t)channel, (adc_atten_t)atten) != ESP_OK) {
+    return luaL_error( L, "Could not set up ADC1 channel %d", channel );
+  }
+
+  adcsampler_t s = (adcsampler_t)lua_newuserdata(L, sizeof(adcsampler_struct_t));
+  memset(s, 0, sizeof(adcsampler_struct_t));
+  luaL_getmetatable(L, "adcsampler.sampler");
+  lua_setmetatable(L, -2);
+
+  s->channel = (adc1_channel_t)channel;
+  s->interval_us = interval_us;
+  s->oversample = oversample;
+  s->filter_shift = filter_shift;
+  s->is_debug = is_debug;
+
+  esp_timer_create_args_t args = {
+    .callback = adcsampler_tick,
+    .arg = s,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "adcsampler"
+  };
+  if (esp_timer_create(&args, &s->timer) != ESP_OK) {
+    s->timer = NULL;
+    return luaL_error( L, "Could not create sample timer" );
+  }
+
+  if (is_debug) ESP_LOGI(TAG, "Created for ADC1 channel %d, %d bits, every %d us, oversample %d, filterShift %d",
+    channel, bits, interval_us, oversample, filter_shift);
+
+  return 1;
+}
+
+// Lua: s:start()
+// Start sampling. The first sample is taken right away so read() has a value.
+static int adcsampler_start( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+  if (s->timer == NULL) return luaL_error( L, "Sampler was unregistered" );
+  if (s->is_running) return 0;
+
+  adcsampler_tick(s);
+  esp_timer_start_periodic(s->timer, s->interval_us);
+  s->is_running = true;
+  if (s->is_debug) ESP_LOGI(TAG, "Started on channel %d", s->channel);
+  return 0;
+}
+
+// Lua: s:stop()
+// Stop sampling. The values stay readable.
+static int adcsampler_stop( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+  if (s->timer != NULL && s->is_running) esp_timer_stop(s->timer);
+  s->is_running = false;
+  if (s->is_debug) ESP_LOGI(TAG, "Stopped on channel %d", s->channel);
+  return 0;
+}
+
+// Lua: avg, min, max, count = s:read(isReset)
+// The filtered value in raw counts, then the min and max sample and how many samples
+// since the last reset. Nothing is read from the ADC here. Pass isReset true to start
+// min, max and count over after reading them. avg is nil until the first sample.
+static int adcsampler_read( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+  bool is_reset = lua_toboolean(L, 2);
+
+  portENTER_CRITICAL(&adcsampler_mux);
+  bool is_primed = s->is_primed;
+  uint32_t filt = s->filt;
+  uint16_t min = s->min;
+  uint16_t max = s->max;
+  uint32_t count = s->count;
+  if (is_reset) {
+    s->count = 0;
+    s->sum = 0;
+  }
+  portEXIT_CRITICAL(&adcsampler_mux);
+
+  if (is_primed) lua_pushnumber(L, (lua_Number)filt / (1 << ADCSAMPLER_FRAC_BITS));
+  else lua_pushnil(L);
+  if (count > 0) {
+    lua_pushinteger(L, min);
+    lua_pushinteger(L, max);
+  } else {
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+  lua_pushinteger(L, count);
+  return 4;
+}
+
+// Lua: tbl = s:stats()
+// {Last, Mean, Min, Max, Count, Total} where Mean is the plain average since the last
+// reset, not the filtered value, and Total counts every sample since create.
+static int adcsampler_stats( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+
+  portENTER_CRITICAL(&adcsampler_mux);
+  uint16_t last = s->last;
+  uint16_t min = s->min;
+  uint16_t max = s->max;
+  uint32_t count = s->count;
+  uint64_t sum = s->sum;
+  uint32_t total = s->total;
+  portEXIT_CRITICAL(&adcsampler_mux);
+
+  lua_createtable(L, 0, 6);
+  if (total > 0) {
+    lua_pushinteger(L, last);
+    lua_setfield(L, -2, "Last");
+  }
+  if (count > 0) {
+    lua_pushnumber(L, (lua_Number)sum / count);
+    lua_setfield(L, -2, "Mean");
+    lua_pushinteger(L, min);
+    lua_setfield(L, -2, "Min");
+    lua_pushinteger(L, max);
+    lua_setfield(L, -2, "Max");
+  }
+  lua_pushinteger(L, count);
+  lua_setfield(L, -2, "Count");
+  lua_pushinteger(L, total);
+  lua_setfield(L, -2, "Total");
+  return 1;
+}
+
+// Lua: s:reset()
+// Start min, max and count over. The filtered value carries on.
+static int adcsampler_reset( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+  portENTER_CRITICAL(&adcsampler_mux);
+  s->count = 0;
+  s->sum = 0;
+  portEXIT_CRITICAL(&adcsampler_mux);
+  return 0;
+}
+
+// Lua: s:unregister()
+// Stop sampling and delete the timer. esp_timer_stop() doesn't wait for a tick that's
+// already running, and __gc frees us right after, so wait that one out first.
+static int adcsampler_unregister( lua_State *L ) {
+
+  adcsampler_t s = adcsampler_get(L, 1);
+  if (s->timer != NULL) {
+    portENTER_CRITICAL(&adcsampler_mux);
+    s->is_stopping = true;
+    portEXIT_CRITICAL(&adcsampler_mux);
+    esp_timer_stop(s->timer);
+    while (true) {
+      portENTER_CRITICAL(&adcsampler_mux);
+      bool is_ticking = s->is_ticking;
+      portEXIT_CRITICAL(&adcsampler_mux);
+      if (!is_ticking) break;
+      vTaskDelay(1);
+    }
+    esp_timer_delete(s->timer);
+    s->timer = NULL;
+  }
+  s->is_running = false;
+  return 0;
+}
+
+LROT_BEGIN(adcsampler_sampler)
+  LROT_FUNCENTRY( start,          adcsampler_start )
+  LROT_FUNCENTRY( stop,           adcsampler_stop )
+  LROT_FUNCENTRY( read,           adcsampler_read )
+  LROT_FUNCENTRY( stats,          adcsampler_stats )
+  LROT_FUNCENTRY( reset,          adcsampler_reset )
+  LROT_FUNCENTRY( unregister,     adcsampler_unregister )
+  LROT_FUNCENTRY( __gc,           adcsampler_unregister )
+  LROT_TABENTRY ( __index,        adcsampler_sampler )
+LROT_END(adcsampler_sampler, NULL, 0)
+
+LROT_BEGIN(adcsampler)
+  LROT_FUNCENTRY( create,         adcsampler_create )
+LROT_END(adcsampler, NULL, 0)
+
+int luaopen_adcsampler(lua_State *L) {
+  luaL_rometatable(L, "adcsampler.sampler", (void *)adcsampler_sampler_map);
+  return 0;
+}
+
+NODEMCU_MODULE(ADCSAMPLER, "adcsampler", adcsampler, luaopen_adcsampler);
@@ -0,0 +1,906 @@
+/*
+Binary framing for the Cayenn protocol
+Authored by: ChiliPeppr (John Lauer) 2019
+
+Cayenn messages are small tables like {Cmd="CmdQ", Id=12, RunCmd={...}}. Over
+JSON every TCP receive had to hold exactly one object, and json.decode was most
+of our CPU during bursts of CmdQ uploads. Here a message is a length prefixed
+frame holding a compact binary encoding of the same table, and the decoder
+takes the TCP stream in whatever chunks it arrives in, split or coalesced.
+
+Frame
+  byte 0    0xCA magic
+  byte 1    version, 1
+  byte 2-3  payload length, little endian
+  payload   one value, normally a map
+
+Values are a type byte followed by its data, little endian
+  0x00 nil, 0x01 false, 0x02 true
+  0x03 int8, 0x04 int16, 0x05 int32, 0x06 float32, 0x07 float64
+  0x08 string with u8 length, 0x09 string with u16 length
+  0x0A map with u8 count, then count times a key (u8 length + bytes) and a value
+  0x0B array with u8 count, then count values
+
+It also has crc32(), which the cmdlog_v1 record log uses to catch torn writes.
+
+It also has the command dispatcher. Commands register by name once, get a small
+id, and a message is routed by hashing its Cmd into an open addressed table, or
+straight from a CmdId, instead of walking _G and an if/elseif chain in Lua.
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+
+Unless required by applicable law or agreed to in writing, this
+software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include "module.h"
+#include "lauxlib.h"
+#include "lmem.h"
+#include "esp_log.h"
+#include "lextra.h"
+#include "common.h"
+
+#include <string.h>
+#include <stdint.h>
+
+static const char* TAG = "CayennBin";
+
+#define CAYENNBIN_MAGIC   0xCA
+#define CAYENNBIN_VERSION 1
+#define CAYENNBIN_HDR_LEN 4
+#define CAYENNBIN_MAX_DEPTH 8
+
+#define CAYENNBIN_T_NIL   0x00
+#define CAYENNBIN_T_FALSE 0x01
+#define CAYENNBIN_T_TRUE  0x02
+#define CAYENNBIN_T_I8    0x03
+#define CAYENNBIN_T_I16   0x04
+#define CAYENNBIN_T_I32   0x05
+#define CAYENNBIN_T_F32   0x06
+#define CAYENNBIN_T_F64   0x07
+#define CAYENNBIN_T_STR8  0x08
+#define CAYENNBIN_T_STR16 0x09
+#define CAYENNBIN_T_MAP   0x0A
+#define CAYENNBIN_T_ARR   0x0B
+
+// One decoded value. A frame is parsed into a flat list of these in the order they
+// appear, maps and arrays followed by their children, before any Lua table is made.
+// So a bad frame is thrown away whole and never hands Lua half a table.
+typedef struct {
+  uint8_t type;           // CAYENNBIN_T_*, ints and floats come out as I32 and F64
+  uint8_t key_len;
+  uint16_t count;         // children for a map or array, length for a string
+  const uint8_t *key;     // NULL inside an array or for the top value
+  union {
+    int32_t i;
+    double d;
+    const uint8_t *s;
+  } v;
+} cayennbin_tok_t;
+
+typedef enum {
+  CAYENNBIN_ST_HDR,       // collecting the 4 header bytes
+  CAYENNBIN_ST_PAYLOAD,   // collecting payload bytes into buf
+  CAYENNBIN_ST_SKIP,      // throwing away the payload of a frame too big for buf
+} cayennbin_state_t;
+
+typedef struct {
+  bool is_debug;
+  int cb_ref;
+  cayennbin_state_t state;
+  uint8_t hdr[CAYENNBIN_HDR_LEN];
+  uint8_t hdr_len;
+  uint16_t frame_len;     // payload length of the frame we're in
+  uint16_t got;           // payload bytes so far
+  uint16_t max_frame;
+  uint8_t *buf;           // [max_frame] allocated once in createDecoder()
+  uint16_t max_toks;
+  cayennbin_tok_t *toks;  // [max_toks] allocated once in createDecoder()
+  uint16_t tok_cnt;
+  uint32_t frames;
+  uint32_t errors;        // frames thrown away, bad version, too big or malformed
+  uint32_t dropped;       // bytes skipped looking for the next magic byte
+} cayennbin_dec_struct_t;
+typedef cayennbin_dec_struct_t *cayennbin_dec_t;
+
+// Dispatcher slot. Names are kept alive by the names table in the registry, and Lua 5.1
+// never moves a string, so we can hold on to the pointer to compare against.
+typedef struct {
+  uint32_t hash;
+  uint8_t id;             // 0 means the slot is empty
+  uint8_t name_len;
+  const char *name;
+} cayennbin_slot_t;
+
+typedef struct {
+  bool is_debug;
+  uint16_t slot_mask;     // slot count - 1, the count is a power of 2
+  cayennbin_slot_t *slots;
+  uint8_t max_cmds;
+  uint8_t cmd_cnt;
+  int *fn_refs;           // [max_cmds] by id - 1
+  int names_ref;          // Lua table of id -> name
+  int fallback_ref;
+  uint32_t calls;
+  uint32_t misses;
+} cayennbin_disp_struct_t;
+typedef cayennbin_disp_struct_t *cayennbin_disp_t;
+
+static cayennbin_dec_t cayennbin_dec_get( lua_State *L, int stack )
+{
+  return (cayennbin_dec_t)luaL_checkudata(L, stack, "cayennbin.decoder");
+}
+
+static cayennbin_disp_t cayennbin_disp_get( lua_State *L, int stack )
+{
+  return (cayennbin_disp_t)luaL_checkudata(L, stack, "cayennbin.dispatcher");
+}
+
+//
+// Encoding
+//
+
+// Internal call
+// Append bytes at pos, or just count them when out is NULL
+static size_t cayennbin_put(uint8_t *out, size_t pos, const void *src, size_t len) {
+  if (out != NULL) memcpy(&out[pos], src, len);
+  return pos + len;
+}
+
+static size_t cayennbin_put_u8(uint8_t *out, size_t pos, uint8_t v) {
+  return cayennbin_put(out, pos, &v, 1);
+}
+
+static size_t cayennbin_put_le(uint8_t *out, size_t pos, uint32_t v, int bytes) {
+  uint8_t b[4];
+  for (int i = 0; i < bytes; i++) b[i] = (v >> (8 * i)) & 0xff;
+  return cayennbin_put(out, pos, b, bytes);
+}
+
+// Internal call
+// Encode the value at idx. Called once with out = NULL to size and check the value, where
+// it raises a Lua error on anything we can't encode, then again to write it.
+static size_t cayennbin_enc(lua_State *L, int idx, uint8_t *out, size_t pos, int depth) {
+
+  if (depth > CAYENNBIN_MAX_DEPTH) {
+    luaL_error( L, "Tables nest deeper than %d", CAYENNBIN_MAX_DEPTH );
+  }
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      return cayennbin_put_u8(out, pos, CAYENNBIN_T_NIL);
+
+    case LUA_TBOOLEAN:
+      return cayennbin_put_u8(out, pos, lua_toboolean(L, idx) ? CAYENNBIN_T_TRUE : CAYENNBIN_T_FALSE);
+
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber(L, idx);
+      if (n >= -2147483648.0 && n <= 2147483647.0 && (lua_Number)(int32_t)n == n) {
+        int32_t i = (int32_t)n;
+        if (i >= INT8_MIN && i <= INT8_MAX) {
+          pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_I8);
+          return cayennbin_put_le(out, pos, (uint32_t)i, 1);
+        } else if (i >= INT16_MIN && i <= INT16_MAX) {
+          pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_I16);
+          return cayennbin_put_le(out, pos, (uint32_t)i, 2);
+        }
+        pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_I32);
+        return cayennbin_put_le(out, pos, (uint32_t)i, 4);
+      }
+      float f = (float)n;
+      if ((lua_Number)f == n) {
+        uint32_t u;
+        memcpy(&u, &f, 4);
+        pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_F32);
+        return cayennbin_put_le(out, pos, u, 4);
+      }
+      double d = (double)n;
+      uint64_t u;
+      memcpy(&u, &d, 8);
+      pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_F64);
+      pos = cayennbin_put_le(out, pos, (uint32_t)u, 4);
+      return cayennbin_put_le(out, pos, (uint32_t)(u >> 32), 4);
+    }
+
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      if (len > 0xffff) luaL_error( L, "Strings are limited to 65535 bytes" );
+      if (len <= 0xff) {
+        pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_STR8);
+        pos = cayennbin_put_le(out, pos, len, 1);
+      } else {
+        pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_STR16);
+        pos = cayennbin_put_le(out, pos, len, 2);
+      }
+      return cayennbin_put(out, pos, s, len);
+    }
+
+    case LUA_TTABLE: {
+      // it's an array if its keys are exactly 1..n
+      size_t n = lua_objlen(L, idx);
+      size_t cnt = 0;
+      lua_pushnil(L);
+      while (lua_next(L, idx) != 0) {
+        cnt++;
+        lua_pop(L, 1);
+      }
+      if (cnt > 0xff) luaL_error( L, "Tables are limited to 255 entries" );
+
+      if (n > 0 && n == cnt) {
+        pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_ARR);
+        pos = cayennbin_put_u8(out, pos, cnt);
+        for (size_t i = 1; i <= n; i++) {
+          lua_rawgeti(L, idx, i);
+          pos = cayennbin_enc(L, -1, out, pos, depth + 1);
+          lua_pop(L, 1);
+        }
+        return pos;
+      }
+
+      pos = cayennbin_put_u8(out, pos, CAYENNBIN_T_MAP);
+      pos = cayennbin_put_u8(out, pos, cnt);
+      lua_pushnil(L);
+      while (lua_next(L, idx) != 0) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+          luaL_error( L, "Map keys must be strings" );
+        }
+        size_t klen;
+        const char *k = lua_tolstring(L, -2, &klen);
+        if (klen > 0xff) luaL_error( L, "Keys are limited to 255 bytes" );
+        pos = cayennbin_put_u8(out, pos, klen);
+        pos = cayennbin_put(out, pos, k, klen);
+        pos = cayennbin_enc(L, -1, out, pos, depth + 1);
+        lua_pop(L, 1);
+      }
+      return pos;
+    }
+
+    default:
+      luaL_error( L, "Can't encode a %s", lua_typename(L, lua_type(L, idx)) );
+  }
+  return pos;
+}
+
+// Lua: frame = cayennbin.encode(tbl)
+// Returns the table as one binary frame, header included, ready to send on a socket
+static int cayennbin_encode( lua_State *L ) {
+
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+
+  size_t len = cayennbin_enc(L, 1, NULL, 0, 0);
+  if (len > 0xffff) {
+    return luaL_error( L, "Frame payload of %d bytes is over 65535", len );
+  }
+
+  // a userdata rather than luaM_malloc, so the GC frees it even if lua_pushlstring() raises
+  uint8_t *out = (uint8_t *)lua_newuserdata(L, CAYENNBIN_HDR_LEN + len);
+  out[0] = CAYENNBIN_MAGIC;
+  out[1] = CAYENNBIN_VERSION;
+  out[2] = len & 0xff;
+  out[3] = len >> 8;
+  cayennbin_enc(L, 1, &out[CAYENNBIN_HDR_LEN], 0, 0);
+  lua_pushlstring(L, (const char *)out, CAYENNBIN_HDR_LEN + len);
+  return 1;
+}
+
+// CRC-32 (IEEE, reflected 0xEDB88320), 4 bits at a time so the table is only 16 entries
+static const uint32_t cayennbin_crc_tbl[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static uint32_t cayennbin_crc32_raw(uint32_t crc, const uint8_t *p, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ cayennbin_crc_tbl[crc & 0x0f];
+    crc = (crc >> 4) ^ cayennbin_crc_tbl[crc & 0x0f];
+  }
+  return ~crc;
+}
+
+// Lua: crc = cayennbin.crc32(data, crc)
+// CRC-32 of a string, same as zlib's. Pass the last result as crc to carry on over another chunk.
+static int cayennbin_crc32( lua_State *L ) {
+  size_t len;
+  const uint8_t *p = (const uint8_t *)luaL_checklstring(L, 1, &len);
+  uint32_t crc = (uint32_t)luaL_optnumber(L, 2, 0);
+  lua_pushnumber(L, (lua_Number)cayennbin_crc32_raw(crc, p, len));
+  return 1;
+}
+
+//
+// Decoding
+//
+
+static uint32_t cayennbin_get_le(const uint8_t *p, int bytes) {
+  uint32_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint32_t)p[i] << (8 * i);
+  return v;
+}
+
+// Internal call
+// Parse one value at *pos into the next token and its children after it. Returns false
+// if the frame is malformed or has more values than the token list holds.
+static bool cayennbin_parse(cayennbin_dec_t dec, const uint8_t *p, uint16_t len, uint16_t *pos,
+                            const uint8_t *key, uint8_t key_len, int depth) {
+
+  if (depth > CAYENNBIN_MAX_DEPTH || dec->tok_cnt >= dec->max_toks || *pos >= len) return false;
+
+  cayennbin_tok_t *t = &dec->toks[dec->tok_cnt++];
+  t->key = key;
+  t->key_len = key_len;
+  t->count = 0;
+  uint8_t type = p[(*pos)++];
+  uint16_t left = len - *pos;
+  const uint8_t *d = &p[*pos];
+
+  switch (type) {
+    case CAYENNBIN_T_NIL:
+    case CAYENNBIN_T_FALSE:
+    case CAYENNBIN_T_TRUE:
+      t->type = type;
+      return true;
+
+    case CAYENNBIN_T_I8:
+      if (left < 1) return false;
+      t->type = CAYENNBIN_T_I32;
+      t->v.i = (int8_t)d[0];
+      *pos += 1;
+      return true;
+
+    case CAYENNBIN_T_I16:
+      if (left < 2) return false;
+      t->type = CAYENNBIN_T_I32;
+      t->v.i = (int16_t)cayennbin_get_le(d, 2);
+      *pos += 2;
+      return true;
+
+    case CAYENNBIN_T_I32:
+      if (left < 4) return false;
+      t->type = CAYENNBIN_T_I32;
+      t->v.i = (int32_t)cayennbin_get_le(d, 4);
+      *pos += 4;
+      return true;
+
+    case CAYENNBIN_T_F32: {
+      if (left < 4) return false;
+      uint32_t u = cayennbin_get_le(d, 4);
+      float f;
+      memcpy(&f, &u, 4);
+      t->type = CAYENNBIN_T_F64;
+      t->v.d = f;
+      *pos += 4;
+      return true;
+    }
+
+    case CAYENNBIN_T_F64: {
+      if (left < 8) return false;
+      uint64_t u = cayennbin_get_le(d, 4) | (uint64_t)cayennbin_get_le(d + 4, 4) << 32;
+      memcpy(&t->v.d, &u, 8);
+      t->type = CAYENNBIN_T_F64;
+      *pos += 8;
+      return true;
+    }
+
+    case CAYENNBIN_T_STR8:
+    case CAYENNBIN_T_STR16: {
+      int lbytes = type == CAYENNBIN_T_STR8 ? 1 : 2;
+      if (left < lbytes) return false;
+      uint16_t slen = cayennbin_get_le(d, lbytes);
+      if (left - lbytes < slen) return false;
+      t->type = CAYENNBIN_T_STR8;
+      t->count = slen;
+      t->v.s = d + lbytes;
+      *pos += lbytes + slen;
+      return true;
+    }
+
+    case CAYENNBIN_T_MAP:
+    case CAYENNBIN_T_ARR: {
+      if (left < 1) return false;
+      t->type = type;
+      t->count = d[0];
+      *pos += 1;
+      for (int i = 0; i < t->count; i++) {
+        const uint8_t *k = NULL;
+        uint8_t klen = 0;
+        if (type == CAYENNBIN_T_MAP) {
+          if (*pos >= len) return false;
+          klen = p[(*pos)++];
+          if (len - *pos < klen) return false;
+          k = &p[*pos];
+          *pos += klen;
+        }
+        if (!cayennbin_parse(dec, p, len, pos, k, klen, depth + 1)) return false;
+      }
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+// Internal call
+// Push the token at *idx as a Lua value, with all its children, and move *idx past them
+static void cayennbin_push_tok(lua_State *L, cayennbin_dec_t dec, uint16_t *idx) {
+
+  cayennbin_tok_t *t = &dec->toks[(*idx)++];
+  switch (t->type) {
+    case CAYENNBIN_T_FALSE: lua_pushboolean(L, 0); break;
+    case CAYENNBIN_T_TRUE:  lua_pushboolean(L, 1); break;
+    case CAYENNBIN_T_I32:   lua_pushinteger(L, t->v.i); break;
+    case CAYENNBIN_T_F64:   lua_pushnumber(L, t->v.d); break;
+    case CAYENNBIN_T_STR8:  lua_pushlstring(L, (const char *)t->v.s, t->count); break;
+    case CAYENNBIN_T_MAP:
+    case CAYENNBIN_T_ARR:
+      lua_createtable(L, t->type == CAYENNBIN_T_ARR ? t->count : 0, t->type == CAYENNBIN_T_MAP ? t->count : 0);
+      for (int i = 0; i < t->count; i++) {
+        cayennbin_tok_t *c = &dec->toks[*idx];
+        if (t->type == CAYENNBIN_T_MAP) {
+          lua_pushlstring(L, (const char *)c->key, c->key_len);
+          cayennbin_push_tok(L, dec, idx);
+          lua_rawset(L, -3);
+        } else {
+          cayennbin_push_tok(L, dec, idx);
+          lua_rawseti(L, -2, i + 1);
+        }
+      }
+      break;
+    default:
+      lua_pushnil(L);
+      break;
+  }
+}
+
+// Internal call
+// A whole payload is in buf. Parse it and hand it to the cb.
+static void cayennbin_frame_done(lua_State *L, cayennbin_dec_t dec) {
+
+  uint16_t pos = 0;
+  dec->tok_cnt = 0;
+  if (!cayennbin_parse(dec, dec->buf, dec->frame_len, &pos, NULL, 0, 0) || pos != dec->frame_len) {
+    dec->errors++;
+    ESP_LOGW(TAG, "Dropped malformed frame of %d bytes", dec->frame_len);
+    return;
+  }
+  dec->frames++;
+  if (dec->is_debug) ESP_LOGI(TAG, "Frame of %d bytes, %d values", dec->frame_len, dec->tok_cnt);
+
+  if (dec->cb_ref == LUA_NOREF) return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, dec->cb_ref);
+  uint16_t idx = 0;
+  cayennbin_push_tok(L, dec, &idx);
+  if (lua_pcall(L, 1, 0, 0) != 0) {
+    ESP_LOGI(TAG, "error running callback function: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+// Lua: count = dec:write(data)
+// Feed the decoder bytes exactly as the socket gave them. Every frame that completes calls
+// the cb with its table. Partial frames wait for the next write(). Returns how many frames
+// completed in this call.
+static int cayennbin_dec_write( lua_State *L ) {
+
+  cayennbin_dec_t dec = cayennbin_dec_get(L, 1);
+  size_t len;
+  const uint8_t *p = (const uint8_t *)luaL_checklstring(L, 2, &len);
+  uint32_t frames = dec->frames;
+
+  size_t i = 0;
+  while (i < len) {
+    switch (dec->state) {
+      case CAYENNBIN_ST_HDR:
+        // resync on the magic byte if we got junk between frames
+        if (dec->hdr_len == 0 && p[i] != CAYENNBIN_MAGIC) {
+          dec->dropped++;
+          i++;
+          break;
+        }
+        dec->hdr[dec->hdr_len++] = p[i++];
+        if (dec->hdr_len < CAYENNBIN_HDR_LEN) break;
+        dec->hdr_len = 0;
+        if (dec->hdr[1] != CAYENNBIN_VERSION) {
+          // not a frame we know, so look for the next magic byte from here
+          dec->errors++;
+          dec->dropped += CAYENNBIN_HDR_LEN;
+          break;
+        }
+        dec->frame_len = dec->hdr[2] | dec->hdr[3] << 8;
+        dec->got = 0;
+        if (dec->frame_len > dec->max_frame) {
+          ESP_LOGW(TAG, "Skipping frame of %d bytes, maxFrame is %d", dec->frame_len, dec->max_frame);
+          dec->errors++;
+          dec->state = CAYENNBIN_ST_SKIP;
+        } else if (dec->frame_len == 0) {
+          dec->errors++;
+        } else {
+          dec->state = CAYENNBIN_ST_PAYLOAD;
+        }
+        break;
+
+      case CAYENNBIN_ST_PAYLOAD:
+      case CAYENNBIN_ST_SKIP: {
+        size_t n = dec->frame_len - dec->got;
+        if (n > len - i) n = len - i;
+        if (dec->state == CAYENNBIN_ST_PAYLOAD) memcpy(&dec->buf[dec->got], &p[i], n);
+        dec->got += n;
+        i += n;
+        if (dec->got < dec->frame_len) break;
+        bool is_payload = dec->state == CAYENNBIN_ST_PAYLOAD;
+        dec->state = CAYENNBIN_ST_HDR;
+        if (is_payload) cayennbin_frame_done(L, dec);
+        break;
+      }
+    }
+  }
+
+  lua_pushinteger(L, dec->frames - frames);
+  return 1;
+}
+
+// Lua: dec:reset()
+// Forget any partial frame, i.e. when the connection drops and a new one starts
+static int cayennbin_dec_reset( lua_State *L ) {
+  cayennbin_dec_t dec = cayennbin_dec_get(L, 1);
+  dec->state = CAYENNBIN_ST_HDR;
+  dec->hdr_len = 0;
+  dec->got = 0;
+  return 0;
+}
+
+// Lua: frames, errors, dropped, isMidFrame = dec:stats()
+static int cayennbin_dec_stats( lua_State *L ) {
+  cayennbin_dec_t dec = cayennbin_dec_get(L, 1);
+  lua_pushinteger(L, dec->frames);
+  lua_pushinteger(L, dec->errors);
+  lua_pushinteger(L, dec->dropped);
+  lua_pushboolean(L, dec->state != CAYENNBIN_ST_HDR || dec->hdr_len > 0);
+  return 4;
+}
+
+/*
+Lua sample code:
+dec = cayennbin.createDecoder({
+  cb = function(tbl) print("Got cmd", tbl.Cmd) end, -- Called with each decoded table
+  maxFrame = 1024, -- Largest payload we accept. Bigger frames are skipped. Defaults to 1024.
+  maxValues = 64, -- Most values in one frame counting every table, key and entry. Defaults to 64.
+  isDebug = false,
+})
+conn:on("receive", function(sck, data) dec:write(data) end)
+*/
+static int cayennbin_create_decoder( lua_State *L ) {
+
+  luaL_checkanytable(L, 1);
+  lua_settop(L, 1);
+
+  int max_frame = opt_checkint_range(L, "maxFrame", 1024, 16, 0xffff);
+  int max_toks = opt_checkint_range(L, "maxValues", 64, 1, 4096);
+  bool is_debug = opt_checkbool(L, "isDebug", false);
+
+  int cb_ref = LUA_NOREF;
+  lua_getfield(L, 1, "cb");
+  if (lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue(L, -1);
+    cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else {
+    return luaL_error( L, "You must pass a cb to get the decoded tables" );
+  }
+  lua_pop(L, 1);
+
+  cayennbin_dec_t dec = (cayennbin_dec_t)lua_newuserdata(L, sizeof(cayennbin_dec_struct_t));
+  memset(dec, 0, sizeof(cayennbin_dec_struct_t));
+  luaL_getmetatable(L, "cayennbin.decoder");
+  lua_setmetatable(L, -2);
+
+  dec->cb_ref = cb_ref;
+  dec->is_debug = is_debug;
+  dec->state = CAYENNBIN_ST_HDR;
+  dec->max_frame = max_frame;
+  dec->max_toks = max_toks;
+  // everything a frame decodes into is allocated here once, not per frame
+  dec->buf = (uint8_t *)luaM_malloc(L, max_frame);
+  dec->toks = (cayennbin_tok_t *)luaM_malloc(L, max_toks * sizeof(cayennbin_tok_t));
+
+  if (is_debug) ESP_LOGI(TAG, "Decoder created. maxFrame: %d, maxValues: %d", max_frame, max_toks);
+  return 1;
+}
+
+// Lua: dec:unregister()
+static int cayennbin_dec_unregister( lua_State *L ) {
+
+  cayennbin_dec_t dec = cayennbin_dec_get(L, 1);
+  if (dec->cb_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->cb_ref);
+    dec->cb_ref = LUA_NOREF;
+  }
+  if (dec->buf != NULL) {
+    luaM_free(L, dec->buf);
+    dec->buf = NULL;
+  }
+  if (dec->toks != NULL) {
+    luaM_free(L, dec->toks);
+    dec->toks = NULL;
+  }
+  dec->max_frame = 0;
+  dec->max_toks = 0;
+  return 0;
+}
+
+//
+// Dispatcher
+//
+
+// FNV-1a
+static uint32_t cayennbin_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Internal call
+// Find the slot for a name. Returns the empty slot it would go in if it isn't registered.
+static cayennbin_slot_t *cayennbin_disp_find(cayennbin_disp_t disp, const char *name, size_t len) {
+  uint32_t h = cayennbin_hash(name, len);
+  uint16_t i = h & disp->slot_mask;
+  while (disp->slots[i].id != 0) {
+    cayennbin_slot_t *slot = &disp->slots[i];
+    if (slot->hash == h && slot->name_len == len && memcmp(slot->name, name, len) == 0) return slot;
+    i = (i + 1) & disp->slot_mask;
+  }
+  disp->slots[i].hash = h;
+  return &disp->slots[i];
+}
+
+/*
+Lua sample code:
+disp = cayennbin.createDispatcher({
+  maxCmds = 64, -- Most commands you can register. Defaults to 64.
+  fallback = otherFunc, -- Optional. Gets any payload whose Cmd isn't registered.
+  isDebug = false, -- Log each dispatch. Nothing is formatted unless this is on.
+})
+*/
+static int cayennbin_create_dispatcher( lua_State *L ) {
+
+  luaL_checkanytable(L, 1);
+  lua_settop(L, 1);
+
+  int max_cmds = opt_checkint_range(L, "maxCmds", 64, 1, 255);
+  bool is_debug = opt_checkbool(L, "isDebug", false);
+
+  int fallback_ref = LUA_NOREF;
+  lua_getfield(L, 1, "fallback");
+  if (lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue(L, -1);
+    fallback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pop(L, 1);
+
+  cayennbin_disp_t disp = (cayennbin_disp_t)lua_newuserdata(L, sizeof(cayennbin_disp_struct_t));
+  memset(disp, 0, sizeof(cayennbin_disp_struct_t));
+  luaL_getmetatable(L, "cayennbin.dispatcher");
+  lua_setmetatable(L, -2);
+
+  // keep the table at most half full so probes stay short
+  uint16_t slots = 4;
+  while (slots < max_cmds * 2) slots <<= 1;
+
+  disp->is_debug = is_debug;
+  disp->max_cmds = max_cmds;
+  disp->fallback_ref = fallback_ref;
+  disp->slot_mask = slots - 1;
+  disp->slots = (cayennbin_slot_t *)luaM_malloc(L, slots * sizeof(cayennbin_slot_t));
+  memset(disp->slots, 0, slots * sizeof(cayennbin_slot_t));
+  disp->fn_refs = (int *)luaM_malloc(L, max_cmds * sizeof(int));
+  for (int i = 0; i < max_cmds; i++) disp->fn_refs[i] = LUA_NOREF;
+  lua_newtable(L);
+  disp->names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  return 1;
+}
+
+// Lua: id = disp:register(name, fn)
+// Register fn for payloads with Cmd = name. It's called as fn(payload, id). Registering a
+// name again swaps its fn and keeps its id. Ids count up from 1 in the order you register.
+static int cayennbin_disp_register( lua_State *L ) {
+
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  luaL_argcheck(L, len > 0 && len <= 0xff, 2, "name must be 1 to 255 chars");
+  luaL_checkanyfunction(L, 3);
+  if (disp->slots == NULL) return luaL_error( L, "Dispatcher was unregistered" );
+
+  cayennbin_slot_t *slot = cayennbin_disp_find(disp, name, len);
+  if (slot->id == 0) {
+    if (disp->cmd_cnt >= disp->max_cmds) {
+      return luaL_error( L, "Already have maxCmds of %d registered", disp->max_cmds );
+    }
+    slot->id = ++disp->cmd_cnt;
+    slot->name_len = len;
+    // anchor the name so the pointer stays good
+    lua_rawgeti(L, LUA_REGISTRYINDEX, disp->names_ref);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, slot->id);
+    lua_pop(L, 1);
+    slot->name = lua_tostring(L, 2);
+  }
+
+  int *ref = &disp->fn_refs[slot->id - 1];
+  if (*ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+  lua_pushvalue(L, 3);
+  *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (disp->is_debug) ESP_LOGI(TAG, "Registered cmd %s as id %d", name, slot->id);
+  lua_pushinteger(L, slot->id);
+  return 1;
+}
+
+// Lua: isHandled = disp:dispatch(payload)
+// Call the fn registered for payload.CmdId, or for payload.Cmd if there's no CmdId. Anything
+// else goes to the fallback. Returns false if nothing took it.
+static int cayennbin_disp_dispatch( lua_State *L ) {
+
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  luaL_checkanytable(L, 2);
+  lua_settop(L, 2);
+  disp->calls++;
+
+  int id = 0;
+  lua_getfield(L, 2, "CmdId");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    id = lua_tointeger(L, -1);
+    if (id < 1 || id > disp->cmd_cnt) id = 0;
+  } else if (disp->slots != NULL) {
+    lua_getfield(L, 2, "Cmd");
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      size_t len;
+      const char *name = lua_tolstring(L, -1, &len);
+      if (len <= 0xff) {
+        cayennbin_slot_t *slot = cayennbin_disp_find(disp, name, len);
+        id = slot->id;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  int ref;
+  if (id != 0) {
+    ref = disp->fn_refs[id - 1];
+  } else {
+    disp->misses++;
+    ref = disp->fallback_ref;
+  }
+  if (disp->is_debug) {
+    lua_getfield(L, 2, "Cmd");
+    ESP_LOGI(TAG, "Dispatch cmd %s, id %d%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "(none)", id, id == 0 ? ", to fallback" : "");
+    lua_pop(L, 1);
+  }
+  if (ref == LUA_NOREF) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, id);
+  if (lua_pcall(L, 2, 0, 0) != 0) {
+    ESP_LOGI(TAG, "error running cmd %d: %s", id, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Lua: id = disp:getId(name)
+// Returns nil if name isn't registered
+static int cayennbin_disp_get_id( lua_State *L ) {
+
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  if (disp->slots == NULL || len == 0 || len > 0xff) return 0;
+  cayennbin_slot_t *slot = cayennbin_disp_find(disp, name, len);
+  if (slot->id == 0) return 0;
+  lua_pushinteger(L, slot->id);
+  return 1;
+}
+
+// Lua: tbl = disp:getCmds()
+// Returns {name = id, ...} so a server can send CmdId instead of the name
+static int cayennbin_disp_get_cmds( lua_State *L ) {
+
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  lua_createtable(L, 0, disp->cmd_cnt);
+  if (disp->names_ref == LUA_NOREF) return 1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, disp->names_ref);
+  for (int id = 1; id <= disp->cmd_cnt; id++) {
+    lua_rawgeti(L, -1, id);
+    lua_pushinteger(L, id);
+    lua_rawset(L, -4);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+// Lua: calls, misses = disp:stats()
+static int cayennbin_disp_stats( lua_State *L ) {
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  lua_pushinteger(L, disp->calls);
+  lua_pushinteger(L, disp->misses);
+  return 2;
+}
+
+// Lua: disp:unregister()
+static int cayennbin_disp_unregister( lua_State *L ) {
+
+  cayennbin_disp_t disp = cayennbin_disp_get(L, 1);
+  if (disp->fn_refs != NULL) {
+    for (int i = 0; i < disp->cmd_cnt; i++) {
+      if (disp->fn_refs[i] != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, disp->fn_refs[i]);
+    }
+    luaM_free(L, disp->fn_refs);
+    disp->fn_refs = NULL;
+  }
+  if (disp->slots != NULL) {
+    luaM_free(L, disp->slots);
+    disp->slots = NULL;
+  }
+  if (disp->names_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, disp->names_ref);
+    disp->names_ref = LUA_NOREF;
+  }
+  if (disp->fallback_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, disp->fallback_ref);
+    disp->fallback_ref = LUA_NOREF;
+  }
+  disp->cmd_cnt = 0;
+  return 0;
+}
+
+LROT_BEGIN(cayennbin_dec)
+  LROT_FUNCENTRY( write,          cayennbin_dec_write )
+  LROT_FUNCENTRY( reset,          cayennbin_dec_reset )
+  LROT_FUNCENTRY( stats,          cayennbin_dec_stats )
+  LROT_FUNCENTRY( unregister,     cayennbin_dec_unregister )
+  LROT_FUNCENTRY( __gc,           cayennbin_dec_unregister )
+  LROT_TABENTRY ( __index,        cayennbin_dec )
+LROT_END(cayennbin_dec, NULL, 0)
+
+LROT_BEGIN(cayennbin_disp)
+  LROT_FUNCENTRY( register,       cayennbin_disp_register )
+  LROT_FUNCENTRY( dispatch,       cayennbin_disp_dispatch )
+  LROT_FUNCENTRY( getId,          cayennbin_disp_get_id )
+  LROT_FUNCENTRY( getCmds,        cayennbin_disp_get_cmds )
+  LROT_FUNCENTRY( stats,          cayennbin_disp_stats )
+  LROT_FUNCENTRY( unregister,     cayennbin_disp_unregister )
+  LROT_FUNCENTRY( __gc,           cayennbin_disp_unregister )
+  LROT_TABENTRY ( __index,        cayennbin_disp )
+LROT_END(cayennbin_disp, NULL, 0)
+
+LROT_BEGIN(cayennbin)
+  LROT_FUNCENTRY( encode,         cayennbin_encode )
+  LROT_FUNCENTRY( crc32,          cayennbin_crc32 )
+  LROT_FUNCENTRY( createDecoder,  cayennbin_create_decoder )
+  LROT_FUNCENTRY( createDispatcher, cayennbin_create_dispatcher )
+  LROT_NUMENTRY ( VERSION,        CAYENNBIN_VERSION )
+LROT_END(cayennbin, NULL, 0)
+
+int luaopen_cayennbin(lua_State *L) {
+  luaL_rometatable(L, "cayennbin.decoder", (void *)cayennbin_dec_map);
+  luaL_rometatable(L, "cayennbin.dispatcher", (void *)cayennbin_disp_map);
+  return 0;
+}
+
+NODEMCU_MODULE(CAYENNBIN, "cayennbin", cayennbin, luaopen_cayennbin);
@@ -13,16 +13,25 @@ software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
 CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include "sdkconfig.h"
 #include "module.h"
 #include "lauxlib.h"
 #include "lmem.h"
 #include "platform.h"
 #include "task/task.h"
 #include "driver/pcnt.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lextra.h"
+#include "common.h"
+#ifdef CONFIG_LUA_MODULE_RMTTX
+#include "rmttx.h"
+#endif
 
 #include <string.h>
+#include <math.h>
 
 
 pcnt_isr_handle_t user_isr_handle = NULL; //user's ISR service handle
@@ -35,6 +44,46 @@ typedef struct {
     uint32_t status; // information on the event type that caused the interrupt
 } pcnt_evt_t;
 
+// Step period capture state. Filled in from the GPIO ISR on the pulse pin so we
+// can see the real timing of the steps that reach the stepper driver, not just
+// the durations we handed to RMT. Only integer math here since it runs in the ISR.
+typedef struct{
+  int gpio;
+  uint32_t bin_us;        // width of each histogram bin in us
+  uint16_t bins;          // number of bins in each histogram
+  uint32_t idle_us;       // periods longer than this are a gap between moves, not a step
+  uint32_t expected_us;   // commanded step period. 0 means no deviation histogram
+  int64_t last_us;        // timestamp of previous edge
+  uint32_t samples;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t sum_us;
+  uint64_t sum_sq_us;
+  int32_t dev_min_us;
+  int32_t dev_max_us;
+  uint32_t dev_samples;
+  uint32_t *period_hist;  // [bins] period/bin_us, last bin catches everything longer
+  uint32_t *dev_hist;     // [bins] centered on 0 deviation, ends catch the outliers
+} pulsecnt_capture_struct_t;
+typedef pulsecnt_capture_struct_t *pulsecnt_capture_t;
+
+// Gated frequency measurement state. An esp_timer fires every gate and turns the
+// change in count since the last gate into pulses per second. We never clear the
+// counter so position users of the same unit are not disturbed.
+typedef struct{
+  esp_timer_handle_t timer;
+  uint32_t gate_us;
+  int64_t last_us;        // timestamp of the previous gate
+  int16_t last_cnt;       // counter value at the previous gate
+  int32_t wrap_cnt;       // counts lost to h_lim/l_lim resets since the previous gate, from the ISR
+  uint32_t gates;         // number of gates measured
+  uint16_t len;           // ring buffer size
+  uint16_t head;          // next slot to write
+  uint16_t used;          // slots filled, up to len
+  float *hist;            // [len] pulses per second for each gate
+} pulsecnt_freq_struct_t;
+typedef pulsecnt_freq_struct_t *pulsecnt_freq_t;
+
 typedef struct{
   // PulsecntHandle_t pcnt;
   int32_t cb_ref, self_ref;
@@ -62,16 +111,32 @@ typedef struct{
   int16_t thresh0;  // thresh0 is for the unit, not the channel
   int16_t thresh1;  // thresh1 is for the unit, not the channel
   uint32_t counter;
+  pulsecnt_capture_t cap; // NULL unless captureStart() was called
+  int8_t filter_rmt_channel; // -1 unless setFilterAuto() bound us to an rmttx channel
+  uint8_t filter_pct;        // filter length as a percent of the expected min pulse width
+  uint16_t filter_min_cycles;
+  uint16_t filter_max_cycles;
+  uint16_t filter_cycles;    // what's in the hardware now
+  int8_t glitch_unit;        // -1 unless setFilterAuto() was given a spare unit to count glitches on
+  pulsecnt_freq_t freq;      // NULL unless startFreqMeasure() was called
 } pulsecnt_struct_t;
 typedef pulsecnt_struct_t *pulsecnt_t;
 
 // array of 8 pulsecnt_struct_t pointers so we can reference by unit number
 // this array gets filled in as we define pulsecnt_struct_t's during the create() method
 static pulsecnt_t pulsecnt_selfs[8];
+// units borrowed as a glitchUnit by setFilterAuto(), so create() can't hand them out too
+static bool pulsecnt_glitch_borrowed[8];
 
 // Task ID to get ISR interrupt back into Lua callback
 static task_handle_t pulsecnt_task_id;
 
+// Protects the capture stats between the GPIO ISR and reads from Lua
+static portMUX_TYPE pulsecnt_cap_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Protects the frequency ring buffer between the gate timer, the PCNT ISR and reads from Lua
+static portMUX_TYPE pulsecnt_freq_mux = portMUX_INITIALIZER_UNLOCKED;
+
 /* Decode what PCNT's unit originated an interrupt
  * and pass this information together with the event type
  * the main program.
@@ -90,7 +155,17 @@ static void IRAM_ATTR pulsecnt_intr_handler(void *arg)
                to pass it to the main program */
             evt.status = PCNT.status_unit[i].val;
             PCNT.int_clr.val = BIT(i);
-            
+
+            // the counter resets to 0 when it hits a limit, so tell the frequency gate
+            // how many counts it would otherwise lose
+            pulsecnt_t pc = pulsecnt_selfs[i];
+            if (pc != NULL && (evt.status & (PCNT_STATUS_H_LIM_M | PCNT_STATUS_L_LIM_M))) {
+              portENTER_CRITICAL_ISR(&pulsecnt_freq_mux);
+              pulsecnt_freq_t f = pc->freq;
+              if (f != NULL && (evt.status & PCNT_STATUS_H_LIM_M)) f->wrap_cnt += pc->ch0_counter_h_lim;
+              if (f != NULL && (evt.status & PCNT_STATUS_L_LIM_M)) f->wrap_cnt += pc->ch0_counter_l_lim;
+              portEXIT_CRITICAL_ISR(&pulsecnt_freq_mux);
+            }
 
             // post using lua task posting technique
             // on lua_open we set pulsecnt_task_id as a method which gets called
@@ -121,6 +196,7 @@ static void pulsecnt_task(task_param_t param, task_prio_t prio)
 
   // try to get the pulsecnt_struct_t from the pulsecnt_selfs array 
   pulsecnt_t pc = pulsecnt_selfs[unit];
+  if (pc == NULL) return; // object was garbage collected before the task ran
   if (pc->is_debug) ESP_LOGI("pulsecnt", "Cb for unit %d, gpio: %d, ctrl_gpio: %d, pos_mode: %d, neg_mode: %d, lctrl_mode: %d, hctrl_mode: %d, counter_l_lim: %d, counter_h_lim: %d", pc->unit, pc->ch0_pulse_gpio_num, pc->ch0_ctrl_gpio_num, pc->ch0_pos_mode, pc->ch0_neg_mode, pc->ch0_lctrl_mode, pc->ch0_hctrl_mode, pc->ch0_counter_l_lim, pc->ch0_counter_h_lim );
 
 
@@ -239,6 +315,9 @@ static int pulsecnt_set_filter( lua_State *L ) {
   int clkCyclesToIgnore = luaL_checkinteger(L, ++stack);
   luaL_argcheck(L, clkCyclesToIgnore >= 0 && clkCyclesToIgnore <= 1023, stack, "The clkCyclesToIgnore number allows 0 to 1023");
 
+  // a manual filter turns off any automatic filter tracking
+  pc->filter_rmt_channel = -1;
+  pc->filter_cycles = clkCyclesToIgnore;
   pcnt_set_filter_value(pc->unit, clkCyclesToIgnore);
 
   if (pc->is_debug) ESP_LOGI("pulsecnt", "Setup filter for unit %d with clkCyclesToIgnore %d", pc->unit, clkCyclesToIgnore);
@@ -247,6 +326,192 @@ static int pulsecnt_set_filter( lua_State *L ) {
 
 }
 
+// Set the filter for the shortest pulse we expect to see. We ignore anything shorter than
+// filter_pct of that width, clamped to the min/max cycles they gave setFilterAuto().
+// A pulse width of 0 means we don't know, so leave the filter alone.
+static void pulsecnt_apply_filter_for_pulse_ns(pulsecnt_t pc, uint32_t pulse_ns)
+{
+  if (pulse_ns == 0) return;
+
+  // 80Mhz APB clock, so 12.5ns per cycle
+  uint32_t cycles = (uint64_t)pulse_ns * pc->filter_pct * 80 / 100000;
+  if (cycles < pc->filter_min_cycles) cycles = pc->filter_min_cycles;
+  if (cycles > pc->filter_max_cycles) cycles = pc->filter_max_cycles;
+
+  if (cycles == pc->filter_cycles) return;
+  pc->filter_cycles = cycles;
+  pcnt_set_filter_value(pc->unit, cycles);
+  if (cycles > 0) {
+    pcnt_filter_enable(pc->unit);
+  } else {
+    pcnt_filter_disable(pc->unit);
+  }
+
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Auto filter for unit %d set to %d cycles for min pulse of %d ns", pc->unit, cycles, pulse_ns);
+}
+
+#ifdef CONFIG_LUA_MODULE_RMTTX
+// rmttx calls us whenever the shortest pulse it is sending on a channel changes
+static void pulsecnt_rmttx_pulse_hook(uint8_t channel, uint32_t min_pulse_ns)
+{
+  for (int i = 0; i < 8; i++) {
+    pulsecnt_t pc = pulsecnt_selfs[i];
+    if (pc != NULL && pc->filter_rmt_channel == channel) {
+      pulsecnt_apply_filter_for_pulse_ns(pc, min_pulse_ns);
+    }
+  }
+}
+#endif
+
+// Mirror our channel config onto a spare unit with no filter so the difference
+// between the two counters is the number of glitches our filter rejected.
+static void pulsecnt_glitch_unit_config(pulsecnt_t pc)
+{
+  pcnt_config_t cfg = {
+    .pulse_gpio_num = pc->ch0_pulse_gpio_num,
+    .ctrl_gpio_num = pc->ch0_ctrl_gpio_num,
+    .channel = PCNT_CHANNEL_0,
+    .unit = pc->glitch_unit,
+    .pos_mode = pc->ch0_pos_mode,
+    .neg_mode = pc->ch0_neg_mode,
+    .lctrl_mode = pc->ch0_lctrl_mode,
+    .hctrl_mode = pc->ch0_hctrl_mode,
+    .counter_l_lim = pc->ch0_counter_l_lim,
+    .counter_h_lim = pc->ch0_counter_h_lim,
+  };
+  pcnt_unit_config(&cfg);
+
+  if (pc->ch1_is_defined) {
+    cfg.pulse_gpio_num = pc->ch1_pulse_gpio_num;
+    cfg.ctrl_gpio_num = pc->ch1_ctrl_gpio_num;
+    cfg.channel = PCNT_CHANNEL_1;
+    cfg.pos_mode = pc->ch1_pos_mode;
+    cfg.neg_mode = pc->ch1_neg_mode;
+    cfg.lctrl_mode = pc->ch1_lctrl_mode;
+    cfg.hctrl_mode = pc->ch1_hctrl_mode;
+    cfg.counter_l_lim = pc->ch1_counter_l_lim;
+    cfg.counter_h_lim = pc->ch1_counter_h_lim;
+    pcnt_unit_config(&cfg);
+  }
+
+  pcnt_filter_disable(pc->glitch_unit);
+  pcnt_counter_pause(pc->glitch_unit);
+  pcnt_counter_clear(pc->glitch_unit);
+  pcnt_counter_clear(pc->unit);
+  pcnt_counter_resume(pc->glitch_unit);
+}
+
+// Lua: pc:setFilterAuto({rmtChannel=0, pct=50, minCycles=0, maxCycles=1023, glitchUnit=6})
+// Derive the glitch filter from the shortest pulse we expect rather than a fixed value.
+// If rmtChannel is given we follow the shortest pulse rmttx is sending on that channel as
+// you write/fill new durations. Otherwise call setExpectedRate() to give us the rate.
+// The filter ignores anything shorter than pct percent of that pulse, clamped to minCycles
+// and maxCycles (80Mhz APB cycles). If glitchUnit is given, that spare unit counts the same
+// pins unfiltered so getGlitchCnt() can tell you how many glitches were rejected.
+// Call this after chan0Config()/chan1Config().
+// Example: pc:setFilterAuto({rmtChannel=0, maxCycles=152, glitchUnit=6})
+static int pulsecnt_set_filter_auto(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+
+  ++stack;
+  if (lua_isnoneornil(L, stack)) {
+    lua_newtable(L);
+    lua_replace(L, stack);
+  }
+  luaL_checktype(L, stack, LUA_TTABLE);
+  lua_settop(L, stack);
+
+  int rmt_channel = opt_checkint_range(L, "rmtChannel", -1, -1, 7);
+  int pct = opt_checkint_range(L, "pct", 50, 1, 100);
+  int min_cycles = opt_checkint_range(L, "minCycles", 0, 0, 1023);
+  int max_cycles = opt_checkint_range(L, "maxCycles", 1023, 0, 1023);
+  int glitch_unit = opt_checkint_range(L, "glitchUnit", -1, -1, 7);
+  luaL_argcheck(L, min_cycles <= max_cycles, stack, "minCycles must be <= maxCycles");
+  luaL_argcheck(L, glitch_unit != pc->unit, stack, "glitchUnit must be a different unit than this one");
+  luaL_argcheck(L, glitch_unit < 0 || pulsecnt_selfs[glitch_unit] == NULL, stack, "glitchUnit is already in use by another pulsecnt object");
+  luaL_argcheck(L, glitch_unit < 0 || glitch_unit == pc->glitch_unit || !pulsecnt_glitch_borrowed[glitch_unit], stack, "glitchUnit is already the glitchUnit of another pulsecnt object");
+  luaL_argcheck(L, glitch_unit < 0 || pc->ch0_is_defined, stack, "Call chan0Config() before asking for a glitchUnit");
+
+#ifndef CONFIG_LUA_MODULE_RMTTX
+  if (rmt_channel >= 0) return luaL_error(L, "rmtChannel needs the rmttx module in your firmware");
+#endif
+
+  pc->filter_pct = pct;
+  pc->filter_min_cycles = min_cycles;
+  pc->filter_max_cycles = max_cycles;
+  pc->filter_rmt_channel = rmt_channel;
+  // force a write to the hardware on the next apply
+  pc->filter_cycles = 0xffff;
+
+  // give back the unit we borrowed last time if it's not the same one
+  if (pc->glitch_unit >= 0 && pc->glitch_unit != glitch_unit) {
+    pcnt_counter_pause(pc->glitch_unit);
+    pulsecnt_glitch_borrowed[pc->glitch_unit] = false;
+    pc->glitch_unit = -1;
+  }
+  if (glitch_unit >= 0) {
+    pc->glitch_unit = glitch_unit;
+    pulsecnt_glitch_borrowed[glitch_unit] = true;
+    pulsecnt_glitch_unit_config(pc);
+  }
+
+#ifdef CONFIG_LUA_MODULE_RMTTX
+  if (rmt_channel >= 0) {
+    rmttx_set_pulse_hook(pulsecnt_rmttx_pulse_hook);
+    pulsecnt_apply_filter_for_pulse_ns(pc, rmttx_get_min_pulse_ns(rmt_channel));
+  }
+#endif
+
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Auto filter for unit %d, rmtChannel: %d, pct: %d, minCycles: %d, maxCycles: %d, glitchUnit: %d", pc->unit, rmt_channel, pct, min_cycles, max_cycles, glitch_unit);
+
+  return 0;
+}
+
+// Lua: cycles = pc:setExpectedRate(hz, dutyPct)
+// Tell the auto filter the step rate you're about to run at. The shortest pulse is the
+// shorter of the high and low parts of the period at dutyPct, which defaults to 50.
+// Returns the filter cycles now in use.
+// Example: pc:setExpectedRate(20000) -- 20khz, 25us high 25us low
+static int pulsecnt_set_expected_rate(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+
+  int hz = luaL_checkinteger(L, ++stack);
+  luaL_argcheck(L, hz > 0 && hz <= 40000000, stack, "The hz number allows 1 to 40000000");
+
+  int duty_pct = luaL_optinteger(L, ++stack, 50);
+  luaL_argcheck(L, duty_pct > 0 && duty_pct < 100, stack, "The dutyPct number allows 1 to 99");
+
+  int short_pct = duty_pct < 50 ? duty_pct : 100 - duty_pct;
+  uint32_t pulse_ns = (uint32_t)(1000000000ULL * short_pct / 100 / hz);
+  pulsecnt_apply_filter_for_pulse_ns(pc, pulse_ns);
+
+  lua_pushinteger(L, pc->filter_cycles);
+  return 1;
+}
+
+// Lua: glitches = pc:getGlitchCnt()
+// Number of pulses the glitch filter rejected since the last clear(). Needs a glitchUnit
+// in setFilterAuto(). This is a net count, i.e. a rejected glitch while counting down
+// subtracts, same as it would have on the main counter.
+static int pulsecnt_get_glitch_cnt(lua_State *L)
+{
+  pulsecnt_t pc = pulsecnt_get(L, 1);
+  if (pc->glitch_unit < 0) return luaL_error(L, "No glitchUnit given in setFilterAuto()");
+
+  // read both back-to-back so they're coherent
+  int16_t filtered = (int16_t)PCNT.cnt_unit[pc->unit].cnt_val;
+  int16_t raw = (int16_t)PCNT.cnt_unit[pc->glitch_unit].cnt_val;
+
+  lua_pushinteger(L, raw - filtered);
+  return 1;
+}
+
 // Lua: pc:setThres(thresh0_val, thresh1_val)
 // Example: pc:setThres(-5, 5)
 // When you set the threshold, the pulse counter will be reset and the callback will be attached.
@@ -556,6 +821,7 @@ static int pulsecnt_create( lua_State *L ) {
   // Get unit number -- first arg
   int unit = luaL_checkinteger(L, ++stack);
   luaL_argcheck(L, unit >= 0 && unit <= 7, stack, "The unit number allows 0 to 7");
+  luaL_argcheck(L, !pulsecnt_glitch_borrowed[unit], stack, "That unit is the glitchUnit of another pulsecnt object");
 
   // Get callback method -- 2nd arg
   ++stack;
@@ -568,6 +834,9 @@ static int pulsecnt_create( lua_State *L ) {
     luaL_argcheck(L, lua_type(L, stack) == LUA_TFUNCTION || lua_type(L, stack) == LUA_TLIGHTFUNCTION, stack, "Must be function");
   }
 
+  // Get is_debug -- 3rd arg optional. Read before we push the object onto the stack.
+  bool is_debug = luaL_optbool(L, stack + 1, false);
+
   // ok, we have our unit number which is required. good. now create our object 
   pulsecnt_t pc = (pulsecnt_t)lua_newuserdata(L, sizeof(pulsecnt_struct_t));
   if (!pc) return luaL_error(L, "not enough memory");
@@ -579,6 +848,16 @@ static int pulsecnt_create( lua_State *L ) {
   pc->is_debug = false;
   pc->counter = 99;
   pc->unit = unit; // default to 0
+  pc->ch0_is_defined = false;
+  pc->ch1_is_defined = false;
+  pc->cap = NULL;
+  pc->filter_rmt_channel = -1;
+  pc->filter_pct = 50;
+  pc->filter_min_cycles = 0;
+  pc->filter_max_cycles = 1023;
+  pc->filter_cycles = 0;
+  pc->glitch_unit = -1;
+  pc->freq = NULL;
 
   //get the lua function reference
   if (isCallback) {
@@ -591,10 +870,7 @@ static int pulsecnt_create( lua_State *L ) {
   // where we only know the unit number 
   pulsecnt_selfs[unit] = pc;
 
-  // Get is_debug -- 3rd arg optional
-  ++stack;
-  bool is_debug = luaL_optbool(L, stack, false);
-  if (is_debug == 1) {
+  if (is_debug) {
     pc->is_debug = true;
   }
 
@@ -644,7 +920,7 @@ static int pulsecnt_getCnt(lua_State* L)
   if (pc->is_debug) ESP_LOGI("pulsecnt", "Got ctr val for unit %d with count of %d", pc->unit, count );
   pc->counter = count;
 
-  lua_pushinteger(L, pc->counter);
+  lua_pushinteger(L, (int16_t)pc->counter);
   return 1;
 }
 
@@ -653,12 +929,488 @@ static int pulsecnt_getCnt(lua_State* L)
 static int pulsecnt_clear(lua_State* L)
 {
   pulsecnt_t pc = pulsecnt_get(L, 1);
+  // rebase the frequency gate so the clear doesn't show up as a huge negative rate.
+  // The counts since the last gate are kept for it so this gate isn't short.
+  portENTER_CRITICAL(&pulsecnt_freq_mux);
+  pulsecnt_freq_t f = pc->freq;
+  if (f != NULL) {
+    int16_t cnt = (int16_t)PCNT.cnt_unit[pc->unit].cnt_val;
+    f->wrap_cnt += (int32_t)cnt - f->last_cnt;
+    f->last_cnt = 0;
+  }
   pcnt_counter_clear(pc->unit);
+  portEXIT_CRITICAL(&pulsecnt_freq_mux);
+  if (pc->glitch_unit >= 0) pcnt_counter_clear(pc->glitch_unit);
   int16_t count = 0;
   pcnt_get_counter_value(pc->unit, &count);
   if (pc->is_debug) ESP_LOGI("pulsecnt", "Cleared ctr for unit %d with new count of %d", pc->unit, count );
   pc->counter = count;
-  lua_pushinteger(L, pc->counter);
+  lua_pushinteger(L, (int16_t)pc->counter);
+  return 1;
+}
+
+// GPIO ISR on the pulse pin for step period capture. Timestamps each edge and
+// drops the period into the histograms.
+static void IRAM_ATTR pulsecnt_capture_isr(void *arg)
+{
+  pulsecnt_t pc = (pulsecnt_t)arg;
+  int64_t now = esp_timer_get_time();
+
+  // take the buffer under the lock. captureStop() clears it under the same lock
+  // before freeing, so an edge that is already in here can't write to freed memory.
+  portENTER_CRITICAL_ISR(&pulsecnt_cap_mux);
+  pulsecnt_capture_t cap = pc->cap;
+  if (cap == NULL) {
+    portEXIT_CRITICAL_ISR(&pulsecnt_cap_mux);
+    return;
+  }
+  int64_t last = cap->last_us;
+  cap->last_us = now;
+  if (last != 0 && (now - last) <= cap->idle_us) {
+    uint32_t period = (uint32_t)(now - last);
+
+    cap->samples++;
+    if (period < cap->min_us) cap->min_us = period;
+    if (period > cap->max_us) cap->max_us = period;
+    cap->sum_us += period;
+    cap->sum_sq_us += (uint64_t)period * period;
+
+    uint32_t bin = period / cap->bin_us;
+    if (bin >= cap->bins) bin = cap->bins - 1;
+    cap->period_hist[bin]++;
+
+    if (cap->expected_us > 0) {
+      int32_t dev = (int32_t)period - (int32_t)cap->expected_us;
+      if (cap->dev_samples == 0 || dev < cap->dev_min_us) cap->dev_min_us = dev;
+      if (cap->dev_samples == 0 || dev > cap->dev_max_us) cap->dev_max_us = dev;
+      cap->dev_samples++;
+
+      // integer divide truncates toward zero, so floor it ourselves for negative devs
+      int32_t dbin = dev >= 0 ? dev / (int32_t)cap->bin_us : -((-dev + (int32_t)cap->bin_us - 1) / (int32_t)cap->bin_us);
+      dbin += cap->bins / 2;
+      if (dbin < 0) dbin = 0;
+      if (dbin >= cap->bins) dbin = cap->bins - 1;
+      cap->dev_hist[dbin]++;
+    }
+  }
+  portEXIT_CRITICAL_ISR(&pulsecnt_cap_mux);
+}
+
+// Zero out the capture stats. Caller must hold pulsecnt_cap_mux if the ISR is live.
+static void pulsecnt_capture_reset(pulsecnt_capture_t cap)
+{
+  cap->last_us = 0;
+  cap->samples = 0;
+  cap->min_us = UINT32_MAX;
+  cap->max_us = 0;
+  cap->sum_us = 0;
+  cap->sum_sq_us = 0;
+  cap->dev_min_us = 0;
+  cap->dev_max_us = 0;
+  cap->dev_samples = 0;
+  memset(cap->period_hist, 0, cap->bins * sizeof(uint32_t));
+  memset(cap->dev_hist, 0, cap->bins * sizeof(uint32_t));
+}
+
+// Stop the GPIO ISR and free the capture buffers. Safe to call if capture is not running.
+static void pulsecnt_capture_free(lua_State *L, pulsecnt_t pc)
+{
+  if (pc->cap == NULL) return;
+  pulsecnt_capture_t cap = pc->cap;
+  gpio_intr_disable(cap->gpio);
+  portENTER_CRITICAL(&pulsecnt_cap_mux);
+  pc->cap = NULL;
+  portEXIT_CRITICAL(&pulsecnt_cap_mux);
+  gpio_isr_handler_remove(cap->gpio);
+  luaM_free(L, cap->period_hist);
+  luaM_free(L, cap->dev_hist);
+  luaM_free(L, cap);
+}
+
+// Lua: pc:captureStart({binUs=10, bins=32, expectedUs=500, idleUs=100000, gpio=36, negEdge=true})
+// Timestamps every step pulse on the pulse pin with a GPIO interrupt and builds a histogram
+// of the inter-step periods and, if expectedUs is given, of the deviation from that commanded
+// period. All args are optional. gpio defaults to the pulse pin from chan0Config().
+// Example: pc:captureStart({binUs=5, bins=40, expectedUs=250, negEdge=true})
+static int pulsecnt_capture_start(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+
+  ++stack;
+  if (lua_isnoneornil(L, stack)) {
+    lua_newtable(L);
+    lua_replace(L, stack);
+  }
+  luaL_checktype(L, stack, LUA_TTABLE);
+  lua_settop(L, stack);
+
+  int gpio = opt_checkint_range(L, "gpio", pc->ch0_is_defined ? pc->ch0_pulse_gpio_num : -1, -1, 39);
+  luaL_argcheck(L, gpio >= 0, stack, "No gpio given and chan0Config() has no pulse pin");
+  int bin_us = opt_checkint_range(L, "binUs", 10, 1, 1000000);
+  int bins = opt_checkint_range(L, "bins", 32, 2, 512);
+  int expected_us = opt_checkint_range(L, "expectedUs", 0, 0, 10000000);
+  int idle_us = opt_checkint_range(L, "idleUs", 100000, 1, 10000000);
+  bool neg_edge = opt_checkbool(L, "negEdge", false);
+
+  // start over if they call us twice
+  pulsecnt_capture_free(L, pc);
+
+  pulsecnt_capture_t cap = (pulsecnt_capture_t)luaM_malloc(L, sizeof(pulsecnt_capture_struct_t));
+  cap->period_hist = (uint32_t *)luaM_malloc(L, bins * sizeof(uint32_t));
+  cap->dev_hist = (uint32_t *)luaM_malloc(L, bins * sizeof(uint32_t));
+  cap->gpio = gpio;
+  cap->bin_us = bin_us;
+  cap->bins = bins;
+  cap->idle_us = idle_us;
+  cap->expected_us = expected_us;
+  pulsecnt_capture_reset(cap);
+  portENTER_CRITICAL(&pulsecnt_cap_mux);
+  pc->cap = cap;
+  portEXIT_CRITICAL(&pulsecnt_cap_mux);
+
+  // the isr service may already be installed by the gpio module which is fine
+  esp_err_t err = gpio_install_isr_service(0);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    pulsecnt_capture_free(L, pc);
+    return luaL_error(L, "Could not install gpio isr service, err %d", err);
+  }
+  gpio_set_intr_type(gpio, neg_edge ? GPIO_INTR_NEGEDGE : GPIO_INTR_POSEDGE);
+  if (gpio_isr_handler_add(gpio, pulsecnt_capture_isr, pc) != ESP_OK) {
+    portENTER_CRITICAL(&pulsecnt_cap_mux);
+    pc->cap = NULL;
+    portEXIT_CRITICAL(&pulsecnt_cap_mux);
+    luaM_free(L, cap->period_hist);
+    luaM_free(L, cap->dev_hist);
+    luaM_free(L, cap);
+    return luaL_error(L, "Could not add gpio isr handler for gpio %d", gpio);
+  }
+  gpio_intr_enable(gpio);
+
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Capture started for unit %d on gpio %d, binUs: %d, bins: %d, expectedUs: %d", pc->unit, gpio, bin_us, bins, expected_us);
+
+  return 0;
+}
+
+// Lua: pc:captureSetExpected(expectedUs)
+// Update the commanded step period on-the-fly, i.e. as your motion profile ramps up and down.
+// Pass 0 to stop collecting deviations.
+static int pulsecnt_capture_set_expected(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+  if (pc->cap == NULL) return luaL_error(L, "Capture not started");
+
+  int expected_us = luaL_checkinteger(L, ++stack);
+  luaL_argcheck(L, expected_us >= 0 && expected_us <= 10000000, stack, "The expectedUs number allows 0 to 10000000");
+
+  portENTER_CRITICAL(&pulsecnt_cap_mux);
+  pc->cap->expected_us = expected_us;
+  portEXIT_CRITICAL(&pulsecnt_cap_mux);
+
+  return 0;
+}
+
+// Lua: stats = pc:captureRead(isReset)
+// Returns a table of {samples, min, max, mean, stddev, devSamples, devMin, devMax, binUs, expectedUs,
+// periods={...}, devs={...}}. All times in us. periods[i] counts periods in bin i, i.e.
+// from (i-1)*binUs to i*binUs, with the last bin catching everything longer. devs is centered
+// so bin bins/2+1 holds deviations from 0 to binUs. Pass true to zero the stats after reading.
+static int pulsecnt_capture_read(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+  pulsecnt_capture_t cap = pc->cap;
+  if (cap == NULL) return luaL_error(L, "Capture not started");
+
+  bool is_reset = luaL_optbool(L, ++stack, false);
+
+  // copy under the lock so the ISR can't tear our view of the stats
+  uint32_t *period_hist = (uint32_t *)luaM_malloc(L, cap->bins * sizeof(uint32_t));
+  uint32_t *dev_hist = (uint32_t *)luaM_malloc(L, cap->bins * sizeof(uint32_t));
+  pulsecnt_capture_struct_t c;
+  portENTER_CRITICAL(&pulsecnt_cap_mux);
+  c = *cap;
+  memcpy(period_hist, cap->period_hist, cap->bins * sizeof(uint32_t));
+  memcpy(dev_hist, cap->dev_hist, cap->bins * sizeof(uint32_t));
+  if (is_reset) pulsecnt_capture_reset(cap);
+  portEXIT_CRITICAL(&pulsecnt_cap_mux);
+
+  lua_createtable(L, 0, 12);
+  lua_pushinteger(L, c.samples);
+  lua_setfield(L, -2, "samples");
+  lua_pushinteger(L, c.samples ? c.min_us : 0);
+  lua_setfield(L, -2, "min");
+  lua_pushinteger(L, c.max_us);
+  lua_setfield(L, -2, "max");
+  double mean = c.samples ? (double)c.sum_us / c.samples : 0;
+  lua_pushnumber(L, mean);
+  lua_setfield(L, -2, "mean");
+  double var = c.samples ? (double)c.sum_sq_us / c.samples - mean * mean : 0;
+  if (var < 0) var = 0; // rounding
+  lua_pushnumber(L, sqrt(var));
+  lua_setfield(L, -2, "stddev");
+  lua_pushinteger(L, c.dev_samples);
+  lua_setfield(L, -2, "devSamples");
+  lua_pushinteger(L, c.dev_min_us);
+  lua_setfield(L, -2, "devMin");
+  lua_pushinteger(L, c.dev_max_us);
+  lua_setfield(L, -2, "devMax");
+  lua_pushinteger(L, c.bin_us);
+  lua_setfield(L, -2, "binUs");
+  lua_pushinteger(L, c.expected_us);
+  lua_setfield(L, -2, "expectedUs");
+
+  lua_createtable(L, c.bins, 0);
+  for (int i = 0; i < c.bins; i++) {
+    lua_pushinteger(L, period_hist[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "periods");
+
+  lua_createtable(L, c.bins, 0);
+  for (int i = 0; i < c.bins; i++) {
+    lua_pushinteger(L, dev_hist[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "devs");
+
+  luaM_free(L, period_hist);
+  luaM_free(L, dev_hist);
+
+  return 1;
+}
+
+// Lua: pc:captureStop()
+// Stops the GPIO interrupt and frees the histograms. Read them first.
+static int pulsecnt_capture_stop(lua_State *L)
+{
+  pulsecnt_t pc = pulsecnt_get(L, 1);
+  pulsecnt_capture_free(L, pc);
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Capture stopped for unit %d", pc->unit);
+  return 0;
+}
+
+// Gate timer for frequency measurement. Runs in the esp_timer task, not an ISR.
+// Uses the real time between gates rather than gate_us so timer jitter doesn't
+// show up in the result.
+static void pulsecnt_freq_gate(void *arg)
+{
+  pulsecnt_t pc = (pulsecnt_t)arg;
+
+  // take the pointer under the lock so it can't be freed out from under us
+  portENTER_CRITICAL(&pulsecnt_freq_mux);
+  pulsecnt_freq_t f = pc->freq;
+  if (f == NULL) {
+    portEXIT_CRITICAL(&pulsecnt_freq_mux);
+    return;
+  }
+  int16_t cnt = (int16_t)PCNT.cnt_unit[pc->unit].cnt_val;
+  int64_t now = esp_timer_get_time();
+  int32_t delta = (int32_t)cnt - f->last_cnt + f->wrap_cnt;
+  int64_t elapsed = now - f->last_us;
+  f->last_cnt = cnt;
+  f->last_us = now;
+  f->wrap_cnt = 0;
+  if (elapsed > 0) {
+    f->hist[f->head] = (float)delta * 1000000.0f / (float)elapsed;
+    f->head = (f->head + 1) % f->len;
+    if (f->used < f->len) f->used++;
+    f->gates++;
+  }
+  portEXIT_CRITICAL(&pulsecnt_freq_mux);
+}
+
+// Stop the gate timer and free the ring buffer. Safe to call if not measuring.
+static void pulsecnt_freq_free(lua_State *L, pulsecnt_t pc)
+{
+  if (pc->freq == NULL) return;
+  // stop the gate first. A gate already running holds the lock while it uses
+  // the buffer, and once we've cleared pc->freq under the lock it sees NULL.
+  esp_timer_stop(pc->freq->timer);
+  esp_timer_delete(pc->freq->timer);
+  pulsecnt_freq_t f = pc->freq;
+  portENTER_CRITICAL(&pulsecnt_freq_mux);
+  pc->freq = NULL;
+  portEXIT_CRITICAL(&pulsecnt_freq_mux);
+  luaM_free(L, f->hist);
+  luaM_free(L, f);
+}
+
+// Lua: pc:startFreqMeasure(gateMs, historyLen)
+// Measures pulses per second over a gate of gateMs using a hardware timer. The last
+// historyLen results (default 16) are kept in a ring buffer. Set up chan0Config() first.
+// If a gate can count past the limits, create() the object with a callback so the limit
+// events and ISR are turned on and the counts lost to the reset get added back in.
+// Example: pc:startFreqMeasure(100, 32)
+static int pulsecnt_freq_start(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+
+  int gate_ms = luaL_checkinteger(L, ++stack);
+  luaL_argcheck(L, gate_ms >= 1 && gate_ms <= 60000, stack, "The gateMs allows 1 to 60000");
+
+  int len = luaL_optinteger(L, ++stack, 16);
+  luaL_argcheck(L, len >= 1 && len <= 1024, stack, "The historyLen allows 1 to 1024");
+
+  // start over if they call us twice
+  pulsecnt_freq_free(L, pc);
+
+  pulsecnt_freq_t f = (pulsecnt_freq_t)luaM_malloc(L, sizeof(pulsecnt_freq_struct_t));
+  f->hist = (float *)luaM_malloc(L, len * sizeof(float));
+  f->gate_us = gate_ms * 1000;
+  f->len = len;
+  f->head = 0;
+  f->used = 0;
+  f->gates = 0;
+  f->wrap_cnt = 0;
+  f->last_cnt = (int16_t)PCNT.cnt_unit[pc->unit].cnt_val;
+  f->last_us = esp_timer_get_time();
+
+  esp_timer_create_args_t args = {
+    .callback = pulsecnt_freq_gate,
+    .arg = pc,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "pulsecnt_freq"
+  };
+  if (esp_timer_create(&args, &f->timer) != ESP_OK) {
+    luaM_free(L, f->hist);
+    luaM_free(L, f);
+    return luaL_error(L, "Could not create gate timer");
+  }
+  pc->freq = f;
+  esp_timer_start_periodic(f->timer, f->gate_us);
+
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Freq measure started for unit %d with gate %d ms, history %d", pc->unit, gate_ms, len);
+
+  return 0;
+}
+
+// Lua: hz, gates = pc:getFreq()
+// Pulses per second from the most recent gate, and how many gates have completed.
+// hz is nil until the first gate completes.
+static int pulsecnt_freq_get(lua_State *L)
+{
+  pulsecnt_t pc = pulsecnt_get(L, 1);
+  if (pc->freq == NULL) return luaL_error(L, "Call startFreqMeasure() first");
+
+  pulsecnt_freq_t f = pc->freq;
+  portENTER_CRITICAL(&pulsecnt_freq_mux);
+  uint32_t gates = f->gates;
+  float hz = f->used > 0 ? f->hist[(f->head + f->len - 1) % f->len] : 0;
+  portEXIT_CRITICAL(&pulsecnt_freq_mux);
+
+  if (gates == 0) lua_pushnil(L);
+  else lua_pushnumber(L, hz);
+  lua_pushinteger(L, gates);
+  return 2;
+}
+
+// Lua: tbl = pc:getFreqHistory(resultTbl)
+// The results kept in the ring buffer, oldest first. Pass in the table from a previous
+// call to avoid creating a new one each time. Entries past the end are set to nil.
+static int pulsecnt_freq_get_history(lua_State *L)
+{
+  int stack = 0;
+
+  pulsecnt_t pc = pulsecnt_get(L, ++stack);
+  if (pc->freq == NULL) return luaL_error(L, "Call startFreqMeasure() first");
+  pulsecnt_freq_t f = pc->freq;
+
+  ++stack;
+  if (lua_isnoneornil(L, stack)) {
+    lua_createtable(L, f->len, 0);
+  } else {
+    luaL_checktype(L, stack, LUA_TTABLE);
+    lua_pushvalue(L, stack);
+  }
+
+  // copy out under the lock, then build the table without it
+  float *hist = (float *)luaM_malloc(L, f->len * sizeof(float));
+  portENTER_CRITICAL(&pulsecnt_freq_mux);
+  uint16_t used = f->used;
+  uint16_t start = (f->head + f->len - used) % f->len;
+  for (int i = 0; i < used; i++) {
+    hist[i] = f->hist[(start + i) % f->len];
+  }
+  portEXIT_CRITICAL(&pulsecnt_freq_mux);
+
+  for (int i = 0; i < used; i++) {
+    lua_pushnumber(L, hist[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  // trim a reused table that was longer
+  for (int i = used + 1; i <= f->len; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i);
+  }
+  luaM_free(L, hist);
+
+  return 1;
+}
+
+// Lua: pc:stopFreqMeasure()
+// Stops the gate timer and frees the ring buffer.
+static int pulsecnt_freq_stop(lua_State *L)
+{
+  pulsecnt_t pc = pulsecnt_get(L, 1);
+  pulsecnt_freq_free(L, pc);
+  if (pc->is_debug) ESP_LOGI("pulsecnt", "Freq measure stopped for unit %d", pc->unit);
+  return 0;
+}
+
+// Lua: tbl = pulsecnt.snapshot({pc1, pc2, ...}, resultTbl)
+// Reads the hardware counter of every pulsecnt object in the list back-to-back from C
+// so multi-axis positions are coherent in time. Nothing is paused. The result table
+// gets tbl[i] = count for each pc in the list plus tbl.ts = esp_timer_get_time() in us.
+// Pass in the table returned from a previous call as resultTbl to avoid creating a new
+// table on each call, which matters when you are polling fast.
+// Example: snap = pulsecnt.snapshot({pcX, pcY, pcZ}, snap)
+static int pulsecnt_snapshot(lua_State* L)
+{
+  int stack = 0;
+
+  luaL_checktype(L, ++stack, LUA_TTABLE);
+  int cnt = lua_objlen(L, stack);
+  luaL_argcheck(L, cnt >= 1 && cnt <= 8, stack, "Need a list of 1 to 8 pulsecnt objects");
+
+  // resolve the units first so the actual reads below are just register loads
+  uint8_t units[8];
+  for (int i = 0; i < cnt; i++) {
+    lua_rawgeti(L, stack, i + 1);
+    units[i] = pulsecnt_get(L, -1)->unit;
+    lua_pop(L, 1);
+  }
+
+  // reuse their result table if they gave us one
+  ++stack;
+  if (lua_isnoneornil(L, stack)) {
+    lua_createtable(L, cnt, 1);
+  } else {
+    luaL_checktype(L, stack, LUA_TTABLE);
+    lua_pushvalue(L, stack);
+  }
+
+  // read all counters back-to-back straight from the registers with one timestamp.
+  // the cnt_val field is the raw 16 bit counter so cast back to signed.
+  int16_t counts[8];
+  int64_t ts = esp_timer_get_time();
+  for (int i = 0; i < cnt; i++) {
+    counts[i] = (int16_t)PCNT.cnt_unit[units[i]].cnt_val;
+  }
+
+  for (int i = 0; i < cnt; i++) {
+    lua_pushinteger(L, counts[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushnumber(L, (lua_Number)ts);
+  lua_setfield(L, -2, "ts");
+
   return 1;
 }
 
@@ -675,6 +1427,17 @@ static int pulsecnt_unregister(lua_State* L){
   luaL_unref(L, LUA_REGISTRYINDEX, pc->cb_ref);
   pc->cb_ref = LUA_NOREF;
 
+  pulsecnt_capture_free(L, pc);
+  pulsecnt_freq_free(L, pc);
+
+  if (pc->glitch_unit >= 0) {
+    pcnt_counter_pause(pc->glitch_unit);
+    pulsecnt_glitch_borrowed[pc->glitch_unit] = false;
+    pc->glitch_unit = -1;
+  }
+  pc->filter_rmt_channel = -1;
+  if (pulsecnt_selfs[pc->unit] == pc) pulsecnt_selfs[pc->unit] = NULL;
+
   return 0;
 }
 
@@ -688,8 +1451,19 @@ LROT_BEGIN(pulsecnt_dyn)
 
   LROT_FUNCENTRY( setThres,       pulsecnt_set_thres )
   LROT_FUNCENTRY( setFilter,      pulsecnt_set_filter )
+  LROT_FUNCENTRY( setFilterAuto,  pulsecnt_set_filter_auto )
+  LROT_FUNCENTRY( setExpectedRate, pulsecnt_set_expected_rate )
+  LROT_FUNCENTRY( getGlitchCnt,   pulsecnt_get_glitch_cnt )
   LROT_FUNCENTRY( rawSetEventVal, pulsecnt_set_event_value )
   LROT_FUNCENTRY( rawGetEventVal, pulsecnt_get_event_value )
+  LROT_FUNCENTRY( captureStart,   pulsecnt_capture_start )
+  LROT_FUNCENTRY( captureSetExpected, pulsecnt_capture_set_expected )
+  LROT_FUNCENTRY( captureRead,    pulsecnt_capture_read )
+  LROT_FUNCENTRY( captureStop,    pulsecnt_capture_stop )
+  LROT_FUNCENTRY( startFreqMeasure, pulsecnt_freq_start )
+  LROT_FUNCENTRY( getFreq,        pulsecnt_freq_get )
+  LROT_FUNCENTRY( getFreqHistory, pulsecnt_freq_get_history )
+  LROT_FUNCENTRY( stopFreqMeasure, pulsecnt_freq_stop )
 
   // LROT_FUNCENTRY( __tostring,     pulsecnt_tostring )
   LROT_FUNCENTRY( __gc,           pulsecnt_unregister )
@@ -698,6 +1472,7 @@ LROT_END(pulsecnt_dyn, NULL, 0)
 
 LROT_BEGIN(pulsecnt)
   LROT_FUNCENTRY( create,            pulsecnt_create )
+  LROT_FUNCENTRY( snapshot,          pulsecnt_snapshot )
   LROT_NUMENTRY ( PCNT_MODE_KEEP,    0 ) /*pcnt_ctrl_mode_t.PCNT_MODE_KEEP*/
   LROT_NUMENTRY ( PCNT_MODE_REVERSE, 1 ) /*pcnt_ctrl_mode_t.PCNT_MODE_REVERSE*/
   LROT_NUMENTRY ( PCNT_MODE_DISABLE, 2 ) /*pcnt_ctrl_mode_t.PCNT_MODE_DISABLE*/
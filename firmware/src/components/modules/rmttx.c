@@ -29,11 +29,65 @@ CONDITIONS OF ANY KIND, either express or implied.
 #include "esp_log.h"
 #include "lextra.h"
 #include "driver/rmt.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "rmttx.h"
 
+#include <math.h>
 #include <string.h>
 
 static const char* TAG = "RmtTx";
 
+// LED animation effects for animate()
+#define RMTTX_ANIM_SOLID    0
+#define RMTTX_ANIM_FADE     1 // colors[0] to colors[1] over periodMs, then hold unless loop
+#define RMTTX_ANIM_PULSE    2 // colors[0] to colors[1] and back every periodMs
+#define RMTTX_ANIM_BLINK    3 // colors[0] for half of periodMs, colors[1] for the other half
+#define RMTTX_ANIM_BREATHE  4 // colors[1] to colors[0] and back on a cosine every periodMs
+#define RMTTX_ANIM_SEQUENCE 5 // each color for periodMs, optionally fading into the next
+#define RMTTX_ANIM_MAX_COLORS 8
+
+// startAt() wakes this early and spins the rest of the way, since the esp_timer task can
+// be a little late getting to its callback
+#define RMTTX_START_SPIN_US 300
+#define RMTTX_START_MAX_US  60000000 // furthest ahead startAt() takes, 60 secs
+
+// One effect as Lua declared it. The animation timer copies this under rmttx_anim_mux every
+// frame, so animate() can swap in a new one without the timer ever seeing half of each.
+typedef struct {
+  uint8_t effect;         // RMTTX_ANIM_*
+  uint8_t color_cnt;
+  uint8_t colors[RMTTX_ANIM_MAX_COLORS][3]; // r, g, b
+  uint8_t brightness;     // 0-255 scale on every color
+  uint32_t period_ms;
+  bool is_loop;           // FADE and SEQUENCE stop at the end unless loop
+  bool is_fade;           // SEQUENCE fades into the next color instead of stepping
+  int64_t start_us;
+} rmttx_anim_effect_t;
+
+typedef struct {
+  esp_timer_handle_t timer;
+  uint16_t frame_ms;
+  uint16_t pixels;        // every pixel shows the same color
+  uint8_t *buf;           // [pixels * 3] in g, r, b order
+  rmttx_anim_effect_t effect;
+  bool is_done;           // a FADE or SEQUENCE without loop got to its end
+  bool is_last;           // last_grb is on the wire
+  uint8_t last_grb[3];
+  uint32_t frames;        // frames sent
+  uint32_t skipped;       // frames skipped because the previous one was still going out
+  bool is_stopping;       // set under the mux before freeing, ticks that see it do nothing
+  bool is_ticking;        // a tick is rendering or writing a frame
+} rmttx_anim_struct_t;
+typedef rmttx_anim_struct_t *rmttx_anim_t;
+
+// Protects the effect between Lua and the animation timer
+static portMUX_TYPE rmttx_anim_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Protects the startAt() armed state between the start timer and Lua
+static portMUX_TYPE rmttx_start_mux = portMUX_INITIALIZER_UNLOCKED;
+
 typedef struct {
   bool is_initted;
   bool is_debug;
@@ -56,30 +110,100 @@ typedef struct {
   bool isDriverInstalled;
   uint16_t thresholdCtr;
   uint16_t offset;
+  uint16_t minDurPrev; // shortest non-zero duration in ticks of the previous write/fill chunk
+  uint32_t minPulseNs; // shortest of the last 2 chunks in ns, which is what may be on the wire now
+  // WS2812 style pixel output through the RMT translator, see writePixels()
+  uint16_t pixTicks[4]; // T0H, T0L, T1H, T1L in ticks. 0 if the ns don't fit this clkDiv
+  bool isTranslator; // translator registered with the driver for this channel
+  uint8_t *pix; // copy of the bytes being sent, since the driver reads them during refills
+  size_t pixLen; // bytes allocated for pix
+  bool isPixBusy; // async writePixels() in flight, cb gets flag 1 when it's done
+  rmttx_anim_t anim; // NULL unless animate() is running
+  uint16_t *lut; // [2][256] color correction tables, setColorCorrection() fills the one not in use
+  uint8_t lutIdx; // which half of lut the translator is reading
+  uint8_t brightness; // setColorCorrection() settings
+  float gamma;
+  bool isDither;
+  uint8_t ditherCtr; // frame counter the dither offset comes from
+  esp_timer_handle_t startTimer; // startAt() one shot, created the first time it's used
+  int64_t startAtUs; // esp_timer time startAt() fires rmt_tx_start()
+  bool isStartIdxReset;
+  bool isStartArmed;
+  bool isStartTicking; // the start timer is spinning towards startAtUs
+  int32_t startLateUs; // how late the last startAt() fired, passed to the cb with flag 4
 } rmttx_struct_t;
 typedef rmttx_struct_t *rmttx_t;
 
 // array for all 8 channels of rmttx. these will be NULL unless there was a successful rmttx.create() from Lua
 static rmttx_t rmttx_selfs[8];
 
-/*
-//Convert uint8_t type of data to rmt format data.
-static void IRAM_ATTR u8_to_rmt(const void* src, rmt_item32_t* dest, size_t src_size, size_t wanted_num, size_t* translated_size, size_t* item_num)
+static float rmttx_getNsPerTickForClkDiv_raw(int clkDiv);
+
+// other modules, i.e. pulsecnt, can follow the shortest pulse we're sending
+static rmttx_pulse_hook_t rmttx_pulse_hook = NULL;
+
+void rmttx_set_pulse_hook(rmttx_pulse_hook_t hook) {
+  rmttx_pulse_hook = hook;
+}
+
+uint32_t rmttx_get_min_pulse_ns(uint8_t channel) {
+  if (channel >= RMT_CHANNEL_MAX || rmttx_selfs[channel] == NULL) return 0;
+  return rmttx_selfs[channel]->minPulseNs;
+}
+
+// Track the shortest pulse after each write/fill. We keep the prev chunk too since with
+// the threshold refills the hardware is still sending the previous half of the buffer
+// when the next chunk gets written. minDur is 0 if the chunk had no non-zero durations.
+static void rmttx_update_min_pulse(rmttx_t tx, uint16_t minDur, bool isRestart) {
+  uint16_t dur = minDur;
+  if (!isRestart && tx->minDurPrev > 0 && (dur == 0 || tx->minDurPrev < dur)) {
+    dur = tx->minDurPrev;
+  }
+  tx->minDurPrev = minDur;
+
+  uint32_t ns = (uint32_t)(dur * rmttx_getNsPerTickForClkDiv_raw(tx->clkDiv));
+  if (ns == tx->minPulseNs) return;
+  tx->minPulseNs = ns;
+  if (tx->is_debug) ESP_LOGI(TAG, "Min pulse on channel %d now %d ns", tx->channel, ns);
+  if (rmttx_pulse_hook != NULL) rmttx_pulse_hook(tx->channel, ns);
+}
+
+// RMT items for a 0 and 1 bit per channel, built from the tx pixTicks when writePixels() runs.
+// The translator runs in the driver's ISR and gets no channel or context, so it reads these.
+// Color correction per channel. The translator runs every byte through lut, which holds the
+// output level in 8.8 fixed point after gamma and brightness, adds this frame's dither offset
+// to the fraction and sends the top 8 bits. NULL means bytes go out as they are.
+static const uint16_t *rmttx_pix_lut[RMT_CHANNEL_MAX];
+static uint8_t rmttx_pix_dither[RMT_CHANNEL_MAX];
+
+static rmt_item32_t rmttx_pix_bit0[RMT_CHANNEL_MAX];
+static rmt_item32_t rmttx_pix_bit1[RMT_CHANNEL_MAX];
+
+//Convert uint8_t type of data to rmt format data. MSB first like the WS2812 wants it.
+//Only whole bytes get translated so a byte never gets split across two refills.
+static inline void rmttx_u8_to_rmt(uint8_t channel, const void* src, rmt_item32_t* dest, size_t src_size, size_t wanted_num, size_t* translated_size, size_t* item_num)
 {
     if(src == NULL || dest == NULL) {
         *translated_size = 0;
         *item_num = 0;
         return;
     }
-    const rmt_item32_t bit0 = {{{ 32767, 1, 15000, 0 }}}; //Logical 0
-    const rmt_item32_t bit1 = {{{ 32767, 1, 32767, 0 }}}; //Logical 1
+    const rmt_item32_t bit0 = rmttx_pix_bit0[channel]; //Logical 0
+    const rmt_item32_t bit1 = rmttx_pix_bit1[channel]; //Logical 1
+    const uint16_t *lut = rmttx_pix_lut[channel];
+    const uint8_t dither = rmttx_pix_dither[channel];
     size_t size = 0;
     size_t num = 0;
-    uint8_t *psrc = (uint8_t *)src;
+    const uint8_t *psrc = (const uint8_t *)src;
     rmt_item32_t* pdest = dest;
-    while (size < src_size && num < wanted_num) {
-        for(int i = 0; i < 8; i++) {
-            if(*psrc & (0x1 << i)) {
+    while (size < src_size && num + 8 <= wanted_num) {
+        uint8_t b = *psrc;
+        if (lut != NULL) {
+            // lut tops out at 255 << 8, so adding the dither can't carry past 255
+            b = (lut[b] + dither) >> 8;
+        }
+        for(int i = 7; i >= 0; i--) {
+            if(b & (0x1 << i)) {
                 pdest->val =  bit1.val; 
             } else {
                 pdest->val =  bit0.val;
@@ -93,7 +217,27 @@ static void IRAM_ATTR u8_to_rmt(const void* src, rmt_item32_t* dest, size_t src_
     *translated_size = size;
     *item_num = num;
 }
-*/
+
+// One translator per channel since the driver doesn't tell the translator which channel it's for
+#define RMTTX_PIX_TRANSLATOR(ch) \
+  static void IRAM_ATTR rmttx_u8_to_rmt_##ch(const void* src, rmt_item32_t* dest, size_t src_size, size_t wanted_num, size_t* translated_size, size_t* item_num) { \
+    rmttx_u8_to_rmt(ch, src, dest, src_size, wanted_num, translated_size, item_num); \
+  }
+RMTTX_PIX_TRANSLATOR(0)
+RMTTX_PIX_TRANSLATOR(1)
+RMTTX_PIX_TRANSLATOR(2)
+RMTTX_PIX_TRANSLATOR(3)
+RMTTX_PIX_TRANSLATOR(4)
+RMTTX_PIX_TRANSLATOR(5)
+RMTTX_PIX_TRANSLATOR(6)
+RMTTX_PIX_TRANSLATOR(7)
+
+static const sample_to_rmt_t rmttx_pix_translators[RMT_CHANNEL_MAX] = {
+  rmttx_u8_to_rmt_0, rmttx_u8_to_rmt_1, rmttx_u8_to_rmt_2, rmttx_u8_to_rmt_3,
+  rmttx_u8_to_rmt_4, rmttx_u8_to_rmt_5, rmttx_u8_to_rmt_6, rmttx_u8_to_rmt_7
+};
+
+static bool rmttx_is_tx_end_cb = false; // rmt_register_tx_end_callback() done
 
 // interrupt handler for RMT ISR
 static rmt_isr_handle_t rmttx_intr_handle;
@@ -101,6 +245,17 @@ static rmt_isr_handle_t rmttx_intr_handle;
 // Task ID to get ISR interrupt back into Lua callback
 static task_handle_t rmttx_task_id;
 
+// The driver calls this from its ISR when a channel finishes. Only async writePixels() cares,
+// so they get the same flag 1 tx end callback as writeRawStart().
+static void IRAM_ATTR rmttx_pix_tx_end(rmt_channel_t channel, void *arg) {
+  (void)arg;
+  if (channel >= RMT_CHANNEL_MAX) return;
+  rmttx_t tx = rmttx_selfs[channel];
+  if (tx == NULL || !tx->isPixBusy) return;
+  tx->isPixBusy = false;
+  task_post_high(rmttx_task_id, 1 << 8 | channel );
+}
+
 // This interrupt is called when a threshold event occurs on the RMT transmitting
 // so we can fill more data. It is also called at the end of the transmission.
 static void IRAM_ATTR rmttx_isr(void *arg) {
@@ -219,7 +374,7 @@ static void rmttx_task(task_param_t param, task_prio_t prio)
 
   // we bit packed the channel number and data_sub_len into 1 uint32_t in the IRAM interrupt so need to unpack here
   uint8_t channel = (uint32_t)param & 0xffu;
-  uint32_t flag = ((uint32_t)param >> 8);  // flag 1 is tx end, flag 2 is threshold event
+  uint32_t flag = ((uint32_t)param >> 8);  // flag 1 is tx end, flag 2 is threshold event, flag 3 is animation done, flag 4 is startAt() fired
   // ESP_LOGI(TAG, "About to do callback for channel %d with flag: %d", channel, flag);
 
   // get the self object for this channel. it has our callback.
@@ -236,6 +391,8 @@ static void rmttx_task(task_param_t param, task_prio_t prio)
     lua_pushinteger (L, flag);
     if (flag == 2) {
       lua_pushinteger (L, tx->thresholdCtr);
+    } else if (flag == 4) {
+      lua_pushinteger (L, tx->startLateUs);
     } else {
       lua_pushnil (L);
     }
@@ -266,6 +423,7 @@ tx = rmttx.create({
   enOutputIdle = , -- Enable the RMT output if idle
   idleLvl = , -- Set the signal level on the RMT output if idle
   carrierFreqHz = 100, -- Set the carrier signal
+  t0hNs = 400, t0lNs = 850, t1hNs = 800, t1lNs = 450, -- Bit timings for writePixels(). Defaults are WS2812.
   isDebug = true
 })
 
@@ -292,6 +450,11 @@ static int rmttx_create( lua_State *L ) {
   tx.carrierLvl = opt_checkint_range(L, "carrierLvl", RMT_CARRIER_LEVEL_LOW, RMT_CARRIER_LEVEL_LOW, RMT_CARRIER_LEVEL_HIGH);
   tx.enOutputIdle = opt_checkbool(L, "enOutputIdle", false);
   tx.idleLvl = opt_checkint_range(L, "idleLvl", RMT_IDLE_LEVEL_LOW, RMT_IDLE_LEVEL_LOW, RMT_IDLE_LEVEL_HIGH);
+  int pixNs[4];
+  pixNs[0] = opt_checkint_range(L, "t0hNs", 400, 1, 1000000);
+  pixNs[1] = opt_checkint_range(L, "t0lNs", 850, 1, 1000000);
+  pixNs[2] = opt_checkint_range(L, "t1hNs", 800, 1, 1000000);
+  pixNs[3] = opt_checkint_range(L, "t1lNs", 450, 1, 1000000);
   
   // See if they gave us a callback
   // bool isCallback = true;
@@ -321,6 +484,13 @@ static int rmttx_create( lua_State *L ) {
   tx.nsPerTick = (1.0 / (800.0 / tx.clkDiv)) * 10000.0;
   if (tx.is_debug) ESP_LOGI(TAG, "Nanoseconds per tick: %f", tx.nsPerTick);
 
+  // pixel bit timings in ticks, rounded. 0 means it doesn't fit an RMT duration at this clkDiv
+  float pixNsPerTick = rmttx_getNsPerTickForClkDiv_raw(tx.clkDiv);
+  for (int i = 0; i < 4; i++) {
+    uint32_t ticks = (uint32_t)(pixNs[i] / pixNsPerTick + 0.5);
+    tx.pixTicks[i] = (ticks >= 1 && ticks <= 32767) ? ticks : 0;
+  }
+
   //esp_err_t rmt_config(const rmt_config_t *rmt_param)
   //esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags)
 
@@ -397,6 +567,30 @@ static int rmttx_create( lua_State *L ) {
   tx2->isDriverInstalled = tx.isDriverInstalled;
   tx2->cb_ref = tx.cb_ref;
   tx2->offset = tx.offset;
+  tx2->thresholdCtr = 0; // writePixels() takes non-zero as a writeRawStart() on this channel
+  tx2->minDurPrev = 0;
+  tx2->minPulseNs = 0;
+  memcpy(tx2->pixTicks, tx.pixTicks, sizeof(tx2->pixTicks));
+  tx2->isTranslator = false;
+  tx2->pix = NULL;
+  tx2->pixLen = 0;
+  tx2->isPixBusy = false;
+  tx2->anim = NULL;
+  tx2->lut = NULL;
+  tx2->lutIdx = 0;
+  tx2->brightness = 255;
+  tx2->gamma = 1.0f;
+  tx2->isDither = false;
+  tx2->ditherCtr = 0;
+  tx2->startTimer = NULL;
+  tx2->startAtUs = 0;
+  tx2->isStartIdxReset = false;
+  tx2->isStartArmed = false;
+  tx2->isStartTicking = false;
+  tx2->startLateUs = 0;
+  // the translator reads these per channel, don't let it see a previous object's tables
+  rmttx_pix_lut[tx2->channel] = NULL;
+  rmttx_pix_dither[tx2->channel] = 0;
 
   // store this in our selfs array so we can find it during the ISR callback
   rmttx_selfs[tx2->channel] = tx2;
@@ -500,6 +694,31 @@ static int rmttx_getClkDivForNsPerTick( lua_State *L ) {
   return 2;
 }
 
+// Internal call
+// Put our ISR on the RMT and turn on the tx end and threshold events for this channel, so the
+// cb gets called to writeRawFill() more. writeRawStart() calls this before it starts the
+// channel, and so does startAt() when it arms a start.
+static void rmttx_raw_intr_enable(rmttx_t tx) {
+
+  // Register ISR, once. It's shared by every channel and each call would allocate another.
+  // esp_err_t rmt_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags, rmt_isr_handle_t *handle, )
+  if (rmttx_intr_handle == NULL) {
+    rmt_isr_register(rmttx_isr, NULL, PLATFORM_RMT_INTR_FLAGS, &rmttx_intr_handle );
+  }
+
+  // Get event when done transmitting
+  // esp_err_t rmt_set_tx_intr_en(rmt_channel_t channel, bool en)
+  rmt_set_tx_intr_en(tx->channel, true);
+
+  // Get threshold event
+  // esp_err_t rmt_set_tx_thr_intr_en(rmt_channel_t channel, bool en, uint16_t evt_thresh)
+  // You want to set the threshold at half the size of the memBlocks provisioned to this channel
+  uint16_t thresCnt = tx->memCnt / 2;
+  if (tx->is_debug) ESP_LOGI(TAG, "Threshold event set at byte count: %d", thresCnt);
+  tx->thresholdCtr = thresCnt;
+  rmt_set_tx_thr_intr_en(tx->channel, true, thresCnt);
+}
+
 // Lua:
 // tx:writeRawStart({32767,1,32767,0})
 // Write in raw mode where you get callbacks and have to keep re-filling the data. 
@@ -561,6 +780,7 @@ static int rmttx_write_raw_start(lua_State *L) {
   int ctr = 0;
   int ctrInner = 0;
   float totalDuration = 0.0;
+  uint16_t minDur = 0;
   while (lua_next(L, -2) != 0)
   {
     lua_pushvalue(L, -1); // copy, so lua_tonumber() doesn't break iter
@@ -574,6 +794,7 @@ static int rmttx_write_raw_start(lua_State *L) {
           tx->items[ctr].duration1 = val;
         }
         totalDuration += val * nsPerTick; // keep running sum
+        if (val > 0 && (minDur == 0 || val < minDur)) minDur = val;
       } else {
         return luaL_error( L, "Index: %d duration must be >= 0 and <= 32767. duration was: %d", ctr, val );
       }
@@ -611,23 +832,7 @@ static int rmttx_write_raw_start(lua_State *L) {
     return luaL_error( L, "You must have a callback set in the rmttx.create() method to do writeRaw().");
   }
 
-  // Register ISR
-  // esp_err_t rmt_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags, rmt_isr_handle_t *handle, )
-  rmt_isr_register(rmttx_isr, NULL, PLATFORM_RMT_INTR_FLAGS, &rmttx_intr_handle );
-  // rmt_isr_register(rmttx_isr, NULL, 0, &rmttx_intr_handle );
-
-  // Get event when done transmitting
-  // esp_err_t rmt_set_tx_intr_en(rmt_channel_t channel, bool en)
-  // rmt_set_tx_intr_en(rmt_channel_t channel, bool en);
-  rmt_set_tx_intr_en(tx->channel, true);
-
-  // Get threshold event
-  // esp_err_t rmt_set_tx_thr_intr_en(rmt_channel_t channel, bool en, uint16_t evt_thresh)
-  // You want to set the threshold at half the size of the memBlocks provisioned to this channel
-  uint16_t thresCnt = memCnt / 2;
-  if (tx->is_debug) ESP_LOGI(TAG, "Threshold event set at byte count: %d", thresCnt);
-  tx->thresholdCtr = thresCnt;
-  rmt_set_tx_thr_intr_en(tx->channel, true, thresCnt);
+  rmttx_raw_intr_enable(tx);
 
   // void rmt_set_intr_enable_mask(uint32_t mask)
   // rmt_set_intr_enable_mask(uint32_t mask);
@@ -639,6 +844,8 @@ static int rmttx_write_raw_start(lua_State *L) {
 
   // reset the offset in case there was already a writeRawStart/writeRawFill operation
   tx->offset = 0;
+
+  rmttx_update_min_pulse(tx, minDur, true);
   // tx->offset = tx->memCnt / 2; // don't understand why we have to start our offset at half threshold
   if (tx->is_debug) ESP_LOGI(TAG, "offset: %d", tx->offset);
 
@@ -715,6 +922,7 @@ static int rmttx_write_raw_fill( lua_State *L ) {
 
   // we are going to write direct to RMT memory in this loop to avoid mem alloc 
   rmt_item32_t item;
+  uint16_t minDur = 0;
 
   while (lua_next(L, -2) != 0)
   {
@@ -731,6 +939,7 @@ static int rmttx_write_raw_fill( lua_State *L ) {
           item.duration1 = val;
         }
         // totalDuration += val * nsPerTick; // keep running sum
+        if (val > 0 && (minDur == 0 || val < minDur)) minDur = val;
       } else {
         return luaL_error( L, "Index: %d duration must be >= 0 and <= 32767. duration was: %d", ctrInner, val );
       }
@@ -780,6 +989,7 @@ static int rmttx_write_raw_fill( lua_State *L ) {
 
   // rmt_fill_tx_items(tx->channel, tx->items, ctr, tx->offset);
 
+  rmttx_update_min_pulse(tx, minDur, false);
 
   return 0;
 }
@@ -898,6 +1108,26 @@ static int rmttx_write_raw_fill( lua_State *L ) {
 //   return 0;
 // }
 
+// Internal call
+// Install the RMT driver for this channel if it isn't already. Raises a Lua error on failure.
+static void rmttx_driver_install(lua_State *L, rmttx_t tx) {
+  if (tx->isDriverInstalled) return;
+
+  // rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags)
+  // Flags for the RMT driver interrupt handler. Pass 0 for default flags.
+  esp_err_t err = rmt_driver_install(tx->channel, 0, 0);
+  if (err == ESP_ERR_INVALID_STATE) {
+    luaL_error( L, "Driver is already installed" );
+  } else if (err == ESP_ERR_NO_MEM) {
+    luaL_error( L, "Memory allocation failure" );
+  } else if (err == ESP_ERR_INVALID_ARG ) {
+    luaL_error( L, "invalid args" );
+  }
+  tx->isDriverInstalled = true;
+  tx->isTranslator = false; // a fresh driver has no translator
+  if (tx->is_debug) ESP_LOGI(TAG, "Installed driver cuz previously uninstalled.");
+}
+
 // Internal call
 static int rmttx_write(bool isAsync, lua_State *L ) {
 
@@ -952,6 +1182,7 @@ static int rmttx_write(bool isAsync, lua_State *L ) {
   int ctr = 0;
   int ctrInner = 0;
   float totalDuration = 0.0;
+  uint16_t minDur = 0;
   while (lua_next(L, -2) != 0)
   {
     lua_pushvalue(L, -1); // copy, so lua_tonumber() doesn't break iter
@@ -965,6 +1196,7 @@ static int rmttx_write(bool isAsync, lua_State *L ) {
           tx->items[ctr].duration1 = val;
         }
         totalDuration += val * nsPerTick; // keep running sum
+        if (val > 0 && (minDur == 0 || val < minDur)) minDur = val;
       } else {
         return luaL_error( L, "Index: %d duration must be >= 0 and <= 32767. duration was: %d", ctr, val );
       }
@@ -994,20 +1226,9 @@ static int rmttx_write(bool isAsync, lua_State *L ) {
 
   // the drive could have been uninstalled from a previous async call
   // if it is, reinstall it
-  if (tx->isDriverInstalled == false) {
-    // rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags)
-    // Flags for the RMT driver interrupt handler. Pass 0 for default flags.
-    esp_err_t err = rmt_driver_install(tx->channel, 0, 0);
-    if (err == ESP_ERR_INVALID_STATE) {
-      return luaL_error( L, "Driver is already installed" );
-    } else if (err == ESP_ERR_NO_MEM) {
-      return luaL_error( L, "Memory allocation failure" );
-    } else if (err == ESP_ERR_INVALID_ARG ) {
-      return luaL_error( L, "invalid args" );
-    }
-    tx->isDriverInstalled = true;
-    if (tx->is_debug) ESP_LOGI(TAG, "Installed driver cuz previously uninstalled.");
-  }
+  rmttx_driver_install(L, tx);
+
+  rmttx_update_min_pulse(tx, minDur, true);
 
   // esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *rmt_item, int item_num, bool wait_tx_done)
   rmt_write_items(tx->channel, tx->items, ctr, isAsync ? false : true);
@@ -1020,6 +1241,7 @@ static int rmttx_write(bool isAsync, lua_State *L ) {
     // uninstall driver for this channel
     rmt_driver_uninstall(tx->channel);
     tx->isDriverInstalled = false;
+    tx->isTranslator = false;
     if (tx->is_debug) ESP_LOGI(TAG, "Uninstalled driver due to enLoop true.");
   }
   // free the memory
@@ -1062,6 +1284,440 @@ static void rmttx_writeAsync( lua_State *L ) {
   rmttx_write(true, L);
 }
 
+// Internal call
+// Call right before a frame goes out, once the previous one is done. Moves the dither offset
+// on so a level between two output steps averages out over the next frames. The offsets are
+// the frame counter bit reversed, so 0, 128, 64, 192, ... spreads them out quickly.
+static void rmttx_pix_frame_start(rmttx_t tx) {
+  if (!tx->isDither) return;
+  uint8_t v = tx->ditherCtr++;
+  v = (v & 0xF0) >> 4 | (v & 0x0F) << 4;
+  v = (v & 0xCC) >> 2 | (v & 0x33) << 2;
+  v = (v & 0xAA) >> 1 | (v & 0x55) << 1;
+  rmttx_pix_dither[tx->channel] = v;
+}
+
+// Internal call
+// Check writePixels() can work on this channel, then install the driver and translator if
+// they aren't yet. Raises a Lua error if not.
+static void rmttx_pix_prepare(lua_State *L, rmttx_t tx) {
+
+  if (tx->enLoop) {
+    luaL_error( L, "writePixels() can't loop. Create with enLoop = false." );
+  }
+  // writeRawStart() puts its own ISR on the channel, which can't live with the driver
+  if (tx->thresholdCtr > 0) {
+    luaL_error( L, "You cannot call writePixels() after writeRawStart() on the same channel." );
+  }
+  for (int i = 0; i < 4; i++) {
+    if (tx->pixTicks[i] == 0) {
+      luaL_error( L, "Pixel timings don't fit clkDiv %d. Use a clkDiv of about 2 to 8.", tx->clkDiv );
+    }
+  }
+
+  rmttx_driver_install(L, tx);
+
+  if (!tx->isTranslator) {
+    rmttx_pix_bit0[tx->channel].duration0 = tx->pixTicks[0];
+    rmttx_pix_bit0[tx->channel].level0 = 1;
+    rmttx_pix_bit0[tx->channel].duration1 = tx->pixTicks[1];
+    rmttx_pix_bit0[tx->channel].level1 = 0;
+    rmttx_pix_bit1[tx->channel].duration0 = tx->pixTicks[2];
+    rmttx_pix_bit1[tx->channel].level0 = 1;
+    rmttx_pix_bit1[tx->channel].duration1 = tx->pixTicks[3];
+    rmttx_pix_bit1[tx->channel].level1 = 0;
+    if (rmt_translator_init(tx->channel, rmttx_pix_translators[tx->channel]) != ESP_OK) {
+      luaL_error( L, "Init fail on translator" );
+    }
+    tx->isTranslator = true;
+    if (tx->is_debug) ESP_LOGI(TAG, "Translator ready. T0H: %d, T0L: %d, T1H: %d, T1L: %d ticks", tx->pixTicks[0], tx->pixTicks[1], tx->pixTicks[2], tx->pixTicks[3]);
+  }
+  if (!rmttx_is_tx_end_cb) {
+    rmt_register_tx_end_callback(rmttx_pix_tx_end, NULL);
+    rmttx_is_tx_end_cb = true;
+  }
+
+  uint16_t minDur = tx->pixTicks[0];
+  for (int i = 1; i < 4; i++) {
+    if (tx->pixTicks[i] < minDur) minDur = tx->pixTicks[i];
+  }
+  rmttx_update_min_pulse(tx, minDur, true);
+}
+
+// Lua:
+// tx:writePixels(grbString, isSync)
+// -- 2 pixels, green then red, as WS2812 wants g,r,b order
+// tx:writePixels(string.char(255,0,0, 0,255,0))
+// Send pixel bytes. The bytes are turned into RMT items by a translator as the driver refills
+// the memBlocks, so a strip of any length works with memBlocks = 1 and Lua never builds item
+// tables. Bits go out MSB first with the t0hNs/t0lNs/t1hNs/t1lNs timings from create().
+// Returns right away unless isSync. With a cb in create() you get flag 1 when it's done.
+static int rmttx_write_pixels( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  bool isSync = lua_toboolean(L, 3);
+
+  if (tx->anim != NULL) {
+    return luaL_error( L, "An animation is running. Call stopAnimation() first." );
+  }
+  rmttx_pix_prepare(L, tx);
+  if (len == 0) return 0;
+
+  // the driver keeps reading our buffer during refills, so let the previous frame finish first
+  rmt_wait_tx_done(tx->channel, portMAX_DELAY);
+
+  // grow the buffer if this frame is bigger than the last one
+  if (len > tx->pixLen) {
+    if (tx->pix != NULL) luaM_free(L, tx->pix);
+    tx->pix = (uint8_t *)luaM_malloc(L, len);
+    tx->pixLen = len;
+  }
+  memcpy(tx->pix, data, len);
+
+  tx->isPixBusy = !isSync && tx->cb_ref != LUA_NOREF;
+  rmttx_pix_frame_start(tx);
+  rmt_write_sample(tx->channel, tx->pix, len, isSync);
+  if (tx->is_debug) ESP_LOGI(TAG, "Sent %u pixel bytes.", (unsigned)len);
+
+  return 0;
+}
+
+// Blend a into b by frac out of 65536
+static void rmttx_anim_lerp(const uint8_t *a, const uint8_t *b, uint32_t frac, uint8_t *out) {
+  for (int i = 0; i < 3; i++) {
+    out[i] = a[i] + (((int32_t)b[i] - a[i]) * (int32_t)frac >> 16);
+  }
+}
+
+// Work out the color of an effect t_ms after it started. Returns true once a non-looping
+// effect has reached its end, where it holds its last color.
+static bool rmttx_anim_render(const rmttx_anim_effect_t *e, uint32_t t_ms, uint8_t *rgb) {
+  static const uint8_t black[3] = {0, 0, 0};
+  const uint8_t *c0 = e->colors[0];
+  const uint8_t *c1 = e->color_cnt > 1 ? e->colors[1] : black;
+  uint32_t period = e->period_ms;
+  uint32_t phase = t_ms % period;
+  bool is_end = false;
+
+  switch (e->effect) {
+    case RMTTX_ANIM_FADE:
+      if (!e->is_loop && t_ms >= period) {
+        memcpy(rgb, c1, 3);
+        is_end = true;
+      } else {
+        rmttx_anim_lerp(c0, c1, ((uint64_t)phase << 16) / period, rgb);
+      }
+      break;
+    case RMTTX_ANIM_PULSE: {
+      uint32_t half = period / 2 > 0 ? period / 2 : 1;
+      uint32_t up = phase < half ? phase : period - phase;
+      rmttx_anim_lerp(c0, c1, ((uint64_t)(up > half ? half : up) << 16) / half, rgb);
+      break;
+    }
+    case RMTTX_ANIM_BLINK:
+      memcpy(rgb, phase < period / 2 ? c0 : c1, 3);
+      break;
+    case RMTTX_ANIM_BREATHE: {
+      float level = (1.0f - cosf(2.0f * (float)M_PI * phase / period)) / 2.0f;
+      rmttx_anim_lerp(c1, c0, (uint32_t)(level * 65535.0f), rgb);
+      break;
+    }
+    case RMTTX_ANIM_SEQUENCE: {
+      uint32_t idx = t_ms / period;
+      if (!e->is_loop && idx >= e->color_cnt) {
+        memcpy(rgb, e->colors[e->color_cnt - 1], 3);
+        is_end = true;
+        break;
+      }
+      idx %= e->color_cnt;
+      if (e->is_fade && (e->is_loop || idx + 1 < e->color_cnt)) {
+        rmttx_anim_lerp(e->colors[idx], e->colors[(idx + 1) % e->color_cnt], ((uint64_t)phase << 16) / period, rgb);
+      } else {
+        memcpy(rgb, e->colors[idx], 3);
+      }
+      break;
+    }
+    default:
+      memcpy(rgb, c0, 3);
+      break;
+  }
+
+  for (int i = 0; i < 3; i++) rgb[i] = rgb[i] * (e->brightness + 1) >> 8;
+  return is_end;
+}
+
+// Render the current effect and send it. Only sends a frame when the color changed and the
+// last one has gone out.
+static void rmttx_anim_frame(rmttx_t tx, rmttx_anim_t an) {
+
+  rmttx_anim_effect_t e;
+  portENTER_CRITICAL(&rmttx_anim_mux);
+  e = an->effect;
+  bool is_done = an->is_done;
+  portEXIT_CRITICAL(&rmttx_anim_mux);
+  if (is_done) return;
+
+  uint8_t rgb[3];
+  uint32_t t_ms = (uint32_t)((esp_timer_get_time() - e.start_us) / 1000);
+  bool is_end = rmttx_anim_render(&e, t_ms, rgb);
+  uint8_t grb[3] = {rgb[1], rgb[0], rgb[2]};
+
+  // with dither on, a steady color still needs fresh frames to average out
+  if (!an->is_last || tx->isDither || memcmp(grb, an->last_grb, 3) != 0) {
+    // don't block the timer task, just try again next frame
+    if (rmt_wait_tx_done(tx->channel, 0) != ESP_OK) {
+      an->skipped++;
+      return;
+    }
+    for (int i = 0; i < an->pixels; i++) memcpy(&an->buf[i * 3], grb, 3);
+    memcpy(an->last_grb, grb, 3);
+    an->is_last = true;
+    an->frames++;
+    rmttx_pix_frame_start(tx);
+    rmt_write_sample(tx->channel, an->buf, an->pixels * 3, false);
+  }
+
+  if (is_end) {
+    // only if Lua didn't swap in a new effect while we were rendering this one
+    bool is_post = false;
+    portENTER_CRITICAL(&rmttx_anim_mux);
+    if (an->effect.start_us == e.start_us) {
+      an->is_done = true;
+      is_post = true;
+    }
+    portEXIT_CRITICAL(&rmttx_anim_mux);
+    if (is_post) task_post_low(rmttx_task_id, 3 << 8 | tx->channel );
+  }
+}
+
+// Animation timer tick. Runs in the esp_timer task, so frames keep coming no matter how busy
+// the Lua VM is. is_ticking lets rmttx_anim_halt() know when it's safe to free.
+static void rmttx_anim_tick(void *arg) {
+  rmttx_t tx = (rmttx_t)arg;
+  portENTER_CRITICAL(&rmttx_anim_mux);
+  rmttx_anim_t an = tx->anim;
+  bool is_stopping = an == NULL || an->is_stopping;
+  if (!is_stopping) an->is_ticking = true;
+  portEXIT_CRITICAL(&rmttx_anim_mux);
+  if (is_stopping) return;
+
+  rmttx_anim_frame(tx, an);
+
+  portENTER_CRITICAL(&rmttx_anim_mux);
+  an->is_ticking = false;
+  portEXIT_CRITICAL(&rmttx_anim_mux);
+}
+
+// Stop the animation timer and wait out a tick that was already running when we did.
+// esp_timer_stop() doesn't wait for one, and it may be halfway through writing a frame.
+static void rmttx_anim_halt(rmttx_anim_t an) {
+  portENTER_CRITICAL(&rmttx_anim_mux);
+  an->is_stopping = true;
+  portEXIT_CRITICAL(&rmttx_anim_mux);
+  esp_timer_stop(an->timer);
+  while (true) {
+    portENTER_CRITICAL(&rmttx_anim_mux);
+    bool is_ticking = an->is_ticking;
+    portEXIT_CRITICAL(&rmttx_anim_mux);
+    if (!is_ticking) break;
+    vTaskDelay(1);
+  }
+}
+
+// Stop the animation timer and free it, once the last frame is out of the buffer
+static void rmttx_anim_free(lua_State *L, rmttx_t tx) {
+  rmttx_anim_t an = tx->anim;
+  if (an == NULL) return;
+  rmttx_anim_halt(an);
+  esp_timer_delete(an->timer);
+  if (tx->isDriverInstalled) rmt_wait_tx_done(tx->channel, portMAX_DELAY);
+  portENTER_CRITICAL(&rmttx_anim_mux);
+  tx->anim = NULL;
+  portEXIT_CRITICAL(&rmttx_anim_mux);
+  luaM_free(L, an->buf);
+  luaM_free(L, an);
+}
+
+// Lua:
+// tx:animate({
+//   effect = rmttx.ANIM_BREATHE, -- ANIM_SOLID, ANIM_FADE, ANIM_PULSE, ANIM_BLINK, ANIM_BREATHE, ANIM_SEQUENCE
+//   colors = {{30,0,30}, {0,0,0}}, -- r,g,b. Up to 8. What each effect does with them is above.
+//   periodMs = 2000,
+//   brightness = 255, -- 0-255 scale on every color
+//   loop = true, -- FADE and SEQUENCE stop at their end unless loop
+//   fade = false, -- SEQUENCE fades into the next color
+//   pixels = 1, -- every pixel shows the same color
+//   frameMs = 20,
+// })
+// Lua declares an effect once and a timer renders the frames through the writePixels()
+// translator without any more Lua. Calling it again swaps the effect in one go at the next
+// frame. Changing pixels or frameMs restarts the timer. The create() cb gets flag 3 when a
+// non-looping effect is done.
+static int rmttx_animate( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+  luaL_checkanytable(L, 2);
+  lua_settop(L, 2);
+
+  rmttx_anim_effect_t e;
+  memset(&e, 0, sizeof(e));
+  e.effect = opt_checkint_range(L, "effect", RMTTX_ANIM_SOLID, RMTTX_ANIM_SOLID, RMTTX_ANIM_SEQUENCE);
+  e.period_ms = opt_checkint_range(L, "periodMs", 1000, 1, 3600000);
+  e.brightness = opt_checkint_range(L, "brightness", 255, 0, 255);
+  e.is_loop = opt_checkbool(L, "loop", true);
+  e.is_fade = opt_checkbool(L, "fade", false);
+  int pixels = opt_checkint_range(L, "pixels", 1, 1, 1024);
+  int frame_ms = opt_checkint_range(L, "frameMs", 20, 5, 10000);
+
+  lua_getfield(L, 2, "colors");
+  luaL_argcheck(L, lua_istable(L, -1), 2, "missing/bad 'colors' field");
+  int cnt = lua_objlen(L, -1);
+  luaL_argcheck(L, cnt >= 1 && cnt <= RMTTX_ANIM_MAX_COLORS, 2, "colors needs 1 to 8 {r,g,b}");
+  for (int i = 0; i < cnt; i++) {
+    lua_rawgeti(L, -1, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 2, "each color must be {r,g,b}");
+    for (int j = 0; j < 3; j++) {
+      lua_rawgeti(L, -1, j + 1);
+      int val = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, val >= 0 && val <= 255, 2, "color values allow 0 to 255");
+      e.colors[i][j] = val;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  e.color_cnt = cnt;
+
+  rmttx_pix_prepare(L, tx);
+
+  rmttx_anim_t an = tx->anim;
+  if (an != NULL && (an->pixels != pixels || an->frame_ms != frame_ms)) {
+    rmttx_anim_free(L, tx);
+    an = NULL;
+  }
+
+  if (an == NULL) {
+    // nothing of ours may still be going out of the old writePixels() buffer after this
+    rmt_wait_tx_done(tx->channel, portMAX_DELAY);
+    tx->isPixBusy = false;
+
+    an = (rmttx_anim_t)luaM_malloc(L, sizeof(rmttx_anim_struct_t));
+    memset(an, 0, sizeof(rmttx_anim_struct_t));
+    an->buf = (uint8_t *)luaM_malloc(L, pixels * 3);
+    an->pixels = pixels;
+    an->frame_ms = frame_ms;
+    e.start_us = esp_timer_get_time();
+    an->effect = e;
+
+    esp_timer_create_args_t args = {
+      .callback = rmttx_anim_tick,
+      .arg = tx,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "rmttx_anim"
+    };
+    if (esp_timer_create(&args, &an->timer) != ESP_OK) {
+      luaM_free(L, an->buf);
+      luaM_free(L, an);
+      return luaL_error( L, "Could not create animation timer" );
+    }
+    portENTER_CRITICAL(&rmttx_anim_mux);
+    tx->anim = an;
+    portEXIT_CRITICAL(&rmttx_anim_mux);
+    esp_timer_start_periodic(an->timer, frame_ms * 1000);
+    if (tx->is_debug) ESP_LOGI(TAG, "Animation started. effect: %d, periodMs: %d, pixels: %d, frameMs: %d", e.effect, e.period_ms, pixels, frame_ms);
+  } else {
+    // swap the effect in one go, the timer picks it up next frame
+    portENTER_CRITICAL(&rmttx_anim_mux);
+    e.start_us = esp_timer_get_time();
+    an->effect = e;
+    an->is_done = false;
+    portEXIT_CRITICAL(&rmttx_anim_mux);
+    if (tx->is_debug) ESP_LOGI(TAG, "Animation swapped. effect: %d, periodMs: %d", e.effect, e.period_ms);
+  }
+
+  return 0;
+}
+
+// Lua:
+// frames, skipped = tx:stopAnimation()
+// Stop the animation. The LEDs keep the last frame. Returns how many frames were sent and
+// how many were skipped because the previous one was still going out.
+static int rmttx_stop_animation( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+  if (tx->anim == NULL) return 0;
+
+  // no tick can count another frame after this
+  rmttx_anim_halt(tx->anim);
+  uint32_t frames = tx->anim->frames;
+  uint32_t skipped = tx->anim->skipped;
+  rmttx_anim_free(L, tx);
+
+  lua_pushinteger(L, frames);
+  lua_pushinteger(L, skipped);
+  return 2;
+}
+
+// Lua:
+// tx:setColorCorrection({
+//   brightness = 255, -- 0-255 scale on every byte
+//   gamma = 2.2, -- 1 is linear
+//   dither = true, -- dither the levels between output steps over frames
+// })
+// Every byte writePixels() and animate() send goes through a table built from these in the
+// translator, so there's no cost per pixel in Lua. Fields you leave out keep their setting.
+// Brightness 255, gamma 1 and no dither turns the table off.
+static int rmttx_set_color_correction( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+  luaL_checkanytable(L, 2);
+  lua_settop(L, 2);
+
+  tx->brightness = opt_checkint_range(L, "brightness", tx->brightness, 0, 255);
+  tx->isDither = opt_checkbool(L, "dither", tx->isDither);
+  if (opt_get(L, "gamma", LUA_TNUMBER)) {
+    float gamma = lua_tonumber(L, -1);
+    luaL_argcheck(L, gamma >= 0.1f && gamma <= 5.0f, 2, "gamma allows 0.1 to 5");
+    tx->gamma = gamma;
+    lua_pop(L, 1);
+  }
+
+  // the translator may be reading the table of the frame going out, so wait for it
+  rmt_wait_tx_done(tx->channel, portMAX_DELAY);
+
+  if (tx->brightness == 255 && tx->gamma == 1.0f && !tx->isDither) {
+    rmttx_pix_lut[tx->channel] = NULL;
+    rmttx_pix_dither[tx->channel] = 0;
+    if (tx->anim != NULL) tx->anim->is_last = false;
+    if (tx->is_debug) ESP_LOGI(TAG, "Color correction off");
+    return 0;
+  }
+
+  if (tx->lut == NULL) {
+    tx->lut = (uint16_t *)luaM_malloc(L, 2 * 256 * sizeof(uint16_t));
+  }
+  // fill the half the translator isn't using, then point it over in one store, so an
+  // animate() frame that starts meanwhile sees either the old table or the new one
+  uint16_t *lut = &tx->lut[(tx->lutIdx ^ 1) * 256];
+  for (int i = 0; i < 256; i++) {
+    float level = powf(i / 255.0f, tx->gamma) * tx->brightness;
+    lut[i] = (uint16_t)(level * 256.0f + 0.5f);
+    // leave room for the dither offset on top
+    if (lut[i] > 255 << 8) lut[i] = 255 << 8;
+  }
+  if (!tx->isDither) rmttx_pix_dither[tx->channel] = 0;
+  tx->lutIdx ^= 1;
+  rmttx_pix_lut[tx->channel] = lut;
+  // have a running animation send its color again through the new table
+  if (tx->anim != NULL) tx->anim->is_last = false;
+  if (tx->is_debug) ESP_LOGI(TAG, "Color correction. brightness: %d, gamma: %.2f, dither: %d", tx->brightness, tx->gamma, tx->isDither);
+
+  return 0;
+}
+
 // Lua:
 // tx:stop()
 // RMT stop sending
@@ -1118,6 +1774,126 @@ static int rmttx_start( lua_State *L ) {
 
 }
 
+// startAt() timer. Runs in the esp_timer task RMTTX_START_SPIN_US ahead of time and spins
+// until the exact microsecond so the start doesn't carry the task's wakeup jitter. The armed
+// flag is checked again under the mux right before the start, so a cancelStart() during the
+// spin wins. isStartTicking lets rmttx_start_halt() know when the tick is done with us.
+static void rmttx_start_at_tick(void *arg) {
+  rmttx_t tx = (rmttx_t)arg;
+  portENTER_CRITICAL(&rmttx_start_mux);
+  bool isArmed = tx->isStartArmed;
+  int64_t at = tx->startAtUs;
+  bool isIdxReset = tx->isStartIdxReset;
+  if (isArmed) tx->isStartTicking = true;
+  portEXIT_CRITICAL(&rmttx_start_mux);
+  if (!isArmed) return;
+
+  int64_t now;
+  while ((now = esp_timer_get_time()) < at) { }
+
+  portENTER_CRITICAL(&rmttx_start_mux);
+  isArmed = tx->isStartArmed;
+  if (isArmed) rmt_tx_start(tx->channel, isIdxReset);
+  tx->isStartArmed = false;
+  tx->isStartTicking = false;
+  portEXIT_CRITICAL(&rmttx_start_mux);
+  if (!isArmed) return;
+
+  tx->startLateUs = (int32_t)(now - at);
+  task_post_high(rmttx_task_id, 4 << 8 | tx->channel );
+}
+
+// Disarm startAt(), stop its timer, and wait out a tick that was already spinning when we
+// did. esp_timer_stop() doesn't wait for one. Returns whether it was armed.
+static bool rmttx_start_halt(rmttx_t tx) {
+  portENTER_CRITICAL(&rmttx_start_mux);
+  bool wasArmed = tx->isStartArmed;
+  tx->isStartArmed = false;
+  portEXIT_CRITICAL(&rmttx_start_mux);
+  if (tx->startTimer == NULL) return wasArmed;
+  esp_timer_stop(tx->startTimer);
+  while (true) {
+    portENTER_CRITICAL(&rmttx_start_mux);
+    bool isTicking = tx->isStartTicking;
+    portEXIT_CRITICAL(&rmttx_start_mux);
+    if (!isTicking) break;
+    vTaskDelay(1);
+  }
+  return wasArmed;
+}
+
+// Lua:
+// us = rmttx.now()
+// Microseconds since boot on the esp_timer clock, which is the clock startAt() takes.
+static int rmttx_now( lua_State *L ) {
+  lua_pushnumber(L, (lua_Number)esp_timer_get_time());
+  return 1;
+}
+
+// Lua:
+// tx:startAt(us, isIndexReset)
+// Same as tx:start() but at us on the rmttx.now() clock, from a hardware timer rather than
+// from Lua, so boards whose clocks are synced start within microseconds of each other. Fill
+// the RMT memory first. A time already past starts right away. Calling it again re-arms it.
+// The create() cb gets flag 4 when it fires, with how many us late it was.
+// isIndexReset: Defaults to true.
+static int rmttx_start_at( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+  int64_t at = (int64_t)luaL_checknumber(L, 2);
+  bool isIndexReset = true;
+  if (lua_isboolean(L, 3)) isIndexReset = lua_toboolean(L, 3);
+
+  int64_t now = esp_timer_get_time();
+  if (at - now > RMTTX_START_MAX_US) {
+    return luaL_error( L, "startAt() is %d ms away. It can only be up to %d ms ahead.", (int)((at - now) / 1000), RMTTX_START_MAX_US / 1000 );
+  }
+
+  if (tx->startTimer == NULL) {
+    esp_timer_create_args_t args = {
+      .callback = rmttx_start_at_tick,
+      .arg = tx,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "rmttx_start",
+    };
+    if (esp_timer_create(&args, &tx->startTimer) != ESP_OK) {
+      return luaL_error( L, "Could not create start timer" );
+    }
+  }
+
+  // a start from the timer needs the same refill events as writeRawStart(), unless the
+  // channel is on the driver from write() or writePixels(), which has its own ISR
+  if (!tx->isDriverInstalled && tx->cb_ref != LUA_NOREF) {
+    rmttx_raw_intr_enable(tx);
+  }
+
+  // re-arming, so let a tick spinning towards the old time finish first
+  rmttx_start_halt(tx);
+  portENTER_CRITICAL(&rmttx_start_mux);
+  tx->startAtUs = at;
+  tx->isStartIdxReset = isIndexReset;
+  tx->isStartArmed = true;
+  portEXIT_CRITICAL(&rmttx_start_mux);
+
+  now = esp_timer_get_time(); // the halt may have waited a tick out
+  int64_t wait = at - now - RMTTX_START_SPIN_US;
+  if (wait < 1) wait = 1;
+  esp_timer_start_once(tx->startTimer, wait);
+  if (tx->is_debug) ESP_LOGI(TAG, "startAt() armed %d us from now", (int)(at - now));
+
+  return 0;
+}
+
+// Lua:
+// wasArmed = tx:cancelStart()
+// Disarm a startAt() that hasn't fired yet.
+static int rmttx_cancel_start( lua_State *L ) {
+
+  rmttx_t tx = rmttx_get(L, 1);
+  lua_pushboolean(L, rmttx_start_halt(tx));
+  return 1;
+}
+
 // Lua:
 // tx:setLoop(isLoop)
 // Set RMT tx loop mode. Enable RMT transmitter loop sending mode. 
@@ -1175,6 +1951,16 @@ static int rmttx_unregister(lua_State* L) {
   // stop sending, if it is (could be in a loop)
   // rmt_tx_stop(tx->channel);
 
+  // stop the animation before the driver it writes to goes away
+  if (tx->anim != NULL) {
+    rmttx_anim_halt(tx->anim);
+  }
+  if (tx->startTimer != NULL) {
+    rmttx_start_halt(tx);
+    esp_timer_delete(tx->startTimer);
+    tx->startTimer = NULL;
+  }
+
   // uninstall driver for this channel
   if (tx->isDriverInstalled) {
     rmt_driver_uninstall(tx->channel);
@@ -1188,6 +1974,22 @@ static int rmttx_unregister(lua_State* L) {
     ESP_LOGI(TAG, "Released items memory.");
   }
 
+  // the driver is gone, so nothing reads the pixel buffer any more
+  rmttx_anim_free(L, tx);
+  rmttx_pix_lut[tx->channel] = NULL;
+  rmttx_pix_dither[tx->channel] = 0;
+  if (tx->lut != NULL) {
+    luaM_free(L, tx->lut);
+    tx->lut = NULL;
+  }
+  tx->isPixBusy = false;
+  tx->isTranslator = false;
+  if (tx->pix != NULL) {
+    luaM_free(L, tx->pix);
+    tx->pix = NULL;
+    tx->pixLen = 0;
+  }
+
   // remove from selfs array
   rmttx_selfs[tx->channel] = NULL;  
 
@@ -1221,8 +2023,14 @@ LROT_BEGIN(rmttx_dyn)
   LROT_FUNCENTRY( setLoop,        rmttx_setLoop )
   LROT_FUNCENTRY( stop,           rmttx_stop )
   LROT_FUNCENTRY( start,          rmttx_start )
+  LROT_FUNCENTRY( startAt,        rmttx_start_at )
+  LROT_FUNCENTRY( cancelStart,    rmttx_cancel_start )
   LROT_FUNCENTRY( writeSync,      rmttx_writeSync )
   LROT_FUNCENTRY( writeAsync,     rmttx_writeAsync )
+  LROT_FUNCENTRY( writePixels,    rmttx_write_pixels )
+  LROT_FUNCENTRY( animate,        rmttx_animate )
+  LROT_FUNCENTRY( stopAnimation,  rmttx_stop_animation )
+  LROT_FUNCENTRY( setColorCorrection, rmttx_set_color_correction )
   LROT_FUNCENTRY( setPin,         rmttx_setPin )
   LROT_FUNCENTRY( __gc,           rmttx_unregister )
   LROT_TABENTRY ( __index,        rmttx_dyn )
@@ -1233,6 +2041,13 @@ LROT_BEGIN(rmttx)
   LROT_FUNCENTRY( getClkDivForNsPerTick,  rmttx_getClkDivForNsPerTick )
   LROT_FUNCENTRY( getNsPerTickForClkDiv,  rmttx_getNsPerTickForClkDiv )
   LROT_FUNCENTRY( create,                 rmttx_create )
+  LROT_FUNCENTRY( now,                    rmttx_now )
+  LROT_NUMENTRY ( ANIM_SOLID,             RMTTX_ANIM_SOLID )
+  LROT_NUMENTRY ( ANIM_FADE,              RMTTX_ANIM_FADE )
+  LROT_NUMENTRY ( ANIM_PULSE,             RMTTX_ANIM_PULSE )
+  LROT_NUMENTRY ( ANIM_BLINK,             RMTTX_ANIM_BLINK )
+  LROT_NUMENTRY ( ANIM_BREATHE,           RMTTX_ANIM_BREATHE )
+  LROT_NUMENTRY ( ANIM_SEQUENCE,          RMTTX_ANIM_SEQUENCE )
 LROT_END(rmttx, NULL, 0)
 
 int luaopen_rmttx(lua_State *L) {
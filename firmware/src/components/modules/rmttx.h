@@ -0,0 +1,25 @@
+/*
+Shared hooks into the rmttx module for other C modules
+Authored by: ChiliPeppr (John Lauer) 2019
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#ifndef __RMTTX_H__
+#define __RMTTX_H__
+
+#include <stdint.h>
+
+// Called from the Lua thread (never the ISR) each time a write or fill on a channel
+// changes the shortest pulse it is sending. min_pulse_ns is 0 if nothing is being sent.
+typedef void (*rmttx_pulse_hook_t)(uint8_t channel, uint32_t min_pulse_ns);
+
+// Only one hook is supported. Pass NULL to remove it.
+void rmttx_set_pulse_hook(rmttx_pulse_hook_t hook);
+
+// Shortest non-zero duration, in ns, in the last two chunks written to the channel.
+// Returns 0 if the channel has no rmttx object or nothing was written yet.
+uint32_t rmttx_get_min_pulse_ns(uint8_t channel);
+
+#endif
@@ -25,18 +25,45 @@ CONDITIONS OF ANY KIND, either express or implied.
 #include "task/task.h" 
 #include "driver/touch_pad.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "lextra.h"
 #include "soc/rtc_periph.h"
 #include "soc/touch_channel.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #define TOUCH_THRESH_NO_USE   (0)
 
 static const char* TAG = "Touch";
 
+// Continuous sampler. A timer reads every pad of a touch object, keeps an IIR filtered copy,
+// and appends a frame to a ring buffer so Lua can read many samples at once without a table
+// per read. Frames are packed little endian: uint32 timestamp in us, then uint16 raw and
+// uint16 filtered per pad in pad number order.
 typedef struct {
-  // uint8_t selfs_index; // Keep track of our own index in touch_selfs so on cleanup we can unallocate
+  esp_timer_handle_t timer;
+  uint32_t period_ms;
+  uint8_t filter_shift;     // IIR, each sample moves 1/2^shift of the way to the raw value
+  uint8_t pad_cnt;
+  uint8_t pads[TOUCH_PAD_MAX];
+  uint16_t frame_len;       // bytes per frame, 4 + 4 * pad_cnt
+  uint16_t depth;           // frames in the ring
+  uint16_t head;            // next frame to write
+  uint16_t cnt;             // unread frames
+  uint32_t dropped;         // unread frames overwritten since the last read
+  uint32_t filt[TOUCH_PAD_MAX];     // by pad number, x16 so the IIR keeps its fraction
+  uint16_t last_raw[TOUCH_PAD_MAX]; // by pad number
+  uint8_t *ring;            // [depth * frame_len]
+  bool is_ticking;          // a tick is reading pads or writing a frame
+} touch_sampler_struct_t;
+typedef touch_sampler_struct_t *touch_sampler_t;
+
+typedef struct {
+  uint8_t selfs_index; // Keep track of our own index in touch_selfs so on cleanup we can unallocate
+  uint16_t pad_mask;   // touch_pads as a bitmask, pads can't be shared between objects
   int32_t cb_ref; // If a callback is provided, then we are using the ISR, otherwise we are just letting them poll
   bool is_initted;
   bool is_debug;
@@ -49,18 +76,153 @@ typedef struct {
   uint8_t slope;
   bool is_intr;
   touch_trigger_mode_t thresTrigger;
+  // Baseline tracking. Untouched counters drift with temperature and humidity, so we follow
+  // them with a slow IIR that freezes while a pad is touched, and keep the hardware thresholds
+  // a fixed percent below the baseline.
+  uint8_t thres_pct;              // 0 means thresholds are only what you set with setThres()
+  uint8_t base_shift;             // IIR, each tick moves 1/2^shift of the way to the new value
+  uint32_t base_ms;               // tick period, 0 means no baseline tracking
+  uint32_t base[TOUCH_PAD_MAX];   // baseline x16 so the IIR keeps its fraction. 0 until the first read
+  esp_timer_handle_t base_timer;
+  bool is_stopping;               // set under touch_base_mux by unregister(), ticks that see it do nothing
+  bool is_base_ticking;           // the baseline tick is reading pads
+  bool is_cal;                    // calibrate() is averaging
+  int64_t cal_end_us;
+  uint32_t cal_sum[TOUCH_PAD_MAX];
+  uint16_t cal_cnt;
+  int32_t cal_cb_ref;
+  touch_sampler_t sampler;        // NULL unless startSampler() was called
+  // Press/release state. The interrupt only fires while a pad is below threshold, so release
+  // is found by a state timer that reads the pads and debounces them with some hysteresis.
+  int32_t press_cb_ref;           // LUA_NOREF means no state tracking
+  uint16_t state_ms;              // state timer period
+  uint8_t debounce;               // reads in a row a pad must agree before it changes state
+  uint8_t hyst_pct;               // release needs the counter this percent above the press threshold
+  esp_timer_handle_t state_timer;
+  bool is_state_ticking;          // the state tick is reading pads, under touch_base_mux like is_stopping
+  bool is_pressed[TOUCH_PAD_MAX];
+  uint8_t deb_cnt[TOUCH_PAD_MAX];
+  int64_t change_us[TOUCH_PAD_MAX]; // when the pad last changed state
+  // Gestures, classified in the state timer from the debounced press/release edges so they
+  // keep their timing even when the Lua VM is busy and the callback runs late.
+  int32_t gesture_cb_ref;         // LUA_NOREF means no gestures
+  uint16_t tap_ms;                // released within this is a tap
+  uint16_t dbl_tap_ms;            // a second tap within this of the first is a double tap. 0 reports taps right away
+  uint16_t long_ms;               // held this long is a long press, reported while still held. 0 is off
+  uint16_t swipe_gap_ms;          // most time between neighbouring pads in a swipe
+  uint8_t swipe_cnt;
+  uint8_t swipe_pads[TOUCH_PAD_MAX]; // pad numbers in physical order
+  int8_t swipe_idx[TOUCH_PAD_MAX];   // by pad number, index into swipe_pads or -1
+  bool is_tap_pending[TOUCH_PAD_MAX];
+  int64_t tap_us[TOUCH_PAD_MAX];     // release of the pending tap
+  uint32_t tap_dur_us[TOUCH_PAD_MAX];
+  bool is_long_fired[TOUCH_PAD_MAX];
+  int8_t run_last;                // swipe in progress, index of the last pad in it, -1 for none
+  int8_t run_dir;
+  uint8_t run_len;                // pads visited
+  uint8_t run_first;              // pad number the swipe started on
+  int64_t run_start_us;
+  int64_t run_press_us;           // last pad press in the swipe
+  int64_t run_edge_us;            // last press or release on any swipe pad
 } touch_struct_t;
 typedef touch_struct_t *touch_t;
 
-// array of 10 touch_struct_t pointers so we can reference by unit number
+// array of touch_struct_t pointers so we can reference by selfs_index
 // this array gets filled in as we define touch_struct_t's during the create() method
-// 10 pads are available, so leave enough room for 1 pad per create
-static touch_t touch_self = NULL; // just allow 1 instance. used to allow 10, but changed approach. s[10] = {NULL};
-// static uint8_t touch_selfs_last_index = 0; // keep track of last index used on touch_selfs
+// each object owns its own pads, so i.e. a jog dial and some buttons can have their own
+// callback, filter period and trigger mode
+#define TOUCH_MAX 4
+static touch_t touch_selfs[TOUCH_MAX] = {NULL};
+
+// Pads each object wants interrupt callbacks for, by selfs_index. 0 if the object has no cb or
+// its interrupt is off. Plain masks so the ISR can route status bits without touching userdata.
+static uint16_t touch_isr_masks[TOUCH_MAX] = {0};
+static uint8_t touch_isr_refs = 0; // objects with a cb, the ISR stays registered while > 0
+static uint32_t touch_filter_ms = 0; // period the hardware filter is running at, 0 if stopped
 
 // Task ID to get ISR interrupt back into Lua callback
 static task_handle_t touch_task_id;
 
+// Capacitive slider / wheel. A timer reads the raw counters of the pads along the slider,
+// filters them, and turns the drop from baseline into an interpolated finger position so
+// Lua only gets a position, direction and velocity instead of raw pad bitmasks.
+#define TOUCH_SLIDER_MAX 4
+#define TOUCH_SLIDER_BASE_TICKS 8 // ticks averaged for the untouched baseline at start
+
+typedef struct {
+  int32_t cb_ref;
+  bool is_debug;
+  bool is_wheel;          // last pad wraps around to the first
+  uint8_t pad_cnt;
+  uint8_t pads[TOUCH_PAD_MAX]; // pad numbers in physical order along the slider
+  uint8_t index;          // our slot in touch_sliders
+  uint32_t rate_ms;
+  uint8_t thres_pct;      // a pad is touched when it drops this many percent below its baseline
+  uint8_t filter_shift;   // IIR filter, each tick moves 1/2^shift of the way to the raw value
+  uint16_t resolution;    // position units per pad
+  uint32_t filt[TOUCH_PAD_MAX]; // filtered counter x16 so the IIR keeps its fraction
+  uint32_t base[TOUCH_PAD_MAX]; // untouched baseline x16
+  uint8_t base_ticks;     // ticks left in the baseline average
+  bool is_touched;
+  bool is_posted;         // a callback is queued and hasn't run yet, so don't queue another
+  int32_t pos;
+  int8_t dir;
+  int32_t vel;            // position units per second, signed
+  int64_t last_us;
+  esp_timer_handle_t timer;
+  bool is_stopping;       // set under the mux by unregister(), ticks that see it do nothing
+  bool is_ticking;        // a tick is reading the pads
+} touch_slider_struct_t;
+typedef touch_slider_struct_t *touch_slider_t;
+
+static touch_slider_t touch_sliders[TOUCH_SLIDER_MAX] = {NULL};
+static task_handle_t touch_slider_task_id;
+
+// Protects slider state between the slider timer and Lua
+static portMUX_TYPE touch_slider_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The touch driver is global, so count who is using it and only init/deinit once
+static uint8_t touch_driver_refs = 0;
+static uint16_t touch_slider_pad_mask = 0; // pads owned by sliders
+
+#define TOUCH_BASE_CAL_MS 10 // read rate while calibrate() is averaging
+#define TOUCH_BASE_FREEZE_PCT 10 // freeze band when there are no auto thresholds
+
+// Protects the baselines between the baseline timer and Lua
+static portMUX_TYPE touch_base_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Protects the sampler ring buffer between the sampler timer and Lua
+static portMUX_TYPE touch_sampler_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Press/release and gesture events from the state timer waiting for the Lua task
+#define TOUCH_EVT_QUEUE_LEN 16
+#define TOUCH_EVT_PRESS   0
+#define TOUCH_EVT_GESTURE 1
+
+#define TOUCH_GESTURE_TAP        1
+#define TOUCH_GESTURE_DOUBLE_TAP 2
+#define TOUCH_GESTURE_LONG_PRESS 3
+#define TOUCH_GESTURE_SWIPE      4
+
+typedef struct {
+  uint8_t index;    // selfs_index of the object the pad belongs to
+  uint8_t kind;     // TOUCH_EVT_PRESS or TOUCH_EVT_GESTURE
+  uint8_t code;     // isPressed for a press, TOUCH_GESTURE_* for a gesture
+  uint8_t pad;
+  int32_t a;        // press: how long the pad was in its previous state in us. gesture: see touch_gesture_*
+  int32_t b;
+  int32_t c;
+} touch_evt_t;
+static touch_evt_t touch_evts[TOUCH_EVT_QUEUE_LEN];
+static uint8_t touch_evt_head = 0;
+static uint8_t touch_evt_cnt = 0;
+static uint32_t touch_evt_dropped = 0;
+static bool touch_evt_is_posted = false;
+static portMUX_TYPE touch_evt_mux = portMUX_INITIALIZER_UNLOCKED;
+static task_handle_t touch_evt_task_id;
+static uint32_t touch_isr_latched = 0; // pads the ISR saw touched since the last state tick
+static task_handle_t touch_base_task_id;
+
 // Helper function to create Lua tables in C
 void l_pushtableintkeyval(lua_State* L , int key , int value) {
     lua_pushinteger(L, key);
@@ -85,13 +247,24 @@ static void IRAM_ATTR touch_intr_handler(void *arg)
   uint32_t pad_intr = touch_pad_get_status();
   //clear interrupt
   touch_pad_clear_status();
+
+  // let the state timer know, so even a tap shorter than its reads still gets a press and release
+  uint16_t masks[TOUCH_MAX];
+  portENTER_CRITICAL_ISR(&touch_evt_mux);
+  touch_isr_latched |= pad_intr;
+  for (int i = 0; i < TOUCH_MAX; i++) masks[i] = touch_isr_masks[i];
+  portEXIT_CRITICAL_ISR(&touch_evt_mux);
   
 
   // post using lua task posting technique
   // on lua_open we set touch_task_id as a method which gets called
   // by Lua after task_post_high with reference to this self object and then we can steal the 
-  // callback_ref and then it gets called by lua_call where we get to add our args
-  task_post_high(touch_task_id, pad_intr );
+  // callback_ref and then it gets called by lua_call where we get to add our args.
+  // Each object only gets woken up for its own pads, with its selfs_index above the pad bits.
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    uint32_t bits = pad_intr & masks[i];
+    if (bits) task_post_high(touch_task_id, (i << TOUCH_PAD_MAX) | bits);
+  }
   
 }
 
@@ -106,20 +279,20 @@ static void touch_task(task_param_t param, task_prio_t prio)
 {
   (void)prio;
 
-  //   if (touch_self != NULL && touch_self->is_debug) ESP_LOGI(TAG, "Got interrupt param: %d", param);
+  // the ISR already worked out which object these pads belong to
+  uint8_t index = param >> TOUCH_PAD_MAX;
+  param &= (1 << TOUCH_PAD_MAX) - 1;
+  touch_t tp = index < TOUCH_MAX ? touch_selfs[index] : NULL;
 
-  // Now see which touch_selfs has cb_refs
-  // For now just call all of them
-  lua_State *L = lua_getstate();
+  //   if (tp != NULL && tp->is_debug) ESP_LOGI(TAG, "Got interrupt param: %d", param);
 
-  // old approach was to allow 10 objects. for now we are allowing 1, so go right to it.
-  // for (int i = 0; i < touch_selfs_last_index; i++) {
+  lua_State *L = lua_getstate();
 
-  // see if there's any self and a callback on self, if so, do the callback
-  if (touch_self != NULL) {
-    if (touch_self->cb_ref != LUA_NOREF) {
+  // see if the object is still there with a callback, if so, do the callback
+  if (tp != NULL) {
+    if (tp->cb_ref != LUA_NOREF) {
       // we have a callback
-      lua_rawgeti (L, LUA_REGISTRYINDEX, touch_self->cb_ref);
+      lua_rawgeti (L, LUA_REGISTRYINDEX, tp->cb_ref);
       const char* funcName = lua_tostring(L, -1);
 
       // create a table in c (it will be at the top of the stack)
@@ -130,12 +303,12 @@ static void touch_task(task_param_t param, task_prio_t prio)
         if ((param >> i) & 0x01) {
           // s_pad_activated[i] = true;
           l_pushtableintkeybool(L, i, true);
-          //   if (touch_self->is_debug) ESP_LOGI(TAG, "Pushed key %d, bool %d", i, true);
+          //   if (tp->is_debug) ESP_LOGI(TAG, "Pushed key %d, bool %d", i, true);
 
         } else {
           // don't push false values for now to reduce memory usage
           //   l_pushtableintkeybool(L, i, false);
-          //   if (touch_self->is_debug) ESP_LOGI(TAG, "Pushed key %d, bool %d", i, false);
+          //   if (tp->is_debug) ESP_LOGI(TAG, "Pushed key %d, bool %d", i, false);
         }
       }
 
@@ -147,10 +320,535 @@ static void touch_task(task_param_t param, task_prio_t prio)
     }
   }
 
-  //} // old for loop
+}
+
+
+// Init the touch driver if nobody else has yet.
+static esp_err_t touch_driver_acquire(void)
+{
+  if (touch_driver_refs == 0) {
+    esp_err_t err = touch_pad_init();
+    if (err != ESP_OK) return err;
+  }
+  touch_driver_refs++;
+  return ESP_OK;
+}
+
+// Deinit the touch driver once the last user is gone.
+static void touch_driver_release(void)
+{
+  if (touch_driver_refs == 0) return;
+  touch_driver_refs--;
+  if (touch_driver_refs == 0) touch_pad_deinit();
+}
+
+// Stop a timer and wait out a tick that was already running when we did, since
+// esp_timer_stop() doesn't wait for one. The tick sets *is_ticking under mux while it works,
+// and does nothing if the caller already took away what it works on.
+static void touch_timer_halt(esp_timer_handle_t timer, portMUX_TYPE *mux, bool *is_ticking)
+{
+  esp_timer_stop(timer);
+  while (true) {
+    portENTER_CRITICAL(mux);
+    bool is_busy = *is_ticking;
+    portEXIT_CRITICAL(mux);
+    if (!is_busy) break;
+    vTaskDelay(1);
+  }
+}
+
+// True if the hardware timer is measuring, i.e. some touch object has a cb or there is a slider.
+static bool touch_is_fsm_timer(void)
+{
+  if (touch_slider_pad_mask) return true;
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    if (touch_selfs[i] != NULL && touch_selfs[i]->cb_ref != LUA_NOREF) return true;
+  }
+  return false;
+}
+
+// Put the FSM back in SW mode once nothing needs the hardware timer any more, i.e. the last
+// slider is gone and only polling objects are left, which is the mode they were created in.
+static void touch_fsm_restore(void)
+{
+  if (touch_driver_refs == 0 || touch_is_fsm_timer()) return;
+  touch_pad_set_fsm_mode(TOUCH_FSM_MODE_SW);
+}
+
+// True if a touch object already has this pad
+static bool touch_pad_owned(int pad)
+{
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    if (touch_selfs[i] != NULL && touch_selfs[i]->touch_pads[pad]) return true;
+  }
+  return false;
+}
 
+// True if another object has its interrupt on with a different trigger mode. The hardware
+// has one trigger mode for all pads, so objects with interrupts on have to agree on it.
+static bool touch_trigger_conflict(touch_t tp, touch_trigger_mode_t mode)
+{
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    touch_t other = touch_selfs[i];
+    if (other != NULL && other != tp && other->cb_ref != LUA_NOREF && other->is_intr && other->thresTrigger != mode) return true;
+  }
+  return false;
 }
 
+// The hardware has one interrupt enable and one filter for all pads, so work them out from
+// every object after one of them changes. Interrupts are on if any object wants them, and
+// the filter runs at the shortest filterMs asked for.
+static void touch_hw_update(void)
+{
+  bool is_intr = false;
+  uint32_t filter_ms = 0;
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    touch_t tp = touch_selfs[i];
+    uint16_t mask = 0;
+    if (tp != NULL) {
+      if (tp->cb_ref != LUA_NOREF && tp->is_intr) {
+        mask = tp->pad_mask;
+        is_intr = true;
+      }
+      if (tp->filterMs > 0 && (filter_ms == 0 || tp->filterMs < filter_ms)) filter_ms = tp->filterMs;
+    }
+    portENTER_CRITICAL(&touch_evt_mux);
+    touch_isr_masks[i] = mask;
+    portEXIT_CRITICAL(&touch_evt_mux);
+  }
+
+  if (is_intr) {
+    touch_pad_intr_enable();
+  } else {
+    touch_pad_intr_disable();
+    touch_pad_clear_status();
+  }
+
+  if (filter_ms != touch_filter_ms) {
+    esp_err_t err = ESP_OK;
+    if (filter_ms == 0) err = touch_pad_filter_stop();
+    else if (touch_filter_ms == 0) err = touch_pad_filter_start(filter_ms);
+    else err = touch_pad_set_filter_period(filter_ms);
+    if (err == ESP_OK) {
+      touch_filter_ms = filter_ms;
+    } else {
+      ESP_LOGI(TAG, "Filter error %d setting period to %d ms", err, filter_ms);
+    }
+  }
+}
+
+// Read one pad now. In interrupt mode (or with a slider) the hardware timer is measuring,
+// so just grab the last result instead of kicking off a software measurement.
+static esp_err_t touch_hw_read_pad(touch_t tp, int pad, uint16_t *val)
+{
+  (void)tp;
+  if (touch_is_fsm_timer()) return touch_pad_read_raw_data((touch_pad_t)pad, val);
+  return touch_pad_read((touch_pad_t)pad, val);
+}
+
+// Program the hardware thresholds thresPct below the baselines. Only pads whose threshold
+// actually changed get written.
+static void touch_base_apply_thres(touch_t tp)
+{
+  if (tp->thres_pct == 0) return;
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (!tp->touch_pads[pad] || tp->base[pad] == 0) continue;
+    uint16_t thres = (tp->base[pad] >> 4) * (100 - tp->thres_pct) / 100;
+    if (thres != tp->thres[pad]) {
+      tp->thres[pad] = thres;
+      touch_pad_set_thresh((touch_pad_t)pad, thres);
+    }
+  }
+}
+
+// Baseline timer tick. Runs in the esp_timer task. is_base_ticking lets unregister() know
+// when it's safe to delete the timer.
+static void touch_base_tick(void *arg)
+{
+  touch_t tp = (touch_t)arg;
+  portENTER_CRITICAL(&touch_base_mux);
+  bool is_stopping = tp->is_stopping;
+  if (!is_stopping) tp->is_base_ticking = true;
+  portEXIT_CRITICAL(&touch_base_mux);
+  if (is_stopping) return;
+
+  uint8_t pct = tp->thres_pct > 0 ? tp->thres_pct : TOUCH_BASE_FREEZE_PCT;
+  bool is_cal_done = false;
+
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (!tp->touch_pads[pad]) continue;
+    uint16_t val = 0;
+    // the sampler already reads every pad, don't read them twice. Take its pointer under
+    // the mux, stopSampler() may be freeing it from the Lua task.
+    portENTER_CRITICAL(&touch_sampler_mux);
+    bool is_sampled = tp->sampler != NULL;
+    if (is_sampled) val = tp->sampler->last_raw[pad];
+    portEXIT_CRITICAL(&touch_sampler_mux);
+    if (is_sampled) {
+      if (val == 0) continue;
+    } else if (touch_hw_read_pad(tp, pad, &val) != ESP_OK || val == 0) continue;
+    int32_t val16 = (int32_t)val << 4;
+
+    portENTER_CRITICAL(&touch_base_mux);
+    if (tp->is_cal) {
+      tp->cal_sum[pad] += val;
+    } else if (tp->base[pad] == 0) {
+      tp->base[pad] = val16;
+    } else {
+      // freeze once the drop is half way to a touch, so a finger never becomes the baseline
+      uint32_t drop = tp->base[pad] > (uint32_t)val16 ? tp->base[pad] - val16 : 0;
+      if (drop * 200 < tp->base[pad] * pct) {
+        tp->base[pad] += (val16 - (int32_t)tp->base[pad]) >> tp->base_shift;
+      }
+    }
+    portEXIT_CRITICAL(&touch_base_mux);
+  }
+
+  if (tp->is_cal) {
+    tp->cal_cnt++;
+    if (esp_timer_get_time() >= tp->cal_end_us) {
+      portENTER_CRITICAL(&touch_base_mux);
+      for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+        if (tp->touch_pads[pad] && tp->cal_cnt > 0) tp->base[pad] = (tp->cal_sum[pad] << 4) / tp->cal_cnt;
+      }
+      tp->is_cal = false;
+      portEXIT_CRITICAL(&touch_base_mux);
+      is_cal_done = true;
+    }
+  }
+
+  touch_base_apply_thres(tp);
+
+  if (is_cal_done) {
+    // back to the slow rate
+    esp_timer_stop(tp->base_timer);
+    esp_timer_start_periodic(tp->base_timer, tp->base_ms * 1000);
+    task_post_low(touch_base_task_id, tp->selfs_index);
+  }
+
+  portENTER_CRITICAL(&touch_base_mux);
+  tp->is_base_ticking = false;
+  portEXIT_CRITICAL(&touch_base_mux);
+}
+
+// Push a table of {[pad]=baseline} for the pads in this object
+static void touch_base_push(lua_State *L, touch_t tp)
+{
+  lua_newtable(L);
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (!tp->touch_pads[pad]) continue;
+    portENTER_CRITICAL(&touch_base_mux);
+    uint32_t base = tp->base[pad] >> 4;
+    portEXIT_CRITICAL(&touch_base_mux);
+    l_pushtableintkeyval(L, pad, base);
+  }
+}
+
+/*
+Called via the Lua task queue when calibrate() finishes.
+The format of the callback to your Lua code is:
+  function onCalibrated(baselines)
+*/
+static void touch_base_task(task_param_t param, task_prio_t prio)
+{
+  (void)prio;
+
+  touch_t tp = param < TOUCH_MAX ? touch_selfs[param] : NULL;
+  if (tp == NULL || tp->cal_cb_ref == LUA_NOREF) return;
+
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, tp->cal_cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->cal_cb_ref);
+  tp->cal_cb_ref = LUA_NOREF;
+  touch_base_push(L, tp);
+  if (lua_pcall(L, 1, 0, 0) != 0) {
+    ESP_LOGI(TAG, "error running calibrate callback: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+// Queue a press/release or gesture event for the Lua task. Runs in the esp_timer task.
+static void touch_evt_push(touch_t tp, uint8_t kind, uint8_t code, uint8_t pad, int32_t a, int32_t b, int32_t c)
+{
+  bool is_post = false;
+  portENTER_CRITICAL(&touch_evt_mux);
+  if (touch_evt_cnt < TOUCH_EVT_QUEUE_LEN) {
+    touch_evt_t *e = &touch_evts[(touch_evt_head + touch_evt_cnt) % TOUCH_EVT_QUEUE_LEN];
+    e->index = tp->selfs_index;
+    e->kind = kind;
+    e->code = code;
+    e->pad = pad;
+    e->a = a;
+    e->b = b;
+    e->c = c;
+    touch_evt_cnt++;
+  } else {
+    touch_evt_dropped++;
+  }
+  if (!touch_evt_is_posted) {
+    touch_evt_is_posted = true;
+    is_post = true;
+  }
+  portEXIT_CRITICAL(&touch_evt_mux);
+  if (is_post) task_post_medium(touch_evt_task_id, 0);
+}
+
+// Press threshold for a pad. Relative to the baseline if thresPct is on, else what setThres() gave us.
+static uint16_t touch_state_press_thres(touch_t tp, int pad)
+{
+  if (tp->thres_pct > 0 && tp->base[pad] != 0) return (tp->base[pad] >> 4) * (100 - tp->thres_pct) / 100;
+  return tp->thres[pad];
+}
+
+// Gesture edge. Runs in the esp_timer task on every debounced press or release.
+//   TAP        a = held ms
+//   DOUBLE_TAP a = ms from the first release to the second press
+//   LONG_PRESS a = held ms, reported once while the pad is still held
+//   SWIPE      pad = first pad, a = direction (1 along swipePads, -1 back), b = speed in pads/s, c = pads crossed
+static void touch_gesture_edge(touch_t tp, int pad, bool is_pressed, int64_t now, uint32_t dur_us)
+{
+  if (tp->gesture_cb_ref == LUA_NOREF) return;
+  int idx = tp->swipe_idx[pad];
+
+  if (is_pressed) {
+    tp->is_long_fired[pad] = false;
+    if (idx < 0) return;
+    bool is_new = tp->run_last < 0 || now - tp->run_edge_us > tp->swipe_gap_ms * 1000;
+    if (!is_new && idx != tp->run_last) {
+      int8_t dir = idx > tp->run_last ? 1 : -1;
+      if (abs(idx - tp->run_last) != 1 || (tp->run_dir != 0 && dir != tp->run_dir)) {
+        is_new = true;
+      } else {
+        tp->run_dir = dir;
+        tp->run_last = idx;
+        tp->run_len++;
+        tp->run_press_us = now;
+        // the pads of a swipe are not taps
+        if (tp->run_len == 2) memset(tp->is_tap_pending, 0, sizeof(tp->is_tap_pending));
+      }
+    }
+    if (is_new) {
+      tp->run_last = idx;
+      tp->run_dir = 0;
+      tp->run_len = 1;
+      tp->run_first = pad;
+      tp->run_start_us = now;
+      tp->run_press_us = now;
+    }
+    tp->run_edge_us = now;
+    return;
+  }
+
+  if (idx >= 0) tp->run_edge_us = now;
+  if (tp->is_long_fired[pad] || dur_us > tp->tap_ms * 1000) {
+    tp->is_tap_pending[pad] = false;
+    return;
+  }
+  if (idx >= 0 && tp->run_len >= 2) return;
+
+  if (tp->is_tap_pending[pad]) {
+    tp->is_tap_pending[pad] = false;
+    int64_t gap_us = now - dur_us - tp->tap_us[pad];
+    touch_evt_push(tp, TOUCH_EVT_GESTURE, TOUCH_GESTURE_DOUBLE_TAP, pad, gap_us > 0 ? gap_us / 1000 : 0, 0, 0);
+  } else if (tp->dbl_tap_ms == 0 && idx < 0) {
+    touch_evt_push(tp, TOUCH_EVT_GESTURE, TOUCH_GESTURE_TAP, pad, dur_us / 1000, 0, 0);
+  } else {
+    tp->is_tap_pending[pad] = true;
+    tp->tap_us[pad] = now;
+    tp->tap_dur_us[pad] = dur_us;
+  }
+}
+
+// Gesture timeouts. Runs in the esp_timer task at the end of every state tick.
+static void touch_gesture_tick(touch_t tp, int64_t now)
+{
+  if (tp->gesture_cb_ref == LUA_NOREF) return;
+
+  bool is_swipe_held = false;
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (!tp->touch_pads[pad]) continue;
+    bool is_swipe_pad = tp->swipe_idx[pad] >= 0;
+    if (is_swipe_pad && tp->is_pressed[pad]) is_swipe_held = true;
+
+    if (tp->is_pressed[pad] && !tp->is_long_fired[pad] && tp->long_ms > 0 &&
+        now - tp->change_us[pad] >= tp->long_ms * 1000 && !(is_swipe_pad && tp->run_len >= 2)) {
+      tp->is_long_fired[pad] = true;
+      tp->is_tap_pending[pad] = false;
+      touch_evt_push(tp, TOUCH_EVT_GESTURE, TOUCH_GESTURE_LONG_PRESS, pad, (now - tp->change_us[pad]) / 1000, 0, 0);
+    }
+
+    // a swipe pad may still turn out to be the start of a swipe, so its tap waits out the gap too
+    if (tp->is_tap_pending[pad]) {
+      uint32_t wait_ms = tp->dbl_tap_ms;
+      if (is_swipe_pad && tp->swipe_gap_ms > wait_ms) wait_ms = tp->swipe_gap_ms;
+      if (now - tp->tap_us[pad] > wait_ms * 1000) {
+        tp->is_tap_pending[pad] = false;
+        touch_evt_push(tp, TOUCH_EVT_GESTURE, TOUCH_GESTURE_TAP, pad, tp->tap_dur_us[pad] / 1000, 0, 0);
+      }
+    }
+  }
+
+  // the finger left the swipe pads and didn't come back within the gap, so the swipe is over
+  if (tp->run_last >= 0 && !is_swipe_held && now - tp->run_edge_us > tp->swipe_gap_ms * 1000) {
+    if (tp->run_len >= 2) {
+      int64_t span_us = tp->run_press_us - tp->run_start_us;
+      int32_t speed = span_us > 0 ? (int32_t)((tp->run_len - 1) * 1000000LL / span_us) : 0;
+      touch_evt_push(tp, TOUCH_EVT_GESTURE, TOUCH_GESTURE_SWIPE, tp->run_first, tp->run_dir, speed, tp->run_len);
+    }
+    tp->run_last = -1;
+    tp->run_len = 0;
+  }
+}
+
+// State timer tick. Runs in the esp_timer task. A pad is pressed once it reads below the
+// press threshold debounce times in a row, and released once it reads above the press
+// threshold plus hysteresis debounce times in a row, so release is seen within
+// stateMs * debounce of the finger lifting. is_state_ticking lets unregister() know when it's
+// safe to delete the timer.
+static void touch_state_tick(void *arg)
+{
+  touch_t tp = (touch_t)arg;
+  portENTER_CRITICAL(&touch_base_mux);
+  bool is_stopping = tp->is_stopping;
+  if (!is_stopping) tp->is_state_ticking = true;
+  portEXIT_CRITICAL(&touch_base_mux);
+  if (is_stopping) return;
+
+  int64_t now = esp_timer_get_time();
+
+  // only take our own pads, the rest belong to other objects' state timers
+  portENTER_CRITICAL(&touch_evt_mux);
+  uint32_t latched = touch_isr_latched & tp->pad_mask;
+  touch_isr_latched &= ~latched;
+  portEXIT_CRITICAL(&touch_evt_mux);
+
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (!tp->touch_pads[pad]) continue;
+
+    // the hardware already compared against the threshold, so an interrupt is a press right away
+    if (!tp->is_pressed[pad] && (latched & (1 << pad))) {
+      tp->deb_cnt[pad] = 0;
+      tp->is_pressed[pad] = true;
+      uint32_t dur_us = tp->change_us[pad] ? (uint32_t)(now - tp->change_us[pad]) : 0;
+      tp->change_us[pad] = now;
+      touch_evt_push(tp, TOUCH_EVT_PRESS, true, pad, dur_us, 0, 0);
+      touch_gesture_edge(tp, pad, true, now, dur_us);
+      continue;
+    }
+
+    uint16_t press_thres = touch_state_press_thres(tp, pad);
+    if (press_thres == 0) continue; // no threshold yet, so nothing counts as a press
+
+    uint16_t val = 0;
+    portENTER_CRITICAL(&touch_sampler_mux);
+    bool is_sampled = tp->sampler != NULL;
+    if (is_sampled) val = tp->sampler->last_raw[pad];
+    portEXIT_CRITICAL(&touch_sampler_mux);
+    if (!is_sampled && touch_hw_read_pad(tp, pad, &val) != ESP_OK) continue;
+    if (val == 0) continue;
+
+    uint32_t release_thres = press_thres + press_thres * tp->hyst_pct / 100;
+    bool is_want = tp->is_pressed[pad] ? val <= release_thres : val < press_thres;
+    if (is_want == tp->is_pressed[pad]) {
+      tp->deb_cnt[pad] = 0;
+      continue;
+    }
+    if (++tp->deb_cnt[pad] < tp->debounce) continue;
+
+    tp->deb_cnt[pad] = 0;
+    tp->is_pressed[pad] = is_want;
+    uint32_t dur_us = tp->change_us[pad] ? (uint32_t)(now - tp->change_us[pad]) : 0;
+    tp->change_us[pad] = now;
+    touch_evt_push(tp, TOUCH_EVT_PRESS, is_want, pad, dur_us, 0, 0);
+    touch_gesture_edge(tp, pad, is_want, now, dur_us);
+  }
+
+  touch_gesture_tick(tp, now);
+
+  portENTER_CRITICAL(&touch_base_mux);
+  tp->is_state_ticking = false;
+  portEXIT_CRITICAL(&touch_base_mux);
+}
+
+/*
+Called via the Lua task queue to deliver press/release and gesture events from the state timer.
+The format of the callbacks to your Lua code is:
+  function onPress(pad, isPressed, durUs)
+where durUs is how long the pad was in its previous state, i.e. how long it was held on release, and
+  function onGesture(gesture, pad, a, b, c)
+where gesture is touch.GESTURE_* and a, b, c depend on it, see touch_gesture_edge().
+*/
+static void touch_evt_task(task_param_t param, task_prio_t prio)
+{
+  (void)param;
+  (void)prio;
+
+  lua_State *L = lua_getstate();
+  while (true) {
+    touch_evt_t e;
+    portENTER_CRITICAL(&touch_evt_mux);
+    if (touch_evt_cnt == 0) {
+      touch_evt_is_posted = false;
+      portEXIT_CRITICAL(&touch_evt_mux);
+      break;
+    }
+    e = touch_evts[touch_evt_head];
+    touch_evt_head = (touch_evt_head + 1) % TOUCH_EVT_QUEUE_LEN;
+    touch_evt_cnt--;
+    portEXIT_CRITICAL(&touch_evt_mux);
+
+    touch_t tp = touch_selfs[e.index];
+    if (tp == NULL) continue;
+
+    if (e.kind == TOUCH_EVT_PRESS) {
+      if (tp->press_cb_ref == LUA_NOREF) continue;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, tp->press_cb_ref);
+      lua_pushinteger(L, e.pad);
+      lua_pushboolean(L, e.code);
+      lua_pushinteger(L, (uint32_t)e.a);
+      if (lua_pcall(L, 3, 0, 0) != 0) {
+        ESP_LOGI(TAG, "error running press callback: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    } else {
+      if (tp->gesture_cb_ref == LUA_NOREF) continue;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, tp->gesture_cb_ref);
+      lua_pushinteger(L, e.code);
+      lua_pushinteger(L, e.pad);
+      lua_pushinteger(L, e.a);
+      lua_pushinteger(L, e.b);
+      lua_pushinteger(L, e.c);
+      if (lua_pcall(L, 5, 0, 0) != 0) {
+        ESP_LOGI(TAG, "error running gesture callback: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+      }
+    }
+  }
+}
+
+// Internal call
+// A reference to the function in field name of the create() table, or LUA_NOREF if it's not
+// there. touch_create() checked the type already.
+static int touch_create_ref(lua_State *L, const char *name) {
+  lua_getfield(L, 1, name);
+  if (lua_isnoneornil(L, -1)) {
+    lua_pop(L, 1);
+    return LUA_NOREF;
+  }
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Internal call
+// Give back the refs touch_create() took, and the driver if it got that far, before it errors.
+static void touch_create_unwind(lua_State *L, touch_t tp, bool isDriver) {
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->cb_ref);
+  tp->cb_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->press_cb_ref);
+  tp->press_cb_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->gesture_cb_ref);
+  tp->gesture_cb_ref = LUA_NOREF;
+  if (isDriver) touch_driver_release();
+}
 
 /* 
 Lua sample code:
@@ -169,14 +867,20 @@ tp = touch.create({
 */
 static int touch_create( lua_State *L ) {
 
-  // Check if we are out of objects. There are only 10 pads, so should never get this, but check anyhow.
-  if (touch_self != NULL) {
-    luaL_error(L, "Only 1 touch pad object allowed in touch library.");
+  // Check if we are out of objects. Find a free slot in touch_selfs for this one.
+  int index = -1;
+  for (int i = 0; i < TOUCH_MAX; i++) {
+    if (touch_selfs[i] == NULL) {
+      index = i;
+      break;
+    }
   }
+  if (index < 0) return luaL_error(L, "Only %d touch pad objects allowed in touch library.", TOUCH_MAX);
 
   // Presume we'll get a good create, so go ahead and make our touch_t object 
   touch_struct_t tpObj = {.cb_ref=LUA_NOREF, .is_initted=false, .is_debug=false};
   touch_t tp = &tpObj;
+  tp->selfs_index = index;
 
   // const int top = lua_gettop(L);
   luaL_checkanytable (L, 1);
@@ -189,6 +893,57 @@ static int touch_create( lua_State *L ) {
   tp->slope = opt_checkint_range(L, "slope", TOUCH_PAD_SLOPE_0, TOUCH_PAD_SLOPE_0, TOUCH_PAD_SLOPE_MAX);
   tp->is_intr = opt_checkbool(L, "intrInitAtStart", true);
   tp->thresTrigger = opt_checkint_range(L, "thresTrigger", TOUCH_TRIGGER_BELOW, TOUCH_TRIGGER_BELOW, TOUCH_TRIGGER_MAX);
+  tp->thres_pct = opt_checkint_range(L, "thresPct", 0, 0, 99);
+  // baseline tracking is opt in, except that thresPct needs it
+  tp->base_ms = opt_checkint_range(L, "baselineMs", tp->thres_pct > 0 ? 250 : 0, 0, 60000);
+  luaL_argcheck(L, tp->thres_pct == 0 || tp->base_ms > 0, 1, "thresPct needs baselineMs > 0");
+  tp->is_stopping = false;
+  tp->is_base_ticking = false;
+  tp->base_shift = opt_checkint_range(L, "baselineFilter", 6, 0, 12);
+  tp->cal_cb_ref = LUA_NOREF;
+  tp->sampler = NULL;
+  tp->state_ms = opt_checkint_range(L, "stateMs", 20, 1, 10000);
+  tp->debounce = opt_checkint_range(L, "debounce", 2, 1, 100);
+  tp->hyst_pct = opt_checkint_range(L, "hysteresisPct", 10, 0, 100);
+  tp->press_cb_ref = LUA_NOREF;
+  lua_getfield(L, 1, "pressCb");
+  if (!lua_isnoneornil(L, -1)) {
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION, 1, "pressCb must be function");
+  }
+  lua_pop(L, 1);
+  tp->state_timer = NULL;
+  tp->is_state_ticking = false;
+
+  tp->tap_ms = opt_checkint_range(L, "tapMs", 250, 1, 10000);
+  tp->dbl_tap_ms = opt_checkint_range(L, "doubleTapMs", 300, 0, 10000);
+  tp->long_ms = opt_checkint_range(L, "longPressMs", 600, 0, 60000);
+  tp->swipe_gap_ms = opt_checkint_range(L, "swipeGapMs", 300, 1, 10000);
+  tp->gesture_cb_ref = LUA_NOREF;
+  tp->swipe_cnt = 0;
+  tp->run_last = -1;
+  tp->run_len = 0;
+  memset(tp->swipe_idx, -1, sizeof(tp->swipe_idx));
+  lua_getfield(L, 1, "gestureCb");
+  if (!lua_isnoneornil(L, -1)) {
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION, 1, "gestureCb must be function");
+  }
+  lua_pop(L, 1);
+  // swipePads = {3,4,5,6,7,8,9} in physical order
+  lua_getfield(L, 1, "swipePads");
+  if (!lua_isnoneornil(L, -1)) {
+    luaL_argcheck(L, lua_istable(L, -1), 1, "swipePads must be table");
+    int cnt = lua_objlen(L, -1);
+    luaL_argcheck(L, cnt >= 2 && cnt <= TOUCH_PAD_MAX, 1, "swipePads needs 2 to 10 pads");
+    for (int i = 1; i <= cnt; i++) {
+      lua_rawgeti(L, -1, i);
+      int pad = luaL_checkinteger(L, -1);
+      lua_pop(L, 1);
+      luaL_argcheck(L, pad >= 0 && pad <= 9 && tp->swipe_idx[pad] < 0, 1, "swipePads must be unique pads 0 to 9");
+      tp->swipe_idx[pad] = tp->swipe_cnt;
+      tp->swipe_pads[tp->swipe_cnt++] = pad;
+    }
+  }
+  lua_pop(L, 1);
 
   if (tp->is_debug) ESP_LOGI(TAG, "isDebug: %d, filterMs: %d, lvolt: %d, hvolt: %d, atten: %d, slope: %d, intrInitAtStart: %d, thresTrigger: %d", 
     tp->is_debug, tp->filterMs, tp->lvolt, tp->hvolt, tp->atten, tp->slope, tp->is_intr, tp->thresTrigger);
@@ -219,6 +974,11 @@ static int touch_create( lua_State *L ) {
   else
     return luaL_error (L, "missing/bad 'pad' field");
 
+  // now we know our pads, every swipe pad has to be one of them
+  for (int i = 0; i < tp->swipe_cnt; i++) {
+    luaL_argcheck(L, tp->touch_pads[tp->swipe_pads[i]], 1, "swipePads must all be in pad");
+  }
+
   // See if they even gave us a callback
   bool isCallback = true;
   lua_getfield(L, 1, "cb");
@@ -228,11 +988,6 @@ static int touch_create( lua_State *L ) {
     if (tp->is_debug) ESP_LOGI(TAG, "No callback provided. Not turning on interrupt." );
   } else {
     luaL_argcheck(L, lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION, -1, "Cb must be function");
-    
-    //get the lua function reference
-    luaL_unref(L, LUA_REGISTRYINDEX, tp->cb_ref);
-    lua_pushvalue(L, -1);
-    tp->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     if (tp->is_debug) ESP_LOGI(TAG, "Cb good." );
   }
 
@@ -240,10 +995,36 @@ static int touch_create( lua_State *L ) {
   /*The default FSM mode is ‘TOUCH_FSM_MODE_SW’. If you want to use interrupt trigger mode, 
   then set it using function ‘touch_pad_set_fsm_mode’ to ‘TOUCH_FSM_MODE_TIMER’ after 
   calling ‘touch_pad_init’. */
-  esp_err_t err = touch_pad_init();
-  if (err == ESP_FAIL) {
-    ESP_LOGI(TAG, "Touch pad init error");
-    return 0;
+  for (int padnum = 0; padnum < TOUCH_PAD_MAX; padnum++) {
+    if (!tp->touch_pads[padnum]) continue;
+    if (touch_slider_pad_mask & (1 << padnum)) {
+      return luaL_error(L, "Pad %d is already used by a slider", padnum);
+    }
+    if (touch_pad_owned(padnum)) {
+      return luaL_error(L, "Pad %d is already used by another touch object", padnum);
+    }
+    tp->pad_mask |= 1 << padnum;
+  }
+
+  if (isCallback && tp->is_intr && touch_trigger_conflict(tp, tp->thresTrigger)) {
+    return luaL_error(L, "thresTrigger must match the other touch objects with their interrupt on, the hardware has one trigger mode");
+  }
+
+  // Make our Lua object now, so running out of memory for it can't strand the refs and the
+  // driver we take next. It gets its metatable once it's filled in.
+  touch_t tp2 = (touch_t)lua_newuserdata(L, sizeof(touch_struct_t));
+  int ud = lua_gettop(L);
+
+  // Everything is checked, so take the lua function references. From here on each error
+  // goes through touch_create_unwind() first.
+  tp->press_cb_ref = touch_create_ref(L, "pressCb");
+  tp->gesture_cb_ref = touch_create_ref(L, "gestureCb");
+  tp->cb_ref = touch_create_ref(L, "cb");
+
+  esp_err_t err = touch_driver_acquire();
+  if (err != ESP_OK) {
+    touch_create_unwind(L, tp, false);
+    return luaL_error(L, "Touch pad init error");
   } else {
     if (tp->is_debug) ESP_LOGI(TAG, "Initted touch pad");
   }
@@ -261,8 +1042,8 @@ static int touch_create( lua_State *L ) {
     if (tp->is_debug) ESP_LOGI(TAG, "Setting FSM mode since you provided a callback");
     err = touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
     if (err == ESP_FAIL) {
-      ESP_LOGI(TAG, "Touch pad set fsm mode error");
-      return 0;
+      touch_create_unwind(L, tp, true);
+      return luaL_error(L, "Touch pad set fsm mode error");
     }
 
     for (int padnum = 0; padnum< TOUCH_PAD_MAX; padnum++) {
@@ -274,33 +1055,33 @@ static int touch_create( lua_State *L ) {
       }
     }
 
-    // Initialize and start a software filter to detect slight change of capacitance.
+    // The software filter to detect slight change of capacitance is started in
+    // touch_hw_update() once we're in touch_selfs, since other objects may want one too.
     if (tp->filterMs > 0) {
-      touch_pad_filter_start(tp->filterMs);
       if (tp->is_debug) ESP_LOGI(TAG, "Set filter period to %d ms", tp->filterMs );
     }
 
-    // Register touch interrupt ISR
-    touch_pad_isr_register(touch_intr_handler, NULL);
-    if (tp->is_debug) ESP_LOGI(TAG, "Registered ISR handler for callback" );
+    // Register touch interrupt ISR. One handler serves every object.
+    if (touch_isr_refs++ == 0) {
+      touch_pad_isr_register(touch_intr_handler, NULL);
+      if (tp->is_debug) ESP_LOGI(TAG, "Registered ISR handler for callback" );
+    }
 
-    // set trigger mode
-    touch_pad_set_trigger_mode(tp->thresTrigger);
+    // set trigger mode, unless someone else's interrupt is using it
+    if (!touch_trigger_conflict(tp, tp->thresTrigger)) touch_pad_set_trigger_mode(tp->thresTrigger);
 
-    if (tp->is_intr) {
-      touch_pad_intr_enable();
-      if (tp->is_debug) ESP_LOGI(TAG, "Enabled interrupt" );
-    }
+    // interrupts get enabled in touch_hw_update() if intrInitAtStart
   
   } else {
 
     // No callback mode. Just polling for values.
     if (tp->is_debug) ESP_LOGI(TAG, "No callback provided, so no interrupt or threshold set." );
-    touch_pad_intr_disable();
-    err = touch_pad_set_fsm_mode(TOUCH_FSM_MODE_SW);
+    // sliders and interrupt objects need the hardware timer to keep measuring, and
+    // touch_pad_read() works in either mode
+    err = touch_is_fsm_timer() ? ESP_OK : touch_pad_set_fsm_mode(TOUCH_FSM_MODE_SW);
     if (err == ESP_FAIL) {
-      ESP_LOGI(TAG, "Touch pad set fsm mode to sw error");
-      return 0;
+      touch_create_unwind(L, tp, true);
+      return luaL_error(L, "Touch pad set fsm mode to sw error");
     } else {
       if (tp->is_debug) ESP_LOGI(TAG, "Touch pad set fsm mode to sw since no callback");
     }
@@ -315,47 +1096,68 @@ static int touch_create( lua_State *L ) {
       }
     }
 
-    // see if they want a filter, if so turn it on
-    // start touch pad filter function This API will start a filter to process the noise in order to 
-    // prevent false triggering when detecting slight change of capacitance. Need to call 
-    // touch_pad_filter_start before all touch filter APIs
+    // see if they want a filter, if so it gets turned on in touch_hw_update()
+    // the filter processes the noise in order to prevent false triggering when detecting
+    // slight change of capacitance. There is one filter period for all pads, so if several
+    // objects ask for one it runs at the shortest period.
     if (tp->filterMs > 0) {
       if (tp->is_debug) ESP_LOGI(TAG, "You provided a filter so turning on filter mode. filterMs: %d", tp->filterMs);
-      esp_err_t err = touch_pad_filter_start(tp->filterMs);
-      if (err == ESP_ERR_INVALID_ARG) {
-        ESP_LOGI(TAG, "Filter start parameter error");
-      } else if (err == ESP_ERR_NO_MEM) {
-        ESP_LOGI(TAG, "Filter no memory for driver");
-      } else if (err == ESP_ERR_INVALID_STATE) {
-        ESP_LOGI(TAG, "Filter driver state error");
-      }
     }
   }
 
   // if (tp->is_debug) ESP_LOGI(TAG, "Created obj with callback ref of %d", tp->cb_ref );
 
-  // Now create our Lua version of this data to pass back
-  touch_t tp2 = (touch_t)lua_newuserdata(L, sizeof(touch_struct_t));
-  if (!tp2) return luaL_error(L, "not enough memory");
+  // Now fill in our Lua version of this data to pass back
   luaL_getmetatable(L, "touch.pctr");
-  lua_setmetatable(L, -2);
-  tp2->cb_ref = tp->cb_ref;
-  // tp2->self_ref = tp->self_ref;
-  tp2->is_initted = tp->is_initted;
-  tp2->is_debug = tp->is_debug;
-  tp2->filterMs = tp->filterMs;
-  tp2->hvolt = tp->hvolt;
-  tp2->lvolt = tp->lvolt;
-  tp2->atten = tp->atten;
-  tp2->slope = tp->slope;
-  
-  for (int i = 0; i < 10; i++) {
-    tp2->touch_pads[i] = tp->touch_pads[i];
+  lua_setmetatable(L, ud);
+  // copy everything, including thres, is_intr and thresTrigger which used to get left behind
+  *tp2 = *tp;
+
+  // We need to store this in touch_selfs so the interrupt task can find our cb_ref, then
+  // update the ISR routing, interrupt enable and filter for everyone
+  touch_selfs[index] = tp2;
+  touch_hw_update();
+  if (tp2->is_debug && tp2->cb_ref != LUA_NOREF && tp2->is_intr) ESP_LOGI(TAG, "Enabled interrupt" );
+
+  // The baseline timer needs the final address of our object, so start it now
+  if (tp2->base_ms > 0) {
+    esp_timer_create_args_t args = {
+      .callback = touch_base_tick,
+      .arg = tp2,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "touch_base"
+    };
+    if (esp_timer_create(&args, &tp2->base_timer) == ESP_OK) {
+      esp_timer_start_periodic(tp2->base_timer, tp2->base_ms * 1000);
+      if (tp2->is_debug) ESP_LOGI(TAG, "Baseline tracking every %d ms, thresPct: %d", tp2->base_ms, tp2->thres_pct);
+    } else {
+      tp2->base_ms = 0;
+      ESP_LOGI(TAG, "Could not create baseline timer");
+    }
   }
 
-  // We need to store this in self_refs so we have a way to look for the cb_ref from the IRAM interrupt
-  touch_self = tp2; 
+  if (tp2->press_cb_ref != LUA_NOREF || tp2->gesture_cb_ref != LUA_NOREF) {
+    esp_timer_create_args_t args = {
+      .callback = touch_state_tick,
+      .arg = tp2,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "touch_state"
+    };
+    if (esp_timer_create(&args, &tp2->state_timer) == ESP_OK) {
+      esp_timer_start_periodic(tp2->state_timer, tp2->state_ms * 1000);
+      if (tp2->is_debug) ESP_LOGI(TAG, "Press/release tracking every %d ms, debounce: %d, hysteresisPct: %d", tp2->state_ms, tp2->debounce, tp2->hyst_pct);
+      if (tp2->is_debug && tp2->gesture_cb_ref != LUA_NOREF) ESP_LOGI(TAG, "Gestures tapMs: %d, doubleTapMs: %d, longPressMs: %d, swipe pads: %d, swipeGapMs: %d", tp2->tap_ms, tp2->dbl_tap_ms, tp2->long_ms, tp2->swipe_cnt, tp2->swipe_gap_ms);
+    } else {
+      tp2->state_timer = NULL;
+      luaL_unref(L, LUA_REGISTRYINDEX, tp2->press_cb_ref);
+      tp2->press_cb_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, tp2->gesture_cb_ref);
+      tp2->gesture_cb_ref = LUA_NOREF;
+      ESP_LOGI(TAG, "Could not create state timer");
+    }
+  }
 
+  lua_pushvalue(L, ud);
   return 1;
 }
 
@@ -376,6 +1178,11 @@ static int touch_setTriggerMode(lua_State* L)
   int thresTrigger = luaL_checkinteger(L, ++stack);
   luaL_argcheck(L, thresTrigger >= 0 && thresTrigger <= 1, -1, "The thresTrigger allows 0 or 1");
 
+  // one trigger mode for all pads, so don't flip it out from under another interrupt object
+  if (touch_trigger_conflict(tp, thresTrigger)) {
+    return luaL_error(L, "Another touch object has its interrupt on with the other trigger mode");
+  }
+
   tp->thresTrigger = thresTrigger;
   touch_pad_set_trigger_mode(tp->thresTrigger);
 
@@ -414,9 +1221,14 @@ static int touch_intrEnable(lua_State* L)
 {
   touch_t tp = touch_get(L, 1);
 
+  if (touch_trigger_conflict(tp, tp->thresTrigger)) {
+    return luaL_error(L, "Another touch object has its interrupt on with the other trigger mode");
+  }
   tp->is_intr = true;
 
-  touch_pad_intr_enable();
+  // the interrupt is shared, this just routes our pads to our callback again
+  touch_pad_set_trigger_mode(tp->thresTrigger);
+  touch_hw_update();
 
   if (tp->is_debug) ESP_LOGI(TAG, "Turned on touch pad interrupt");
 
@@ -430,15 +1242,23 @@ static int touch_intrDisable(lua_State* L)
 
   tp->is_intr = false;
 
-  touch_pad_intr_disable();
-  touch_pad_clear_status();
+  // only turns the hardware interrupt off if no other object wants it
+  touch_hw_update();
 
   if (tp->is_debug) ESP_LOGI(TAG, "Turned off touch pad interrupt");
 
   return 0;
 }
 
-// Lua: tbl = touch:read()
+// Push the table the caller passed in at stack so we can refill it, or a new one if they didn't
+static void touch_push_table(lua_State *L, int stack)
+{
+  if (lua_istable(L, stack)) lua_pushvalue(L, stack);
+  else lua_newtable(L);
+}
+
+// Lua: raw, filter = touch:read(rawTbl, filterTbl)
+// Pass in the tables from a previous read to have them refilled instead of getting new ones.
 // Get touch sensor counter value. Each touch sensor has a counter to count the 
 // number of charge/discharge cycles. When the pad is not ‘touched’, we can get 
 // a number of the counter. When the pad is ‘touched’, the value in counter will 
@@ -450,6 +1270,29 @@ static int touch_read(lua_State* L)
   // return 1 parameter by default, unless in filter mode, then return 2 params
   uint8_t numRetVals = 1;
 
+  if (tp->sampler != NULL) {
+    // the sampler already has the latest raw and filtered values, no need to touch the hardware
+    touch_sampler_t sp = tp->sampler;
+    uint16_t raw[TOUCH_PAD_MAX];
+    uint16_t filt[TOUCH_PAD_MAX];
+    portENTER_CRITICAL(&touch_sampler_mux);
+    for (int i = 0; i < TOUCH_PAD_MAX; i++) {
+      raw[i] = sp->last_raw[i];
+      filt[i] = sp->filt[i] >> 4;
+    }
+    portEXIT_CRITICAL(&touch_sampler_mux);
+
+    touch_push_table(L, 2);
+    for (int i = 0; i < TOUCH_PAD_MAX; i++) {
+      if (tp->touch_pads[i]) l_pushtableintkeyval(L, i, raw[i]);
+    }
+    touch_push_table(L, 3);
+    for (int i = 0; i < TOUCH_PAD_MAX; i++) {
+      if (tp->touch_pads[i]) l_pushtableintkeyval(L, i, filt[i]);
+    }
+    return 2;
+  }
+
   // see if we are in interrupt mode or polling mode
   // see if we are in filter mode or non-filter
   // if in filter mode, we need to do raw_read and filter_read
@@ -467,7 +1310,7 @@ static int touch_read(lua_State* L)
 
     // do raw vals
     // create a table in c (it will be at the top of the stack)
-    lua_newtable(L);
+    touch_push_table(L, 2);
 
     uint16_t touch_value = 0;
     for (int i = 0; i < TOUCH_PAD_MAX; i++) {
@@ -496,7 +1339,7 @@ static int touch_read(lua_State* L)
 
     // do filter vals
     // create a table in c (it will be at the top of the stack)
-    lua_newtable(L);
+    touch_push_table(L, 3);
 
     // uint16_t touch_value = 0;
     for (int i = 0; i < TOUCH_PAD_MAX; i++) {
@@ -530,7 +1373,7 @@ static int touch_read(lua_State* L)
 
     // we will send back data in the format: {"0":val, "1":val}
     // create a table in c (it will be at the top of the stack)
-    lua_newtable(L);
+    touch_push_table(L, 2);
 
     uint16_t touch_value = 0;
     for (int i = 0; i < TOUCH_PAD_MAX; i++) {
@@ -563,28 +1406,646 @@ static int touch_read(lua_State* L)
 }
 
 
+// Sampler timer tick. Runs in the esp_timer task. Reads every pad, filters, and appends a frame.
+// is_ticking lets touch_sampler_free() know when it's safe to free.
+static void touch_sampler_tick(void *arg)
+{
+  touch_t tp = (touch_t)arg;
+  portENTER_CRITICAL(&touch_sampler_mux);
+  touch_sampler_t sp = tp->sampler;
+  if (sp != NULL) sp->is_ticking = true;
+  portEXIT_CRITICAL(&touch_sampler_mux);
+  if (sp == NULL) return;
+
+  uint16_t raw[TOUCH_PAD_MAX];
+  for (int i = 0; i < sp->pad_cnt; i++) {
+    raw[i] = 0;
+    touch_hw_read_pad(tp, sp->pads[i], &raw[i]);
+  }
+  uint32_t ts = (uint32_t)esp_timer_get_time();
+
+  portENTER_CRITICAL(&touch_sampler_mux);
+  uint8_t *f = sp->ring + sp->head * sp->frame_len;
+  f[0] = ts; f[1] = ts >> 8; f[2] = ts >> 16; f[3] = ts >> 24;
+  f += 4;
+  for (int i = 0; i < sp->pad_cnt; i++) {
+    uint8_t pad = sp->pads[i];
+    int32_t raw16 = (int32_t)raw[i] << 4;
+    if (sp->filt[pad] == 0) sp->filt[pad] = raw16;
+    else sp->filt[pad] += (raw16 - (int32_t)sp->filt[pad]) >> sp->filter_shift;
+    sp->last_raw[pad] = raw[i];
+    uint16_t filt = sp->filt[pad] >> 4;
+    f[0] = raw[i]; f[1] = raw[i] >> 8;
+    f[2] = filt; f[3] = filt >> 8;
+    f += 4;
+  }
+  sp->head = (sp->head + 1) % sp->depth;
+  if (sp->cnt < sp->depth) sp->cnt++;
+  else sp->dropped++; // overwrote the oldest unread frame
+  sp->is_ticking = false;
+  portEXIT_CRITICAL(&touch_sampler_mux);
+}
+
+// Stop the sampler timer and free the ring. Safe to call if not sampling.
+// Ticks that start once the pointer is NULL do nothing.
+static void touch_sampler_free(lua_State *L, touch_t tp)
+{
+  portENTER_CRITICAL(&touch_sampler_mux);
+  touch_sampler_t sp = tp->sampler;
+  tp->sampler = NULL;
+  portEXIT_CRITICAL(&touch_sampler_mux);
+  if (sp == NULL) return;
+  touch_timer_halt(sp->timer, &touch_sampler_mux, &sp->is_ticking);
+  esp_timer_delete(sp->timer);
+  luaM_free(L, sp->ring);
+  luaM_free(L, sp);
+}
+
+// Lua: touch:startSampler({periodMs=10, depth=64, filter=2})
+// Read every pad of this object on a timer into a ring buffer of depth frames. While the
+// sampler runs read() returns its latest values and the baseline tracking uses them too.
+static int touch_sampler_start(lua_State* L)
+{
+  int stack = 0;
+  touch_t tp = touch_get(L, ++stack);
+
+  ++stack;
+  if (lua_isnoneornil(L, stack)) {
+    lua_newtable(L);
+    lua_replace(L, stack);
+  }
+  luaL_checktype(L, stack, LUA_TTABLE);
+  lua_settop(L, stack);
+
+  int period_ms = opt_checkint_range(L, "periodMs", 10, 1, 60000);
+  int depth = opt_checkint_range(L, "depth", 64, 1, 4096);
+  int filter_shift = opt_checkint_range(L, "filter", 2, 0, 6);
+
+  // start over if they call us twice
+  touch_sampler_free(L, tp);
+
+  touch_sampler_t sp = (touch_sampler_t)luaM_malloc(L, sizeof(touch_sampler_struct_t));
+  memset(sp, 0, sizeof(touch_sampler_struct_t));
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (tp->touch_pads[pad]) sp->pads[sp->pad_cnt++] = pad;
+  }
+  sp->period_ms = period_ms;
+  sp->filter_shift = filter_shift;
+  sp->depth = depth;
+  sp->frame_len = 4 + 4 * sp->pad_cnt;
+  sp->ring = (uint8_t *)luaM_malloc(L, depth * sp->frame_len);
+
+  esp_timer_create_args_t args = {
+    .callback = touch_sampler_tick,
+    .arg = tp,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "touch_sampler"
+  };
+  if (esp_timer_create(&args, &sp->timer) != ESP_OK) {
+    luaM_free(L, sp->ring);
+    luaM_free(L, sp);
+    return luaL_error(L, "Could not create sampler timer");
+  }
+  portENTER_CRITICAL(&touch_sampler_mux);
+  tp->sampler = sp;
+  portEXIT_CRITICAL(&touch_sampler_mux);
+  esp_timer_start_periodic(sp->timer, period_ms * 1000);
+
+  if (tp->is_debug) ESP_LOGI(TAG, "Sampler started for %d pads every %d ms, depth %d", sp->pad_cnt, period_ms, depth);
+  return 0;
+}
+
+// Lua: touch:stopSampler()
+static int touch_sampler_stop(lua_State* L)
+{
+  touch_t tp = touch_get(L, 1);
+  touch_sampler_free(L, tp);
+  if (tp->is_debug) ESP_LOGI(TAG, "Sampler stopped");
+  return 0;
+}
+
+// Lua: str, n, dropped = touch:readSamples()
+// Lua: n, dropped = touch:readSamples(tbl)
+// Takes every unread frame out of the ring, oldest first. With no args you get the frames
+// packed into one string, see touch_sampler_struct_t for the layout. Pass in a table and
+// it gets filled flat instead, ts, raw, filt, raw, filt... per frame in pad number order,
+// so reusing the same table each time allocates nothing.
+static int touch_sampler_read(lua_State* L)
+{
+  int stack = 0;
+  touch_t tp = touch_get(L, ++stack);
+  if (tp->sampler == NULL) return luaL_error(L, "Call startSampler() first");
+  touch_sampler_t sp = tp->sampler;
+
+  bool is_tbl = lua_istable(L, ++stack);
+
+  if (!is_tbl) {
+    // copy out under the lock then build the string without it
+    uint8_t *buf = (uint8_t *)luaM_malloc(L, sp->depth * sp->frame_len);
+    portENTER_CRITICAL(&touch_sampler_mux);
+    uint16_t cnt = sp->cnt;
+    uint32_t dropped = sp->dropped;
+    uint16_t tail = (sp->head + sp->depth - cnt) % sp->depth;
+    uint16_t first = cnt < sp->depth - tail ? cnt : sp->depth - tail;
+    memcpy(buf, sp->ring + tail * sp->frame_len, first * sp->frame_len);
+    memcpy(buf + first * sp->frame_len, sp->ring, (cnt - first) * sp->frame_len);
+    sp->cnt = 0;
+    sp->dropped = 0;
+    portEXIT_CRITICAL(&touch_sampler_mux);
+
+    lua_pushlstring(L, (const char *)buf, cnt * sp->frame_len);
+    luaM_free(L, buf);
+    lua_pushinteger(L, cnt);
+    lua_pushinteger(L, dropped);
+    return 3;
+  }
+
+  // one frame at a time through a stack buffer, so the table path doesn't touch the heap
+  uint8_t frame[4 + 4 * TOUCH_PAD_MAX];
+  portENTER_CRITICAL(&touch_sampler_mux);
+  uint32_t dropped = sp->dropped;
+  sp->dropped = 0;
+  portEXIT_CRITICAL(&touch_sampler_mux);
+
+  int idx = 1;
+  int cnt = 0;
+  while (cnt < sp->depth) {
+    portENTER_CRITICAL(&touch_sampler_mux);
+    if (sp->cnt == 0) {
+      portEXIT_CRITICAL(&touch_sampler_mux);
+      break;
+    }
+    uint16_t tail = (sp->head + sp->depth - sp->cnt) % sp->depth;
+    memcpy(frame, sp->ring + tail * sp->frame_len, sp->frame_len);
+    sp->cnt--;
+    portEXIT_CRITICAL(&touch_sampler_mux);
+
+    uint8_t *f = frame;
+    lua_pushnumber(L, (lua_Number)(f[0] | (f[1] << 8) | (f[2] << 16) | ((uint32_t)f[3] << 24)));
+    lua_rawseti(L, stack, idx++);
+    f += 4;
+    for (int p = 0; p < sp->pad_cnt * 2; p++) {
+      lua_pushinteger(L, f[0] | (f[1] << 8));
+      lua_rawseti(L, stack, idx++);
+      f += 2;
+    }
+    cnt++;
+  }
+  // mark the end for a reused table that was longer
+  lua_pushnil(L);
+  lua_rawseti(L, stack, idx);
+
+  lua_pushinteger(L, cnt);
+  lua_pushinteger(L, dropped);
+  return 2;
+}
+
+// Lua: isPressed, durUs = touch:isPressed(pad)
+// Debounced state of a pad from the state timer, and how long it has been in that state.
+static int touch_isPressed(lua_State* L)
+{
+  touch_t tp = touch_get(L, 1);
+  int pad = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, pad >= 0 && pad <= 9 && tp->touch_pads[pad], 2, "Pad is not in this touch object");
+  if (tp->state_timer == NULL) return luaL_error(L, "No pressCb or gestureCb given in create()");
+
+  lua_pushboolean(L, tp->is_pressed[pad]);
+  lua_pushinteger(L, tp->change_us[pad] ? (uint32_t)(esp_timer_get_time() - tp->change_us[pad]) : 0);
+  return 2;
+}
+
+// Lua: touch:calibrate(ms, cb)
+// Average every pad for ms and make that the baseline, then reprogram the thresholds if
+// thresPct is on. Don't touch the pads while it runs. cb(baselines) is optional.
+static int touch_calibrate(lua_State* L)
+{
+  int stack = 0;
+  touch_t tp = touch_get(L, ++stack);
+  if (tp->base_ms == 0) return luaL_error(L, "Baseline tracking is off, create() with baselineMs > 0");
+
+  int ms = luaL_optinteger(L, ++stack, 500);
+  luaL_argcheck(L, ms >= TOUCH_BASE_CAL_MS && ms <= 60000, stack, "The ms allows 10 to 60000");
+
+  ++stack;
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->cal_cb_ref);
+  tp->cal_cb_ref = LUA_NOREF;
+  if (!lua_isnoneornil(L, stack)) {
+    luaL_argcheck(L, lua_type(L, stack) == LUA_TFUNCTION || lua_type(L, stack) == LUA_TLIGHTFUNCTION, stack, "Cb must be function");
+    lua_pushvalue(L, stack);
+    tp->cal_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  esp_timer_stop(tp->base_timer);
+  portENTER_CRITICAL(&touch_base_mux);
+  memset(tp->cal_sum, 0, sizeof(tp->cal_sum));
+  tp->cal_cnt = 0;
+  tp->cal_end_us = esp_timer_get_time() + ms * 1000LL;
+  tp->is_cal = true;
+  portEXIT_CRITICAL(&touch_base_mux);
+  esp_timer_start_periodic(tp->base_timer, TOUCH_BASE_CAL_MS * 1000);
+
+  if (tp->is_debug) ESP_LOGI(TAG, "Calibrating baselines for %d ms", ms);
+  return 0;
+}
+
+// Lua: base, thres = touch:getBaselines()
+// Current baseline and hardware threshold per pad, as {[pad]=val} tables.
+static int touch_getBaselines(lua_State* L)
+{
+  touch_t tp = touch_get(L, 1);
+
+  touch_base_push(L, tp);
+
+  lua_newtable(L);
+  for (int pad = 0; pad < TOUCH_PAD_MAX; pad++) {
+    if (tp->touch_pads[pad]) l_pushtableintkeyval(L, pad, tp->thres[pad]);
+  }
+  return 2;
+}
+
+// Lua: touch:setThresPct(pct)
+// Keep the hardware thresholds pct percent below the baselines. 0 turns it off and leaves
+// the thresholds where they are, so setThres() is yours again.
+static int touch_setThresPct(lua_State* L)
+{
+  touch_t tp = touch_get(L, 1);
+
+  int pct = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, pct >= 0 && pct <= 99, 2, "The pct allows 0 to 99");
+  if (pct > 0 && tp->base_ms == 0) return luaL_error(L, "Baseline tracking is off, create() with baselineMs > 0");
+
+  tp->thres_pct = pct;
+  touch_base_apply_thres(tp);
+
+  if (tp->is_debug) ESP_LOGI(TAG, "Set thresPct to %d", pct);
+  return 0;
+}
+
+// Reads and filters every pad on the slider, then interpolates the finger position from the
+// strongest pad and its two neighbors.
+static void touch_slider_sample(touch_slider_t sl)
+{
+  int64_t now = esp_timer_get_time();
+
+  for (int i = 0; i < sl->pad_cnt; i++) {
+    uint16_t raw = 0;
+    touch_pad_read_raw_data((touch_pad_t)sl->pads[i], &raw);
+    int32_t raw16 = (int32_t)raw << 4;
+    if (sl->filt[i] == 0) sl->filt[i] = raw16;
+    else sl->filt[i] += (raw16 - (int32_t)sl->filt[i]) >> sl->filter_shift;
+  }
+
+  // average the first few ticks as the untouched baseline. don't touch the slider at start.
+  if (sl->base_ticks > 0) {
+    for (int i = 0; i < sl->pad_cnt; i++) {
+      sl->base[i] += sl->filt[i] / TOUCH_SLIDER_BASE_TICKS;
+    }
+    sl->base_ticks--;
+    return;
+  }
+
+  // signal is the drop below baseline. the strongest pad over threshold is where the finger is.
+  uint32_t sig[TOUCH_PAD_MAX];
+  int best = -1;
+  for (int i = 0; i < sl->pad_cnt; i++) {
+    sig[i] = sl->filt[i] < sl->base[i] ? sl->base[i] - sl->filt[i] : 0;
+    if (sig[i] > 0 && sig[i] * 100 >= sl->base[i] * sl->thres_pct && (best < 0 || sig[i] > sig[best])) best = i;
+  }
+
+  bool is_post = false;
+  if (best < 0) {
+    // finger lifted
+    portENTER_CRITICAL(&touch_slider_mux);
+    if (sl->is_touched) {
+      sl->is_touched = false;
+      sl->dir = 0;
+      sl->vel = 0;
+      is_post = !sl->is_posted;
+      sl->is_posted = true;
+    }
+    portEXIT_CRITICAL(&touch_slider_mux);
+    if (is_post) task_post_medium(touch_slider_task_id, sl->index);
+    return;
+  }
+
+  int n = sl->pad_cnt;
+  int32_t span = sl->is_wheel ? n * sl->resolution : (n - 1) * sl->resolution;
+  uint32_t left = 0, right = 0;
+  if (best > 0) left = sig[best - 1];
+  else if (sl->is_wheel) left = sig[n - 1];
+  if (best < n - 1) right = sig[best + 1];
+  else if (sl->is_wheel) right = sig[0];
+
+  // 3 pad centroid, so the offset from the center of the best pad is -resolution..resolution
+  int32_t pos = best * sl->resolution + ((int32_t)right - (int32_t)left) * sl->resolution / (int32_t)(left + sig[best] + right);
+  if (sl->is_wheel) pos = (pos + span) % span;
+  else if (pos < 0) pos = 0;
+  else if (pos > span) pos = span;
+
+  portENTER_CRITICAL(&touch_slider_mux);
+  if (!sl->is_touched) {
+    sl->is_touched = true;
+    sl->pos = pos;
+    sl->dir = 0;
+    sl->vel = 0;
+    is_post = true;
+  } else if (pos != sl->pos) {
+    int32_t delta = pos - sl->pos;
+    // on a wheel the short way around is the real move
+    if (sl->is_wheel && delta > span / 2) delta -= span;
+    else if (sl->is_wheel && delta < -span / 2) delta += span;
+    int64_t dt = now - sl->last_us;
+    if (dt > 0) sl->vel = (sl->vel + (int32_t)(delta * 1000000LL / dt)) / 2;
+    sl->dir = delta > 0 ? 1 : -1;
+    sl->pos = pos;
+    is_post = true;
+  }
+  sl->last_us = now;
+  if (is_post) {
+    is_post = !sl->is_posted;
+    sl->is_posted = true;
+  }
+  portEXIT_CRITICAL(&touch_slider_mux);
+
+  if (is_post) task_post_medium(touch_slider_task_id, sl->index);
+}
+
+// Slider timer tick. Runs in the esp_timer task. is_ticking lets unregister() know when it's
+// safe to let go of the driver.
+static void touch_slider_tick(void *arg)
+{
+  touch_slider_t sl = (touch_slider_t)arg;
+  portENTER_CRITICAL(&touch_slider_mux);
+  bool is_stopping = sl->is_stopping;
+  if (!is_stopping) sl->is_ticking = true;
+  portEXIT_CRITICAL(&touch_slider_mux);
+  if (is_stopping) return;
+
+  touch_slider_sample(sl);
+
+  portENTER_CRITICAL(&touch_slider_mux);
+  sl->is_ticking = false;
+  portEXIT_CRITICAL(&touch_slider_mux);
+}
+
+/*
+Called via the Lua task queue after a slider tick saw the finger move, touch or lift.
+The format of the callback to your Lua code is:
+  function onSlider(pos, dir, vel, isTouched)
+*/
+static void touch_slider_task(task_param_t param, task_prio_t prio)
+{
+  (void)prio;
+
+  touch_slider_t sl = touch_sliders[param];
+  if (sl == NULL || sl->cb_ref == LUA_NOREF) return;
+
+  portENTER_CRITICAL(&touch_slider_mux);
+  int32_t pos = sl->pos;
+  int8_t dir = sl->dir;
+  int32_t vel = sl->vel;
+  bool is_touched = sl->is_touched;
+  sl->is_posted = false;
+  portEXIT_CRITICAL(&touch_slider_mux);
+
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sl->cb_ref);
+  lua_pushinteger(L, pos);
+  lua_pushinteger(L, dir);
+  lua_pushinteger(L, vel);
+  lua_pushboolean(L, is_touched);
+  if (lua_pcall(L, 4, 0, 0) != 0) {
+    ESP_LOGI(TAG, "error running slider callback: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+// Get the touch.slider object from the stack
+static touch_slider_t touch_slider_get( lua_State *L, int stack )
+{
+  return (touch_slider_t)luaL_checkudata(L, stack, "touch.slider");
+}
+
+/*
+Lua sample code:
+sl = touch.createSlider({
+  pads = {3,4,5,6,7,8,9}, -- Pads in physical order along the slider. 2 to 10 pads.
+  wheel = true, -- Last pad sits next to the first, like a jog dial. Defaults to false.
+  cb = onSlider, -- function(pos, dir, vel, isTouched) Optional. You can call sl:read() instead.
+  rateMs = 20, -- How often the pads are read. Defaults to 20.
+  thresPct = 10, -- Pad is touched when its counter drops this percent below baseline. Defaults to 10.
+  filter = 2, -- IIR filter strength 0-6. Each read moves 1/2^filter of the way. Defaults to 2.
+  resolution = 100, -- Position units per pad. Defaults to 100.
+  isDebug = false
+})
+*/
+static int touch_slider_create( lua_State *L ) {
+
+  luaL_checkanytable(L, 1);
+  lua_settop(L, 1);
+
+  int index = -1;
+  for (int i = 0; i < TOUCH_SLIDER_MAX; i++) {
+    if (touch_sliders[i] == NULL) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) return luaL_error(L, "Only %d sliders allowed", TOUCH_SLIDER_MAX);
+
+  bool is_debug = opt_checkbool(L, "isDebug", false);
+  bool is_wheel = opt_checkbool(L, "wheel", false);
+  int rate_ms = opt_checkint_range(L, "rateMs", 20, 1, 10000);
+  int thres_pct = opt_checkint_range(L, "thresPct", 10, 1, 99);
+  int filter_shift = opt_checkint_range(L, "filter", 2, 0, 6);
+  int resolution = opt_checkint_range(L, "resolution", 100, 1, 10000);
+
+  uint8_t pads[TOUCH_PAD_MAX];
+  int pad_cnt = 0;
+  uint16_t mask = 0;
+  lua_getfield(L, 1, "pads");
+  luaL_argcheck(L, lua_type(L, -1) == LUA_TTABLE, 1, "missing/bad 'pads' field");
+  pad_cnt = lua_objlen(L, -1);
+  luaL_argcheck(L, pad_cnt >= 2 && pad_cnt <= TOUCH_PAD_MAX, 1, "Need a list of 2 to 10 pads");
+  for (int i = 0; i < pad_cnt; i++) {
+    lua_rawgeti(L, -1, i + 1);
+    int padnum = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, padnum >= 0 && padnum <= 9, 1, "The pads allow 0 to 9");
+    if ((mask & (1 << padnum)) || (touch_slider_pad_mask & (1 << padnum)) || touch_pad_owned(padnum)) {
+      return luaL_error(L, "Pad %d is already in use", padnum);
+    }
+    mask |= 1 << padnum;
+    pads[i] = padnum;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "cb");
+  if (!lua_isnoneornil(L, -1)) {
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION, 1, "Cb must be function");
+  }
+
+  touch_slider_t sl = (touch_slider_t)lua_newuserdata(L, sizeof(touch_slider_struct_t));
+  if (!sl) return luaL_error(L, "not enough memory");
+  memset(sl, 0, sizeof(touch_slider_struct_t));
+  luaL_getmetatable(L, "touch.slider");
+  lua_setmetatable(L, -2);
+
+  // move the callback up above our userdata so we can ref it
+  sl->cb_ref = LUA_NOREF;
+  if (!lua_isnil(L, -2)) {
+    lua_pushvalue(L, -2);
+    sl->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  sl->is_debug = is_debug;
+  sl->is_wheel = is_wheel;
+  sl->pad_cnt = pad_cnt;
+  memcpy(sl->pads, pads, pad_cnt);
+  sl->index = index;
+  sl->rate_ms = rate_ms;
+  sl->thres_pct = thres_pct;
+  sl->filter_shift = filter_shift;
+  sl->resolution = resolution;
+  sl->base_ticks = TOUCH_SLIDER_BASE_TICKS;
+
+  if (touch_driver_acquire() != ESP_OK) {
+    luaL_unref(L, LUA_REGISTRYINDEX, sl->cb_ref);
+    return luaL_error(L, "Touch pad init error");
+  }
+  // the hardware timer keeps measuring every pad so the slider tick just reads the results
+  touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
+  for (int i = 0; i < pad_cnt; i++) {
+    touch_pad_config((touch_pad_t)pads[i], TOUCH_THRESH_NO_USE);
+  }
+
+  esp_timer_create_args_t args = {
+    .callback = touch_slider_tick,
+    .arg = sl,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "touch_slider"
+  };
+  if (esp_timer_create(&args, &sl->timer) != ESP_OK) {
+    touch_driver_release();
+    touch_fsm_restore();
+    luaL_unref(L, LUA_REGISTRYINDEX, sl->cb_ref);
+    return luaL_error(L, "Could not create slider timer");
+  }
+
+  touch_slider_pad_mask |= mask;
+  touch_sliders[index] = sl;
+  esp_timer_start_periodic(sl->timer, rate_ms * 1000);
+
+  if (sl->is_debug) ESP_LOGI(TAG, "Created slider %d with %d pads, wheel: %d, rateMs: %d, thresPct: %d", index, pad_cnt, is_wheel, rate_ms, thres_pct);
+
+  return 1;
+}
+
+// Lua: pos, dir, vel, isTouched = slider:read()
+// Latest position without waiting for a callback.
+static int touch_slider_read(lua_State* L)
+{
+  touch_slider_t sl = touch_slider_get(L, 1);
+
+  portENTER_CRITICAL(&touch_slider_mux);
+  int32_t pos = sl->pos;
+  int8_t dir = sl->dir;
+  int32_t vel = sl->vel;
+  bool is_touched = sl->is_touched;
+  portEXIT_CRITICAL(&touch_slider_mux);
+
+  lua_pushinteger(L, pos);
+  lua_pushinteger(L, dir);
+  lua_pushinteger(L, vel);
+  lua_pushboolean(L, is_touched);
+  return 4;
+}
+
+// Lua: slider:recalibrate()
+// Take a new untouched baseline over the next few reads. Don't touch the slider while it runs.
+static int touch_slider_recalibrate(lua_State* L)
+{
+  touch_slider_t sl = touch_slider_get(L, 1);
+
+  esp_timer_stop(sl->timer);
+  memset(sl->base, 0, sizeof(sl->base));
+  sl->base_ticks = TOUCH_SLIDER_BASE_TICKS;
+  esp_timer_start_periodic(sl->timer, sl->rate_ms * 1000);
+
+  if (sl->is_debug) ESP_LOGI(TAG, "Recalibrating slider %d", sl->index);
+  return 0;
+}
+
+// Lua: slider:unregister( self )
+static int touch_slider_unregister(lua_State* L)
+{
+  touch_slider_t sl = touch_slider_get(L, 1);
+  if (touch_sliders[sl->index] != sl) return 0;
+
+  // a tick may be reading the pads, so wait it out before the driver can go away
+  portENTER_CRITICAL(&touch_slider_mux);
+  sl->is_stopping = true;
+  portEXIT_CRITICAL(&touch_slider_mux);
+  touch_timer_halt(sl->timer, &touch_slider_mux, &sl->is_ticking);
+  esp_timer_delete(sl->timer);
+  touch_sliders[sl->index] = NULL;
+
+  for (int i = 0; i < sl->pad_cnt; i++) {
+    touch_slider_pad_mask &= ~(1 << sl->pads[i]);
+  }
+  touch_driver_release();
+  touch_fsm_restore();
+
+  luaL_unref(L, LUA_REGISTRYINDEX, sl->cb_ref);
+  sl->cb_ref = LUA_NOREF;
+
+  return 0;
+}
+
 // Lua: touch:unregister( self )
 static int touch_unregister(lua_State* L) {
   touch_t tp = touch_get(L, 1);
+  if (touch_selfs[tp->selfs_index] != tp) return 0;
+
+  // take us out of the ISR routing, and let the interrupt and filter go if nobody else needs them
+  touch_selfs[tp->selfs_index] = NULL;
+  touch_hw_update();
 
-  // if there was a callback, turn off ISR
+  // if there was a callback, turn off ISR once the last object with one is gone
   if (tp->cb_ref != LUA_NOREF) {
-    touch_intrDisable(L);
-    
-    touch_pad_isr_deregister(touch_intr_handler, NULL);
+    if (--touch_isr_refs == 0) {
+      touch_pad_isr_deregister(touch_intr_handler, NULL);
+    }
 
     luaL_unref(L, LUA_REGISTRYINDEX, tp->cb_ref);
     tp->cb_ref = LUA_NOREF;
-    
-  } else {
-    // non-interrupt mode
-    if (tp->filterMs > 0) {
-      touch_pad_filter_stop();
-    }
   }
 
-  touch_pad_deinit();
-  touch_self = NULL;
+  portENTER_CRITICAL(&touch_base_mux);
+  tp->is_stopping = true;
+  portEXIT_CRITICAL(&touch_base_mux);
+  if (tp->base_ms > 0) {
+    touch_timer_halt(tp->base_timer, &touch_base_mux, &tp->is_base_ticking);
+    // a calibrate() that finished in that tick started the timer again
+    esp_timer_stop(tp->base_timer);
+    esp_timer_delete(tp->base_timer);
+    tp->base_ms = 0;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->cal_cb_ref);
+  tp->cal_cb_ref = LUA_NOREF;
+  touch_sampler_free(L, tp);
+
+  if (tp->state_timer != NULL) {
+    touch_timer_halt(tp->state_timer, &touch_base_mux, &tp->is_state_ticking);
+    esp_timer_delete(tp->state_timer);
+    tp->state_timer = NULL;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->press_cb_ref);
+  tp->press_cb_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, tp->gesture_cb_ref);
+  tp->gesture_cb_ref = LUA_NOREF;
+
+  touch_driver_release();
 
   return 0;
 }
@@ -595,14 +2056,29 @@ LROT_BEGIN(touch_dyn)
   LROT_FUNCENTRY( intrDisable,    touch_intrDisable )
   LROT_FUNCENTRY( setThres,       touch_setThres )
   LROT_FUNCENTRY( setTriggerMode, touch_setTriggerMode )
+  LROT_FUNCENTRY( setThresPct,    touch_setThresPct )
+  LROT_FUNCENTRY( calibrate,      touch_calibrate )
+  LROT_FUNCENTRY( getBaselines,   touch_getBaselines )
+  LROT_FUNCENTRY( isPressed,      touch_isPressed )
+  LROT_FUNCENTRY( startSampler,   touch_sampler_start )
+  LROT_FUNCENTRY( stopSampler,    touch_sampler_stop )
+  LROT_FUNCENTRY( readSamples,    touch_sampler_read )
 
   // LROT_FUNCENTRY( __tostring,     touch_tostring )
   LROT_FUNCENTRY( __gc,           touch_unregister )
   LROT_TABENTRY ( __index,        touch_dyn )
 LROT_END(touch_dyn, NULL, 0)
 
+LROT_BEGIN(touch_slider_dyn)
+  LROT_FUNCENTRY( read,           touch_slider_read )
+  LROT_FUNCENTRY( recalibrate,    touch_slider_recalibrate )
+  LROT_FUNCENTRY( __gc,           touch_slider_unregister )
+  LROT_TABENTRY ( __index,        touch_slider_dyn )
+LROT_END(touch_slider_dyn, NULL, 0)
+
 LROT_BEGIN(touch)
   LROT_FUNCENTRY( create,            touch_create )
+  LROT_FUNCENTRY( createSlider,      touch_slider_create )
   LROT_NUMENTRY ( TOUCH_HVOLT_KEEP,    TOUCH_HVOLT_KEEP )
   LROT_NUMENTRY ( TOUCH_HVOLT_2V4,    TOUCH_HVOLT_2V4 )
   LROT_NUMENTRY ( TOUCH_HVOLT_2V5,    TOUCH_HVOLT_2V5 )
@@ -622,13 +2098,21 @@ LROT_BEGIN(touch)
   LROT_NUMENTRY ( TOUCH_HVOLT_ATTEN_0V,    TOUCH_HVOLT_ATTEN_0V )
   LROT_NUMENTRY ( TOUCH_TRIGGER_BELOW,    TOUCH_TRIGGER_BELOW )
   LROT_NUMENTRY ( TOUCH_TRIGGER_ABOVE,    TOUCH_TRIGGER_ABOVE )
+  LROT_NUMENTRY ( GESTURE_TAP,        TOUCH_GESTURE_TAP )
+  LROT_NUMENTRY ( GESTURE_DOUBLE_TAP, TOUCH_GESTURE_DOUBLE_TAP )
+  LROT_NUMENTRY ( GESTURE_LONG_PRESS, TOUCH_GESTURE_LONG_PRESS )
+  LROT_NUMENTRY ( GESTURE_SWIPE,      TOUCH_GESTURE_SWIPE )
 LROT_END(touch, NULL, 0)
 
 int luaopen_touch(lua_State *L) {
 
   luaL_rometatable(L, "touch.pctr", (void *)touch_dyn_map);
+  luaL_rometatable(L, "touch.slider", (void *)touch_slider_dyn_map);
 
   touch_task_id = task_get_id(touch_task);
+  touch_slider_task_id = task_get_id(touch_slider_task);
+  touch_base_task_id = task_get_id(touch_base_task);
+  touch_evt_task_id = task_get_id(touch_evt_task);
 
   return 0;
 }
@@ -0,0 +1,16 @@
+/*
+Host build stand-in for the option helpers in NodeMCU's common.h. They all
+look at the table on the top of the stack.
+*/
+#ifndef __HOST_COMMON_H__
+#define __HOST_COMMON_H__
+
+#include <lua.h>
+#include <stdbool.h>
+
+bool opt_get(lua_State *L, const char *name, int check_type);
+int opt_checkint(lua_State *L, const char *name, int default_val);
+int opt_checkint_range(lua_State *L, const char *name, int default_val, int min_val, int max_val);
+bool opt_checkbool(lua_State *L, const char *name, bool default_val);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+Host build PCNT driver. Same API and register names as ESP-IDF's driver/pcnt.h
+and soc/pcnt_struct.h, backed by the simulator in sim/sim_pcnt.c
+*/
+#ifndef __HOST_DRIVER_PCNT_H__
+#define __HOST_DRIVER_PCNT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define PCNT_PIN_NOT_USED (-1)
+
+typedef int pcnt_unit_t;
+typedef int pcnt_channel_t;
+typedef void *pcnt_isr_handle_t;
+
+enum { PCNT_UNIT_0 = 0, PCNT_UNIT_MAX = 8 };
+enum { PCNT_CHANNEL_0 = 0, PCNT_CHANNEL_1 = 1, PCNT_CHANNEL_MAX };
+
+typedef enum { PCNT_MODE_KEEP = 0, PCNT_MODE_REVERSE = 1, PCNT_MODE_DISABLE = 2 } pcnt_ctrl_mode_t;
+typedef enum { PCNT_COUNT_DIS = 0, PCNT_COUNT_INC = 1, PCNT_COUNT_DEC = 2 } pcnt_count_mode_t;
+typedef enum {
+  PCNT_EVT_L_LIM = 0,
+  PCNT_EVT_H_LIM = 1,
+  PCNT_EVT_THRES_0 = 2,
+  PCNT_EVT_THRES_1 = 3,
+  PCNT_EVT_ZERO = 4,
+  PCNT_EVT_MAX
+} pcnt_evt_type_t;
+
+// status_unit bits, same as soc/pcnt_reg.h
+#define PCNT_STATUS_THRES1_M  (1 << 2)
+#define PCNT_STATUS_THRES0_M  (1 << 3)
+#define PCNT_STATUS_L_LIM_M   (1 << 4)
+#define PCNT_STATUS_H_LIM_M   (1 << 5)
+#define PCNT_STATUS_ZERO_M    (1 << 6)
+
+typedef struct {
+  int pulse_gpio_num;
+  int ctrl_gpio_num;
+  pcnt_ctrl_mode_t lctrl_mode;
+  pcnt_ctrl_mode_t hctrl_mode;
+  pcnt_count_mode_t pos_mode;
+  pcnt_count_mode_t neg_mode;
+  int16_t counter_h_lim;
+  int16_t counter_l_lim;
+  pcnt_unit_t unit;
+  pcnt_channel_t channel;
+} pcnt_config_t;
+
+typedef union { uint32_t val; } host_pcnt_reg_t;
+
+// The parts of the PCNT register file the firmware touches directly
+typedef struct {
+  union {
+    struct {
+      uint32_t cnt_val: 16;
+      uint32_t reserved: 16;
+    };
+    uint32_t val;
+  } cnt_unit[8];
+  host_pcnt_reg_t int_raw;
+  host_pcnt_reg_t int_st;
+  host_pcnt_reg_t int_ena;
+  host_pcnt_reg_t int_clr;
+  host_pcnt_reg_t status_unit[8];
+} pcnt_dev_t;
+
+extern volatile pcnt_dev_t PCNT;
+
+esp_err_t pcnt_unit_config(const pcnt_config_t *pcnt_config);
+esp_err_t pcnt_get_counter_value(pcnt_unit_t pcnt_unit, int16_t *count);
+esp_err_t pcnt_counter_pause(pcnt_unit_t pcnt_unit);
+esp_err_t pcnt_counter_resume(pcnt_unit_t pcnt_unit);
+esp_err_t pcnt_counter_clear(pcnt_unit_t pcnt_unit);
+esp_err_t pcnt_intr_enable(pcnt_unit_t pcnt_unit);
+esp_err_t pcnt_intr_disable(pcnt_unit_t pcnt_unit);
+esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t evt_type);
+esp_err_t pcnt_event_disable(pcnt_unit_t unit, pcnt_evt_type_t evt_type);
+esp_err_t pcnt_set_event_value(pcnt_unit_t unit, pcnt_evt_type_t evt_type, int16_t value);
+esp_err_t pcnt_get_event_value(pcnt_unit_t unit, pcnt_evt_type_t evt_type, int16_t *value);
+esp_err_t pcnt_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags, pcnt_isr_handle_t *handle);
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val);
+esp_err_t pcnt_get_filter_value(pcnt_unit_t unit, uint16_t *filter_val);
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit);
+esp_err_t pcnt_filter_disable(pcnt_unit_t unit);
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef __HOST_FREERTOS_TASK_H__
+#define __HOST_FREERTOS_TASK_H__
+#include "freertos/FreeRTOS.h"
+#endif
@@ -0,0 +1,14 @@
+/*
+Host build stand-in that adds the NodeMCU extras on top of stock Lua 5.1
+*/
+#ifndef __HOST_LAUXLIB_H__
+#define __HOST_LAUXLIB_H__
+
+#include_next <lauxlib.h>
+#include <stdbool.h>
+
+void luaL_checkanytable(lua_State *L, int arg);
+void luaL_checkanyfunction(lua_State *L, int arg);
+bool luaL_optbool(lua_State *L, int arg, bool def);
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef __HOST_LEXTRA_H__
+#define __HOST_LEXTRA_H__
+#endif
@@ -0,0 +1,9 @@
+#ifndef __HOST_LMEM_H__
+#define __HOST_LMEM_H__
+
+#include <stdlib.h>
+
+#define luaM_malloc(L, n) malloc(n)
+#define luaM_free(L, p)   free(p)
+
+#endif
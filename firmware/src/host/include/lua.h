@@ -0,0 +1,15 @@
+/*
+Host build stand-in that adds the NodeMCU extras on top of stock Lua 5.1
+*/
+#ifndef __HOST_LUA_H__
+#define __HOST_LUA_H__
+
+#include_next <lua.h>
+
+#ifndef LUA_TLIGHTFUNCTION
+#define LUA_TLIGHTFUNCTION 100 // no light functions on the host, so never matches
+#endif
+
+lua_State *lua_getstate(void);
+
+#endif
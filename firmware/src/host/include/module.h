@@ -0,0 +1,37 @@
+/*
+Host build stand-in for NodeMCU's module.h. The LROT tables become plain
+arrays that sim/host_lua.c turns into ordinary Lua tables at load time.
+*/
+#ifndef __HOST_MODULE_H__
+#define __HOST_MODULE_H__
+
+#include <lua.h>
+#include <lauxlib.h>
+
+typedef enum { HOST_ROT_END, HOST_ROT_FUNC, HOST_ROT_NUM, HOST_ROT_TAB } host_rot_type_t;
+
+typedef struct host_rot_entry {
+  const char *key;
+  host_rot_type_t type;
+  lua_CFunction func;
+  lua_Number num;
+  const struct host_rot_entry *tab;
+} host_rot_entry_t;
+
+#define LROT_BEGIN(name)        static const host_rot_entry_t name ## _map[] = {
+#define LROT_FUNCENTRY(key, f)  { #key, HOST_ROT_FUNC, (lua_CFunction)(f), 0, NULL },
+#define LROT_NUMENTRY(key, v)   { #key, HOST_ROT_NUM, NULL, (lua_Number)(v), NULL },
+#define LROT_TABENTRY(key, t)   { #key, HOST_ROT_TAB, NULL, 0, t ## _map },
+#define LROT_END(name, mt, f)   { NULL, HOST_ROT_END, NULL, 0, NULL } };
+
+// Build a metatable in the registry from a LROT map, same as the firmware's rom metatables
+void host_rometatable(lua_State *L, const char *name, const host_rot_entry_t *map);
+#define luaL_rometatable(L, name, map) host_rometatable(L, name, (const host_rot_entry_t *)(map))
+
+// Set global `name` to a table built from `map` and then call the module's luaopen
+int host_rot_open(lua_State *L, const char *name, const host_rot_entry_t *map, lua_CFunction init);
+
+#define NODEMCU_MODULE(cfgname, luaname, map, initfunc) \
+  int host_open_ ## cfgname(lua_State *L) { return host_rot_open(L, luaname, map ## _map, initfunc); }
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __HOST_PLATFORM_H__
+#define __HOST_PLATFORM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IRAM_ATTR
+#ifndef BIT
+#define BIT(nr) (1UL << (nr))
+#endif
+
+#endif
@@ -0,0 +1,9 @@
+/*
+Host build config. Only the modules we build on the host are turned on.
+*/
+#ifndef __HOST_SDKCONFIG_H__
+#define __HOST_SDKCONFIG_H__
+
+#define CONFIG_LUA_MODULE_PULSECNT 1
+
+#endif
@@ -0,0 +1,23 @@
+/*
+Host build task queue. Posts are run by the simulator after each ISR, which
+is the same "later, on the Lua thread" ordering the firmware gives you.
+*/
+#ifndef __HOST_TASK_H__
+#define __HOST_TASK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum { TASK_PRIORITY_LOW, TASK_PRIORITY_MEDIUM, TASK_PRIORITY_HIGH, TASK_PRIORITY_COUNT } task_prio_t;
+typedef uint32_t task_handle_t;
+typedef intptr_t task_param_t;
+typedef void (*task_callback_t)(task_param_t param, task_prio_t prio);
+
+task_handle_t task_get_id(task_callback_t t);
+bool task_post(task_prio_t prio, task_handle_t handle, task_param_t param);
+
+#define task_post_low(handle, param)    task_post(TASK_PRIORITY_LOW, handle, param)
+#define task_post_medium(handle, param) task_post(TASK_PRIORITY_MEDIUM, handle, param)
+#define task_post_high(handle, param)   task_post(TASK_PRIORITY_HIGH, handle, param)
+
+#endif
@@ -0,0 +1,179 @@
+-- Stand-ins for the NodeMCU Lua modules our scripts use, running on the
+-- simulator's virtual clock. Only what our libraries call is here.
+
+-- tmr
+tmr = {
+  ALARM_SINGLE = 0,
+  ALARM_AUTO = 1,
+  ALARM_SEMI = 2,
+}
+
+local Timer = {}
+Timer.__index = Timer
+
+function tmr.create()
+  return setmetatable({}, Timer)
+end
+
+function Timer:register(ms, mode, fn)
+  self.ms = ms
+  self.mode = mode
+  self.fn = fn
+end
+
+function Timer:start()
+  if self.id ~= nil then return false end
+  local function fire()
+    self.id = nil
+    if self.mode == tmr.ALARM_AUTO then self:start() end
+    self.fn(self)
+  end
+  self.id = sim.after(self.ms * 1000, fire)
+  return true
+end
+
+function Timer:alarm(ms, mode, fn)
+  self:register(ms, mode, fn)
+  return self:start()
+end
+
+function Timer:stop()
+  if self.id == nil then return false end
+  sim.cancel(self.id)
+  self.id = nil
+  return true
+end
+
+function Timer:interval(ms)
+  self.ms = ms
+  if self.id ~= nil then
+    self:stop()
+    self:start()
+  end
+end
+
+function Timer:unregister()
+  self:stop()
+  self.fn = nil
+end
+
+function Timer:state()
+  return self.id ~= nil, self.mode
+end
+
+function tmr.now()
+  return math.floor(sim.now())
+end
+
+-- gpio
+gpio = {
+  IN = 0,
+  OUT = 1,
+  IN_OUT = 2,
+}
+
+function gpio.config(...)
+  -- pins are driven by sim.set() so nothing to do
+end
+
+function gpio.write(pin, level)
+  sim.set(pin, level)
+  sim.run(0)
+end
+
+function gpio.read(pin)
+  return sim.get(pin)
+end
+
+-- node
+node = {
+  task = {
+    LOW_PRIORITY = 0,
+    MEDIUM_PRIORITY = 1,
+    HIGH_PRIORITY = 2,
+  },
+}
+
+function node.task.post(prio, fn)
+  if fn == nil then fn = prio end
+  sim.after(0, fn)
+end
+
+-- time
+time = {}
+
+function time.get()
+  local us = sim.now()
+  return math.floor(us / 1000000), math.floor(us % 1000000)
+end
+
+-- file
+-- SPIFFS is flat, so names are put in one folder on the host, /tmp unless
+-- file.dir says otherwise. Only the fd style calls are here.
+file = {
+  dir = "/tmp/pcntsim_",
+}
+
+local Fd = {}
+Fd.__index = Fd
+
+local function fsPath(name)
+  return file.dir .. name
+end
+
+function file.open(name, mode)
+  local f = io.open(fsPath(name), (mode or "r") .. "b")
+  if f == nil then return nil end
+  return setmetatable({ f = f }, Fd)
+end
+
+function file.exists(name)
+  local f = io.open(fsPath(name), "rb")
+  if f == nil then return false end
+  f:close()
+  return true
+end
+
+function file.remove(name)
+  os.remove(fsPath(name))
+end
+
+function file.rename(old, new)
+  return os.rename(fsPath(old), fsPath(new)) ~= nil
+end
+
+function Fd:read(n)
+  local s = self.f:read(n or 1024)
+  if s == nil or #s == 0 then return nil end
+  return s
+end
+
+function Fd:readline()
+  local s = self.f:read("*l")
+  if s == nil then return nil end
+  -- the firmware keeps the newline, unless it's the last line without one
+  local pos = self.f:seek()
+  self.f:seek("set", pos - 1)
+  if self.f:read(1) == "\n" then s = s .. "\n" end
+  return s
+end
+
+function Fd:write(s)
+  return self.f:write(s) ~= nil
+end
+
+function Fd:writeline(s)
+  return self:write(s .. "\n")
+end
+
+function Fd:seek(whence, offset)
+  return self.f:seek(whence or "cur", offset or 0)
+end
+
+function Fd:flush()
+  self.f:flush()
+end
+
+function Fd:close()
+  self.f:close()
+end
@@ -0,0 +1,62 @@
+-- cayennbin command dispatcher, and the Lua one cmddispatch_v1 falls back to
+-- Run with: make run S=scripts/cayennbin_dispatch.lua
+
+local cmddispatch = require("cmddispatch_v1")
+
+local function check(label, create)
+  local ran = {}
+  local other = {}
+  local disp = create({
+    maxCmds = 8,
+    fallback = function(payload) other[#other + 1] = payload end,
+  })
+
+  local jogId = disp:register("JogFreq", function(payload, id) ran[#ran + 1] = {"JogFreq", id, payload.Freq} end)
+  local qId = disp:register("CmdQ", function(payload, id) ran[#ran + 1] = {"CmdQ", id} end)
+  assert(jogId == 1 and qId == 2)
+  assert(disp:getId("CmdQ") == 2 and disp:getId("Nope") == nil)
+
+  -- by name and by id
+  assert(disp:dispatch({Cmd = "JogFreq", Freq = 500}))
+  assert(disp:dispatch({CmdId = qId}))
+  assert(ran[1][1] == "JogFreq" and ran[1][2] == jogId and ran[1][3] == 500)
+  assert(ran[2][1] == "CmdQ")
+
+  -- unknown names, bad ids and announces go to the fallback
+  disp:dispatch({Cmd = "Nope"})
+  disp:dispatch({CmdId = 99})
+  disp:dispatch({Announce = "i-am-your-server"})
+  assert(#other == 3 and other[3].Announce == "i-am-your-server")
+  local calls, misses = disp:stats()
+  assert(calls == 5 and misses == 3)
+
+  -- registering again swaps the fn and keeps the id
+  local swapped = false
+  assert(disp:register("JogFreq", function() swapped = true end) == jogId)
+  disp:dispatch({Cmd = "JogFreq"})
+  assert(swapped)
+
+  -- a handler error doesn't take the caller down
+  disp:register("Boom", function() error("boom") end)
+  assert(disp:dispatch({Cmd = "Boom"}))
+
+  -- full up
+  for i = 4, 8 do disp:register("Cmd" .. i, function() end) end
+  assert(not pcall(disp.register, disp, "OneTooMany", function() end))
+  local cmds = disp:getCmds()
+  assert(cmds.JogFreq == 1 and cmds.Cmd8 == 8)
+
+  -- a name built at runtime still finds its slot
+  assert(disp:dispatch({Cmd = "Cmd" .. (4 + 1)}))
+
+  -- cost per dispatch doesn't depend on how many are registered
+  local t0 = sim.hostUs()
+  local n = 20000
+  local p = {Cmd = "Cmd8"}
+  for i = 1, n do disp:dispatch(p) end
+  print(string.format("%s: %d dispatches in %d us", label, n, sim.hostUs() - t0))
+end
+
+check("cayennbin", cayennbin.createDispatcher)
+check("lua", cmddispatch.createLua)
+print("cayennbin dispatch ok")
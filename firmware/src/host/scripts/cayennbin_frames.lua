@@ -0,0 +1,90 @@
+-- cayennbin framing and the streaming decoder, fed the way TCP really delivers
+-- Run with: make run S=scripts/cayennbin_frames.lua
+
+local got = {}
+local dec = cayennbin.createDecoder({
+  cb = function(tbl) got[#got + 1] = tbl end,
+  maxFrame = 256,
+  maxValues = 32,
+})
+
+local cmd = {Cmd = "CmdQ", Id = 100, TransId = 7,
+  RunCmd = {Cmd = "Move", Steps = -40000, Freq = 1250.5, Dir = true, Path = {1, 2, 3}}}
+local frame = cayennbin.encode(cmd)
+assert(frame:byte(1) == 0xCA and frame:byte(2) == cayennbin.VERSION)
+assert(frame:byte(3) + frame:byte(4) * 256 == #frame - 4)
+
+local function check(t)
+  assert(t.Cmd == "CmdQ" and t.Id == 100 and t.TransId == 7)
+  assert(t.RunCmd.Cmd == "Move" and t.RunCmd.Steps == -40000 and t.RunCmd.Dir == true)
+  assert(t.RunCmd.Freq == 1250.5)
+  assert(#t.RunCmd.Path == 3 and t.RunCmd.Path[3] == 3)
+end
+
+-- one frame in one write
+assert(dec:write(frame) == 1)
+check(got[1])
+
+-- split at every possible point
+for i = 1, #frame - 1 do
+  got = {}
+  assert(dec:write(frame:sub(1, i)) == 0)
+  assert(select(4, dec:stats()) == true, "mid frame after " .. i .. " bytes")
+  assert(dec:write(frame:sub(i + 1)) == 1)
+  check(got[1])
+end
+
+-- one byte at a time
+got = {}
+for i = 1, #frame do dec:write(frame:sub(i, i)) end
+assert(#got == 1)
+check(got[1])
+
+-- three coalesced, the last one split with the start of the next write
+got = {}
+local mem = cayennbin.encode({Cmd = "Mem", TransId = 8})
+local three = frame .. mem .. frame
+assert(dec:write(three .. frame:sub(1, 5)) == 3)
+assert(got[2].Cmd == "Mem" and got[2].TransId == 8)
+assert(dec:write(frame:sub(6)) == 1)
+assert(#got == 4)
+check(got[4])
+
+-- junk between frames is skipped, a broken frame is dropped whole
+local frames, errors, dropped = dec:stats()
+got = {}
+local broken = string.char(0xCA, 1, 3, 0, 0x0A, 5, 9)
+assert(dec:write("garbage" .. broken .. mem) == 1)
+assert(#got == 1 and got[1].Cmd == "Mem")
+local frames2, errors2, dropped2 = dec:stats()
+assert(errors2 == errors + 1, "broken frame counted")
+assert(dropped2 == dropped + #"garbage")
+
+-- a frame bigger than maxFrame is skipped without losing the next one
+got = {}
+local big = cayennbin.encode({Blob = string.rep("x", 300)})
+assert(dec:write(big .. mem) == 1)
+assert(got[1].Cmd == "Mem")
+
+-- numbers keep their value across the int and float encodings
+got = {}
+local nums = {0, 127, -128, 128, 32767, -32768, 70000, -2147483648, 2147483647, 0.25, 1/3, 1e12}
+dec:write(cayennbin.encode({N = nums}))
+for i, v in ipairs(nums) do
+  assert(got[1].N[i] == v, "number " .. i .. " was " .. tostring(got[1].N[i]))
+end
+
+-- what can't be encoded errors in Lua
+assert(not pcall(cayennbin.encode, {[5] = "x", y = 1}))
+assert(not pcall(cayennbin.encode, {f = print}))
+
+-- rough decode speed on the host
+local t0 = sim.hostUs()
+local n = 2000
+local stream = string.rep(frame, n)
+got = {}
+dec:write(stream)
+local us = sim.hostUs() - t0
+assert(#got == n)
+print(string.format("decoded %d CmdQ frames in %d us, %.1f us each", n, us, us / n))
+print("cayennbin frames ok")
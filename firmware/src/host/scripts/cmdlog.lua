@@ -0,0 +1,81 @@
+-- cmdlog_v1 group commit, torn tail recovery and compaction
+-- Run with: make run S=scripts/cmdlog.lua
+
+local cmdlog = require("cmdlog_v1")
+local name = "cmdlog_test.log"
+file.remove(name)
+
+-- crc32 is zlib's
+assert(cayennbin.crc32("123456789") == 0xCBF43926)
+assert(cayennbin.crc32("6789", cayennbin.crc32("12345")) == 0xCBF43926)
+-- and so is the Lua one used without cayennbin
+assert(cmdlog.crc32Lua("123456789") == 0xCBF43926)
+assert(cmdlog.crc32Lua("6789", cmdlog.crc32Lua("12345")) == 0xCBF43926)
+assert(cmdlog.crc32Lua(string.rep("\255\0", 300)) == cayennbin.crc32(string.rep("\255\0", 300)))
+
+-- appends wait in RAM until flushMs
+local log = cmdlog.open(name, { flushBytes = 4096, flushMs = 200 })
+local offs = {}
+for i = 1, 20 do
+  offs[i] = log:append({ Id = i, Step = i * 10, Fr = 200, Acc = 50 })
+end
+assert(log.records == 0, "nothing written yet")
+sim.run(250 * 1000)
+assert(log.records == 20, "written after flushMs")
+
+-- and go straight out past flushBytes
+log.flushBytes = 64
+log:append({ Id = 21, Step = 210, Fr = 200, Acc = 50 })
+log:append({ Id = 22, Step = 220, Fr = 200, Acc = 50 })
+assert(log.records >= 21)
+log:flush()
+
+-- read back by offset and in order
+local cmd, nextOff = log:readAt(offs[7])
+assert(cmd.Id == 7 and cmd.Step == 70)
+assert(nextOff == offs[8])
+log:rewind()
+local n = 0
+while true do
+  local c = log:next()
+  if c == nil then break end
+  n = n + 1
+  assert(c.Id == n)
+end
+assert(n == 22)
+log:close()
+
+-- power cut halfway through a record
+local f = io.open(file.dir .. name, "ab")
+f:write(string.char(30, 0, 2, 0xCA, 1, 20))
+f:close()
+log = cmdlog.open(name)
+assert(log.truncated == 6, "torn tail cut off")
+assert(log.records == 22)
+log:append({ Id = 23, Step = 230 })
+log:flush()
+log:close()
+log = cmdlog.open(name)
+assert(log.truncated == 0 and log.records == 23)
+
+-- a flipped bit fails the crc and everything from there is dropped
+local fd = io.open(file.dir .. name, "r+b")
+fd:seek("set", offs[20] + 8)
+local b = fd:read(1)
+fd:seek("set", offs[20] + 8)
+fd:write(string.char((string.byte(b) + 1) % 256))
+fd:close()
+log = cmdlog.open(name)
+assert(log.records == 19)
+
+-- compact keeps what you ask for
+local kept, dropped = log:compact(function(c) return c.Id % 2 == 0 end)
+assert(kept == 9 and dropped == 10)
+log:rewind()
+assert(log:next().Id == 2)
+log:wipe()
+assert(log.records == 0 and log:next() == nil)
+log:close()
+file.remove(name)
+
+print("cmdlog ok")
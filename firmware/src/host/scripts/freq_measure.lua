@@ -0,0 +1,48 @@
+-- pulsecnt gated frequency measurement on the PCNT simulator
+-- Run with: make run S=scripts/freq_measure.lua
+
+local pin = 34
+
+-- a callback turns on the limit events, which the gate needs to count across h_lim
+local pc = pulsecnt.create(5, function() end)
+pc:chan0Config(pin, pulsecnt.PCNT_PIN_NOT_USED,
+  pulsecnt.PCNT_COUNT_INC, pulsecnt.PCNT_COUNT_DIS,
+  pulsecnt.PCNT_MODE_KEEP, pulsecnt.PCNT_MODE_KEEP,
+  -1000, 1000)
+
+pc:startFreqMeasure(100, 4)
+assert(pc:getFreq() == nil, "no gate has completed yet")
+
+-- 2khz fan tach for 1 second, 200 counts per gate
+sim.pulses(pin, {count=2000, periodUs=500, atUs=sim.now() + 1})
+sim.run(1000000)
+local hz, gates = pc:getFreq()
+print("2khz:", hz, "gates:", gates)
+assert(gates == 10)
+assert(math.abs(hz - 2000) <= 10, "hz was " .. hz)
+
+-- 25khz is 2500 counts per gate so h_lim of 1000 resets twice per gate
+sim.pulses(pin, {count=25000, periodUs=40, atUs=sim.now() + 1})
+sim.run(1000000)
+hz = pc:getFreq()
+print("25khz across h_lim:", hz)
+assert(math.abs(hz - 25000) <= 50, "hz was " .. hz)
+
+-- the ring only keeps the last 4, all at 25khz now, oldest first
+local hist = pc:getFreqHistory()
+assert(#hist == 4)
+for i, v in ipairs(hist) do assert(math.abs(v - 25000) <= 50, "hist[" .. i .. "] was " .. v) end
+
+-- clear() mid measurement must not show up as a negative rate
+sim.pulses(pin, {count=1000, periodUs=100, atUs=sim.now() + 1})
+sim.run(50000)
+pc:clear()
+sim.run(60000)
+hz = pc:getFreq()
+print("10khz with clear:", hz)
+assert(math.abs(hz - 10000) <= 50, "clear showed up as " .. hz)
+
+pc:stopFreqMeasure()
+local ok = pcall(pc.getFreq, pc)
+assert(not ok, "getFreq should fail after stop")
+print("freq_measure ok")
@@ -0,0 +1,47 @@
+-- gcode_file playback reads ahead while a move runs
+-- Run with: make run S=scripts/gcode_prefetch.lua
+
+local gf = require("gcode_file")
+gf.fileName = "gcode_prefetch_test.log"
+file.remove(gf.fileName)
+gf.init({ prefetchCount = 3 })
+
+for i = 1, 10 do gf.write({ Step = i * 100 }) end
+gf.close()
+
+-- the first move is read right away, the rest come from the task queue
+gf.openRead()
+sim.run(0)
+assert(gf.getAheadCount() == 3, "read ahead on openRead")
+
+local n = 0
+while true do
+  local move = gf.getNext()
+  if move == nil then break end
+  n = n + 1
+  assert(move.Step == n * 100, "moves in order")
+  -- the move runs for a while, refills happen meanwhile
+  sim.run(20 * 1000)
+end
+assert(n == 10)
+assert(gf.stats.misses == 0, "every move came from read ahead, misses " .. gf.stats.misses)
+
+-- back to the start, and moves recorded after playback ended show up
+gf.openRead()
+sim.run(0)
+for i = 1, 10 do assert(gf.getNext().Step == i * 100) end
+sim.run(0)
+assert(gf.getNext() == nil)
+gf.write({ Step = 1100 })
+gf.close()
+assert(gf.getNext().Step == 1100)
+
+-- wiping drops what was read ahead
+gf.openRead()
+sim.run(0)
+gf.wipe()
+sim.run(0)
+assert(gf.getNext() == nil)
+file.remove(gf.fileName)
+
+print("gcode prefetch ok, hits " .. gf.stats.hits .. ", misses " .. gf.stats.misses)
@@ -0,0 +1,89 @@
+-- homing_v1.lua driving a fake motor into a simulated hall sensor, with
+-- position kept by pulsecnt_machine.lua on the PCNT simulator
+-- Run with: make run S=scripts/homing.lua
+
+local pinStep = 36
+local pinDir = 0
+
+-- the hall sensor sees the magnet between these machine positions
+local hallLo, hallHi = -420, -380
+
+local pm = require("pulsecnt_machine")
+pm.init({
+  pinDir = pinDir,
+  pinPulseInput = pinStep,
+  stepLimitMin = -32767,
+  stepLimitMax = 32767,
+  rmtChannel = -1,
+  glitchUnit = 6,
+})
+pm.pcnt:setExpectedRate(1000)
+
+local homing = require("homing_v1")
+
+-- fake drv8825: direction pin only
+local motor = {}
+function motor.dirFwd() sim.set(pinDir, 1) end
+function motor.dirRev() sim.set(pinDir, 0) end
+
+-- fake hall endstop: watches the pulse counter after each step
+local endstop = { isOn = false }
+local function checkHall()
+  local pos = pm.getMachineCoords()
+  local isOn = pos >= hallLo and pos <= hallHi
+  if isOn ~= endstop.isOn then
+    endstop.isOn = isOn
+    local hitOrLeave = isOn and "hit" or "leave"
+    node.task.post(node.task.HIGH_PRIORITY, function()
+      if homing.getState() ~= "" then homing.home(hitOrLeave) end
+    end)
+  end
+end
+
+-- fake jog: one step pulse per period while running. gen makes a pause()
+-- kill the step that was already queued up
+local jog = { freq = 0, running = false, steps = 0, gen = 0 }
+local function step(gen)
+  if not jog.running or gen ~= jog.gen or jog.freq <= 0 then return end
+  sim.pulses(pinStep, {count=1, periodUs=10, widthUs=5})
+  jog.steps = jog.steps + 1
+  -- look at the counter once the filter has let the edge through
+  sim.after(20, checkHall)
+  sim.after(1000000 / jog.freq, function() step(gen) end)
+end
+function jog.setfreq(freq) jog.freq = freq end
+function jog.resume()
+  if jog.running then return end
+  jog.running = true
+  local gen = jog.gen
+  sim.after(0, function() step(gen) end)
+end
+function jog.pause()
+  jog.running = false
+  jog.gen = jog.gen + 1
+end
+
+local steps = {}
+homing.init({
+  jog = jog,
+  motor = motor,
+  endstop = endstop,
+  isDebug = false,
+  microSteps = 4,
+  cbOnHomingStep = function(s) steps[#steps + 1] = s end,
+})
+
+homing.home()
+-- plenty of virtual time for the slow final back-off
+sim.run(60 * 1000000)
+
+print("homing steps:", table.concat(steps, ","))
+assert(steps[#steps] == "done", "homing did not finish")
+assert(homing.getState() == "")
+
+-- we finish just off the fwd side of the magnet
+local pos = pm.getMachineCoords()
+print("home position:", pos, "steps sent:", jog.steps, "glitches:", pm.getGlitchCnt())
+assert(pos == hallHi + 1, "home ended at " .. pos)
+
+print("homing ok")
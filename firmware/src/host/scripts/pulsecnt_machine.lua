@@ -0,0 +1,72 @@
+-- pulsecnt.c and pulsecnt_machine.lua on the PCNT simulator
+-- Run with: make run S=scripts/pulsecnt_machine.lua
+
+local pinStep = 36
+local pinDir = 0
+
+local pm = require("pulsecnt_machine")
+pm.init({
+  pinDir = pinDir,
+  pinPulseInput = pinStep,
+  stepLimitMin = -32767,
+  stepLimitMax = 32767,
+  rmtChannel = -1, -- no rmttx on the host, so we use setExpectedRate()
+  glitchUnit = 6,
+})
+
+-- steps count on the falling edge, direction pin high counts up
+local function steps(count, periodUs)
+  local done = sim.pulses(pinStep, {count=count, periodUs=periodUs, atUs=sim.now() + 10})
+  sim.runUntil(done + 10)
+end
+
+local function dir(level)
+  sim.set(pinDir, level)
+  sim.run(5)
+end
+
+-- 20khz, 25us pulses. The filter wants 12.5us but is capped at 152 cycles (1.9us)
+local cycles = pm.pcnt:setExpectedRate(20000)
+print("filter cycles at 20khz:", cycles)
+assert(cycles == 152, "filter should be capped at maxCycles")
+assert(sim.pcnt(7).filter == 152)
+
+dir(1)
+steps(1000, 50)
+assert(pm.getMachineCoords() == 1000, "fwd count was " .. pm.getMachineCoords())
+
+-- a 300ns spike is shorter than the filter, so it must not count
+sim.glitch(pinStep, sim.now() + 10, 300)
+sim.run(100)
+assert(pm.getMachineCoords() == 1000, "glitch got counted")
+assert(pm.getGlitchCnt() == 1, "glitch unit saw " .. pm.getGlitchCnt())
+
+dir(0)
+steps(400, 50)
+assert(pm.getMachineCoords() == 600, "rev count was " .. pm.getMachineCoords())
+
+-- snapshot reads the register file straight, so it has to agree with getCnt()
+local snap = pulsecnt.snapshot({pm.pcnt})
+assert(snap[1] == 600 and snap.ts == math.floor(sim.now()))
+
+-- event storm: 200khz through the h_lim of 32767, timing each step in the ISR
+pm.pcnt:setExpectedRate(200000)
+pm.pcnt:captureStart({binUs=1, bins=16, expectedUs=5, negEdge=true})
+dir(1)
+local hostStart = sim.hostUs()
+steps(40000, 5)
+local hostUs = sim.hostUs() - hostStart
+-- h_lim resets the counter to 0, so we wrapped once
+assert(pm.getMachineCoords() == 600 + 40000 - 32767, "storm count was " .. pm.getMachineCoords())
+
+local cap = pm.pcnt:captureRead(true)
+print("capture samples:", cap.samples, "mean:", cap.mean, "stddev:", cap.stddev)
+assert(cap.samples == 39999 and cap.min == 5 and cap.max == 5)
+assert(cap.devs[#cap.devs / 2 + 1] == 39999, "all steps should be on time")
+pm.pcnt:captureStop()
+
+local st = sim.stats()
+print(string.format("storm: 40000 steps in %.1f ms host time, %d isr calls, %d tasks, %d task overflows",
+  hostUs / 1000, st.isrCalls, st.tasksRun, st.taskOverflows))
+
+print("pulsecnt_machine ok")
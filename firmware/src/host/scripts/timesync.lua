@@ -0,0 +1,52 @@
+-- timesync_v1 offset and drift estimate against a made up master clock
+-- Run with: make run S=scripts/timesync.lua
+
+local ts = require("timesync_v1")
+
+-- master runs 40ppm fast and 123.456789 secs ahead of us
+local drift = 40e-6
+local ahead = 123456789
+local function master(localUs) return localUs * (1 + drift) + ahead end
+
+math.randomseed(7)
+local t = 5000000
+for round = 1, 8 do
+  for i = 1, ts.samplesPerRound do
+    -- WiFi: 1 to 1.5ms each way, now and then 15ms more
+    local up = 1000 + math.random(0, 500)
+    local down = 1000 + math.random(0, 500)
+    if math.random(1, 4) == 1 then up = up + 15000 end
+    local t1 = t
+    local t2 = master(t1 + up)
+    local t3 = t2 + 40 -- master takes 40us to answer
+    local t4 = t1 + up + 40 / (1 + drift) + down
+    ts.addSample(t1, t2, t3, t4)
+    t = t + 50000
+  end
+  ts._endRound()
+  t = t + 2000000
+end
+
+assert(ts.isSynced())
+local st = ts.getStatus()
+print("offset", st.OffsetUs, "drift ppm", st.DriftPpm, "delay", st.DelayUs)
+assert(math.abs(st.DriftPpm - 40) < 25)
+
+-- a second after the last round. the error is the one way asymmetry
+-- left in the best samples, which no two way exchange can see
+local now = t + 1000000
+local err = ts.toMaster(now) - master(now)
+print("error us", err)
+assert(math.abs(err) < 500)
+
+-- and back again
+local at = master(now) + 250000
+assert(math.abs(master(ts.toLocal(at)) - at) < 500)
+assert(math.abs(ts.toMaster(ts.toLocal(at)) - at) < 1)
+
+-- answers that don't match a request we sent are ignored
+ts._pending = {}
+ts.onResponse({Seq = 3, T1 = 1, T2 = 2, T3 = 3}, 4)
+assert(#ts._round == 0)
+
+print("timesync ok")
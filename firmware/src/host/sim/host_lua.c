@@ -0,0 +1,114 @@
+/*
+Host build of the NodeMCU Lua extras our C modules rely on: rom tables,
+option helpers from common.c and lua_getstate()
+Authored by: ChiliPeppr (John Lauer) 2019
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#include "module.h"
+#include "lauxlib.h"
+#include "common.h"
+#include "sim.h"
+
+static lua_State *host_L = NULL;
+
+lua_State *lua_getstate(void) {
+  return host_L;
+}
+
+lua_State *sim_lua_state(void) {
+  return host_L;
+}
+
+void sim_lua_set_state(lua_State *L) {
+  host_L = L;
+}
+
+// Push a table built from a rom map. A TABENTRY pointing back at its own map
+// (the usual __index trick) points at the table being built.
+static void host_rot_push(lua_State *L, const host_rot_entry_t *map) {
+  lua_newtable(L);
+  for (const host_rot_entry_t *e = map; e->type != HOST_ROT_END; e++) {
+    switch (e->type) {
+      case HOST_ROT_FUNC:
+        lua_pushcfunction(L, e->func);
+        break;
+      case HOST_ROT_NUM:
+        lua_pushnumber(L, e->num);
+        break;
+      case HOST_ROT_TAB:
+        if (e->tab == map) lua_pushvalue(L, -1);
+        else host_rot_push(L, e->tab);
+        break;
+      default:
+        continue;
+    }
+    lua_setfield(L, -2, e->key);
+  }
+}
+
+void host_rometatable(lua_State *L, const char *name, const host_rot_entry_t *map) {
+  host_rot_push(L, map);
+  lua_setfield(L, LUA_REGISTRYINDEX, name);
+}
+
+int host_rot_open(lua_State *L, const char *name, const host_rot_entry_t *map, lua_CFunction init) {
+  if (init != NULL) {
+    lua_pushcfunction(L, init);
+    lua_call(L, 0, 0);
+  }
+  host_rot_push(L, map);
+  lua_setglobal(L, name);
+  return 0;
+}
+
+//
+// lauxlib extras
+//
+void luaL_checkanytable(lua_State *L, int arg) {
+  luaL_checktype(L, arg, LUA_TTABLE);
+}
+
+void luaL_checkanyfunction(lua_State *L, int arg) {
+  luaL_checktype(L, arg, LUA_TFUNCTION);
+}
+
+// Lenient like the firmware's. Anything that isn't a boolean gets the default.
+bool luaL_optbool(lua_State *L, int arg, bool def) {
+  if (lua_isboolean(L, arg)) return lua_toboolean(L, arg);
+  return def;
+}
+
+//
+// common.c option helpers. These work on the table at the top of the stack.
+//
+bool opt_get(lua_State *L, const char *name, int check_type) {
+  lua_getfield(L, -1, name);
+  bool ret = check_type == LUA_TNONE ? !lua_isnil(L, -1) : lua_type(L, -1) == check_type;
+  if (!ret) lua_pop(L, 1);
+  return ret;
+}
+
+int opt_checkint(lua_State *L, const char *name, int default_val) {
+  if (!opt_get(L, name, LUA_TNUMBER)) return default_val;
+  int result = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return result;
+}
+
+int opt_checkint_range(lua_State *L, const char *name, int default_val, int min_val, int max_val) {
+  int result = opt_checkint(L, name, default_val);
+  if (result < min_val || result > max_val) {
+    luaL_error(L, "expected range %d..%d for '%s'", min_val, max_val, name);
+  }
+  return result;
+}
+
+bool opt_checkbool(lua_State *L, const char *name, bool default_val) {
+  if (!opt_get(L, name, LUA_TBOOLEAN)) return default_val;
+  bool result = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return result;
+}
@@ -0,0 +1,78 @@
+/*
+pcntsim: run a Lua script against our C modules on the host simulator
+Authored by: ChiliPeppr (John Lauer) 2019
+
+Usage: pcntsim script.lua [args]
+
+The script gets the same pulsecnt module as the firmware plus the sim module
+to feed it pulses, and the repo's lua/ folder is on package.path so you can
+require("pulsecnt_machine") etc. Exits non-zero if the script errors, so
+assert() in a script fails the run.
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#include "sim.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include <stdio.h>
+
+#ifndef HOST_LUA_DIR
+#define HOST_LUA_DIR "lua"
+#endif
+#ifndef REPO_LUA_DIR
+#define REPO_LUA_DIR "../../../lua"
+#endif
+
+// the firmware modules built into this host binary
+int host_open_PULSECNT(lua_State *L);
+int host_open_CAYENNBIN(lua_State *L);
+
+static int report(lua_State *L, int status) {
+  if (status != 0) {
+    fprintf(stderr, "pcntsim: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  return status;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s script.lua [args]\n", argv[0]);
+    return 2;
+  }
+
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  sim_lua_set_state(L);
+  sim_reset();
+
+  luaopen_sim(L);
+  lua_pop(L, 1);
+  host_open_PULSECNT(L);
+  host_open_CAYENNBIN(L);
+
+  // put our stand-ins and the repo's Lua files on the require path
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  lua_pushfstring(L, "%s/?.lua;%s/?.lua;%s", HOST_LUA_DIR, REPO_LUA_DIR, lua_tostring(L, -1));
+  lua_setfield(L, -3, "path");
+  lua_pop(L, 2);
+
+  // script args like the stock lua interpreter gives you
+  lua_createtable(L, argc, 0);
+  for (int i = 1; i < argc; i++) {
+    lua_pushstring(L, argv[i]);
+    lua_rawseti(L, -2, i - 1);
+  }
+  lua_setglobal(L, "arg");
+
+  int status = report(L, luaL_dofile(L, HOST_LUA_DIR "/nodemcu.lua"));
+  if (status == 0) status = report(L, luaL_dofile(L, argv[1]));
+
+  lua_close(L);
+  return status == 0 ? 0 : 1;
+}
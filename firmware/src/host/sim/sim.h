@@ -0,0 +1,88 @@
+/*
+Host simulator for the ESP32 peripherals our C modules use
+Authored by: ChiliPeppr (John Lauer) 2019
+
+Everything runs off a virtual clock in nanoseconds. Pulse trains, timers and
+filter delays are events in one time-ordered queue. Processing an event may
+run an "ISR" (the PCNT or GPIO handler the module registered) and anything
+those ISRs post with task_post_*() runs right after, like the Lua task queue
+does on the chip.
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lua.h"
+
+typedef enum {
+  SIM_EVT_GPIO,     // a = gpio, b = level
+  SIM_EVT_PCNT,     // a = unit, b = input, c = level, gen = filter generation
+  SIM_EVT_TIMER,    // p = esp_timer, gen = timer generation
+  SIM_EVT_LUA,      // a = registry ref of the Lua function to call
+} sim_evt_type_t;
+
+typedef struct {
+  int64_t at_ns;
+  uint64_t seq;     // keeps events at the same time in the order they were scheduled
+  sim_evt_type_t type;
+  int a, b, c;
+  uint32_t gen;
+  void *p;
+} sim_evt_t;
+
+typedef struct {
+  uint64_t events;
+  uint64_t edges;
+  uint64_t pcnt_counts;
+  uint64_t pcnt_glitches;   // edges the PCNT filter swallowed
+  uint64_t isr_calls;
+  uint64_t tasks_run;
+  uint64_t timer_fires;
+  uint64_t task_overflows;  // task_post() with a full queue, which drops the post like the chip does
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+// virtual clock
+int64_t sim_now_ns(void);
+void sim_schedule(sim_evt_t evt);
+void sim_run_until(int64_t at_ns);
+void sim_reset(void);
+
+// gpio
+void sim_gpio_set(int gpio, int level);
+int sim_gpio_get(int gpio);
+
+// peripherals, called by the core
+void sim_pcnt_reset(void);
+void sim_pcnt_on_edge(int gpio, int level);
+void sim_pcnt_on_filter(const sim_evt_t *evt);
+void sim_timer_on_fire(const sim_evt_t *evt);
+void sim_timer_reset(void);
+void sim_tasks_run(void);
+void sim_tasks_reset(void);
+void sim_tasks_unlock(void); // after a Lua error unwound out of a task
+
+// peek at a PCNT unit's internal state that is not in the register file
+typedef struct {
+  int16_t count;
+  int16_t h_lim, l_lim, thres0, thres1;
+  uint16_t filter;
+  bool filter_en;
+  bool paused;
+  uint8_t evt_en; // bit per pcnt_evt_type_t
+} sim_pcnt_state_t;
+void sim_pcnt_get_state(int unit, sim_pcnt_state_t *state);
+
+// Lua side
+lua_State *sim_lua_state(void);
+void sim_lua_set_state(lua_State *L);
+int luaopen_sim(lua_State *L);
+void sim_lua_on_event(const sim_evt_t *evt);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+Host simulator core: virtual clock, event queue, GPIO, task queue and esp_timer
+Authored by: ChiliPeppr (John Lauer) 2019
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#include "sim.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+sim_stats_t sim_stats;
+
+static int64_t now_ns = 0;
+static uint64_t next_seq = 0;
+
+//
+// Event queue. A binary min-heap ordered by time, then by the order scheduled.
+//
+static sim_evt_t *heap = NULL;
+static size_t heap_len = 0;
+static size_t heap_cap = 0;
+
+static bool evt_before(const sim_evt_t *a, const sim_evt_t *b) {
+  if (a->at_ns != b->at_ns) return a->at_ns < b->at_ns;
+  return a->seq < b->seq;
+}
+
+void sim_schedule(sim_evt_t evt) {
+  if (heap_len == heap_cap) {
+    heap_cap = heap_cap ? heap_cap * 2 : 256;
+    heap = realloc(heap, heap_cap * sizeof(sim_evt_t));
+  }
+  evt.seq = next_seq++;
+  if (evt.at_ns < now_ns) evt.at_ns = now_ns;
+
+  size_t i = heap_len++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!evt_before(&evt, &heap[parent])) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = evt;
+}
+
+static sim_evt_t heap_pop(void) {
+  sim_evt_t top = heap[0];
+  sim_evt_t last = heap[--heap_len];
+  size_t i = 0;
+  for (;;) {
+    size_t child = i * 2 + 1;
+    if (child >= heap_len) break;
+    if (child + 1 < heap_len && evt_before(&heap[child + 1], &heap[child])) child++;
+    if (!evt_before(&heap[child], &last)) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  if (heap_len > 0) heap[i] = last;
+  return top;
+}
+
+int64_t sim_now_ns(void) {
+  return now_ns;
+}
+
+// Run every event up to and including at_ns, then leave the clock at at_ns.
+// Tasks posted by each event run before the next event, like the chip would
+// get to them long before the next step pulse.
+void sim_run_until(int64_t at_ns) {
+  while (heap_len > 0 && heap[0].at_ns <= at_ns) {
+    sim_evt_t evt = heap_pop();
+    now_ns = evt.at_ns;
+    sim_stats.events++;
+
+    switch (evt.type) {
+      case SIM_EVT_GPIO:
+        sim_gpio_set(evt.a, evt.b);
+        break;
+      case SIM_EVT_PCNT:
+        sim_pcnt_on_filter(&evt);
+        break;
+      case SIM_EVT_TIMER:
+        sim_timer_on_fire(&evt);
+        break;
+      case SIM_EVT_LUA:
+        sim_lua_on_event(&evt);
+        break;
+    }
+    sim_tasks_run();
+  }
+  if (at_ns > now_ns) now_ns = at_ns;
+}
+
+void sim_reset(void) {
+  heap_len = 0;
+  now_ns = 0;
+  next_seq = 0;
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  sim_timer_reset();
+  sim_tasks_reset();
+  sim_pcnt_reset();
+}
+
+void vTaskDelay(TickType_t ticks) {
+  sim_run_until(now_ns + (int64_t)ticks * portTICK_PERIOD_MS * 1000000);
+}
+
+//
+// GPIO
+//
+typedef struct {
+  gpio_isr_t handler;
+  void *arg;
+  gpio_int_type_t type;
+  bool enabled;
+} sim_gpio_isr_t;
+
+static uint8_t gpio_levels[HOST_GPIO_MAX];
+static sim_gpio_isr_t gpio_isrs[HOST_GPIO_MAX];
+
+void sim_gpio_set(int gpio, int level) {
+  if (gpio < 0 || gpio >= HOST_GPIO_MAX) return;
+  level = level ? 1 : 0;
+  if (gpio_levels[gpio] == level) return;
+  gpio_levels[gpio] = level;
+  sim_stats.edges++;
+
+  sim_gpio_isr_t *isr = &gpio_isrs[gpio];
+  if (isr->handler != NULL && isr->enabled) {
+    bool fire = isr->type == GPIO_INTR_ANYEDGE
+      || (isr->type == GPIO_INTR_POSEDGE && level == 1)
+      || (isr->type == GPIO_INTR_NEGEDGE && level == 0);
+    if (fire) {
+      sim_stats.isr_calls++;
+      isr->handler(isr->arg);
+    }
+  }
+
+  sim_pcnt_on_edge(gpio, level);
+}
+
+int sim_gpio_get(int gpio) {
+  if (gpio < 0 || gpio >= HOST_GPIO_MAX) return 0;
+  return gpio_levels[gpio];
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+  return sim_gpio_get(gpio_num);
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+  (void)intr_alloc_flags;
+  return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args) {
+  if (gpio_num < 0 || gpio_num >= HOST_GPIO_MAX) return ESP_ERR_INVALID_ARG;
+  gpio_isrs[gpio_num].handler = isr_handler;
+  gpio_isrs[gpio_num].arg = args;
+  return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num) {
+  if (gpio_num < 0 || gpio_num >= HOST_GPIO_MAX) return ESP_ERR_INVALID_ARG;
+  memset(&gpio_isrs[gpio_num], 0, sizeof(sim_gpio_isr_t));
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+  if (gpio_num < 0 || gpio_num >= HOST_GPIO_MAX) return ESP_ERR_INVALID_ARG;
+  gpio_isrs[gpio_num].type = intr_type;
+  return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num) {
+  if (gpio_num < 0 || gpio_num >= HOST_GPIO_MAX) return ESP_ERR_INVALID_ARG;
+  gpio_isrs[gpio_num].enabled = true;
+  return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num) {
+  if (gpio_num < 0 || gpio_num >= HOST_GPIO_MAX) return ESP_ERR_INVALID_ARG;
+  gpio_isrs[gpio_num].enabled = false;
+  return ESP_OK;
+}
+
+//
+// Task queue. Same fixed depth per priority as the firmware so event storms
+// drop posts here too instead of hiding the problem.
+//
+#define SIM_TASK_MAX_IDS 32
+#define SIM_TASK_QUEUE_LEN 64
+
+typedef struct {
+  task_handle_t handle;
+  task_param_t param;
+} sim_task_post_t;
+
+typedef struct {
+  sim_task_post_t posts[SIM_TASK_QUEUE_LEN];
+  size_t head, len;
+} sim_task_queue_t;
+
+static task_callback_t task_cbs[SIM_TASK_MAX_IDS];
+static size_t task_cb_cnt = 0;
+static sim_task_queue_t task_queues[TASK_PRIORITY_COUNT];
+static bool tasks_running = false;
+
+task_handle_t task_get_id(task_callback_t t) {
+  for (size_t i = 0; i < task_cb_cnt; i++) {
+    if (task_cbs[i] == t) return i;
+  }
+  if (task_cb_cnt == SIM_TASK_MAX_IDS) abort();
+  task_cbs[task_cb_cnt] = t;
+  return task_cb_cnt++;
+}
+
+bool task_post(task_prio_t prio, task_handle_t handle, task_param_t param) {
+  sim_task_queue_t *q = &task_queues[prio];
+  if (q->len == SIM_TASK_QUEUE_LEN) {
+    sim_stats.task_overflows++;
+    return false;
+  }
+  q->posts[(q->head + q->len) % SIM_TASK_QUEUE_LEN] = (sim_task_post_t){ handle, param };
+  q->len++;
+  return true;
+}
+
+// Run posted tasks, highest priority first, until the queues are empty.
+// Not re-entrant, so a task that runs the simulator doesn't recurse in here.
+void sim_tasks_run(void) {
+  if (tasks_running) return;
+  tasks_running = true;
+  for (;;) {
+    int prio;
+    for (prio = TASK_PRIORITY_COUNT - 1; prio >= 0; prio--) {
+      if (task_queues[prio].len > 0) break;
+    }
+    if (prio < 0) break;
+
+    sim_task_queue_t *q = &task_queues[prio];
+    sim_task_post_t post = q->posts[q->head];
+    q->head = (q->head + 1) % SIM_TASK_QUEUE_LEN;
+    q->len--;
+
+    sim_stats.tasks_run++;
+    task_cbs[post.handle](post.param, prio);
+  }
+  tasks_running = false;
+}
+
+void sim_tasks_unlock(void) {
+  tasks_running = false;
+}
+
+void sim_tasks_reset(void) {
+  memset(task_queues, 0, sizeof(task_queues));
+  tasks_running = false;
+}
+
+//
+// esp_timer. Timers are never freed so a stale event for a deleted timer can
+// still look at its generation and skip itself. Fine for a test run.
+//
+struct esp_timer {
+  esp_timer_cb_t cb;
+  void *arg;
+  int64_t period_ns; // 0 for one-shot
+  uint32_t gen;
+  bool deleted;
+  struct esp_timer *next;
+};
+
+static struct esp_timer *timers = NULL;
+
+static void timer_arm(esp_timer_handle_t t, int64_t in_ns) {
+  sim_evt_t evt = { .at_ns = now_ns + in_ns, .type = SIM_EVT_TIMER, .gen = t->gen, .p = t };
+  sim_schedule(evt);
+}
+
+void sim_timer_on_fire(const sim_evt_t *evt) {
+  esp_timer_handle_t t = (esp_timer_handle_t)evt->p;
+  if (t->deleted || t->gen != evt->gen) return;
+  if (t->period_ns > 0) timer_arm(t, t->period_ns);
+  sim_stats.timer_fires++;
+  t->cb(t->arg);
+}
+
+// Stop every timer. The modules still hold their handles so don't free them.
+void sim_timer_reset(void) {
+  for (struct esp_timer *t = timers; t != NULL; t = t->next) {
+    t->gen++;
+  }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle) {
+  if (args == NULL || args->callback == NULL || out_handle == NULL) return ESP_ERR_INVALID_ARG;
+  struct esp_timer *t = calloc(1, sizeof(struct esp_timer));
+  if (t == NULL) return ESP_ERR_NO_MEM;
+  t->cb = args->callback;
+  t->arg = args->arg;
+  t->next = timers;
+  timers = t;
+  *out_handle = t;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  timer->gen++;
+  timer->period_ns = 0;
+  timer_arm(timer, (int64_t)timeout_us * 1000);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+  timer->gen++;
+  timer->period_ns = (int64_t)period * 1000;
+  timer_arm(timer, timer->period_ns);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  timer->gen++;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+  timer->gen++;
+  timer->deleted = true;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void) {
+  return now_ns / 1000;
+}
@@ -0,0 +1,314 @@
+/*
+Lua "sim" module to drive the host simulator from test scripts
+Authored by: ChiliPeppr (John Lauer) 2019
+
+All times from Lua are in microseconds and can be fractional, i.e. 0.5 for a
+500ns pulse. Times you pass in with atUs are absolute on the virtual clock.
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#include "sim.h"
+#include "lauxlib.h"
+#include "driver/gpio.h"
+
+#include <time.h>
+
+static int64_t us_to_ns(lua_Number us) {
+  return (int64_t)(us * 1000.0 + (us >= 0 ? 0.5 : -0.5));
+}
+
+static int sim_check_gpio(lua_State *L, int arg) {
+  int gpio = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, gpio >= 0 && gpio < HOST_GPIO_MAX, arg, "gpio allows 0 to 39");
+  return gpio;
+}
+
+static int64_t sim_opt_at(lua_State *L, int arg) {
+  if (lua_isnoneornil(L, arg)) return sim_now_ns();
+  return us_to_ns(luaL_checknumber(L, arg));
+}
+
+static void sim_schedule_level(int gpio, int level, int64_t at_ns) {
+  sim_evt_t evt = { .at_ns = at_ns, .type = SIM_EVT_GPIO, .a = gpio, .b = level };
+  sim_schedule(evt);
+}
+
+// Lua: sim.reset()
+// Clock back to 0, queue emptied, PCNT back to its reset state, timers stopped
+static int sim_l_reset(lua_State *L) {
+  sim_reset();
+  return 0;
+}
+
+// Lua: us = sim.now()
+static int sim_l_now(lua_State *L) {
+  lua_pushnumber(L, sim_now_ns() / 1000.0);
+  return 1;
+}
+
+// Runs the simulator from inside a pcall so a Lua error thrown by a callback
+// doesn't leave the task queue locked
+static int sim_run_protected(lua_State *L) {
+  int64_t *at_ns = (int64_t *)lua_touserdata(L, 1);
+  sim_run_until(*at_ns);
+  return 0;
+}
+
+static int sim_run_to(lua_State *L, int64_t at_ns) {
+  lua_pushcfunction(L, sim_run_protected);
+  lua_pushlightuserdata(L, &at_ns);
+  if (lua_pcall(L, 1, 0, 0) != 0) {
+    sim_tasks_unlock();
+    return lua_error(L);
+  }
+  lua_pushnumber(L, sim_now_ns() / 1000.0);
+  return 1;
+}
+
+// Lua: nowUs = sim.run(us)
+// Advance the virtual clock by us, running every event on the way
+static int sim_l_run(lua_State *L) {
+  lua_Number us = luaL_checknumber(L, 1);
+  luaL_argcheck(L, us >= 0, 1, "us must be >= 0");
+  return sim_run_to(L, sim_now_ns() + us_to_ns(us));
+}
+
+// Lua: nowUs = sim.runUntil(atUs)
+static int sim_l_run_until(lua_State *L) {
+  return sim_run_to(L, us_to_ns(luaL_checknumber(L, 1)));
+}
+
+// Lua: sim.set(gpio, level, atUs)
+// Drive a gpio, i.e. a direction pin. Happens on the next run if atUs is nil.
+static int sim_l_set(lua_State *L) {
+  int gpio = sim_check_gpio(L, 1);
+  int level = luaL_checkinteger(L, 2);
+  sim_schedule_level(gpio, level, sim_opt_at(L, 3));
+  return 0;
+}
+
+// Lua: level = sim.get(gpio)
+static int sim_l_get(lua_State *L) {
+  lua_pushinteger(L, sim_gpio_get(sim_check_gpio(L, 1)));
+  return 1;
+}
+
+// Lua: endUs = sim.pulses(gpio, {count=100, periodUs=50, widthUs=2, atUs=0, activeLow=false})
+// Queue a pulse train. widthUs defaults to half the period.
+static int sim_l_pulses(lua_State *L) {
+  int gpio = sim_check_gpio(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  lua_getfield(L, 2, "count");
+  int count = luaL_checkinteger(L, -1);
+  lua_getfield(L, 2, "periodUs");
+  lua_Number period_us = luaL_checknumber(L, -1);
+  lua_getfield(L, 2, "widthUs");
+  lua_Number width_us = luaL_optnumber(L, -1, period_us / 2);
+  lua_getfield(L, 2, "atUs");
+  int64_t at_ns = sim_opt_at(L, -1);
+  lua_getfield(L, 2, "activeLow");
+  int active = lua_toboolean(L, -1) ? 0 : 1;
+  lua_pop(L, 5);
+
+  luaL_argcheck(L, count >= 0, 2, "count must be >= 0");
+  luaL_argcheck(L, period_us > 0 && width_us > 0 && width_us < period_us, 2, "need 0 < widthUs < periodUs");
+
+  int64_t period_ns = us_to_ns(period_us);
+  int64_t width_ns = us_to_ns(width_us);
+  for (int i = 0; i < count; i++) {
+    int64_t t = at_ns + i * period_ns;
+    sim_schedule_level(gpio, active, t);
+    sim_schedule_level(gpio, !active, t + width_ns);
+  }
+
+  lua_pushnumber(L, (at_ns + count * period_ns) / 1000.0);
+  return 1;
+}
+
+// Lua: sim.glitch(gpio, atUs, widthNs)
+// A short spike on a gpio away from its current level and back
+static int sim_l_glitch(lua_State *L) {
+  int gpio = sim_check_gpio(L, 1);
+  int64_t at_ns = sim_opt_at(L, 2);
+  int width_ns = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, width_ns > 0, 3, "widthNs must be > 0");
+
+  // figure the level at that time from what's queued is overkill, so flip from now's level
+  int level = sim_gpio_get(gpio);
+  sim_schedule_level(gpio, !level, at_ns);
+  sim_schedule_level(gpio, level, at_ns + width_ns);
+  return 0;
+}
+
+// Lua: endUs = sim.rmt(gpio, {dur0, lvl0, dur1, lvl1, ...}, clkDiv, atUs)
+// Play RMT items onto a gpio, same format as rmttx's writeSync(). Stops at a 0 duration.
+static int sim_l_rmt(lua_State *L) {
+  int gpio = sim_check_gpio(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int clk_div = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, clk_div >= 1 && clk_div <= 255, 3, "clkDiv allows 1 to 255");
+  int64_t t = sim_opt_at(L, 4);
+
+  // 80Mhz APB clock, 12.5ns per tick before the divider
+  double ns_per_tick = 12.5 * clk_div;
+  int len = lua_objlen(L, 2);
+  for (int i = 1; i + 1 <= len; i += 2) {
+    lua_rawgeti(L, 2, i);
+    lua_rawgeti(L, 2, i + 1);
+    int dur = lua_tointeger(L, -2);
+    int lvl = lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    if (dur == 0) break;
+    sim_schedule_level(gpio, lvl, t);
+    t += (int64_t)(dur * ns_per_tick + 0.5);
+  }
+
+  lua_pushnumber(L, t / 1000.0);
+  return 1;
+}
+
+// Lua: id = sim.after(us, fn)
+// Call fn on the Lua side after us of virtual time. Used for the tmr/node stand-ins.
+static int sim_l_after(lua_State *L) {
+  lua_Number us = luaL_checknumber(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  // mark it live so sim.cancel() can kill it
+  lua_getfield(L, LUA_REGISTRYINDEX, "sim.after");
+  lua_pushboolean(L, 1);
+  lua_rawseti(L, -2, ref);
+  lua_pop(L, 1);
+
+  sim_evt_t evt = { .at_ns = sim_now_ns() + us_to_ns(us), .type = SIM_EVT_LUA, .a = ref };
+  sim_schedule(evt);
+
+  lua_pushinteger(L, ref);
+  return 1;
+}
+
+// Lua: sim.cancel(id)
+static int sim_l_cancel(lua_State *L) {
+  int ref = luaL_checkinteger(L, 1);
+  lua_getfield(L, LUA_REGISTRYINDEX, "sim.after");
+  lua_rawgeti(L, -1, ref);
+  if (lua_toboolean(L, -1)) {
+    lua_pushnil(L);
+    lua_rawseti(L, -3, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  }
+  lua_pop(L, 2);
+  return 0;
+}
+
+void sim_lua_on_event(const sim_evt_t *evt) {
+  lua_State *L = sim_lua_state();
+  int ref = evt->a;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, "sim.after");
+  lua_rawgeti(L, -1, ref);
+  bool live = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (!live) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pushnil(L);
+  lua_rawseti(L, -2, ref);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  lua_call(L, 0, 0);
+}
+
+// Lua: tbl = sim.pcnt(unit)
+// Everything about a PCNT unit, including what's not in the register file
+static int sim_l_pcnt(lua_State *L) {
+  int unit = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, unit >= 0 && unit <= 7, 1, "unit allows 0 to 7");
+
+  sim_pcnt_state_t st;
+  sim_pcnt_get_state(unit, &st);
+
+  lua_createtable(L, 0, 10);
+  lua_pushinteger(L, st.count);
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, st.h_lim);
+  lua_setfield(L, -2, "hLim");
+  lua_pushinteger(L, st.l_lim);
+  lua_setfield(L, -2, "lLim");
+  lua_pushinteger(L, st.thres0);
+  lua_setfield(L, -2, "thres0");
+  lua_pushinteger(L, st.thres1);
+  lua_setfield(L, -2, "thres1");
+  lua_pushinteger(L, st.filter);
+  lua_setfield(L, -2, "filter");
+  lua_pushboolean(L, st.filter_en);
+  lua_setfield(L, -2, "filterEn");
+  lua_pushboolean(L, st.paused);
+  lua_setfield(L, -2, "paused");
+  lua_pushinteger(L, st.evt_en);
+  lua_setfield(L, -2, "evtEn");
+  return 1;
+}
+
+// Lua: tbl = sim.stats()
+static int sim_l_stats(lua_State *L) {
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, sim_stats.events);
+  lua_setfield(L, -2, "events");
+  lua_pushnumber(L, sim_stats.edges);
+  lua_setfield(L, -2, "edges");
+  lua_pushnumber(L, sim_stats.pcnt_counts);
+  lua_setfield(L, -2, "pcntCounts");
+  lua_pushnumber(L, sim_stats.pcnt_glitches);
+  lua_setfield(L, -2, "pcntGlitches");
+  lua_pushnumber(L, sim_stats.isr_calls);
+  lua_setfield(L, -2, "isrCalls");
+  lua_pushnumber(L, sim_stats.tasks_run);
+  lua_setfield(L, -2, "tasksRun");
+  lua_pushnumber(L, sim_stats.timer_fires);
+  lua_setfield(L, -2, "timerFires");
+  lua_pushnumber(L, sim_stats.task_overflows);
+  lua_setfield(L, -2, "taskOverflows");
+  return 1;
+}
+
+// Lua: us = sim.hostUs()
+// Wall clock of the host, for benchmarking how fast the code under test runs
+static int sim_l_host_us(lua_State *L) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0);
+  return 1;
+}
+
+static const luaL_Reg sim_funcs[] = {
+  { "reset",    sim_l_reset },
+  { "now",      sim_l_now },
+  { "run",      sim_l_run },
+  { "runUntil", sim_l_run_until },
+  { "set",      sim_l_set },
+  { "get",      sim_l_get },
+  { "pulses",   sim_l_pulses },
+  { "glitch",   sim_l_glitch },
+  { "rmt",      sim_l_rmt },
+  { "after",    sim_l_after },
+  { "cancel",   sim_l_cancel },
+  { "pcnt",     sim_l_pcnt },
+  { "stats",    sim_l_stats },
+  { "hostUs",   sim_l_host_us },
+  { NULL, NULL }
+};
+
+int luaopen_sim(lua_State *L) {
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, "sim.after");
+  luaL_register(L, "sim", sim_funcs);
+  return 1;
+}
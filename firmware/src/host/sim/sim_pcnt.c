@@ -0,0 +1,312 @@
+/*
+Host simulator for the ESP32 pulse counter (PCNT) peripheral
+Authored by: ChiliPeppr (John Lauer) 2019
+
+Models the 8 units the way the ESP32 TRM describes them:
+- 2 channels per unit, each with a pulse input and a control input
+- pos/neg edge modes and low/high control modes
+- the glitch filter, which drops any input change that does not stay put for
+  filter_val APB cycles (12.5ns each). It defaults to 16 cycles, enabled,
+  like the chip does out of reset
+- h_lim/l_lim reset the counter to 0 when reached
+- thres0/thres1/zero/limit events set status_unit and int_st and call the
+  registered ISR, which must write int_clr like it would on the chip
+
+This example code is in the Public Domain (or CC0 licensed, at your option.)
+Make modifications at will and freely.
+*/
+
+#include "sim.h"
+#include "platform.h"
+#include "driver/pcnt.h"
+#include "driver/gpio.h"
+
+#include <string.h>
+
+#define SIM_PCNT_UNITS 8
+#define SIM_PCNT_INPUTS 4 // ch0 pulse, ch0 ctrl, ch1 pulse, ch1 ctrl
+
+volatile pcnt_dev_t PCNT;
+
+typedef struct {
+  bool ch_en[2];
+  int gpio[SIM_PCNT_INPUTS];
+  uint8_t pos_mode[2];
+  uint8_t neg_mode[2];
+  uint8_t lctrl_mode[2];
+  uint8_t hctrl_mode[2];
+  int16_t count;
+  int16_t h_lim;
+  int16_t l_lim;
+  int16_t thres0;
+  int16_t thres1;
+  uint16_t filter;
+  bool filter_en;
+  bool paused;
+  uint8_t evt_en;
+  uint8_t level[SIM_PCNT_INPUTS];   // input levels after the filter
+  bool pending[SIM_PCNT_INPUTS];    // an input change is waiting out the filter
+  uint32_t gen[SIM_PCNT_INPUTS];    // bumped to cancel the pending change
+} sim_pcnt_unit_t;
+
+static sim_pcnt_unit_t units[SIM_PCNT_UNITS];
+static void (*isr_fn)(void *) = NULL;
+static void *isr_arg = NULL;
+
+static void unit_reset(int u) {
+  memset(&units[u], 0, sizeof(sim_pcnt_unit_t));
+  for (int i = 0; i < SIM_PCNT_INPUTS; i++) units[u].gpio[i] = PCNT_PIN_NOT_USED;
+  units[u].filter = 16;
+  units[u].filter_en = true;
+}
+
+void sim_pcnt_reset(void) {
+  for (int u = 0; u < SIM_PCNT_UNITS; u++) unit_reset(u);
+  memset((void *)&PCNT, 0, sizeof(PCNT));
+  isr_fn = NULL;
+  isr_arg = NULL;
+}
+
+void sim_pcnt_get_state(int unit, sim_pcnt_state_t *state) {
+  sim_pcnt_unit_t *pu = &units[unit];
+  state->count = pu->count;
+  state->h_lim = pu->h_lim;
+  state->l_lim = pu->l_lim;
+  state->thres0 = pu->thres0;
+  state->thres1 = pu->thres1;
+  state->filter = pu->filter;
+  state->filter_en = pu->filter_en;
+  state->paused = pu->paused;
+  state->evt_en = pu->evt_en;
+}
+
+static void raise_events(int u, uint32_t status) {
+  // bits 0-1: 0 pos to zero, 1 neg to zero, 2 negative, 3 positive
+  int16_t count = units[u].count;
+  uint32_t zero_mode = count < 0 ? 2 : count > 0 ? 3 : 0;
+  PCNT.status_unit[u].val = status | zero_mode;
+
+  if (!(PCNT.int_ena.val & BIT(u))) return;
+  PCNT.int_raw.val |= BIT(u);
+  PCNT.int_st.val |= BIT(u);
+  if (isr_fn == NULL) return;
+
+  sim_stats.isr_calls++;
+  isr_fn(isr_arg);
+  PCNT.int_st.val &= ~PCNT.int_clr.val;
+  PCNT.int_raw.val &= ~PCNT.int_clr.val;
+  PCNT.int_clr.val = 0;
+}
+
+static void count_edge(int u, int ch, int level) {
+  sim_pcnt_unit_t *pu = &units[u];
+  if (pu->paused || !pu->ch_en[ch]) return;
+
+  int mode = level ? pu->pos_mode[ch] : pu->neg_mode[ch];
+  int delta = mode == PCNT_COUNT_INC ? 1 : mode == PCNT_COUNT_DEC ? -1 : 0;
+
+  // an unrouted control input reads low
+  int ctrl = pu->gpio[ch * 2 + 1] >= 0 ? pu->level[ch * 2 + 1] : 0;
+  int ctrl_mode = ctrl ? pu->hctrl_mode[ch] : pu->lctrl_mode[ch];
+  if (ctrl_mode == PCNT_MODE_REVERSE) delta = -delta;
+  else if (ctrl_mode == PCNT_MODE_DISABLE) delta = 0;
+  if (delta == 0) return;
+
+  sim_stats.pcnt_counts++;
+  pu->count += delta;
+
+  uint32_t status = 0;
+  if (pu->h_lim != 0 && pu->count >= pu->h_lim) {
+    if (pu->evt_en & BIT(PCNT_EVT_H_LIM)) status |= PCNT_STATUS_H_LIM_M;
+    pu->count = 0;
+  } else if (pu->l_lim != 0 && pu->count <= pu->l_lim) {
+    if (pu->evt_en & BIT(PCNT_EVT_L_LIM)) status |= PCNT_STATUS_L_LIM_M;
+    pu->count = 0;
+  }
+  if (pu->count == pu->thres0 && (pu->evt_en & BIT(PCNT_EVT_THRES_0))) status |= PCNT_STATUS_THRES0_M;
+  if (pu->count == pu->thres1 && (pu->evt_en & BIT(PCNT_EVT_THRES_1))) status |= PCNT_STATUS_THRES1_M;
+  if (pu->count == 0 && (pu->evt_en & BIT(PCNT_EVT_ZERO))) status |= PCNT_STATUS_ZERO_M;
+
+  PCNT.cnt_unit[u].cnt_val = (uint16_t)pu->count;
+  if (status) raise_events(u, status);
+}
+
+static void commit_input(int u, int input, int level) {
+  sim_pcnt_unit_t *pu = &units[u];
+  pu->pending[input] = false;
+  pu->level[input] = level;
+  if ((input & 1) == 0) count_edge(u, input / 2, level);
+}
+
+void sim_pcnt_on_edge(int gpio, int level) {
+  for (int u = 0; u < SIM_PCNT_UNITS; u++) {
+    sim_pcnt_unit_t *pu = &units[u];
+    for (int input = 0; input < SIM_PCNT_INPUTS; input++) {
+      if (pu->gpio[input] != gpio || !pu->ch_en[input / 2]) continue;
+
+      if (!pu->filter_en || pu->filter == 0) {
+        commit_input(u, input, level);
+        continue;
+      }
+
+      if (pu->pending[input]) {
+        // input went back before the filter time was up, so it was a glitch
+        pu->pending[input] = false;
+        pu->gen[input]++;
+        sim_stats.pcnt_glitches++;
+        continue;
+      }
+      if (pu->level[input] == level) continue;
+
+      pu->pending[input] = true;
+      pu->gen[input]++;
+      sim_evt_t evt = {
+        .at_ns = sim_now_ns() + (int64_t)pu->filter * 25 / 2,
+        .type = SIM_EVT_PCNT,
+        .a = u, .b = input, .c = level,
+        .gen = pu->gen[input],
+      };
+      sim_schedule(evt);
+    }
+  }
+}
+
+void sim_pcnt_on_filter(const sim_evt_t *evt) {
+  sim_pcnt_unit_t *pu = &units[evt->a];
+  if (!pu->pending[evt->b] || pu->gen[evt->b] != evt->gen) return;
+  commit_input(evt->a, evt->b, evt->c);
+}
+
+//
+// ESP-IDF driver/pcnt.h API
+//
+#define CHECK_UNIT(u) do { if ((u) < 0 || (u) >= SIM_PCNT_UNITS) return ESP_ERR_INVALID_ARG; } while (0)
+
+esp_err_t pcnt_unit_config(const pcnt_config_t *cfg) {
+  CHECK_UNIT(cfg->unit);
+  if (cfg->channel < 0 || cfg->channel > 1) return ESP_ERR_INVALID_ARG;
+  sim_pcnt_unit_t *pu = &units[cfg->unit];
+  int ch = cfg->channel;
+  pu->ch_en[ch] = true;
+  pu->gpio[ch * 2] = cfg->pulse_gpio_num;
+  pu->gpio[ch * 2 + 1] = cfg->ctrl_gpio_num;
+  pu->level[ch * 2] = sim_gpio_get(cfg->pulse_gpio_num);
+  pu->level[ch * 2 + 1] = sim_gpio_get(cfg->ctrl_gpio_num);
+  pu->pending[ch * 2] = pu->pending[ch * 2 + 1] = false;
+  pu->pos_mode[ch] = cfg->pos_mode;
+  pu->neg_mode[ch] = cfg->neg_mode;
+  pu->lctrl_mode[ch] = cfg->lctrl_mode;
+  pu->hctrl_mode[ch] = cfg->hctrl_mode;
+  pu->h_lim = cfg->counter_h_lim;
+  pu->l_lim = cfg->counter_l_lim;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_counter_value(pcnt_unit_t unit, int16_t *count) {
+  CHECK_UNIT(unit);
+  *count = units[unit].count;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_pause(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  units[unit].paused = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_resume(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  units[unit].paused = false;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_clear(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  units[unit].count = 0;
+  PCNT.cnt_unit[unit].cnt_val = 0;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_intr_enable(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  PCNT.int_ena.val |= BIT(unit);
+  return ESP_OK;
+}
+
+esp_err_t pcnt_intr_disable(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  PCNT.int_ena.val &= ~BIT(unit);
+  return ESP_OK;
+}
+
+esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t evt_type) {
+  CHECK_UNIT(unit);
+  if (evt_type < 0 || evt_type >= PCNT_EVT_MAX) return ESP_ERR_INVALID_ARG;
+  units[unit].evt_en |= BIT(evt_type);
+  return ESP_OK;
+}
+
+esp_err_t pcnt_event_disable(pcnt_unit_t unit, pcnt_evt_type_t evt_type) {
+  CHECK_UNIT(unit);
+  if (evt_type < 0 || evt_type >= PCNT_EVT_MAX) return ESP_ERR_INVALID_ARG;
+  units[unit].evt_en &= ~BIT(evt_type);
+  return ESP_OK;
+}
+
+esp_err_t pcnt_set_event_value(pcnt_unit_t unit, pcnt_evt_type_t evt_type, int16_t value) {
+  CHECK_UNIT(unit);
+  switch (evt_type) {
+    case PCNT_EVT_L_LIM: units[unit].l_lim = value; break;
+    case PCNT_EVT_H_LIM: units[unit].h_lim = value; break;
+    case PCNT_EVT_THRES_0: units[unit].thres0 = value; break;
+    case PCNT_EVT_THRES_1: units[unit].thres1 = value; break;
+    default: return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_event_value(pcnt_unit_t unit, pcnt_evt_type_t evt_type, int16_t *value) {
+  CHECK_UNIT(unit);
+  switch (evt_type) {
+    case PCNT_EVT_L_LIM: *value = units[unit].l_lim; break;
+    case PCNT_EVT_H_LIM: *value = units[unit].h_lim; break;
+    case PCNT_EVT_THRES_0: *value = units[unit].thres0; break;
+    case PCNT_EVT_THRES_1: *value = units[unit].thres1; break;
+    case PCNT_EVT_ZERO: *value = 0; break;
+    default: return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t pcnt_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags, pcnt_isr_handle_t *handle) {
+  (void)intr_alloc_flags;
+  isr_fn = fn;
+  isr_arg = arg;
+  if (handle != NULL) *handle = (pcnt_isr_handle_t)&isr_fn;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val) {
+  CHECK_UNIT(unit);
+  if (filter_val > 1023) return ESP_ERR_INVALID_ARG;
+  units[unit].filter = filter_val;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_filter_value(pcnt_unit_t unit, uint16_t *filter_val) {
+  CHECK_UNIT(unit);
+  *filter_val = units[unit].filter;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  units[unit].filter_en = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_filter_disable(pcnt_unit_t unit) {
+  CHECK_UNIT(unit);
+  units[unit].filter_en = false;
+  return ESP_OK;
+}
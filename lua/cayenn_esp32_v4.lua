@@ -15,6 +15,7 @@
 local json = sjson -- attach to esp32 library instead of my previous local json.lua
 wifi_util = require("wifi_util_v1")
 tcp = require("tcp_client")
+timesync = require("timesync_v1")
 
 local M = {}
 -- M = {}
@@ -30,6 +31,23 @@ M.jsonTagTable = nil
 
 M.isInitted = false
 
+-- Binary framing. We offer it in our announce if the firmware has the
+-- cayennbin module, and use it with a peer once it says it does too,
+-- by the Framing in its announce or by sending us frames. JSON still
+-- works either way, and each peer gets whichever it talks.
+M.FRAMING = "cayennbin1"
+M.isBinAvail = cayennbin ~= nil
+M.maxFrame = 1024 -- largest binary frame we accept
+M._isBinPeer = {} -- [ip] = true if we send that peer binary frames
+
+function M._isBinSendTo(ip)
+  return M.isBinAvail and M._isBinPeer[ip] == true
+end
+
+-- Clock sync to a master board, see timesync_v1. Any device answers
+-- sync requests. syncClock() makes us follow one.
+M.timesync = timesync
+
 -- When you are initting you can pass in tags to describe your device
 -- You should use a format like this:
 -- opts = {}
@@ -102,6 +120,9 @@ function M.createAnnounce(jsonTagTable)
   local a = {}
   a.Announce = "i-am-a-client"
   a.MyDeviceId = "chip:" .. node.chipid() .. "-ip:" .. M.myip -- .. "-mac:" .. wifi.sta.getmac()
+  if M.isBinAvail then
+    a.Framing = M.FRAMING
+  end
   
   if jsonTagTable.Widget then
     a.Widget = jsonTagTable.Widget
@@ -181,8 +202,12 @@ function M.sendBroadcast(jsonTagTable)
   M.sendUtility(jsonTagTable, "broadcast")
 end
 
-M._tcpClientIp = nil
-function M.initTcpSend(ip)
+M._tcpClientIp = nil -- the server, where sends go by default
+M._replyIp = nil -- peer whose command we're handling right now
+-- Pass in the Framing the server gave in its i-am-your-server
+-- announce so we send it binary frames if it can take them
+function M.initTcpSend(ip, framing)
+  M._isBinPeer[ip] = M.isBinAvail and framing == M.FRAMING
   -- see if we have a tcp_client for this ip 
   if M._tcpClientIp == nil then
     print("Creating tcp_client for ip: "..ip)
@@ -191,33 +216,71 @@ function M.initTcpSend(ip)
   elseif M._tcpClientIp == ip then 
     print("Have tcp_client for ip: "..ip)
   else
-    print("Already have tcp_client for other ip: "..M._tcpClientIp.." and you asked for ip: "..ip)
-    print("We only support 1 IP for now. Sorry.")
+    -- the new server becomes the default. the old one keeps its
+    -- connection for as long as it keeps sending us commands
+    print("Switching tcp_client from ip: "..M._tcpClientIp.." to ip: "..ip)
+    tcp.init(ip, 8988)
+    M._tcpClientIp = ip 
   end
 end 
 
-function M.send(jsonTagTable, cb)
+-- Run a command's listener with replies going back to the peer that sent it
+function M._dispatchFromPeer(peerIp, data)
+  M._replyIp = peerIp
+  local ok, err = pcall(M.listenerOnIncomingCmd, data)
+  M._replyIp = nil
+  if not ok then
+    print("Err in cmd listener: " .. tostring(err))
+  end
+end
+
+-- isLowPri is for things like status that can be dropped when the
+-- server is slow. Returns false if the message was dropped or the send
+-- queue is backed up, see tcp_client. Hold off until M.isSendBusy() is false.
+-- Sent while handling a command, it goes back to the peer that sent the
+-- command on that peer's open connection. Otherwise it goes to the server.
+function M.send(jsonTagTable, cb, isLowPri)
   
   if M.myip == nil then
     print("Err sending with myip nil")
-    return
+    return false
   end
   
-  local jsonFinal = M.createJsonStrFromJsonTagTable(jsonTagTable)
-  
   if M._tcpClientIp == nil then 
     print("You need to call initTcpSend(ip) first.")
     -- M.initTcpSend(ip)
-    return
+    return false
   end 
   
-  print("Sending TCP to ip:"..M._tcpClientIp..", msg:"..jsonFinal)
-  tcp.send(jsonFinal, function()
+  local ip = M._replyIp or M._tcpClientIp
+  
+  -- don't bother encoding what's just going to get dropped
+  if isLowPri and tcp.isBusy(ip) then
+    return false
+  end
+  
+  local msg
+  if M._isBinSendTo(ip) then
+    -- JsonTag goes in as a table, no JSON encode at either end
+    msg = cayennbin.encode({
+      JsonTag = jsonTagTable,
+      MyDeviceId = "chip:" .. node.chipid() .. "-ip:" .. M.myip,
+    })
+  else
+    msg = M.createJsonStrFromJsonTagTable(jsonTagTable)
+    print("Sending TCP to ip:"..ip..", msg:"..msg)
+  end
+  return tcp.send(msg, function()
     -- print("Yay. Done sending.")
     if cb ~= nil then 
       node.task.post(node.task.MEDIUM_PRIORITY, cb)
     end 
-  end)
+  end, isLowPri, ip)
+end
+
+-- True while the TCP send queue to the server is over its high water mark
+function M.isSendBusy()
+  return tcp.isBusy(M._tcpClientIp)
 end
 
 function M.createJsonStrFromJsonTagTable(jsonTagTable)
@@ -269,16 +332,24 @@ function M.sendUdp(jsonTagTable, cb)
     return
   end
   
-  local jsonFinal = M.createJsonStrFromJsonTagTable(jsonTagTable)
-  
   if M._tcpClientIp == nil then 
     print("You need to call initTcpSend(ip) first.")
     -- M.initTcpSend(ip)
     return
   end 
   
-  print("Sending UDP to ip: " .. M._tcpClientIp .. ", msg: " .. jsonFinal)
-  M.udpsock:send(M.port, M._tcpClientIp, jsonFinal)
+  local msg
+  if M._isBinSendTo(M._tcpClientIp) then
+    -- same binary frame as send(), one frame per datagram
+    msg = cayennbin.encode({
+      JsonTag = jsonTagTable,
+      MyDeviceId = "chip:" .. node.chipid() .. "-ip:" .. M.myip,
+    })
+  else
+    msg = M.createJsonStrFromJsonTagTable(jsonTagTable)
+    print("Sending UDP to ip: " .. M._tcpClientIp .. ", msg: " .. msg)
+  end
+  M.udpsock:send(M.port, M._tcpClientIp, msg)
   
   if cb ~= nil then 
     node.task.post(node.task.MEDIUM_PRIORITY, cb)
@@ -347,6 +418,12 @@ function M.onUdpConnection(sck)
 end
 
 function M.onUdpRecv(sck, data, port, ip)
+  -- stamp it before anything else for clock sync
+  local rxUs = timesync.now()
+  if string.find(data, '"TimeSync"', 1, true) ~= nil and M.onTimeSync(data, ip, rxUs) then
+    return
+  end
+  
   print("UDP Recv " .. data)
   
   print("UDP connection. from IP: " .. ip .. ", from port: " .. port)
@@ -373,6 +450,29 @@ function M.onUdpRecv(sck, data, port, ip)
   end
 end
 
+-- Answer a sync request or take in an answer. Kept off the print and
+-- listener path so the timestamps stay tight. Returns true if it was one.
+function M.onTimeSync(data, ip, rxUs)
+  local succ, tbl = pcall(json.decode, data)
+  if not succ or type(tbl) ~= "table" then return false end
+  if tbl.Cmd == "TimeSync" then
+    M.udpsock:send(M.port, ip, timesync.onRequest(tbl, rxUs))
+    return true
+  elseif tbl.Resp == "TimeSync" then
+    timesync.onResponse(tbl, rxUs)
+    return true
+  end
+  return false
+end
+
+-- Follow the clock of the board at ip, i.e. the one told SetAsMaster
+function M.syncClock(ip)
+  timesync.init({
+    send = function(toIp, str) M.udpsock:send(M.port, toIp, str) end,
+  })
+  timesync.start(ip)
+end
+
 -- this property and method let an external object attach a
 -- listener to the incoming UDP cmd
 M.listenerOnIncomingUdpCmd = nil
@@ -394,7 +494,51 @@ function M.initTcpServer()
 end
 
 function M.onTcpListen(conn)
-  conn:on("receive", M.onTcpRecv)
+  -- The first byte a connection sends tells us if it's binary
+  -- frames or JSON. Frames get a decoder of their own so they can
+  -- come split or coalesced however TCP likes.
+  local dec = nil
+  -- open our connection back to this peer now, while its command is
+  -- still on the way, so the response doesn't wait on a handshake
+  local peerPort, peerIp = conn:getpeer()
+  if M._tcpClientIp ~= nil and peerIp ~= nil then
+    tcp.addPeer(peerIp)
+  end
+  local isFirst = true
+  conn:on("receive", function(sck, data)
+    local isBin = dec == nil and M.isBinAvail and string.byte(data, 1) == 0xCA
+    if isFirst then
+      -- answer this peer in the framing it sends us
+      isFirst = false
+      if peerIp ~= nil then M._isBinPeer[peerIp] = isBin end
+    end
+    if isBin then
+      dec = cayennbin.createDecoder({
+        cb = function(tbl) M.onTcpFrame(sck, tbl) end,
+        maxFrame = M.maxFrame,
+      })
+    end
+    if dec ~= nil then
+      dec:write(data)
+    else
+      M.onTcpRecv(sck, data)
+    end
+  end)
+  conn:on("disconnection", function()
+    if dec ~= nil then
+      dec:unregister()
+      dec = nil
+    end
+  end)
+end
+
+-- A binary frame decoded into a table
+function M.onTcpFrame(sck, tbl)
+  if M.listenerOnIncomingCmd and type(tbl) == "table" then
+    local peerPort, peerIp = sck:getpeer()
+    tbl.peerIp = peerIp
+    M._dispatchFromPeer(peerIp, tbl)
+  end
 end
 
 function M.onTcpConnection(sck)
@@ -422,7 +566,7 @@ function M.onTcpRecv(sck, data)
       end
       
     end
-    M.listenerOnIncomingCmd(data)
+    M._dispatchFromPeer(peerIp, data)
   end
 end
 
@@ -0,0 +1,112 @@
+-- Command dispatcher
+-- Gives you cayennbin.createDispatcher() if the firmware has the
+-- cayennbin module, and otherwise a Lua table that does the same job
+-- with the same methods, so main files don't need to care which.
+-- The C one hashes names in C and takes CmdId. The Lua one looks the
+-- Cmd up in a table, which is still one lookup rather than an if/elseif
+-- chain, and takes CmdId too.
+--
+-- To use:
+-- cmddispatch = require("cmddispatch_v1")
+-- disp = cmddispatch.create({
+--   maxCmds = 64,
+--   fallback = function(payload) print("Unsupported cmd") end,
+-- })
+-- disp:register("JogFreq", function(payload, id) ctrl.jog.setfreq(payload.Freq) end)
+-- disp:dispatch(payload)
+
+local m = {}
+-- m = {}
+
+local Disp = {}
+Disp.__index = Disp
+
+-- opts same as cayennbin.createDispatcher() { maxCmds = 64, fallback = fn, isDebug = false }
+-- isLua = true gets you the Lua one even with cayennbin there
+function m.create(opts)
+  opts = opts or {}
+  if cayennbin ~= nil and not opts.isLua then
+    return cayennbin.createDispatcher({
+      maxCmds = opts.maxCmds,
+      fallback = opts.fallback,
+      isDebug = opts.isDebug,
+    })
+  end
+  return m.createLua(opts)
+end
+
+function m.createLua(opts)
+  local d = setmetatable({}, Disp)
+  d.maxCmds = opts.maxCmds or 64
+  d.fallback = opts.fallback
+  d.isDebug = opts.isDebug or false
+  d._ids = {} -- [name] = id
+  d._fns = {} -- [id] = fn
+  d._cnt = 0
+  d._calls = 0
+  d._misses = 0
+  return d
+end
+
+-- Same name again swaps the fn and keeps the id
+function Disp:register(name, fn)
+  if type(name) ~= "string" or #name == 0 or #name > 255 then error("Command name must be 1 to 255 chars") end
+  if type(fn) ~= "function" then error("Need a function for " .. name) end
+  local id = self._ids[name]
+  if id == nil then
+    if self._cnt >= self.maxCmds then error("Dispatcher is full at " .. self.maxCmds .. " cmds") end
+    self._cnt = self._cnt + 1
+    id = self._cnt
+    self._ids[name] = id
+  end
+  self._fns[id] = fn
+  return id
+end
+
+function Disp:getId(name)
+  return self._ids[name]
+end
+
+function Disp:getCmds()
+  local tbl = {}
+  for name, id in pairs(self._ids) do tbl[name] = id end
+  return tbl
+end
+
+-- Returns true if a handler or the fallback took it
+function Disp:dispatch(payload)
+  self._calls = self._calls + 1
+  local id = nil
+  if type(payload.CmdId) == "number" then
+    id = payload.CmdId
+  elseif type(payload.Cmd) == "string" then
+    id = self._ids[payload.Cmd]
+  end
+  local fn = id and self._fns[id]
+  if self.isDebug then print("dispatch " .. tostring(payload.Cmd) .. " id " .. tostring(id)) end
+  if fn ~= nil then
+    local ok, err = pcall(fn, payload, id)
+    if not ok then print("Err running cmd " .. id .. ": " .. tostring(err)) end
+    return true
+  end
+  self._misses = self._misses + 1
+  if self.fallback ~= nil then
+    local ok, err = pcall(self.fallback, payload)
+    if not ok then print("Err running fallback: " .. tostring(err)) end
+    return true
+  end
+  return false
+end
+
+function Disp:stats()
+  return self._calls, self._misses
+end
+
+function Disp:unregister()
+  self._ids = {}
+  self._fns = {}
+  self._cnt = 0
+  self.fallback = nil
+end
+
+return m
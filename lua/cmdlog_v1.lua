@@ -0,0 +1,407 @@
+-- Command log
+-- An append only file of records for the command queue and recorded
+-- gcode. Appending a JSON line meant opening, writing and closing the
+-- file for every command, which is slow on SPIFFS and wears the flash,
+-- and a power loss mid write left half a line that got silently skipped.
+--
+-- The file starts with "CLG" and a version byte, then records:
+--   u16 len | u8 type | payload (len bytes) | u32 crc32
+-- all little endian, crc32 over len, type and payload. The payload is
+-- the command as a cayennbin frame (type 2) or JSON (type 1).
+--
+-- Appends are held in RAM and written together once flushBytes have
+-- built up or flushMs after the first one, whichever is first. That's
+-- one write per group of commands instead of an open/write/close each.
+--
+-- Opening the log checks every record. At the first one that's short or
+-- fails its crc, i.e. the write that was cut off by a power loss, the
+-- file is cut back to the last good record so new appends go after it.
+--
+-- compact() rewrites the log with only the records you keep.
+--
+-- Without the cayennbin module in the firmware, records are JSON and
+-- the crc32 is worked out in Lua, which is slower but the same crc.
+-- Binary records already in a log can't be decoded then.
+--
+-- To use:
+-- cmdlog = require("cmdlog_v1")
+-- log = cmdlog.open("gcode.log")
+-- log:append({Step=100, Fr=200, Acc=50})
+-- log:rewind()
+-- local cmd = log:next() -- nil at the end
+
+local m = {}
+-- m = {}
+
+m.TYPE_JSON = 1
+m.TYPE_BIN = 2
+m.HDR = "CLG\1"
+m.REC_HDR_LEN = 3 -- len and type
+m.REC_CRC_LEN = 4
+m.MAX_PAYLOAD = 1024 -- biggest command we log, and the decoder buffer
+
+m.flushBytes = 512 -- default group commit size
+m.flushMs = 200 -- default longest an append waits in RAM
+
+local Log = {}
+Log.__index = Log
+
+local function u16(n)
+  return string.char(n % 256, math.floor(n / 256) % 256)
+end
+
+local function u32(n)
+  return string.char(n % 256, math.floor(n / 256) % 256, math.floor(n / 65536) % 256, math.floor(n / 16777216) % 256)
+end
+
+local function getU32(s, i)
+  local b1, b2, b3, b4 = string.byte(s, i, i + 3)
+  return b1 + b2 * 256 + b3 * 65536 + b4 * 16777216
+end
+
+-- crc32 in Lua for when there's no cayennbin. No bit ops in Lua 5.1,
+-- so bytes are xor'd a nibble at a time from a 16x16 table.
+local _xor4 = nil
+local _crcTbl = nil
+
+local function xor8(a, b)
+  local al, bl = a % 16, b % 16
+  return _xor4[(a - al) / 16 * 16 + (b - bl) / 16] * 16 + _xor4[al * 16 + bl]
+end
+
+local function xor32(a, b)
+  local r, p = 0, 1
+  for i = 1, 4 do
+    local ab, bb = a % 256, b % 256
+    r = r + xor8(ab, bb) * p
+    a, b, p = (a - ab) / 256, (b - bb) / 256, p * 256
+  end
+  return r
+end
+
+local function crcInit()
+  _xor4 = {}
+  for a = 0, 15 do
+    for b = 0, 15 do
+      local r, p, x, y = 0, 1, a, b
+      for i = 1, 4 do
+        if x % 2 ~= y % 2 then r = r + p end
+        x, y, p = math.floor(x / 2), math.floor(y / 2), p * 2
+      end
+      _xor4[a * 16 + b] = r
+    end
+  end
+  _crcTbl = {}
+  for n = 0, 255 do
+    local c = n
+    for k = 1, 8 do
+      if c % 2 == 1 then
+        c = xor32((c - 1) / 2, 0xEDB88320)
+      else
+        c = c / 2
+      end
+    end
+    _crcTbl[n] = c
+  end
+end
+
+function m.crc32Lua(s, crc)
+  if _crcTbl == nil then crcInit() end
+  crc = 0xFFFFFFFF - (crc or 0)
+  for i = 1, #s do
+    local lo = crc % 256
+    crc = xor32(_crcTbl[xor8(lo, string.byte(s, i))], (crc - lo) / 256)
+  end
+  return 0xFFFFFFFF - crc
+end
+
+-- zlib's crc32, continuing from crc if given
+function m.crc32(s, crc)
+  if cayennbin ~= nil then return cayennbin.crc32(s, crc) end
+  return m.crc32Lua(s, crc)
+end
+
+-- One record as it goes in the file
+function m.encodeRecord(typ, payload)
+  if #payload > m.MAX_PAYLOAD then
+    error("Record payload of " .. #payload .. " bytes is over " .. m.MAX_PAYLOAD)
+  end
+  local hdr = u16(#payload) .. string.char(typ)
+  return hdr .. payload .. u32(m.crc32(payload, m.crc32(hdr)))
+end
+
+-- Payload of a record to a table
+local _decoded = nil
+local _dec = nil
+function m.decodePayload(typ, payload)
+  if typ == m.TYPE_BIN then
+    if cayennbin == nil then return nil end
+    if _dec == nil then
+      _dec = cayennbin.createDecoder({
+        cb = function(tbl) _decoded = tbl end,
+        maxFrame = m.MAX_PAYLOAD,
+        maxValues = 128,
+      })
+    end
+    _decoded = nil
+    _dec:reset()
+    _dec:write(payload)
+    return _decoded
+  elseif typ == m.TYPE_JSON then
+    local ok, tbl = pcall(sjson.decode, payload)
+    if ok then return tbl end
+  end
+  return nil
+end
+
+-- Open a log, creating it if it's not there, and cut off a torn tail.
+-- opts { flushBytes = 512, flushMs = 200, isJson = false }
+function m.open(name, opts)
+  local log = setmetatable({}, Log)
+  log.name = name
+  log.flushBytes = m.flushBytes
+  log.flushMs = m.flushMs
+  log.isJson = cayennbin == nil -- store JSON rather than cayennbin frames
+  if opts ~= nil then
+    if opts.flushBytes ~= nil then log.flushBytes = opts.flushBytes end
+    if opts.flushMs ~= nil then log.flushMs = opts.flushMs end
+    if opts.isJson ~= nil then log.isJson = opts.isJson end
+  end
+  log._buf = {} -- encoded records waiting for the group commit
+  log._bufLen = 0
+  log._wfd = nil -- kept open for appends
+  log._rfd = nil -- kept open for reads
+  log._readOff = #m.HDR
+  log._tmr = nil
+  log.size = 0 -- bytes on flash, header included
+  log.records = 0 -- good records on flash
+  log.truncated = 0 -- bytes cut off the tail when it was opened
+  log:recover()
+  return log
+end
+
+-- Check every record and cut the file back to the last good one
+function Log:recover()
+  self:close()
+  if not file.exists(self.name) then
+    local fd = file.open(self.name, "w+")
+    if fd == nil then error("Could not create " .. self.name) end
+    fd:write(m.HDR)
+    fd:close()
+    self.size = #m.HDR
+    self.records = 0
+    return
+  end
+
+  local fd = file.open(self.name, "r")
+  if fd == nil then error("Could not open " .. self.name) end
+  local fileLen = fd:seek("end")
+  fd:seek("set", 0)
+  local hdr = fd:read(#m.HDR)
+  local good = #m.HDR
+  local cnt = 0
+  if hdr ~= m.HDR then
+    -- not a log, or the header itself got torn. start over.
+    good = 0
+  else
+    while true do
+      local typ, payload, nextOff = self:_readRecord(fd, good)
+      if typ == nil then break end
+      good = nextOff
+      cnt = cnt + 1
+    end
+  end
+  fd:close()
+
+  self.records = cnt
+  if good == fileLen then
+    self.size = good
+    return
+  end
+
+  -- torn tail. copy the good part over and swap it in, since there's no truncate
+  print("cmdlog " .. self.name .. " cutting " .. (fileLen - good) .. " bytes of torn tail")
+  self.truncated = fileLen - good
+  local tmp = self.name .. ".tmp"
+  file.remove(tmp)
+  local src = file.open(self.name, "r")
+  local dst = file.open(tmp, "w+")
+  if good == 0 then
+    dst:write(m.HDR)
+    good = #m.HDR
+  else
+    local left = good
+    while left > 0 do
+      local chunk = src:read(math.min(left, 1024))
+      if chunk == nil then break end
+      dst:write(chunk)
+      left = left - #chunk
+    end
+  end
+  src:close()
+  dst:close()
+  file.remove(self.name)
+  file.rename(tmp, self.name)
+  self.size = good
+end
+
+-- Read and check the record at off. Returns type, payload and the next
+-- record's offset, or nil if it's past the end, short or fails its crc.
+function Log:_readRecord(fd, off)
+  fd:seek("set", off)
+  local hdr = fd:read(m.REC_HDR_LEN)
+  if hdr == nil or #hdr < m.REC_HDR_LEN then return nil end
+  local b1, b2, typ = string.byte(hdr, 1, 3)
+  local len = b1 + b2 * 256
+  -- append() never writes one this big, so it's a torn or garbage header
+  if len > m.MAX_PAYLOAD then return nil end
+  local rest = fd:read(len + m.REC_CRC_LEN)
+  if rest == nil or #rest < len + m.REC_CRC_LEN then return nil end
+  local payload = string.sub(rest, 1, len)
+  local crc = m.crc32(payload, m.crc32(hdr))
+  if crc ~= getU32(rest, len + 1) then return nil end
+  return typ, payload, off + m.REC_HDR_LEN + len + m.REC_CRC_LEN
+end
+
+-- Queue a command. Returns the offset its record will be at, for readAt().
+function Log:append(tbl)
+  local rec
+  if self.isJson or type(tbl) == "string" or cayennbin == nil then
+    if type(tbl) ~= "string" then tbl = sjson.encode(tbl) end
+    rec = m.encodeRecord(m.TYPE_JSON, tbl)
+  else
+    rec = m.encodeRecord(m.TYPE_BIN, cayennbin.encode(tbl))
+  end
+  local off = self.size + self._bufLen
+  table.insert(self._buf, rec)
+  self._bufLen = self._bufLen + #rec
+
+  if self._bufLen >= self.flushBytes then
+    self:flush()
+  elseif self._tmr == nil and self.flushMs > 0 then
+    self._tmr = tmr.create()
+    self._tmr:alarm(self.flushMs, tmr.ALARM_SINGLE, function() self._tmr = nil; self:flush() end)
+  elseif self.flushMs <= 0 then
+    self:flush()
+  end
+  return off
+end
+
+-- Write what's waiting in RAM to flash now
+function Log:flush()
+  if self._tmr ~= nil then
+    self._tmr:unregister()
+    self._tmr = nil
+  end
+  if self._bufLen == 0 then return end
+  if self._wfd == nil then
+    self._wfd = file.open(self.name, "a+")
+    if self._wfd == nil then
+      print("Err opening " .. self.name .. " for append")
+      return
+    end
+  end
+  self._wfd:write(table.concat(self._buf))
+  self._wfd:flush()
+  self.size = self.size + self._bufLen
+  self.records = self.records + #self._buf
+  self._buf = {}
+  self._bufLen = 0
+  -- the read handle may not see the new end
+  if self._rfd ~= nil then
+    self._rfd:close()
+    self._rfd = nil
+  end
+end
+
+-- The command at off, and the offset of the one after it. nil if there
+-- isn't a good record there.
+function Log:readAt(off)
+  if off >= self.size then
+    -- it may still be waiting in RAM
+    if off < self.size + self._bufLen then
+      self:flush()
+    else
+      return nil
+    end
+  end
+  if self._rfd == nil then
+    self._rfd = file.open(self.name, "r")
+    if self._rfd == nil then return nil end
+  end
+  local typ, payload, nextOff = self:_readRecord(self._rfd, off)
+  if typ == nil then return nil end
+  return m.decodePayload(typ, payload), nextOff
+end
+
+-- Start next() over from the first record
+function Log:rewind()
+  self._readOff = #m.HDR
+end
+
+-- The next command, or nil at the end
+function Log:next()
+  local tbl, nextOff = self:readAt(self._readOff)
+  if nextOff == nil then return nil end
+  self._readOff = nextOff
+  return tbl
+end
+
+-- Empty the log
+function Log:wipe()
+  self._buf = {}
+  self._bufLen = 0
+  self:close()
+  file.remove(self.name)
+  self.truncated = 0
+  self:recover()
+  self:rewind()
+end
+
+-- Rewrite the log with only the records keepFn(tbl) says to keep, or
+-- every good one if there's no keepFn. Not for while commands are
+-- streaming in, since it reads the whole log. Returns kept, dropped.
+function Log:compact(keepFn)
+  self:flush()
+  self:close()
+  local tmp = self.name .. ".tmp"
+  file.remove(tmp)
+  local src = file.open(self.name, "r")
+  local dst = file.open(tmp, "w+")
+  dst:write(m.HDR)
+  local off = #m.HDR
+  local size = #m.HDR
+  local kept, dropped = 0, 0
+  while true do
+    local typ, payload, nextOff = self:_readRecord(src, off)
+    if typ == nil then break end
+    if keepFn == nil or keepFn(m.decodePayload(typ, payload)) then
+      local rec = m.encodeRecord(typ, payload)
+      dst:write(rec)
+      size = size + #rec
+      kept = kept + 1
+    else
+      dropped = dropped + 1
+    end
+    off = nextOff
+  end
+  src:close()
+  dst:close()
+  file.remove(self.name)
+  file.rename(tmp, self.name)
+  self.size = size
+  self.records = kept
+  self:rewind()
+  return kept, dropped
+end
+
+-- Flush and let go of the file handles
+function Log:close()
+  if self._bufLen > 0 then self:flush() end
+  if self._wfd ~= nil then self._wfd:close() end
+  if self._rfd ~= nil then self._rfd:close() end
+  self._wfd = nil
+  self._rfd = nil
+end
+
+return m
@@ -14,7 +14,8 @@ cmds = {
   "Receipt {DeviceId,Ctr}",
   "Home",
   "GcodePlay", "GcodeStop", "GcodePlayStopToggle", "GcodeWipe", "GcodeRecord",
-  "Gcode {Step,Fr,Acc}",
+  "Gcode {Step,Fr,Acc}", "GcodeAt {Step,Fr,Acc,At}",
+  "SyncClock {MasterIp}", "GetClock",
   "Restart",
   "LedFill {r,g,b}", "LedPulse {r,g,b}",
   -- 'SetAValue {Hz,Duty} (Max Hz:1000, Max Duty:1023)',
@@ -61,6 +62,48 @@ function Gcode(payload)
   ctrl.gcodeRunOneMove(payload)
 end
 
+-- Same as Gcode but the move starts at At, microseconds on the master's
+-- clock, so boards synced with SyncClock all start it together. Get At
+-- from GetClock's Now plus enough lead for the command to reach everyone.
+-- rmttx startAt() only takes a start up to 60 secs ahead.
+gcodeAtMaxLeadUs = 60 * 1000 * 1000
+function GcodeAt(payload)
+  local ts = cayenn.timesync
+  if not ts.isSynced() and not isMaster then
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Clock not synced"})
+    return
+  end
+  if type(payload.At) ~= "number" then
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Missing At"})
+    return
+  end
+  payload.StartUs = ts.toLocal(payload.At)
+  local leadUs = payload.StartUs - ts.now()
+  if leadUs < 0 then
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Start time already passed", ["LateUs"] = -leadUs})
+    return
+  end
+  if leadUs > gcodeAtMaxLeadUs then
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Start time more than 60 secs away", ["LeadUs"] = leadUs})
+    return
+  end
+  cayenn.send({["TransId"] = payload.TransId, Step=payload.Step, At=payload.At, ["Resp"] = payload.Cmd})
+  ctrl.gcodeRunOneMove(payload)
+end
+
+-- Follow the master board's clock. It should be the one told SetAsMaster.
+function SyncClock(payload)
+  cayenn.syncClock(payload.MasterIp)
+  cayenn.send({["TransId"] = payload.TransId, MasterIp=payload.MasterIp, ["Resp"] = payload.Cmd})
+end
+
+function GetClock(payload)
+  local resp = cayenn.timesync.getStatus()
+  resp.TransId = payload.TransId
+  resp.Resp = payload.Cmd
+  cayenn.send(resp)
+end
+
 function Home(payload)
   cayenn.send({["TransId"] = payload.TransId, ["Desc"] = "Running homing routine", ["Resp"] = payload.Cmd})
   ctrl.homing.home()
@@ -100,7 +143,7 @@ function JogStart(payload)
     desc = "Jogging not allowed right now. State:"..state.State
   end
   cayenn.send({["TransId"] = payload.TransId, ["Desc"] = desc, ["Resp"] = payload.Cmd})
-  ctrl.led.pulse(100,0,0)
+  ctrl.led.pulse(167,0,0)
   stat.start() -- start sending position updates
 end
 
@@ -117,7 +160,7 @@ function JogStop(payload)
   cayenn.send({["TransId"] = payload.TransId, ["Desc"] = desc, ["Resp"] = payload.Cmd})
   -- stat.stop() -- stop sending position updates
   -- stat.send()
-  ctrl.led.pulse(0,0,55)
+  ctrl.led.pulse(0,0,127)
 end
 
 function JogFreq(payload)
@@ -140,7 +183,7 @@ function StatusGet(payload)
   tbl.TransId = payload.TransId
   tbl.Resp = payload.Cmd 
   cayenn.send(tbl)
-  ctrl.led.fill(0,10,0)
+  ctrl.led.fill(0,59,0)
 end
 
 function StatusStart(payload)
@@ -149,22 +192,24 @@ function StatusStart(payload)
     desc = "Status loop already running"
   end
   cayenn.send({["TransId"] = payload.TransId, ["Desc"] = desc, ["Resp"] = payload.Cmd})
-  ctrl.led.fill(0,10,0)
+  ctrl.led.fill(0,59,0)
 end
 
 function StatusStop(payload)
   stat.stop()
   cayenn.send({["TransId"] = payload.TransId, ["Desc"] = "Stopped status loop", ["Resp"] = payload.Cmd})
-  ctrl.led.fill(0,10,0)
+  ctrl.led.fill(0,59,0)
 end
 
 function GetCmds(payload)
   local resp = {}
   resp.Resp = "GetCmds"
   resp.Cmds = cmds
+  -- ids a server can send as CmdId instead of the Cmd name
+  resp.CmdIds = disp:getCmds()
   resp.TransId = payload.TransId
   cayenn.send(resp)
-  ctrl.led.fill(0,10,10)
+  ctrl.led.fill(0,59,59)
 end
 
 function DirToggle(payload)
@@ -1,99 +1,145 @@
 -- Record Gcode and play it back
+-- Recorded moves go in a cmdlog_v1 log, so a burst of them is one write
+-- to flash instead of an open/write/close each, and a power cut while
+-- recording only loses the move that was being written.
+--
+-- Playback reads ahead. The next prefetchCount moves are kept decoded in
+-- RAM, topped up one move per low priority task while the current move
+-- runs, so getNext() after a move finishes is a table lookup and not a
+-- SPIFFS read and decode sitting between two moves.
 
 local m = {}
 -- m = {}
 
-m.fileName = "gcode.txt"
+m.fileName = "gcode.log"
+m.oldFileName = "gcode.txt" -- one JSON line per move, from before the log
+m.prefetchCount = 4 -- moves kept decoded ahead of playback
 
-m._isFileAppend = false
-m._isFileRead = false
+m.cmdlog = require("cmdlog_v1")
+m._log = nil
 
-function m.init()
+m._ahead = {} -- decoded moves waiting, by slot
+m._head = 1 -- slot getNext() takes from
+m._tail = 1 -- slot the next prefetched move goes in
+m._isEof = false -- prefetch hit the end of the log
+m._isFilling = false -- a refill task is posted
+m._gen = 0 -- bumped on rewind/wipe so a stale refill task does nothing
+
+m.stats = { hits = 0, misses = 0 }
+
+function m.init(tbl)
   
-  -- m.wipe()
-  m.openAppend()
+  if tbl ~= nil then
+    if tbl.prefetchCount ~= nil then m.prefetchCount = tbl.prefetchCount end
+  end
+  local isNew = not file.exists(m.fileName)
+  m._log = m.cmdlog.open(m.fileName)
+  if isNew and file.exists(m.oldFileName) then
+    m.importOld()
+  end
+  print("Initted Gcode file save/retrieve. Moves:", m._log.records)
   
 end
 
-function m.openAppend()
-  if m._isFileAppend then return end
-  
-  if m._isFileRead then
-    -- need to close file so we can re-open for append
-    m.close()
+-- Move a gcode.txt from before the log into gcode.log, in the same order
+function m.importOld()
+  local fd = file.open(m.oldFileName, "r")
+  if fd then
+    while true do
+      local line = fd:readline()
+      if line == nil then break end
+      local ok, obj = pcall(sjson.decode, line)
+      if ok and type(obj) == "table" then
+        m._log:append(obj)
+      end
+    end
+    fd:close()
   end
+  m._log:flush()
+  file.remove(m.oldFileName)
+end
 
-  if file.open(m.fileName, "a") then
-    print("Apppending")
-    m._isFileAppend = true
-  else
-    print("Err opening file")
-  end
-  
-  print("Initted Gcode file save/retrieve")
-  
+-- Kept for callers from before the log. Appends need no open.
+function m.openAppend()
 end
 
+-- Start playing back from the first move, and start reading ahead
 function m.openRead()
-  if m._isFileRead then return end
-  
-  if file.open(m.fileName, "r") then
-    print("Reading")
-    m._isFileRead = true
-  else
-    print("Err opening file")
-  end
-  
+  m._log:rewind()
+  m._resetAhead()
+  m._startFill()
 end
 
+-- Get what's been recorded onto flash
 function m.close()
-  file.close()
-  m._isFileAppend = false
-  m._isFileRead = false
+  m._log:flush()
 end
 
 function m.write(line)
-  
-  if type(line) == "table" then
-    line = sjson.encode(line)
-  end
-  
-  m.openAppend()
-  file.writeline(line)
-  m.close()
+  m._log:append(line)
+  -- there's more to read now
+  m._isEof = false
 end
 
 function m.wipe()
-  file.open(m.fileName, "w+")
-  file.close()
-  m._isFileAppend = false
+  m._log:wipe()
+  m._resetAhead()
 end
 
 function m.getNext()
-  -- get the next line in the file
-  if m._isFileAppend then
-    -- we are in writing mode. need to seek back to start of file
-    m.close()
-    m.openRead()
-  end
-  
-  local line = file.readline()
-  print("line:", line)
-  local obj = nil
-  local err, msg
-  if line ~= nil then
-    isSuccess, obj = pcall(sjson.decode, line)
-    if isSuccess then
-      -- print("Good parse")
-    else
-      print("Got err parsing json. msg:", obj)
-      obj = nil
-    end
+  -- get the next move, from what's read ahead if it got there first
+  local obj
+  if m._head < m._tail then
+    obj = m._ahead[m._head]
+    m._ahead[m._head] = nil
+    m._head = m._head + 1
+    m.stats.hits = m.stats.hits + 1
+  else
+    obj = m._log:next()
+    if obj ~= nil then m.stats.misses = m.stats.misses + 1 end
   end
+  m._startFill()
   -- print("obj:", obj)
   return obj
 end
 
+-- How many moves are read ahead right now
+function m.getAheadCount()
+  return m._tail - m._head
+end
+
+function m._resetAhead()
+  m._ahead = {}
+  m._head = 1
+  m._tail = 1
+  m._isEof = false
+  m._gen = m._gen + 1
+end
+
+function m._startFill()
+  if m._isFilling or m._isEof then return end
+  if m._tail - m._head >= m.prefetchCount then return end
+  m._isFilling = true
+  local gen = m._gen
+  node.task.post(node.task.LOW_PRIORITY, function() m._fill(gen) end)
+end
+
+-- Read one move ahead, then post again until we're prefetchCount ahead.
+-- One per task so a move done callback never waits behind a long read.
+function m._fill(gen)
+  m._isFilling = false
+  if gen ~= m._gen then return end
+  if m._tail - m._head >= m.prefetchCount then return end
+  local obj = m._log:next()
+  if obj == nil then
+    m._isEof = true
+    return
+  end
+  m._ahead[m._tail] = obj
+  m._tail = m._tail + 1
+  m._startFill()
+end
+
 -- m.init()
 -- -- m.write('x')
 -- m.write('{"step":100, "fr":200, "acc":50}')
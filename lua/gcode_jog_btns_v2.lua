@@ -164,12 +164,28 @@ function m.getState()
   return state
 end
 
+-- Just the State string of getState(), without building the table.
+-- For things like telemetry that read it every tick.
+function m.getStateName()
+  if m._isGcodePlaying then return "GcodePlaying" end
+  if m.homing.getState() ~= "" then return "Homing" end
+  if m.jog._isPaused == false then return "Jogging" end
+  return "Idle"
+end
+
+-- Just the Freq of getState(), nil when idle
+function m.getFreq()
+  if m._isGcodePlaying then return m.gcode.rmtstep.getSpeed() end
+  if m.homing.getState() ~= "" or m.jog._isPaused == false then return m.jog.getFreq() end
+  return nil
+end
+
 function m.onHomingStep(homeStep)
   m.printCoords()
   print("Home step:", homeStep)
   
   if homeStep == "done" then
-    m.led.blink(0,0,255, 30,0,30)
+    m.led.blink(0,0,255, 96,0,96)
     -- m.sendStat()
    
     -- Now that we are done homing, we have to ZeroOut everything
@@ -180,7 +196,7 @@ function m.onHomingStep(homeStep)
     m.printCoords()
   
   else
-    m.led.blink(0,0,40, 0,0,10)
+    m.led.blink(0,0,110, 0,0,59)
     -- m.sendStat(true) -- as udp (non-guaranteed)
   end
 end
@@ -259,7 +275,7 @@ end
 
 function m.recordGcode()
   -- blink green to indicate record
-  m.led.blink(255,255,0, 30,0,30)
+  m.led.blink(255,255,0, 96,0,96)
   
   local gcode = {
     Step=m.pcnt.getMachineCoords(),
@@ -273,7 +289,7 @@ end
 
 function m.wipeGcode()
   -- go red to indicate wipe
-  m.led.blink(255,0,0, 30,0,30)
+  m.led.blink(255,0,0, 96,0,96)
   m.file.wipe()
   print("Wiped Gcode")
 end
@@ -328,7 +344,7 @@ function m.gcodePlay()
   m._isAskedForStop = false
   
   -- show green on led as playing gcode
-  m.led.blink(0,255,0, 0,100,0)
+  m.led.blink(0,255,0, 0,167,0)
   
   -- make sure jogging is off and rebind gcode lib
   m.jog.stop()
@@ -338,7 +354,9 @@ function m.gcodePlay()
   -- get callback of onGcodeMoveDone() when line done playing
   -- so we can get next
   m.file.close()
-  m.file.openRead()
+  -- a single move from the network doesn't read the file, so don't
+  -- rewind it and start reading ahead for nothing
+  if not m._isNonFileMove then m.file.openRead() end
   local qItem = m.gcodeGetNext() --m.file.getNext()
   if qItem ~= nil then
     -- we have a line
@@ -361,7 +379,7 @@ function m.gcodeStop()
   m.motor.disable()
   
   -- go purple bright, then purple dim
-  m.led.blink(255,0,255, 30,0,30)
+  m.led.blink(255,0,255, 96,0,96)
   
   -- unbind gcode lib RMT hardware from pinStep
   -- rebind jogging LEDC pwm generator to pinStep
@@ -372,7 +390,7 @@ end
 
 function m.onGcodeMoveDone()
   print("Got onGcodeMoveDone")
-  m.led.blink(0,30,0, 0,100,0)
+  m.led.blink(0,96,0, 0,167,0)
   m.printCoords()
   m.sendStat()
   
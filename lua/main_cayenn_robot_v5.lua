@@ -47,6 +47,17 @@ servers = {}
 -- for each command so we know we can send the signal for the next cmd 
 isMaster = false
 
+-- Commands are looked up in C by a hashed id that's handed out when
+-- they register, instead of searching _G and then an if/elseif chain
+-- of string compares. Without the cayennbin module in the firmware
+-- it's a Lua table lookup instead. Turn on isDebug to log each one.
+cmddispatch = require("cmddispatch_v1")
+disp = cmddispatch.create({
+  maxCmds = 64,
+  fallback = function(payload) onOtherCmd(payload) end,
+  isDebug = false,
+})
+
 -- This is called when an incoming cmd comes in
 -- from the network, i.e. from SPJS. These are TCP commands so
 -- they are guaranteed to come in (vs UDP which could drop and has
@@ -54,123 +65,143 @@ isMaster = false
 function onCmd(payload)
   
   if (type(payload) == "table") then
-    
-    if payload.Cmd ~= nil then
-      print("Got incoming Cayenn cmd: " .. payload.Cmd .. ", JSON: " .. json.encode(payload))
-      -- see if we have a function to handle this. _G has all global functions in it
-      if _G[payload.Cmd] then
-        _G[payload.Cmd](payload)
-        -- print("Handled by global func")
-        return
-      end
-    else 
-      print("Got incoming Cayenn with no cmd. JSON: " .. json.encode(payload))
-    end 
-    
-    -- These are your custom commands you are implementing
-    -- for this Cayenn device
-    if payload.Cmd == "SetAsMaster" then
-      -- If we are master, we have to get a "Play" command,
-      -- a "Pause" command, and a "Stop" command.
-    
-    elseif payload.Cmd == "Restart" then
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
-      node.restart()
-    elseif payload.Cmd == "TestStart" then
-    
-      -- Start loop on stepper 
-      ctrl.jog.testStart()
-      -- cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Hz"] = payload.Hz, ["Duty"] = actualDuty})
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
-      print("Started loop test on stepper")
+    disp:dispatch(payload)
+  else
+    -- If we are sent Cayenn commands that aren't JSON, they
+    -- will get here. However, JSON should always be used.
+    -- print("is string")
+    -- print("Got incoming Cayenn cmd. str: ", payload)
+  end
+  
+end
+
+-- These are your custom commands you are implementing
+-- for this Cayenn device
+disp:register("SetAsMaster", function(payload)
+  -- If we are master, we have to get a "Play" command,
+  -- a "Pause" command, and a "Stop" command.
+end)
+
+disp:register("Restart", function(payload)
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
+  node.restart()
+end)
+
+disp:register("TestStart", function(payload)
+  -- Start loop on stepper 
+  ctrl.jog.testStart()
+  -- cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Hz"] = payload.Hz, ["Duty"] = actualDuty})
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
+  print("Started loop test on stepper")
+end)
+
+disp:register("TestStop", function(payload)
+  ctrl.jog.testStop()
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
+  print("Stopped loop test on stepper")
+end)
+
+-- Below are more standard commands you should always support
+disp:register("ResetCtr", function(payload)
+  -- cnc.resetIdCounter()
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Ctr"] = cnc.getIdCounter()})
+end)
+
+disp:register("GetCtr", function(payload)
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Ctr"] = cnc.getIdCounter()})
+end)
+
+disp:register("GetQ", function(payload)
+  -- this method will send slowly as not to overwhelm
+  -- queue.send(function(t) cayenn.send(t); end, payload.TransId)
+end)
+
+disp:register("WipeQ", function(payload)
+  queue.wipe()
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
+end)
+
+disp:register("CmdQ", function(payload)
+  -- queuing cmd. we must have ID.
+  if payload.Id == nil then
+    -- print("Error queuing command. It must have an ID")
+    return
+  end
+  if payload.RunCmd == nil then
+    -- print("Error queuing command. It must have a RunCmd like RunCmd:{Cmd:AugerOn,Speed:10}.")
+    return
+  end
+  -- wipe the peerIp cuz don't need it
+  payload.peerIp = nil
+  -- print("Queing command")
+  --queue[payload.Id] = payload.RunCmd
+  payload.RunCmd.Id = payload.Id
+  if not queue.add(payload.RunCmd) then
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Id"] = payload.Id, ["Err"] = "Id must be above " .. queue.lastAddId})
+    return
+  end
+  -- print("New queue: " .. cjson.encode(queue))
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Id"] = payload.Id})
+end)
+
+disp:register("Mem", function(payload)
+  cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["MemRemain"] = node.heap()})
+end)
+
+-- Every command in commands_v1's cmds list that has a global function
+-- of the same name, i.e. "JogFreq {Freq}" runs JogFreq(payload). Only
+-- these can be run from the network, not just any global.
+for i, v in ipairs(cmds) do
+  local name = string.match(v, "^(%w+)")
+  if name ~= nil and disp:getId(name) == nil and type(_G[name]) == "function" then
+    disp:register(name, _G[name])
+  end
+end
+
+-- Anything the dispatcher doesn't have a command for
+function onOtherCmd(payload)
+  if payload["Announce"] ~= nil then
+    -- do nothing. 
+    if payload.Announce == "i-am-your-server" then
+      -- store this ip
+      -- so we know what our SPJS server is
       
-    elseif payload.Cmd == "TestStop" then
-    
-      ctrl.jog.testStop()
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
-      print("Stopped loop test on stepper")
-
-    -- Below are more standard commands you should always support
-    elseif payload.Cmd == "ResetCtr" then
-      -- cnc.resetIdCounter()
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Ctr"] = cnc.getIdCounter()})
-    elseif payload.Cmd == "GetCtr" then
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Ctr"] = cnc.getIdCounter()})
-    elseif payload.Cmd == "GetQ" then
-      -- this method will send slowly as not to overwhelm
-      -- queue.send(function(t) cayenn.send(t); end, payload.TransId)
-    elseif payload.Cmd == "WipeQ" then
-      queue.wipe()
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd})
-    elseif payload.Cmd == "CmdQ" then
-      -- queuing cmd. we must have ID.
-      if payload.Id == nil then
-        -- print("Error queuing command. It must have an ID")
-        return
-      end
-      if payload.RunCmd == nil then
-        -- print("Error queuing command. It must have a RunCmd like RunCmd:{Cmd:AugerOn,Speed:10}.")
-        return
+      -- we should get a ServerIp, but should also get peerIp
+      -- see if they are the same. latest nodemcu firmware seems
+      -- to give us a peerIp now.
+      local ip = payload.ServerIp
+      if ip == nil then
+        ip = payload.peerIp
       end
-      -- wipe the peerIp cuz don't need it
-      payload.peerIp = nil
-      -- print("Queing command")
-      --queue[payload.Id] = payload.RunCmd
-      payload.RunCmd.Id = payload.Id
-      queue.add(payload.RunCmd)
-      -- print("New queue: " .. cjson.encode(queue))
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Id"] = payload.Id})
-    elseif payload.Cmd == "Mem" then
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["MemRemain"] = node.heap()})
-    elseif payload["Announce"] ~= nil then
-      -- do nothing. 
-      if payload.Announce == "i-am-your-server" then
-        -- store this ip
-        -- so we know what our SPJS server is
-        
-        -- we should get a ServerIp, but should also get peerIp
-        -- see if they are the same. latest nodemcu firmware seems
-        -- to give us a peerIp now.
-        local ip = payload.ServerIp
-        if ip == nil then
-          ip = payload.peerIp
-        end
-        if ip == nil then
-          print("Err: Did not get ip from server.")
+      if ip == nil then
+        print("Err: Did not get ip from server.")
+      else
+        -- see if in ignore list
+        if (ip == ignoreIp) then
+          print("Got server to ignore: "..ip)
         else
-          -- see if in ignore list
-          if (ip == ignoreIp) then
-            print("Got server to ignore: "..ip)
-          else
+          
+          -- we got a server we want, see if we already
+          -- got this server and initted our TCP connection back 
+          if servers[ip] then 
+            print("We are already connected back to this server.")
+          else 
+            servers[ip] = true
+            print("Got a server:" .. json.encode(servers))
+            -- connect tcp_client back to the server 
+            cayenn.initTcpSend(ip, payload.Framing)
             
-            -- we got a server we want, see if we already
-            -- got this server and initted our TCP connection back 
-            if servers[ip] then 
-              print("We are already connected back to this server.")
-            else 
-              servers[ip] = true
-              print("Got a server:" .. json.encode(servers))
-              -- connect tcp_client back to the server 
-              cayenn.initTcpSend(ip)
-              
-              -- start sending status
-              -- statusStart()
-              ctrl.led.pulse(0,0,80)
-            end
+            -- start sending status
+            -- statusStart()
+            ctrl.led.pulse(0,0,151)
           end
         end
       end
-    else
-      cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Unsupported cmd"})
-      -- print("Got cmd we do not understand. Huh?")
     end
   else
-    -- If we are sent Cayenn commands that aren't JSON, they
-    -- will get here. However, JSON should always be used.
-    -- print("is string")
-    -- print("Got incoming Cayenn cmd. str: ", payload)
+    cayenn.send({["TransId"] = payload.TransId, ["Resp"] = payload.Cmd, ["Err"] = "Unsupported cmd"})
+    -- print("Got cmd we do not understand. Huh?")
   end
-  
 end
 
 -- This callback is called when an incoming UDP broadcast 
@@ -214,7 +245,7 @@ function onConnected()
   -- start sending status
   -- stat.start()
   
-  ctrl.led.pulse(0,80,0)
+  ctrl.led.pulse(0,151,0)
 end
 
 -- Get stat library
@@ -13,6 +13,14 @@ m.pinDir = 0
 -- m.pinPulseInput = 25 -- orig
 m.pinPulseInput = 36 -- v8
 
+-- Pass in on init. The rmttx channel sending the steps so the glitch
+-- filter can follow the step rate. rmttx_stepper_v3 uses channel 0.
+m.rmtChannel = 0
+
+-- Pass in on init. A spare pulse counter unit to count rejected glitches on.
+-- Set to nil if you need unit 6 for something else.
+m.glitchUnit = 6
+
 -- in case you inverted your direction pin, we need count reverse here
 m.isInvert = false 
 
@@ -30,6 +38,8 @@ function m.init(tbl)
     if tbl.onLimit ~= nil then m._onLimit = tbl.onLimit end
     if tbl.stepLimitMax ~= nil then m.stepLimitMax = tbl.stepLimitMax end
     if tbl.stepLimitMin ~= nil then m.stepLimitMin = tbl.stepLimitMin end
+    if tbl.rmtChannel ~= nil then m.rmtChannel = tbl.rmtChannel end
+    if tbl.glitchUnit ~= nil then m.glitchUnit = tbl.glitchUnit end
   end
   
   m.pcnt = pulsecnt.create(7, m.onPulseCnt) -- Use unit 7 (0-7 are allowed)
@@ -66,7 +76,16 @@ function m.init(tbl)
   -- sees as a step
   -- 1023 filter = 0.0127875 ms / 12.7875 us
   -- 1.9us is stepper motor response, so 1.9/0.0125 = 152 filter.
-  m.pcnt:setFilter(152) 
+  -- m.pcnt:setFilter(152) 
+  -- A fixed 152 was too aggressive for short RMT pulses at high step
+  -- rates, so follow the shortest pulse on the RMT channel instead, but
+  -- never filter longer than what the DRV8825 treats as a step.
+  m.pcnt:setFilterAuto({
+    rmtChannel = m.rmtChannel,
+    pct = 50,
+    maxCycles = 152,
+    glitchUnit = m.glitchUnit,
+  })
   
   -- Clear counting
   m.pcnt:clear()
@@ -119,4 +138,10 @@ function m.getMachineCoords()
   return m.pcnt:getCnt()
 end
 
+-- How many noise pulses the filter threw away since last zeroing
+function m.getGlitchCnt()
+  if m.glitchUnit == nil then return 0 end
+  return m.pcnt:getGlitchCnt()
+end
+
 return m
@@ -1,12 +1,38 @@
 ------------------------------------------------
 -- Cayenn Queue by using a file
+-- queue.log is a cmdlog_v1 log with one record per command. queue.idx
+-- next to it has the byte offset of each id's record in queue.log, 4
+-- bytes little endian per id starting at id 0, and FFFFFFFF for ids that
+-- never got added. So getting any id is a seek, not a read through every
+-- record before it. The offsets of the first ramIds ids are kept in RAM
+-- too, so most gets don't touch queue.idx at all.
+-- Adds go through the log's group commit, so a burst of queued commands
+-- is one write to flash, not an open/write/close per command.
 local m = {}
 -- m = {}
 
-m.filename = "queue.txt"
+m.filename = "queue.log"
+m.idxFilename = "queue.idx"
+m.oldFilename = "queue.txt" -- one JSON line per command, from before the log
+m.ramIds = 2000 -- ids whose offset we keep in RAM, about 16 bytes each
 m.tmrSend = nil
 
-m.isFileOpen = false
+m.cmdlog = require("cmdlog_v1")
+m._log = nil
+m._idxFd = nil -- queue.idx open for reading
+m._idxAppendFd = nil -- queue.idx kept open for adds
+m._offsets = {} -- offset by id for ids < ramIds, false for a gap
+
+local GAP = 4294967295 -- 0xFFFFFFFF in queue.idx, an id that was skipped
+
+local function packOffset(o)
+  return string.char(o % 256, math.floor(o / 256) % 256, math.floor(o / 65536) % 256, math.floor(o / 16777216) % 256)
+end
+
+local function unpackOffset(s, i)
+  local b1, b2, b3, b4 = string.byte(s, i, i + 3)
+  return b1 + b2 * 256 + b3 * 65536 + b4 * 16777216
+end
 
 function m.init()
 
@@ -15,132 +41,228 @@ function m.init()
   m.tmrSend = tmr.create()
   m.tmrSend:register(10, tmr.ALARM_SEMI, m.onSend)
   
-  -- make sure file exists
-  if file.exists(m.filename) then
-    -- good to go
+  local isNew = not file.exists(m.filename)
+  -- opening the log cuts off a record a power cut left half written
+  m._log = m.cmdlog.open(m.filename)
+  if isNew and file.exists(m.oldFilename) then
+    m.importOld()
   else
-    m.wipe()
+    m.loadIndex()
+  end
+end
+
+-- Move a queue.txt from before the log into queue.log, one line per id
+-- with blank lines as gaps
+function m.importOld()
+  m.wipe()
+  local fd = file.open(m.oldFilename, "r")
+  local id = 0
+  if fd then
+    while true do
+      local line = fd:readline()
+      if line == nil then break end
+      local ok, payload = pcall(cjson.decode, line)
+      if ok and type(payload) == "table" then
+        payload.Id = id
+        m.add(payload)
+      end
+      id = id + 1
+    end
+    fd:close()
+  end
+  m._log:flush()
+  file.remove(m.oldFilename)
+end
+
+-- Read queue.idx into RAM and pick up lastAddId from it, so adds and
+-- gets carry on after a restart. If it doesn't match queue.log, i.e. the
+-- power went between writing one and the other, it's rebuilt from the log.
+function m.loadIndex()
+  m.close()
+  m._offsets = {}
+  if not file.exists(m.idxFilename) then
+    m.rebuildIndex()
+    return
+  end
+  local fd = file.open(m.idxFilename, "r")
+  local id = 0
+  local cnt = 0
+  local isBad = false
+  if fd then
+    while true do
+      local chunk = fd:read(256)
+      if chunk == nil or #chunk < 4 then break end
+      for i = 1, #chunk - 3, 4 do
+        local o = unpackOffset(chunk, i)
+        if o ~= GAP then
+          cnt = cnt + 1
+          if o >= m._log.size then isBad = true end
+        end
+        if id < m.ramIds then
+          m._offsets[id] = o ~= GAP and o
+        end
+        id = id + 1
+      end
+    end
+    fd:close()
+  end
+  m.lastAddId = id - 1
+  if isBad or cnt ~= m._log.records then
+    print("queue.idx doesn't match queue.log. Rebuilding it.")
+    m.rebuildIndex()
+  end
+end
+
+-- Build queue.idx from queue.log by the Id in each record
+function m.rebuildIndex()
+  m.close()
+  m._offsets = {}
+  local idx = file.open(m.idxFilename, "w+")
+  local id = -1
+  local off = #m.cmdlog.HDR
+  if idx then
+    while true do
+      local payload, nextOff = m._log:readAt(off)
+      if nextOff == nil then break end
+      if payload ~= nil and type(payload.Id) == "number" and payload.Id > id then
+        local recs = {}
+        for ctr = id + 1, payload.Id - 1 do
+          table.insert(recs, packOffset(GAP))
+          if ctr < m.ramIds then m._offsets[ctr] = false end
+        end
+        table.insert(recs, packOffset(off))
+        idx:write(table.concat(recs))
+        if payload.Id < m.ramIds then m._offsets[payload.Id] = off end
+        id = payload.Id
+      end
+      off = nextOff
+    end
+    idx:close()
+  end
+  m.lastAddId = id
+end
+
+-- Close the read handles and get pending adds onto flash
+function m.close()
+  if m._idxFd then m._idxFd:close() end
+  if m._idxAppendFd then m._idxAppendFd:close() end
+  m._idxFd = nil
+  m._idxAppendFd = nil
+  if m._log then m._log:close() end
+end
+
+-- How many ids the queue spans, gaps included
+function m.count()
+  return m.lastAddId + 1
+end
+
+-- Byte offset of id's record in queue.log, or nil if it's a gap or past the end
+function m.getOffset(id)
+  if id < 0 or id > m.lastAddId then return nil end
+  if id < m.ramIds then
+    return m._offsets[id] or nil
   end
+  if m._idxAppendFd then m._idxAppendFd:flush() end
+  if m._idxFd == nil then
+    m._idxFd = file.open(m.idxFilename, "r")
+    if m._idxFd == nil then return nil end
+  end
+  m._idxFd:seek("set", id * 4)
+  local s = m._idxFd:read(4)
+  if s == nil or #s < 4 then return nil end
+  local o = unpackOffset(s, 1)
+  if o == GAP then return nil end
+  return o
 end
 
--- Wipe the queue by deleting file, recreating it, and resetting counters
+-- Wipe the queue by emptying the log and index, and resetting counters
 function m.wipe()
-  file.remove(m.filename)
-  file.open(m.filename, "w+")
-  -- file.writeline("")
+  m.close()
+  m._log:wipe()
+  file.remove(m.idxFilename)
+  local fd = file.open(m.idxFilename, "w+")
+  if fd then fd:close() end
   -- make sure to reset the GetId so our gets start at top
   m.lastGetId = -1
   m.lastAddId = -1
-  file.close()
-  m.isFileOpen = false
+  m._offsets = {}
 end
 
 -- Add to the queue
 -- It must have an Id in the payload table and Id's must
--- be added in incrementing order
+-- be added in incrementing order. queue.idx only grows, so an id at or
+-- below lastAddId is rejected rather than written over, since its slot
+-- is already taken. Returns true if it was added.
 m.lastAddId = -1
 function m.add(payload)
   
+  local id = payload.Id
+  if type(id) ~= "number" or id < 0 or id % 1 ~= 0 then
+    print("Error. Queue ID must be a whole number 0 or above. ID:" .. tostring(id))
+    return false
+  end
   -- make sure the id is greater than last id
-  if payload.Id > m.lastAddId then
-    -- good. we have an incrementing id
-  else
+  if id <= m.lastAddId then
     -- bad. we somehow are moving backwards
-    print("Error. Got an ID < lastAddId. ID:" .. payload.Id .. ", lastAddId:" .. m.lastAddId)
-    return
+    print("Error. Got an ID <= lastAddId. ID:" .. id .. ", lastAddId:" .. m.lastAddId)
+    return false
   end
   
-  -- open 'queue.txt' in 'a+' mode to append
-  file.open(m.filename, "a+")
-  
-  -- based on m.lastAddId we need to decide whether to write 
-  -- empty lines or not
-  if payload.Id == m.lastAddId + 1 then 
-    -- we do not need to advance
-  else 
-    -- we need to write blank lines
-    for ctr = m.lastAddId + 1, payload.Id - 1 do
-      file.writeline("")
-      print("Padded line:", ctr)
+  -- open the index first, so a record never goes in the log without its offset
+  if m._idxAppendFd == nil then
+    m._idxAppendFd = file.open(m.idxFilename, "a+")
+    if m._idxAppendFd == nil then
+      print("Error. Could not open " .. m.idxFilename)
+      return false
     end
-  end 
+  end
   
-  local ok, jsontag = pcall(cjson.encode, payload)
-  if ok then
-    -- write to the end of the file
-    file.writeline(jsontag)
-    -- print("Wrote line to file:" .. jsontag)
-  else
-    -- print("failed to encode jsontag for queue file!")
+  local ok, offset = pcall(m._log.append, m._log, payload)
+  if not ok then
+    print("Error. Could not add to queue. " .. tostring(offset))
+    return false
+  end
+  
+  -- skipped ids get a gap in the index
+  local recs = {}
+  for ctr = m.lastAddId + 1, id - 1 do
+    table.insert(recs, packOffset(GAP))
+    if ctr < m.ramIds then m._offsets[ctr] = false end
   end
-  file.close()
-  m.isFileOpen = false
-  m.lastAddId = payload.Id 
+  table.insert(recs, packOffset(offset))
+  m._idxAppendFd:write(table.concat(recs))
+  
+  if id < m.ramIds then m._offsets[id] = offset end
+  m.lastAddId = id
+  return true
 end
 
 -- Get queue item by ID
--- Goal is to keep file open so we can just move forward
--- so we don't slow down our retrievals re-opening from
--- the beginning each time
--- The format of our file is one line per id starting at 0
--- That way we just associate lines with ID's for expediency
--- If we get scattered id's, then we place in empty lines
+-- The index gives us where id's record starts so this is a seek and one
+-- read no matter which id, or which id came before it.
+-- Returns -1 past the end of the queue, nil for an id that was skipped.
+-- Each get decodes the record again, so the caller owns the table it gets
+-- back and changing it can't leak into the next get of the same id.
 m.lastGetId = -1
-m.lastLine = nil
 function m.getId(id)
   
-  -- make sure file is open
-  if m.isFileOpen == false then
-    -- we need to open file
-    file.open(m.filename, "r")
-    m.isFileOpen = true
-  end
-  
-  -- local line
-
-  -- see if we get a lesser id, and if so, start back at -1
-  if id < m.lastGetId then
-    -- we need to just start back from the beginning
-    file.close()
-    file.open(m.filename, "r")
-    m.isFileOpen = true
-    m.lastGetId = -1
-  end
-  
-  if id > m.lastGetId then
-    -- advance the line forward to correct one
-    for ctr = m.lastGetId + 1, id do
-      m.lastLine = file.readline()
-      -- print("Line:", id, ctr, line)
-    end
-  elseif id == m.lastGetId then
-    -- don't move forward in file. just use last line
-    -- line = m.lastLine
-  end
-  
-  -- m.lastLine = line
   m.lastGetId = id
-  
-  -- print("Line:", m.lastLine)
-  
-  if m.lastLine == nil then
+  if id > m.lastAddId then
     return -1 -- to indicate EOF
   end
   
-  -- parse json to table
-  local succ, results = pcall(function()
-  	return cjson.decode(m.lastLine)
-  end)
+  local offset = m.getOffset(id)
+  if offset == nil then return nil end
   
-  -- see if we could parse
-  if succ then
-  	--data = results
-  	return results
-  else
-  -- 	print("Error parsing JSON")
-  	return nil
+  local item, nextOff = m._log:readAt(offset)
+  if nextOff == nil then
+    -- record is bad or gone
+    return -1 -- to indicate EOF
   end
   
+  -- print("Item:", sjson.encode(item))
+  return item
+  
 end
 
 -- Send queue back to ChiliPeppr
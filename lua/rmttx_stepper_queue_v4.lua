@@ -60,6 +60,7 @@ m._lastMoveWasSingleGcode = false
 
 -- Instead of using the queue, you can just pass 1 line
 -- You will still get a callback on move done
+-- If qItem.StartUs is set the move waits for that time on the rmttx.now() clock
 function m.runGcodeAbs(qItem)
   
   m._lastMoveWasSingleGcode = true
@@ -83,7 +84,7 @@ function m.runGcodeAbs(qItem)
   
   -- print("step: "..qItem.Step)
   -- m.motor.enable()
-  m.rmtstep.sendMoveAbs(qItem.Step)
+  m.rmtstep.sendMoveAbs(qItem.Step, qItem.StartUs)
 end
 
 function m.runGcodeRel()
@@ -124,16 +124,18 @@ function m.setAcceleration(accel)
 end 
 
 -- Absolute move
-function m.sendMoveAbs(steps)
+function m.sendMoveAbs(steps, startUs)
   -- get current position, then check it against steps
   -- to calc relative position, then call sendMove()
   local curPos = m.astep.currentPosition()
   local relSteps = steps - curPos
-  m.sendMove(relSteps)
+  m.sendMove(relSteps, startUs)
 end
 
 -- Relative move
-function m.sendMove(steps)
+-- startUs is optional. If given the move starts at that time on the
+-- rmttx.now() clock, off a hardware timer, instead of right away.
+function m.sendMove(steps, startUs)
   
   print("sendMove:", steps, "fr:", m.astep.maxSpeed(), "acc:", m.astep._acceleration)
   m.getStepCtr()
@@ -154,7 +156,11 @@ function m.sendMove(steps)
   
   -- Now start the RMT sending. This sets up interrupt for
   -- callbacks, threshold event, and starts the send.
-  m.tx:writeRawFillStart()
+  if startUs ~= nil then
+    m.tx:startAt(startUs)
+  else
+    m.tx:writeRawFillStart()
+  end
   
   -- print("Done initial send")
 end
@@ -1,4 +1,8 @@
 -- Status sending
+-- get() is the full status for a StatusGet. start() streams only what
+-- changes through telemetry_v1, each field at its own rate.
+
+local tel = require("telemetry_v1")
 
 local m = {}
 
@@ -20,8 +24,9 @@ end
 
 function m.send()
   local tbl = m.get()
-  -- send it off to listeners
-  m.cayenn.send(tbl)
+  -- send it off to listeners. status is low priority, another one
+  -- comes along soon if this one gets dropped
+  return m.cayenn.send(tbl, nil, true)
 end
 
 function m.sendUdp()
@@ -53,35 +58,71 @@ function m.get()
   tbl.Step = m.ctrl.pcnt.getMachineCoords() -- from hardware pulse count on step pin
   -- get frequency 
   -- tbl.Freq = ctrl.jog.getFreq()
-  -- get temp 
-  tbl.Temp, isWarning, isEmergency = m.fan.temp.read(10) -- 10 samples to avg
-  if isWarning then tbl.IsTempWarning = true end
-  if isEmergency then tbl.IsTempEmergency = true end
+  -- get temp. the fan loop reads it every few seconds so use that
+  -- reading rather than sampling the ADC again here
+  local temp = m.fan.temp
+  if temp.lastTempC == nil then temp.read(10) end -- 10 samples to avg
+  tbl.Temp = temp.lastTempC
+  if temp.lastIsWarning then tbl.IsTempWarning = true end
+  if temp.lastIsEmergency then tbl.IsTempEmergency = true end
   -- get fan 
   tbl.Fan = m.fan.getStatus().Pct --fan.getSpeedPercent()
   -- tbl.State = ctrl.getState()
   return {["Stat"] = tbl}
 end 
 
+-- Telemetry fields. Short keys on the wire:
+-- st State, f Freq, sr StepRmt, s Step, t Temp, tw IsTempWarning,
+-- te IsTempEmergency, fn Fan
+m._isFields = false
+function m.initFields()
+  if m._isFields then return end
+  m._isFields = true
+  
+  tel.init({
+    send = function(tbl) m.cayenn.sendUdp(tbl) end,
+    tickMs = 100,
+    batchMs = 500,
+    keyframeMs = 10000,
+  })
+  
+  -- position and velocity are fast
+  -- read every tick, so these skip the table getState() builds
+  tel.addField("st", { periodMs = 100, read = function() return m.ctrl.getStateName() end })
+  tel.addField("f", { periodMs = 100, deadband = 0.5, read = function()
+    local freq = m.ctrl.getFreq()
+    if freq then return m.round(freq, 1) end
+    return 0
+  end })
+  tel.addField("sr", { periodMs = 100, read = function() return m.ctrl.gcode.getMachineCoords() end })
+  tel.addField("s", { periodMs = 100, read = function() return m.ctrl.pcnt.getMachineCoords() end })
+  
+  -- temperature and fan are slow
+  tel.addField("t", { periodMs = 5000, deadband = 0.2, read = function() return m.fan.temp.lastTempC end })
+  tel.addField("tw", { periodMs = 1000, read = function() return m.fan.temp.lastIsWarning end })
+  tel.addField("te", { periodMs = 1000, read = function() return m.fan.temp.lastIsEmergency end })
+  tel.addField("fn", { periodMs = 2000, read = function() return m.fan.getStatus().Pct end })
+end
+
 function m.start()
-  if m._tmrStatus and m._tmrStatus:state() then 
+  if tel.isRunning() then 
     print("Status already running")
     return false
   end 
   
-  m._tmrStatus = tmr.create()
-  -- TODO only send updates, so keep last status and debounce
-  m._tmrStatus:alarm(2000, tmr.ALARM_AUTO, function()
-    m.sendUdp()
-  end)
+  m.initFields()
+  tel.start()
   
   return true
 end 
 
 function m.stop()
-  if m._tmrStatus and m._tmrStatus:state() then 
-    m._tmrStatus:unregister()
-  end 
+  tel.stop()
+end
+
+-- Send every field on the next tick, i.e. a new listener showed up
+function m.keyframe()
+  tel.keyframe()
 end
 
 return m
\ No newline at end of file
@@ -1,6 +1,21 @@
 -- TCP Socket
 -- Creates connections, manages them, let's you send lots of data
 --
+-- Keeps a connection open to each peer we talk to, keyed by IP, so a
+-- response can go straight back to whoever sent the command without
+-- waiting on a TCP handshake. A watchdog timer reconnects a peer ahead
+-- of time if its socket drops, rather than waiting for the next send,
+-- and closes peers that have gone quiet. The net module has no TCP
+-- keepalive option so the watchdog stands in for it.
+--
+-- Each peer's queued messages sit in a ring buffer. Each socket send
+-- takes as many of them as fit in one segment (mss bytes) so a burst of
+-- small responses goes out in a few packets instead of one per onSent.
+-- The queue is capped in bytes. Past highWater, send() returns false so
+-- producers know to back off, and low priority messages like status are
+-- dropped. Past maxBytes everything is dropped. Once the queue drains
+-- below half of highWater the onDrain listener gets called.
+--
 -- To use:
 -- wifi_util = require("wifi_util")
 -- tcp = require("tcp_client")
@@ -9,12 +24,14 @@
 -- data[1] = '{"JsonTag":"{\\"MemRemain\\":293300,\\"TransId\\":1,\\"Resp\\":\\"Mem\\"}","MyDeviceId":"chip:0xad30aea4252c-ip:10.0.0.10"}'
 -- data[2] = '{"JsonTag":"{\\"MemRemain\\":93300,\\"TransId\\":1,\\"Resp\\":\\"Mem\\"}","MyDeviceId":"chip:0xad30aea4252c-ip:10.0.0.10"}'
 -- data[3] = '{"JsonTag":"{\\"MemRemain\\":493300,\\"TransId\\":1,\\"Resp\\":\\"Mem\\"}","MyDeviceId":"chip:0xad30aea4252c-ip:10.0.0.10"}'
-  
--- wifi_util.init(function() 
+
+-- wifi_util.init(function()
 --   print("Got wifi")
 --   print("My IP:" .. wifi_util.getIp() )
 --   tcp.init("10.0.0.233", 8988)
 --   tcp.send(data, function() print("Yay. done!") end)
+--   -- or to another peer, which gets its own connection
+--   tcp.send(data, nil, false, "10.0.0.234")
 -- end)
 
 local m = {}
@@ -22,175 +39,387 @@ local m = {}
 
 -- wifi_util = require("wifi_util")
 
-m._dataTable = {}
--- m._cb = nil 
-m._sck = nil
-m._ip = nil
-m._isConnecting = false
-m._isDisconnected = true 
+m.mss = 1460 -- most bytes coalesced into one socket send
+m.highWater = 4096 -- queued bytes where we start pushing back
+m.maxBytes = 16384 -- queued bytes where we drop everything
+m.maxPeers = 4 -- most connections we keep open, the quietest goes first
+m.watchdogMs = 2000 -- how often we check the connections
+m.connectTicks = 3 -- watchdog ticks a connect gets before we retry
+m.idleTicks = 150 -- watchdog ticks with no sends before we close a peer, 0 to never
+
+m._ip = nil -- default peer, i.e. the server that said i-am-your-server
+m._port = nil
+m._peers = {} -- keyed by ip
+m._peerCnt = 0
+m._tmr = nil
+m._onDrain = nil
 
 m._isDebug = false
 
-function m.init(ip, port)
-  m._ip = ip 
-  m._port = port 
+-- opts is optional { mss = 1460, highWater = 4096, maxBytes = 16384, maxPeers = 4, idleTicks = 150 }
+function m.init(ip, port, opts)
+  m._ip = ip
+  m._port = port
+  if opts ~= nil then
+    if opts.mss ~= nil then m.mss = opts.mss end
+    if opts.highWater ~= nil then m.highWater = opts.highWater end
+    if opts.maxBytes ~= nil then m.maxBytes = opts.maxBytes end
+    if opts.maxPeers ~= nil then m.maxPeers = opts.maxPeers end
+    if opts.idleTicks ~= nil then m.idleTicks = opts.idleTicks end
+  end
+  -- connect now so the first response doesn't wait on it
+  m.addPeer(ip)
+end
+
+-- Open a connection to ip ahead of sending to it. Returns the peer.
+function m.addPeer(ip, port)
+  local p = m._peers[ip]
+  if p ~= nil then return p end
+
+  if m._peerCnt >= m.maxPeers then
+    m._evictPeer()
+  end
+
+  p = {}
+  p.ip = ip
+  p.port = port or m._port
+  p.sck = nil
+  -- ring buffer of {str, cb}. head is the next to send, tail the next free slot
+  p.q = {}
+  p.head = 1
+  p.tail = 1
+  p.bytes = 0 -- bytes queued, not counting what's in flight
+  p.isSending = false -- a send is out and we're waiting on onSent
+  p.inflightCbs = nil -- callbacks of the messages in flight
+  p.isPushback = false -- went over highWater, waiting to drain
+  p.isConnecting = false
+  p.isConnected = false
+  p.wasConnected = false -- the last socket got as far as connecting
+  p.connectTick = 0 -- watchdog ticks since we started connecting
+  p.idleTick = 0 -- watchdog ticks since the last send
+  p.dropped = 0 -- messages turned away
+  p.sends = 0 -- socket sends
+  p.msgs = 0 -- messages sent, so msgs / sends is how well we coalesce
+  m._peers[ip] = p
+  m._peerCnt = m._peerCnt + 1
+
+  m._startWatchdog()
+  m.createConnection(p)
+  return p
+end
+
+function m.removePeer(ip)
+  local p = m._peers[ip]
+  if p == nil then return end
+  m._peers[ip] = nil
+  m._peerCnt = m._peerCnt - 1
+  m._closeSocket(p)
+  if m._isDebug then
+    print("Removed peer: "..ip)
+  end
+end
+
+function m.hasPeer(ip)
+  return m._peers[ip] ~= nil
+end
+
+-- Close the peer that's been quiet longest, never the default one
+function m._evictPeer()
+  local quietest = nil
+  for ip, p in pairs(m._peers) do
+    if ip ~= m._ip and (quietest == nil or p.idleTick > quietest.idleTick) then
+      quietest = p
+    end
+  end
+  if quietest ~= nil then m.removePeer(quietest.ip) end
+end
+
+-- Called as callback(ip) once a peer's queue drains after send() returned false
+function m.setOnDrain(callback)
+  m._onDrain = callback
+end
+
+-- Bytes queued to ip (or the default peer) and not yet handed to the socket
+function m.getQueuedBytes(ip)
+  local p = m._peers[ip or m._ip]
+  if p == nil then return 0 end
+  return p.bytes
+end
+
+-- True while ip (or the default peer) is over highWater, i.e. producers should hold off
+function m.isBusy(ip)
+  local p = m._peers[ip or m._ip]
+  if p == nil then return false end
+  return p.isPushback
+end
+
+-- True if ip (or the default peer) has its socket up
+function m.isConnected(ip)
+  local p = m._peers[ip or m._ip]
+  if p == nil then return false end
+  return p.isConnected
+end
+
+-- messages, socket sends, dropped messages for ip (or the default peer)
+function m.getStats(ip)
+  local p = m._peers[ip or m._ip]
+  if p == nil then return 0, 0, 0 end
+  return p.msgs, p.sends, p.dropped
 end
 
 -- data should be a table of strings, i.e. an array of strings
--- we queue it up and then send one after the other
-function m.send(dataTable, callback)
-  
+-- we queue it up and then send it in as few socket sends as we can
+-- isLowPri messages get dropped rather than queued once we're over highWater
+-- ip picks the peer, nil for the default one. A new ip gets a connection.
+-- Returns true if queued and under highWater. false if dropped or if the
+-- queue is now over highWater, so the caller should back off until onDrain.
+function m.send(dataTable, callback, isLowPri, ip)
+
   -- we need to queue up this dataTable
   if type(dataTable) == "table" then
-    -- m._dataTable = dataTable 
+    -- m._dataTable = dataTable
   elseif type(dataTable) == "string" then
     dataTable = {dataTable}
-  else 
+  else
     -- print("You need to pass in a table of strings or a string as 1st param. Returning.")
-    return 
+    return false
+  end
+
+  ip = ip or m._ip
+  if ip == nil then return false end
+  local p = m._peers[ip] or m.addPeer(ip)
+  p.idleTick = 0
+
+  local len = 0
+  for i,v in ipairs(dataTable) do
+    len = len + #v
+  end
+
+  -- see if we have room for it
+  if p.bytes + len > m.maxBytes or (isLowPri and p.bytes + len > m.highWater) then
+    p.dropped = p.dropped + #dataTable
+    p.isPushback = true
+    if m._isDebug then
+      print("Queue full for "..ip..", dropping. queued:"..p.bytes..", len:"..len)
+    end
+    -- the queue may already be drained, i.e. one big message was turned
+    -- away, and then no onSent is coming to lift the pushback
+    m._checkDrain(p)
+    return false
   end
-  -- m._cb = callback
 
   -- append to end of queue
+  local cnt = #dataTable
   for i,v in ipairs(dataTable) do
     local item = {}
-    item.str = dataTable[i] 
+    item.str = v
     item.cb = nil
     -- see if this is the last send item, if so make it have callback
     -- that way callback only happens on last item sent from this send request
-    if i == table.maxn(dataTable) then item.cb = callback end
-    table.insert(m._dataTable, item)
+    if i == cnt then item.cb = callback end
+    p.q[p.tail] = item
+    p.tail = p.tail + 1
   end
+  p.bytes = p.bytes + len
+  if p.bytes > m.highWater then p.isPushback = true end
 
-  -- see if we have a connection to this ip already open
-  if m._sck ~= nil then 
-    -- yes, we have a connection already!
-    -- trigger the send 
-    m.doSend()
-  else 
-    m.createConnection()
-  end 
-  
+  -- trigger the send. if we're not connected yet it goes once we are
+  m.doSend(p)
+
+  return not p.isPushback
 end
 
-function m.createConnection()
-  
-  if m._isConnecting then
+function m.createConnection(p)
+
+  if p.isConnecting then
     if m._isDebug then
       print("Already trying to connect. Returning.")
     end
-    return 
-  end 
-  
-  m._isConnecting = true
+    return
+  end
+
+  m._closeSocket(p)
+  p.isConnecting = true
+  p.connectTick = 0
   if m._isDebug then
-    print("Connecting to IP: "..m._ip..", port:"..m._port)
-  end
-  m._sck = net.createConnection(net.TCP)
-  -- Wait for connection before sending.
-  m._sck:on("connection", m.onConnection)
-  m._sck:on("disconnection", m.onConnection)
-  m._sck:on("reconnection", m.onConnection)
-  m._sck:on("sent", m.onSent)
-  m._sck:connect(m._port, m._ip)
+    print("Connecting to IP: "..p.ip..", port:"..p.port)
+  end
+  local sck = net.createConnection(net.TCP)
+  p.sck = sck
+  -- Wait for connection before sending. Events from a socket we've
+  -- since replaced are ignored.
+  sck:on("connection", function(s)
+    if p.sck == sck then m.onConnection(p) end
+  end)
+  sck:on("disconnection", function(s, err)
+    if p.sck == sck then m.onDisconnection(p, err) end
+  end)
+  sck:on("reconnection", function(s, err)
+    if p.sck == sck then m.onDisconnection(p, err) end
+  end)
+  sck:on("sent", function(s)
+    if p.sck == sck then m.onSent(p) end
+  end)
+  sck:connect(p.port, p.ip)
   -- after we connect, we get callback, which then calls m.doSend()
 end
 
-function m.doSend()
+function m._closeSocket(p)
+  local sck = p.sck
+  p.sck = nil
+  p.isConnected = false
+  p.isConnecting = false
+  p.isSending = false
+  p.inflightCbs = nil
+  if sck ~= nil then
+    pcall(function() sck:close() end)
+  end
+end
+
+function m.doSend(p)
 
   if m._isDebug then
-    print("m.doSend. m._dataTable:",m._dataTable)
+    print("m.doSend. ip:", p.ip, "queued:", p.tail - p.head)
   end
-  
-  if m._dataTable ~= nil and #m._dataTable > 0 then
-    
-    -- see if we got disconnected 
-    if m._isDisconnected then
+
+  -- one send out at a time, onSent brings us back here
+  if p.isSending then return end
+
+  if p.head < p.tail then
+
+    -- see if we got disconnected
+    if not p.isConnected then
       if m._isDebug then
-        print("Seems like got disconnected. Reconnecting...")
+        print("Not connected. Connecting...")
       end
-      m.createConnection()
+      m.createConnection(p)
       -- we will get a callback on connection, which will re-call this function
-      return 
-    end 
-    
-    if m._isDebug then
-      print("Sending. m._dataTable items:"..#m._dataTable)
+      return
     end
-    
-    local item = m._dataTable[1] 
-    -- local val = item.str
+
+    -- take as many messages as fit in one segment, at least one
+    local parts = {}
+    local cbs = {}
+    local len = 0
+    local i = p.head
+    while i < p.tail do
+      local item = p.q[i]
+      if #parts > 0 and len + #item.str > m.mss then break end
+      table.insert(parts, item.str)
+      if item.cb ~= nil then table.insert(cbs, item.cb) end
+      len = len + #item.str
+      i = i + 1
+    end
+
     if m._isDebug then
-      print("Sending: "..item.str)
+      print("Sending "..#parts.." msgs, "..len.." bytes to "..p.ip)
     end
-    
-    local result, err = pcall(function() m._sck:send(item.str) end)
-    if result == true then 
+
+    local result, err = pcall(function() p.sck:send(table.concat(parts)) end)
+    if result == true then
       -- call was good
-      -- remove item from queue
-      local qItem = table.remove(m._dataTable, 1)
-      -- see if we need to do the callback, if this qItem has one 
-      if qItem.cb ~= nil then 
-        -- yes, there was a callback. post it.
-        -- print("Doing callback.")
-        node.task.post(node.task.LOW_PRIORITY, qItem.cb)
-      end 
-    else 
+      -- remove the items from the queue
+      for j = p.head, i - 1 do p.q[j] = nil end
+      p.head = i
+      if p.head == p.tail then
+        -- empty, so start over at the front
+        p.head = 1
+        p.tail = 1
+      end
+      p.bytes = p.bytes - len
+      p.sends = p.sends + 1
+      p.msgs = p.msgs + #parts
+      p.isSending = true
+      p.inflightCbs = cbs
+    else
       -- call was bad, so error
       -- print("Err trying to send. Probably not connected. err:", err)
       -- print("Reconnecting...")
-      m.createConnection()
+      p.isConnected = false
+      m.createConnection(p)
     end
-  else
-    -- localSocket:close()
-    -- m._dataTable = nil
-    -- print("Done sending.")
-    -- if m._cb ~= nil then 
-    --   print("Doing callback.")
-    --   node.task.post(node.task.MEDIUM_PRIORITY, m._cb) 
-    --   m._cb = nil
-    -- end
-  end
-end
-
--- sends and removes the first element from the 'response' table
-function m.onSent(sck, val)
-  -- print("Got onSent. sck:",sck,"val:",val)
-  node.task.post(node.task.MEDIUM_PRIORITY, m.doSend)
-end
-
-function m.onConnection(sck, val)
-  -- it looks like if val is null then got "connection"
-  -- if val is 0 got "disconnection" but not sure, so using
-  -- the pcall() on send() and the error as my indicator
-  -- this is annoying though cuz inconsistent with docs
-  
-  -- print("Got onConnection. sck:",sck,"val:",val)
-  
-  if val == 0 then 
-    -- this means disconnection 
-    -- print("Got disconnected")
-    m._isDisconnected = true
-  else 
-    -- this means got connection
-    m._isDisconnected = false
-    m._isConnecting = false
-    m.doSend()
-  end 
-  
-end
-
-function m.onDisconnection(sck, val)
-  -- print("Got onDisconnection. sck:",sck,"val:",val)
-  -- local port, ip = sck:getpeer()
-  m._sck = nil
-end
-
-function m.onReconnection(sck, val)
-  -- print("Got onReconnection. sck:",sck,"val:",val)
-end 
-
--- wifi_util.init(function() 
+  end
+end
+
+-- Tell producers they can send again once we're well under highWater
+function m._checkDrain(p)
+  if p.isPushback and p.bytes <= m.highWater / 2 then
+    p.isPushback = false
+    if m._onDrain ~= nil then
+      node.task.post(node.task.LOW_PRIORITY, function() m._onDrain(p.ip) end)
+    end
+  end
+end
+
+function m.onSent(p)
+  -- print("Got onSent. ip:",p.ip)
+  p.isSending = false
+  -- the batch is out, so do the callbacks of the messages it held
+  local cbs = p.inflightCbs
+  p.inflightCbs = nil
+  if cbs ~= nil then
+    for i, cb in ipairs(cbs) do
+      node.task.post(node.task.LOW_PRIORITY, cb)
+    end
+  end
+  m._checkDrain(p)
+  node.task.post(node.task.MEDIUM_PRIORITY, function() m.doSend(p) end)
+end
+
+function m.onConnection(p)
+  -- print("Got connection. ip:",p.ip)
+  p.isConnected = true
+  p.isConnecting = false
+  p.wasConnected = true
+  m.doSend(p)
+end
+
+function m.onDisconnection(p, err)
+  -- print("Got disconnection. ip:",p.ip,"err:",err)
+  local wasConnected = p.wasConnected
+  p.wasConnected = false
+  -- a send that was out won't get its onSent
+  m._closeSocket(p)
+
+  -- reconnect ahead so the next response doesn't wait on a handshake.
+  -- a connect that failed waits for the watchdog instead so a peer
+  -- that's down doesn't get hammered
+  if wasConnected and m._peers[p.ip] == p then
+    node.task.post(node.task.LOW_PRIORITY, function()
+      if m._peers[p.ip] == p then m.createConnection(p) end
+    end)
+  end
+end
+
+function m._startWatchdog()
+  if m._tmr ~= nil then return end
+  m._tmr = tmr.create()
+  m._tmr:alarm(m.watchdogMs, tmr.ALARM_AUTO, m._watchdog)
+end
+
+-- Keep each peer's connection up, give up on connects that hang, and
+-- close peers nobody has sent to in a while
+function m._watchdog()
+  for ip, p in pairs(m._peers) do
+    p.idleTick = p.idleTick + 1
+    if ip ~= m._ip and m.idleTicks > 0 and p.idleTick > m.idleTicks and p.head == p.tail then
+      m.removePeer(ip)
+    elseif p.isConnecting then
+      p.connectTick = p.connectTick + 1
+      if p.connectTick > m.connectTicks then
+        if m._isDebug then
+          print("Connect to "..ip.." timed out. Retrying...")
+        end
+        m._closeSocket(p)
+        m.createConnection(p)
+      end
+    elseif not p.isConnected then
+      m.createConnection(p)
+    end
+  end
+end
+
+-- wifi_util.init(function()
 --   print("Got wifi")
 --   print("My IP:" .. wifi_util.getIp() )
 --   local data = {}
@@ -201,5 +430,3 @@ end
 -- end)
 
 return m
-
-
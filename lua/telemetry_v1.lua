@@ -0,0 +1,190 @@
+-- Telemetry stream
+-- Sends only what changed since the last datagram, each field at its
+-- own rate, with several samples batched into one datagram. Replaces
+-- sending the full status every 2 seconds.
+--
+-- Each field has a short key, a read function and a rate. Fast ones
+-- like position are read every tick, slow ones like temperature every
+-- few seconds. A field only goes in a sample if it moved more than its
+-- deadband since it was last sent. Every keyframeMs we send all fields
+-- anyway so a listener that joined late or lost a datagram catches up.
+--
+-- What gets sent, inside the usual Cayenn JsonTag:
+-- {Tl = {
+--   Seq = 12, -- counts datagrams so a listener sees drops
+--   K = true, -- only on a keyframe
+--   T = 5300, -- ms since start() of the 1st sample
+--   S = { {d=0, s=1200, f=500.5}, {d=100, s=1250}, {d=400, t=31.5} },
+-- }}
+-- where d is ms after T and the rest are field keys
+--
+-- To use:
+-- tel = require("telemetry_v1")
+-- tel.init({ send = function(tbl) cayenn.sendUdp(tbl) end })
+-- tel.addField("s", { periodMs = 100, read = function() return pcnt.getMachineCoords() end })
+-- tel.addField("t", { periodMs = 5000, deadband = 0.2, read = function() return tmp.lastTempC end })
+-- tel.start()
+
+local m = {}
+-- m = {}
+
+m.tickMs = 100 -- fastest any field can be read
+m.batchMs = 500 -- longest a sample waits before its datagram goes
+m.maxSamples = 8 -- send early once this many samples are waiting
+m.keyframeMs = 10000 -- send every field this often, 0 to never
+
+m.isDebug = false
+
+m._send = nil
+m._fields = {} -- in the order they were added
+m._tmr = nil
+m._ms = 0 -- ms since start()
+m._seq = 0
+m._batch = nil -- samples waiting to go
+m._batchT = 0
+m._nextKeyMs = 0
+m._isKey = false -- the batch waiting is a keyframe
+
+-- { send = fn(tbl), tickMs = 100, batchMs = 500, maxSamples = 8, keyframeMs = 10000, isDebug = false }
+function m.init(tbl)
+  if tbl ~= nil then
+    if tbl.send ~= nil then m._send = tbl.send end
+    if tbl.tickMs ~= nil then m.tickMs = tbl.tickMs end
+    if tbl.batchMs ~= nil then m.batchMs = tbl.batchMs end
+    if tbl.maxSamples ~= nil then m.maxSamples = tbl.maxSamples end
+    if tbl.keyframeMs ~= nil then m.keyframeMs = tbl.keyframeMs end
+    if tbl.isDebug ~= nil then m.isDebug = tbl.isDebug end
+  end
+end
+
+-- key is what the field is called on the wire, keep it short
+-- { read = fn() returning a number, string or bool, periodMs = 1000, deadband = 0 }
+-- read() returning nil leaves the field out of that sample
+function m.addField(key, tbl)
+  if key == "d" then
+    error("d is the sample time, pick another key")
+  end
+  local f = {}
+  f.key = key
+  f.read = tbl.read
+  f.periodMs = tbl.periodMs or 1000
+  f.deadband = tbl.deadband or 0
+  f.nextMs = 0
+  f.last = nil
+  -- adding the same key again replaces it
+  for i, v in ipairs(m._fields) do
+    if v.key == key then
+      m._fields[i] = f
+      return
+    end
+  end
+  table.insert(m._fields, f)
+end
+
+function m.removeField(key)
+  for i, v in ipairs(m._fields) do
+    if v.key == key then
+      table.remove(m._fields, i)
+      return
+    end
+  end
+end
+
+-- true if val should be sent given what we last sent
+function m._isChanged(f, val)
+  if f.last == nil then return true end
+  if type(val) == "number" and type(f.last) == "number" then
+    return math.abs(val - f.last) > f.deadband
+  end
+  return val ~= f.last
+end
+
+function m._tick()
+  m._ms = m._ms + m.tickMs
+  local isKey = m.keyframeMs > 0 and m._ms >= m._nextKeyMs
+
+  local sample = nil
+  for i, f in ipairs(m._fields) do
+    if isKey or m._ms >= f.nextMs then
+      f.nextMs = m._ms + f.periodMs
+      local val = f.read()
+      if val ~= nil and (isKey or m._isChanged(f, val)) then
+        if sample == nil then sample = {} end
+        sample[f.key] = val
+        f.last = val
+      end
+    end
+  end
+
+  if isKey then
+    m._nextKeyMs = m._ms + m.keyframeMs
+    -- a keyframe goes by itself so it's complete on its own
+    m.flush()
+    m._isKey = true
+  end
+
+  if sample ~= nil then
+    if m._batch == nil then
+      m._batch = {}
+      m._batchT = m._ms
+    end
+    sample.d = m._ms - m._batchT
+    table.insert(m._batch, sample)
+  end
+
+  if m._batch ~= nil and (isKey or #m._batch >= m.maxSamples or m._ms - m._batchT >= m.batchMs) then
+    m.flush()
+  end
+end
+
+-- Send what's waiting now
+function m.flush()
+  if m._batch == nil then
+    m._isKey = false
+    return
+  end
+  m._seq = m._seq + 1
+  local tl = { Seq = m._seq, T = m._batchT, S = m._batch }
+  if m._isKey then tl.K = true end
+  m._batch = nil
+  m._isKey = false
+  if m.isDebug then print("Telemetry seq " .. m._seq .. " samples " .. #tl.S) end
+  if m._send ~= nil then
+    m._send({Tl = tl})
+  end
+end
+
+-- Send every field with the next tick, i.e. when a new listener shows up
+function m.keyframe()
+  m._nextKeyMs = m._ms
+end
+
+function m.start()
+  if m._tmr ~= nil then
+    print("Telemetry already running")
+    return false
+  end
+  m._ms = 0
+  m._nextKeyMs = 0
+  for i, f in ipairs(m._fields) do
+    f.nextMs = 0
+    f.last = nil
+  end
+  m._tmr = tmr.create()
+  m._tmr:alarm(m.tickMs, tmr.ALARM_AUTO, m._tick)
+  return true
+end
+
+function m.stop()
+  if m._tmr ~= nil then
+    m._tmr:unregister()
+    m._tmr = nil
+  end
+  m.flush()
+end
+
+function m.isRunning()
+  return m._tmr ~= nil
+end
+
+return m
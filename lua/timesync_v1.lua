@@ -0,0 +1,214 @@
+-- Clock sync between Cayenn devices
+-- Several boards driving one machine, i.e. the joints of an arm, only
+-- get their moves over WiFi, so each one starts whenever its command
+-- happens to land. This keeps every board's idea of the master board's
+-- clock, so a move can be scheduled for a shared time and each board
+-- starts it at that time on its own clock with rmttx startAt().
+--
+-- NTP style. A slave sends the master a small UDP request stamped with
+-- its clock (T1). The master stamps when it got it (T2) and when it
+-- answered (T3), and the slave stamps when the answer came (T4).
+--   delay  = (T4 - T1) - (T3 - T2)
+--   offset = ((T2 - T1) + (T3 - T4)) / 2
+-- WiFi delay jumps around a lot, so out of each round of samples we only
+-- keep the one with the least delay. The offsets of the last few rounds
+-- give us the drift between the two crystals by least squares, so the
+-- estimate stays good between rounds.
+--
+-- On the wire, raw JSON over UDP to port 8988, not wrapped in JsonTag:
+-- {"Cmd":"TimeSync","Seq":12,"T1":5300123}
+-- {"Resp":"TimeSync","Seq":12,"T1":5300123,"T2":912000456,"T3":912000501}
+--
+-- To use:
+-- ts = require("timesync_v1")
+-- ts.init({ send = function(ip, str) cayenn.udpsock:send(8988, ip, str) end })
+-- ts.start("10.0.0.10") -- the master's ip
+-- ...
+-- local localUs = ts.toLocal(masterUs)
+
+local m = {}
+-- m = {}
+
+m.samplesPerRound = 8 -- requests per round, we keep the one with least delay
+m.sampleMs = 50 -- between requests in a round
+m.roundMs = 2000 -- between rounds once synced
+m.maxRounds = 8 -- rounds the drift is fit over
+m.maxDelayUs = 20000 -- round trips slower than this are thrown away
+
+m.isDebug = false
+
+m._send = nil
+m._masterIp = nil
+m._tmr = nil
+m._seq = 0
+m._pending = {} -- T1 by Seq for requests we're waiting on
+m._round = {} -- samples this round, {t, offset, delay}
+m._rounds = {} -- best sample of each recent round, oldest first
+m._offset = nil -- master - local at _t0
+m._drift = 0 -- change in offset per local us
+m._t0 = 0
+m._delay = nil -- round trip of the best sample in the last round
+
+-- Our clock, microseconds. rmttx.now() is the same clock startAt() uses.
+function m.now()
+  if rmttx ~= nil then return rmttx.now() end
+  return tmr.now()
+end
+
+-- { send = fn(ip, str), samplesPerRound = 8, roundMs = 2000, isDebug = false }
+function m.init(tbl)
+  if tbl ~= nil then
+    if tbl.send ~= nil then m._send = tbl.send end
+    if tbl.samplesPerRound ~= nil then m.samplesPerRound = tbl.samplesPerRound end
+    if tbl.sampleMs ~= nil then m.sampleMs = tbl.sampleMs end
+    if tbl.roundMs ~= nil then m.roundMs = tbl.roundMs end
+    if tbl.maxRounds ~= nil then m.maxRounds = tbl.maxRounds end
+    if tbl.isDebug ~= nil then m.isDebug = tbl.isDebug end
+  end
+end
+
+-- Start syncing to the master at ip. Starting again with a new ip starts over.
+function m.start(ip)
+  m.stop()
+  m._masterIp = ip
+  m._round = {}
+  m._rounds = {}
+  m._pending = {}
+  m._offset = nil
+  m._drift = 0
+  m._delay = nil
+  m._tmr = tmr.create()
+  m._tmr:alarm(m.sampleMs, tmr.ALARM_SINGLE, m._poll)
+end
+
+function m.stop()
+  if m._tmr ~= nil then
+    m._tmr:unregister()
+    m._tmr = nil
+  end
+end
+
+-- Send the next request of the round, or wait for the next round
+function m._poll()
+  if m._tmr == nil then return end
+  m._seq = m._seq + 1
+  local t1 = m.now()
+  m._pending[m._seq] = t1
+  -- forget requests whose answer got lost
+  m._pending[m._seq - m.samplesPerRound] = nil
+  if m._send ~= nil then
+    m._send(m._masterIp, '{"Cmd":"TimeSync","Seq":' .. m._seq .. ',"T1":' .. string.format("%.0f", t1) .. '}')
+  end
+
+  if m._seq % m.samplesPerRound == 0 then
+    -- give the last answer time to come back, then wrap up the round
+    m._tmr:alarm(m.sampleMs, tmr.ALARM_SINGLE, function()
+      m._endRound()
+      if m._tmr ~= nil then m._tmr:alarm(m.roundMs, tmr.ALARM_SINGLE, m._poll) end
+    end)
+  else
+    m._tmr:alarm(m.sampleMs, tmr.ALARM_SINGLE, m._poll)
+  end
+end
+
+-- Master side. Call with the request and the time it came in, as early
+-- in the receive as you can get it. Returns the answer to send back.
+function m.onRequest(tbl, rxUs)
+  return '{"Resp":"TimeSync","Seq":' .. tostring(tbl.Seq) ..
+    ',"T1":' .. string.format("%.0f", tbl.T1) ..
+    ',"T2":' .. string.format("%.0f", rxUs) ..
+    ',"T3":' .. string.format("%.0f", m.now()) .. '}'
+end
+
+-- Slave side. Call with the master's answer and the time it came in.
+function m.onResponse(tbl, rxUs)
+  local t1 = m._pending[tbl.Seq]
+  if t1 == nil or t1 ~= tbl.T1 then return end
+  m._pending[tbl.Seq] = nil
+  m.addSample(t1, tbl.T2, tbl.T3, rxUs)
+end
+
+-- One exchange's four timestamps
+function m.addSample(t1, t2, t3, t4)
+  local delay = (t4 - t1) - (t3 - t2)
+  if delay < 0 or delay > m.maxDelayUs then return end
+  local offset = ((t2 - t1) + (t3 - t4)) / 2
+  table.insert(m._round, { t = t1 + (t4 - t1) / 2, offset = offset, delay = delay })
+end
+
+-- Keep the least delayed sample of the round and refit the drift
+function m._endRound()
+  local best = nil
+  for i, s in ipairs(m._round) do
+    if best == nil or s.delay < best.delay then best = s end
+  end
+  m._round = {}
+  if best == nil then return end
+
+  table.insert(m._rounds, best)
+  if #m._rounds > m.maxRounds then table.remove(m._rounds, 1) end
+  m._delay = best.delay
+
+  -- least squares of offset against our time. times are taken from the
+  -- newest point so the sums stay small
+  local n = #m._rounds
+  local t0 = best.t
+  local sx, sy, sxx, sxy = 0, 0, 0, 0
+  for i, s in ipairs(m._rounds) do
+    local x = s.t - t0
+    sx = sx + x
+    sy = sy + s.offset
+    sxx = sxx + x * x
+    sxy = sxy + x * s.offset
+  end
+  local den = n * sxx - sx * sx
+  local drift = 0
+  if n >= 3 and den > 0 then
+    drift = (n * sxy - sx * sy) / den
+  end
+  m._drift = drift
+  m._t0 = t0
+  m._offset = (sy - drift * sx) / n
+
+  if m.isDebug then
+    print("TimeSync offset:", m._offset, "drift ppm:", drift * 1000000, "delay:", best.delay)
+  end
+end
+
+function m.isSynced()
+  return m._offset ~= nil
+end
+
+-- Our clock to the master's. Same time if we're not synced, i.e. we are the master.
+function m.toMaster(localUs)
+  if m._offset == nil then return localUs end
+  return localUs + m._offset + m._drift * (localUs - m._t0)
+end
+
+-- The master's clock to ours
+function m.toLocal(masterUs)
+  if m._offset == nil then return masterUs end
+  -- solve masterUs = l + offset + drift * (l - t0) for l
+  return (masterUs - m._offset + m._drift * m._t0) / (1 + m._drift)
+end
+
+-- The master's clock right now
+function m.masterNow()
+  return m.toMaster(m.now())
+end
+
+-- For a status reply
+function m.getStatus()
+  local tbl = {}
+  tbl.Master = m._masterIp
+  tbl.IsSynced = m.isSynced()
+  tbl.Now = m.masterNow()
+  if m._offset ~= nil then
+    tbl.OffsetUs = math.floor(m._offset + 0.5)
+    tbl.DriftPpm = math.floor(m._drift * 1000000 * 100 + 0.5) / 100
+    tbl.DelayUs = m._delay
+  end
+  return tbl
+end
+
+return m
@@ -26,11 +26,23 @@ tmp.adcMaxReading = 1024 -- 2^10 =  2^12 bits = 4096
 
 tmp.isDebug = false
 
+-- last reading, so status and telemetry don't have to sample the ADC again
+tmp.lastTempC = nil
+tmp.lastIsWarning = false
+tmp.lastIsEmergency = false
+
 tmp._cb = nil
 
+-- With the adcsampler C module in the firmware the ADC is sampled in the
+-- background and read() just takes its filtered value, so reading the
+-- temperature never holds up the Lua VM. Without it we loop on adc.read().
+tmp.sampler = nil
+tmp.sampleIntervalUs = 20000 -- 50 samples a second
+tmp.sampleFilterShift = 4 -- each sample moves the average 1/16th of the way
+
 -- Pass in callback to be called on each temperature loop reading
 -- Pass in isDebug for extra debug info
--- { cb=myfunc, isDebug=false, samplesToRead=1, measureIntervalMs=1000 }
+-- { cb=myfunc, isDebug=false, samplesToRead=1, measureIntervalMs=1000, sampleIntervalUs=20000 }
 function tmp.init(tbl)
    
   if tbl ~= nil then
@@ -38,16 +50,30 @@ function tmp.init(tbl)
     if tbl.isDebug ~= nil then tmp.isDebug = tbl.isDebug end
     if tbl.samplesToRead ~= nil then tmp.samplesToRead = tbl.samplesToRead end
     if tbl.measureIntervalMs ~= nil then tmp.measureIntervalMs = tbl.measureIntervalMs end
+    if tbl.sampleIntervalUs ~= nil then tmp.sampleIntervalUs = tbl.sampleIntervalUs end
   end
   
   -- adc.ATTEN_0db The input voltage of ADC will be reduced to about 1/1 (1.1V when VDD_A=3.3V)
   -- adc.ATTEN_2_5db The input voltage of ADC will be reduced to about 1/1.34 (1.5V when VDD_A=3.3V)
   -- adc.ATTEN_6db The input voltage of ADC will be reduced to about 1/2 (2.2V when VDD_A=3.3V)
   -- adc.ATTEN_11db The input voltage of ADC will be reduced to about 1/3.6 (3.9V when VDD_A=3.3V, maximum voltage is limited by VDD_A)
-  adc.setup(adc.ADC1, tmp.adcChannel, adc.ATTEN_0db)
-  
-  -- bits One of 9/10/11/12.
-  adc.setwidth(adc.ADC1, tmp.adcBits)
+  if adcsampler ~= nil then
+    if tmp.sampler ~= nil then tmp.sampler:unregister() end
+    tmp.sampler = adcsampler.create({
+      channel = tmp.adcChannel,
+      atten = 0, -- adc.ATTEN_0db
+      bits = tmp.adcBits, -- bits One of 9/10/11/12.
+      intervalUs = tmp.sampleIntervalUs,
+      oversample = 4,
+      filterShift = tmp.sampleFilterShift,
+    })
+    tmp.sampler:start()
+  else
+    adc.setup(adc.ADC1, tmp.adcChannel, adc.ATTEN_0db)
+    
+    -- bits One of 9/10/11/12.
+    adc.setwidth(adc.ADC1, tmp.adcBits)
+  end
   
   if isDebug == true then 
     tmp.isDebug = true
@@ -71,21 +97,29 @@ end
 
 tmp.samplesToRead = 1
 -- @return tempDegC
+-- samples is only used without adcsampler, the sampler already averages
 function tmp.read(samples)
   
-  -- see if they wanted to override number of samples
-  if samples == nil then
-    samples = tmp.samplesToRead
-  end 
+  local val = nil
+  if tmp.sampler ~= nil then
+    val = tmp.sampler:read()
+  end
   
-  -- since this is a 12bit read, the max val is 4096
-  -- with 0db atten we max at 1.1v, but the Tmp36 could go above that
-  -- for really high temps
-  local total = 0
-  for i=1,samples do
-    total = total + adc.read(adc.ADC1, tmp.adcChannel)
+  if val == nil then
+    -- see if they wanted to override number of samples
+    if samples == nil then
+      samples = tmp.samplesToRead
+    end 
+    
+    -- since this is a 12bit read, the max val is 4096
+    -- with 0db atten we max at 1.1v, but the Tmp36 could go above that
+    -- for really high temps
+    local total = 0
+    for i=1,samples do
+      total = total + adc.read(adc.ADC1, tmp.adcChannel)
+    end
+    val = total / samples
   end
-  local val = total / samples
   
   local volts = val/tmp.adcMaxReading -- normalize by the maximum temperature raw reading range. we are using 12bits so 2^12 = 4096
   -- calculate temperature celsius from voltage as per the equation found on the sensor spec sheet.
@@ -103,7 +137,7 @@ function tmp.read(samples)
   local isTempEmergency = false
   local isTempWarning = false
   if temp > tmp.degCToEmergencyStop then 
-    isEmergency = true
+    isTempEmergency = true
     print("Motor is over tempearature. Stopping.")
     -- localTime = time.getlocal()
     -- print(string.format("%02d:%02d:%02d",  localTime["hour"], localTime["min"], localTime["sec"]))
@@ -123,7 +157,10 @@ function tmp.read(samples)
     
   end
   
-  return tmp.round(temp,1), isTempWarning, isTempEmergency
+  tmp.lastTempC = tmp.round(temp,1)
+  tmp.lastIsWarning = isTempWarning
+  tmp.lastIsEmergency = isTempEmergency
+  return tmp.lastTempC, isTempWarning, isTempEmergency
 end
 
 function tmp.loop()
@@ -142,6 +179,14 @@ function tmp.stop()
   tmp.tmr:unregister()
 end
 
+-- Min, max and count of the raw samples since the last call, from adcsampler.
+-- nil without it.
+function tmp.getSampleStats()
+  if tmp.sampler == nil then return nil end
+  local avg, min, max, count = tmp.sampler:read(true)
+  return { Avg = avg, Min = min, Max = max, Count = count }
+end
+
 -- tmp.init(true)
 -- tmp.loop()
 
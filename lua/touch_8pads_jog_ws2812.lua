@@ -10,8 +10,17 @@ m.jog = nil --require("jog_v2")
 
 m.pad = {2,3,4,5,6,7,8,9} -- 6=GPIO14
 
--- set length of timer to trigger untouch event (100ms default)
-m.msUntilBtnUntouched = 200
+-- set true to decode the dial pads in C with touch.createSlider() instead
+-- of getNarrowIndex()/wasIncrOrDecr(). only the center pad uses touch.create().
+m.useSlider = false
+m.dialPads = {3,4,5,6,7,8,9} -- dial pads in order around the ring. 9 sits next to 3.
+m.sliderResolution = 100 -- slider position units per pad
+
+-- release is detected in C by reading the pads every stateMs and needs
+-- debounce reads in a row above the threshold, so untouch is seen within
+-- stateMs * debounce of the finger lifting
+m.stateMs = 20
+m.debounce = 2
 
 m.jogFreqIncrement = 5 --40
 m.jogMaxFreq = 500 --* 8
@@ -24,6 +33,7 @@ m._isInitted = false
 -- Pass in table of vals to init with:
 -- {
 --   cbOnCenterBtnTouch = yourfunc(event, usec), -- event:0 is touch, event:1 is untouch, usec is delta from touch
+--   cbOnCenterBtnGesture = yourfunc(gesture, a), -- gesture is touch.GESTURE_TAP, _DOUBLE_TAP or _LONG_PRESS, a is ms
 --   motor = motorObj, -- in case you did your own drv8825 lib
 --   isDebug=false
 -- }
@@ -39,14 +49,28 @@ function m.init(tbl)
   if tbl ~= nil then
     if tbl.jogFreqIncrement ~= nil then m.jogFreqIncrement = tbl.jogFreqIncrement end
     if tbl.cbOnCenterBtnTouch ~= nil then m._cbOnCenterBtnTouch = tbl.cbOnCenterBtnTouch end
+    if tbl.cbOnCenterBtnGesture ~= nil then m._cbOnCenterBtnGesture = tbl.cbOnCenterBtnGesture end
     -- if tbl.motor ~= nil then m.motor = tbl.motor end
     if tbl.led ~= nil then m.led = tbl.led end
     if tbl.jog ~= nil then m.jog = tbl.jog end
     if tbl.isDebug ~= nil then m.isDebug = tbl.isDebug end
+    if tbl.useSlider ~= nil then m.useSlider = tbl.useSlider end
+  end
+  
+  local pads = m.pad
+  if m.useSlider then
+    pads = {2} -- just the center button
+    m._slider = touch.createSlider({
+      pads = m.dialPads,
+      wheel = true,
+      cb = m.onSlider,
+      rateMs = 20,
+      resolution = m.sliderResolution,
+    })
   end
   
   m._tp = touch.create({
-    pad = m.pad, -- pad = 0 || {0,1,2,3,4,5,6,7,8,9} 0=GPIO4, 1=GPIO0, 2=GPIO2, ...
+    pad = pads, -- pad = 0 || {0,1,2,3,4,5,6,7,8,9} 0=GPIO4, 1=GPIO0, 2=GPIO2, ...
     cb = m.onTouch, -- Callback will get Lua table of pads/bool(true) that were touched.
     intrInitAtStart = false, -- Turn on interrupt at start. Default to true. 
     -- thres = 720, -- Defaults to 0. All pads set to this thres. 
@@ -55,6 +79,14 @@ function m.init(tbl)
     lvolt = touch.TOUCH_LVOLT_0V5, -- Touch sensor low reference voltage TOUCH_LVOLT_0V4, 
     hvolt = touch.TOUCH_HVOLT_2V7, -- Touch sensor high reference voltage TOUCH_HVOLT_2V4, 
     atten = touch.TOUCH_HVOLT_ATTEN_1V, -- High ref attenuation TOUCH_HVOLT_ATTEN_0V, 
+    pressCb = m.onPress, -- explicit press/release per pad so we don't have to time out
+    stateMs = m.stateMs,
+    debounce = m.debounce,
+    hysteresisPct = 10,
+    gestureCb = m.onGesture, -- tap, double tap and long press on the center button classified in C
+    tapMs = 250,
+    doubleTapMs = 300,
+    longPressMs = 600,
     isDebug = false
   })
 
@@ -69,10 +101,6 @@ function m.init(tbl)
   --   motor = tbl.motor, -- in case they passed us a drv8825 lib, nil is safe
   -- })
 
-
-  -- Setup the tmr for the callback process
-  m._tmr = tmr.create()
-  m._tmr:register(m.msUntilBtnUntouched, tmr.ALARM_SEMI, m.onTmr)
   
   -- set color purple
   m.led.set(20, 0, 20)
@@ -103,20 +131,13 @@ m._curIndex = -1
 m._jogFreq = 0
 m._padState = 0 -- 0 means untouched
 m._isCenterBtnTouched = false
-m._centerBtnTouchStartTs = {}  -- keeps track of secs/usecs on start
+m._pressed = {} -- pads the C side says are pressed
 function m.onTouch(pads)
 
   if m._padState == 0 then
     -- we just got touched
     m._padState = 1 -- 1 means touched
-    m._tmr:start()
     print("Touch: Got touch")
-  else -- m._padState == 1
-    -- we will get here on successive callbacks while touched
-    -- we get them about every 8ms
-    -- so reset the tmr so it doesn't timeout yet
-    m._tmr:stop()
-    m._tmr:start()
   end
 
   -- debounce here if still sending. we get callbacks so fast, need this
@@ -134,7 +155,6 @@ function m.onTouch(pads)
     else
       -- it wasn't touched before
       print("Touch: Center btn touched")
-      m._centerBtnTouchStartTs.sec, m._centerBtnTouchStartTs.usec = time.get()
       m._isCenterBtnTouched = true
       -- m.isSending = true
       m.led.set(100, 100, 100)
@@ -196,7 +216,56 @@ function m.onTouch(pads)
     elseif incr == nil then
       print("finger jumped too much")
     end
-  elseif incr > 0 then
+  else
+    m.jogBy(incr)
+  end
+
+
+end
+
+-- Jog dial decoded in C by touch.createSlider() when m.useSlider is on.
+-- pos runs 0 to #m.dialPads * m.sliderResolution around the ring.
+m._sliderPos = nil
+function m.onSlider(pos, dir, vel, isTouched)
+  
+  if not isTouched then
+    -- finger lifted, no need to wait on a timer to find out
+    m._sliderPos = nil
+    m._padState = 0
+    m.startDecelToZero()
+    m.led.set(20, 0, 20)
+    print("Touch: Dial untouched")
+    return
+  end
+  
+  if m._sliderPos == nil then
+    -- just got touched, this is where we measure from
+    m._sliderPos = pos
+    m._padState = 1
+    return
+  end
+  
+  local span = #m.dialPads * m.sliderResolution
+  local delta = pos - m._sliderPos
+  if delta > span / 2 then delta = delta - span end
+  if delta < -span / 2 then delta = delta + span end
+  
+  -- one step is half a pad, same as a getNarrowIndex() step
+  local stepSize = m.sliderResolution / 2
+  local steps = math.floor(math.abs(delta) / stepSize)
+  if steps == 0 then return end
+  if delta < 0 then steps = -steps end
+  m._sliderPos = (m._sliderPos + steps * stepSize) % span
+  
+  -- pads count up counterclockwise, so invert so clockwise is incr
+  m.jogBy(-steps)
+end
+
+-- Bump the jog frequency up (incr > 0) or down (incr < 0) and
+-- show it on the led. Each incr is one narrow index step.
+function m.jogBy(incr)
+
+  if incr > 0 then
     m.led.incrementColor()
     
     m._jogFreq = m._jogFreq + m.jogFreqIncrement
@@ -246,16 +315,36 @@ function m.onTouch(pads)
     m.jog.setfreq(math.abs(m._jogFreq), true)
     if m.jog._isPaused then m.jog.resume() end
     
-  else
-    print("got state should not")
   end
 
+end
+
+-- Press/release per pad from touch.c. The jog work is all done in
+-- onTouch(), here we only need to know when every pad has let go.
+function m.onPress(pad, isPressed, durUs)
+  if isPressed then
+    m._pressed[pad] = true
+    return
+  end
+  m._pressed[pad] = nil
+  if pad == 2 then m._centerBtnUsec = durUs end
+  if next(m._pressed) == nil then
+    m.onUntouch()
+  end
+end
 
+-- Gestures from touch.c. Only the center button has a use for them, the
+-- dial pads are jogging.
+function m.onGesture(gesture, pad, a, b, c)
+  if pad ~= 2 then return end
+  print("Touch: Center btn gesture:", gesture, "ms:", a)
+  if m._cbOnCenterBtnGesture ~= nil then
+    m._cbOnCenterBtnGesture(gesture, a)
+  end
 end
 
-function m.onTmr()
-  -- if we get the timer triggered, it means that we timed out
-  -- from touch callbacks, so we presume the touch ended
+function m.onUntouch()
+  -- every pad has been released
   m._padState = 0
   -- m.jog.pause()
   -- m._jogFreq = 0
@@ -267,12 +356,8 @@ function m.onTmr()
   if m._isCenterBtnTouched then
     -- we have untouch on center button
     m._isCenterBtnTouched = false
-    local sec, usec = time.get()
-    -- see how long the button was pressed for
-    local deltaSec = sec - m._centerBtnTouchStartTs.sec
-    local deltaUsec = usec - m._centerBtnTouchStartTs.usec
-    
-    deltaUsec = deltaUsec + (deltaSec * 1000000)
+    -- how long the button was pressed for, measured in C
+    local deltaUsec = m._centerBtnUsec or 0
     print("Touch: Center btn untouched. len of touch usec:", deltaUsec)
     
     -- do callback if user asked us
@@ -0,0 +1,522 @@
+#!/usr/bin/env python3
+"""Cayenn load generator and stand-in controller.
+
+Plays the ChiliPeppr/SPJS side of the Cayenn protocol against an actuator
+so you can measure how many commands per second it keeps up with and how
+long each one takes to get answered.
+
+It connects to the device's TCP port, tells it "i-am-your-server" so the
+device connects back to us on port 8988, then sends a mix of commands at
+a fixed rate. Each command carries a TransId and the time from sending it
+to getting the device's response with the same TransId is its latency.
+Commands not answered by the end of the drain time are counted as lost.
+
+    # 100 cmds/sec for 20 secs, mostly CmdQ uploads
+    ./cayenn_loadgen.py run --device 10.0.0.10 --rate 100 --duration 20 \\
+        --mix CmdQ=60,JogFreq=30,StatusGet=10
+
+    # find devices on the LAN
+    ./cayenn_loadgen.py discover
+
+    # no hardware: a stand-in device on this machine that answers every
+    # command after --service-ms, one at a time like the Lua VM does
+    ./cayenn_loadgen.py device --port 9000 --service-ms 2
+    ./cayenn_loadgen.py run --device 127.0.0.1 --device-port 9000 --rate 200
+
+Use --framing bin to talk cayennbin frames instead of JSON, see
+firmware/src/docs/modules/cayennbin.md. Needs nothing but Python 3.
+"""
+
+import argparse
+import json
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+CAYENN_PORT = 8988
+FRAMING_BIN = "cayennbin1"
+
+# ---------------------------------------------------------------------------
+# cayennbin frames, same format as firmware/src/components/modules/cayennbin.c
+
+MAGIC = 0xCA
+VERSION = 1
+T_NIL, T_FALSE, T_TRUE = 0x00, 0x01, 0x02
+T_I8, T_I16, T_I32 = 0x03, 0x04, 0x05
+T_F32, T_F64 = 0x06, 0x07
+T_STR8, T_STR16 = 0x08, 0x09
+T_MAP, T_ARR = 0x0A, 0x0B
+
+
+def _enc_value(v, out):
+    if v is None:
+        out.append(T_NIL)
+    elif v is True:
+        out.append(T_TRUE)
+    elif v is False:
+        out.append(T_FALSE)
+    elif isinstance(v, (int, float)) and float(v).is_integer() and -2**31 <= v < 2**31:
+        v = int(v)
+        if -128 <= v < 128:
+            out += struct.pack("<Bb", T_I8, v)
+        elif -32768 <= v < 32768:
+            out += struct.pack("<Bh", T_I16, v)
+        else:
+            out += struct.pack("<Bi", T_I32, v)
+    elif isinstance(v, (int, float)):
+        f32 = struct.pack("<f", v)
+        if struct.unpack("<f", f32)[0] == v:
+            out += bytes([T_F32]) + f32
+        else:
+            out += struct.pack("<Bd", T_F64, v)
+    elif isinstance(v, str):
+        b = v.encode()
+        if len(b) < 256:
+            out += struct.pack("<BB", T_STR8, len(b)) + b
+        else:
+            out += struct.pack("<BH", T_STR16, len(b)) + b
+    elif isinstance(v, dict):
+        out += struct.pack("<BB", T_MAP, len(v))
+        for k, kv in v.items():
+            kb = str(k).encode()
+            out += struct.pack("<B", len(kb)) + kb
+            _enc_value(kv, out)
+    elif isinstance(v, (list, tuple)):
+        out += struct.pack("<BB", T_ARR, len(v))
+        for iv in v:
+            _enc_value(iv, out)
+    else:
+        raise TypeError("can't encode %r" % (v,))
+
+
+def bin_encode(tbl):
+    payload = bytearray()
+    _enc_value(tbl, payload)
+    return struct.pack("<BBH", MAGIC, VERSION, len(payload)) + bytes(payload)
+
+
+def _dec_value(b, i):
+    t = b[i]
+    i += 1
+    if t == T_NIL:
+        return None, i
+    if t == T_FALSE:
+        return False, i
+    if t == T_TRUE:
+        return True, i
+    if t == T_I8:
+        return struct.unpack_from("<b", b, i)[0], i + 1
+    if t == T_I16:
+        return struct.unpack_from("<h", b, i)[0], i + 2
+    if t == T_I32:
+        return struct.unpack_from("<i", b, i)[0], i + 4
+    if t == T_F32:
+        return struct.unpack_from("<f", b, i)[0], i + 4
+    if t == T_F64:
+        return struct.unpack_from("<d", b, i)[0], i + 8
+    if t in (T_STR8, T_STR16):
+        if t == T_STR8:
+            n, i = b[i], i + 1
+        else:
+            n, i = struct.unpack_from("<H", b, i)[0], i + 2
+        return bytes(b[i:i + n]).decode(), i + n
+    if t == T_MAP:
+        n, i = b[i], i + 1
+        d = {}
+        for _ in range(n):
+            kn = b[i]
+            k = bytes(b[i + 1:i + 1 + kn]).decode()
+            d[k], i = _dec_value(b, i + 1 + kn)
+        return d, i
+    if t == T_ARR:
+        n, i = b[i], i + 1
+        a = []
+        for _ in range(n):
+            v, i = _dec_value(b, i)
+            a.append(v)
+        return a, i
+    raise ValueError("bad type byte 0x%02x" % t)
+
+
+class Stream:
+    """Splits a TCP byte stream into messages.
+
+    The device's tcp_client packs several messages into one segment, so
+    one receive can hold many JSON objects or frames, or part of one.
+    The first byte picks JSON or cayennbin, like the device does.
+    """
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.is_bin = None
+        self.dec = json.JSONDecoder()
+
+    def feed(self, data):
+        self.buf += data
+        msgs = []
+        if self.is_bin is None and self.buf:
+            self.is_bin = self.buf[0] == MAGIC
+        if self.is_bin:
+            while len(self.buf) >= 4:
+                if self.buf[0] != MAGIC:
+                    del self.buf[0]
+                    continue
+                n = struct.unpack_from("<H", self.buf, 2)[0]
+                if len(self.buf) < 4 + n:
+                    break
+                frame = bytes(self.buf[4:4 + n])
+                del self.buf[:4 + n]
+                try:
+                    msgs.append(_dec_value(frame, 0)[0])
+                except (ValueError, IndexError, struct.error, UnicodeDecodeError):
+                    pass
+        else:
+            text = self.buf.decode(errors="replace")
+            pos = 0
+            while True:
+                while pos < len(text) and text[pos] not in "{[":
+                    pos += 1
+                if pos >= len(text):
+                    break
+                try:
+                    obj, end = self.dec.raw_decode(text, pos)
+                except ValueError:
+                    break
+                msgs.append(obj)
+                pos = end
+            self.buf = bytearray(text[pos:].encode())
+        return msgs
+
+
+def unwrap(msg):
+    """The payload a device sent. JSON puts it in JsonTag as a string."""
+    if not isinstance(msg, dict):
+        return None
+    tag = msg.get("JsonTag", msg)
+    if isinstance(tag, str):
+        try:
+            tag = json.loads(tag)
+        except ValueError:
+            return None
+    return tag if isinstance(tag, dict) else None
+
+
+def encode_cmd(tbl, is_bin):
+    if is_bin:
+        return bin_encode(tbl)
+    return json.dumps(tbl, separators=(",", ":")).encode()
+
+
+# ---------------------------------------------------------------------------
+# the commands we send
+
+
+def make_cmd(name, trans_id, seq):
+    if name == "CmdQ":
+        return {"Cmd": "CmdQ", "TransId": trans_id, "Id": seq,
+                "RunCmd": {"Cmd": "Gcode", "Step": (seq % 400) * 10, "Fr": 800, "Acc": 400}}
+    if name == "JogFreq":
+        return {"Cmd": "JogFreq", "TransId": trans_id, "Freq": 100 + (seq % 50) * 10}
+    return {"Cmd": name, "TransId": trans_id}
+
+
+def parse_mix(s):
+    mix = []
+    for part in s.split(","):
+        name, _, weight = part.partition("=")
+        mix.append((name.strip(), float(weight) if weight else 1.0))
+    return mix
+
+
+def percentile(sorted_vals, p):
+    if not sorted_vals:
+        return float("nan")
+    k = max(0, min(len(sorted_vals) - 1, int(round(p / 100.0 * len(sorted_vals) + 0.5)) - 1))
+    return sorted_vals[k]
+
+
+# ---------------------------------------------------------------------------
+# controller side
+
+
+class Controller:
+
+    def __init__(self, args):
+        self.args = args
+        self.is_bin = args.framing == "bin"
+        self.lock = threading.Lock()
+        self.pending = {}  # TransId -> (cmd name, send time)
+        self.lat = {}  # cmd name -> [ms]
+        self.sent = {}
+        self.errs = 0  # responses with an Err
+        self.stray = 0  # responses with a TransId we didn't send
+        self.inflight_cv = threading.Condition(self.lock)
+
+    def listen(self):
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(("0.0.0.0", self.args.listen_port))
+        srv.listen(4)
+        threading.Thread(target=self._accept, args=(srv,), daemon=True).start()
+
+    def _accept(self, srv):
+        while True:
+            conn, _ = srv.accept()
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self._read, args=(conn,), daemon=True).start()
+
+    def _read(self, conn):
+        stream = Stream()
+        while True:
+            data = conn.recv(4096)
+            if not data:
+                return
+            now = time.monotonic()
+            for msg in stream.feed(data):
+                self._on_resp(unwrap(msg), now)
+
+    def _on_resp(self, tbl, now):
+        if tbl is None or "TransId" not in tbl:
+            return
+        with self.lock:
+            p = self.pending.pop(tbl["TransId"], None)
+            if p is None:
+                self.stray += 1
+                return
+            name, t = p
+            self.lat.setdefault(name, []).append((now - t) * 1000.0)
+            if "Err" in tbl:
+                self.errs += 1
+            self.inflight_cv.notify()
+
+    def run(self):
+        a = self.args
+        self.listen()
+
+        sck = socket.create_connection((a.device, a.device_port), timeout=5)
+        sck.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        my_ip = a.server_ip or sck.getsockname()[0]
+        hello = {"Announce": "i-am-your-server", "ServerIp": my_ip}
+        if self.is_bin:
+            hello["Framing"] = FRAMING_BIN
+        sck.sendall(encode_cmd(hello, self.is_bin))
+        # give it a moment to connect back
+        time.sleep(a.settle)
+
+        mix = parse_mix(a.mix)
+        names = [m[0] for m in mix]
+        weights = [m[1] for m in mix]
+        rnd = random.Random(a.seed)
+        interval = 1.0 / a.rate
+        trans_id = 0
+        start = time.monotonic()
+        next_t = start
+        end = start + a.duration
+        stalls = 0
+
+        while True:
+            now = time.monotonic()
+            if now >= end:
+                break
+            if now < next_t:
+                time.sleep(next_t - now)
+            next_t += interval
+
+            with self.lock:
+                # don't let a stuck device pile up unlimited requests
+                while len(self.pending) >= a.max_inflight:
+                    stalls += 1
+                    if not self.inflight_cv.wait(timeout=a.timeout):
+                        break
+                trans_id += 1
+                name = rnd.choices(names, weights)[0]
+                self.sent[name] = self.sent.get(name, 0) + 1
+                self.pending[trans_id] = (name, time.monotonic())
+            sck.sendall(encode_cmd(make_cmd(name, trans_id, trans_id), self.is_bin))
+            if a.gap_ms > 0:
+                # JSON needs one object per receive on the device
+                time.sleep(a.gap_ms / 1000.0)
+
+        send_secs = time.monotonic() - start
+        deadline = time.monotonic() + a.timeout
+        while time.monotonic() < deadline:
+            with self.lock:
+                if not self.pending:
+                    break
+            time.sleep(0.01)
+        total_secs = time.monotonic() - start
+        sck.close()
+        self.report(send_secs, total_secs, stalls)
+
+    def report(self, send_secs, total_secs, stalls):
+        with self.lock:
+            lost = {}
+            for name, _ in self.pending.values():
+                lost[name] = lost.get(name, 0) + 1
+            rows = []
+            all_lat = []
+            for name in sorted(self.sent):
+                lat = sorted(self.lat.get(name, []))
+                all_lat += lat
+                rows.append((name, self.sent[name], len(lat), lost.get(name, 0), lat))
+            all_lat.sort()
+            rows.append(("all", sum(self.sent.values()), len(all_lat), sum(lost.values()), all_lat))
+
+        print("%-10s %7s %7s %6s %8s %8s %8s %8s" % ("cmd", "sent", "ok", "lost", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+        for name, sent, ok, nlost, lat in rows:
+            print("%-10s %7d %7d %6d %8.1f %8.1f %8.1f %8.1f" % (
+                name, sent, ok, nlost, percentile(lat, 50), percentile(lat, 90),
+                percentile(lat, 99), lat[-1] if lat else float("nan")))
+        sent = rows[-1][1]
+        ok = rows[-1][2]
+        print()
+        print("offered %.1f cmds/s, answered %.1f cmds/s over %.1f s" % (
+            sent / send_secs if send_secs else 0, ok / total_secs if total_secs else 0, total_secs))
+        print("errors %d, stray responses %d, waits at max-inflight %d" % (self.errs, self.stray, stalls))
+
+
+def cmd_run(args):
+    Controller(args).run()
+
+
+def cmd_discover(args):
+    """Broadcast a Cayenn Discover and print who announces."""
+    sck = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sck.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sck.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    sck.bind(("0.0.0.0", CAYENN_PORT))
+    sck.settimeout(0.2)
+    msg = json.dumps({"Cayenn": "Discover"}).encode()
+    sck.sendto(msg, (args.broadcast, CAYENN_PORT))
+    seen = set()
+    end = time.monotonic() + args.wait
+    while time.monotonic() < end:
+        try:
+            data, (ip, _) = sck.recvfrom(2048)
+        except socket.timeout:
+            continue
+        try:
+            tbl = json.loads(data)
+        except ValueError:
+            continue
+        if tbl.get("Announce") == "i-am-a-client" and ip not in seen:
+            seen.add(ip)
+            tag = unwrap(tbl) or {}
+            print("%-15s %-30s framing=%s" % (ip, tag.get("Name", tbl.get("MyDeviceId", "")), tbl.get("Framing", "json")))
+    if not seen:
+        print("No devices answered")
+
+
+# ---------------------------------------------------------------------------
+# stand-in device
+
+
+class Device:
+    """Answers like a Cayenn device, one command at a time."""
+
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.back = None  # connection back to the server
+        self.is_bin = False
+        self.cnt = 0
+
+    def serve(self):
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(("0.0.0.0", self.args.port))
+        srv.listen(4)
+        print("Stand-in device on port %d, %.1f ms per command" % (self.args.port, self.args.service_ms))
+        while True:
+            conn, (peer_ip, _) = srv.accept()
+            threading.Thread(target=self._read, args=(conn, peer_ip), daemon=True).start()
+
+    def _read(self, conn, peer_ip):
+        stream = Stream()
+        while True:
+            data = conn.recv(4096)
+            if not data:
+                return
+            for tbl in stream.feed(data):
+                if isinstance(tbl, dict):
+                    # the lock stands in for the single Lua VM
+                    with self.lock:
+                        self._on_cmd(tbl, peer_ip)
+
+    def _on_cmd(self, tbl, peer_ip):
+        if tbl.get("Announce") == "i-am-your-server":
+            ip = tbl.get("ServerIp") or peer_ip
+            self.is_bin = tbl.get("Framing") == FRAMING_BIN
+            if self.back is not None:
+                self.back.close()
+            self.back = socket.create_connection((ip, self.args.server_port))
+            self.back.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            print("Server %s, framing %s" % (ip, "bin" if self.is_bin else "json"))
+            return
+        if self.back is None or "Cmd" not in tbl:
+            return
+        if self.args.service_ms > 0:
+            time.sleep(self.args.service_ms / 1000.0)
+        self.cnt += 1
+        resp = {"TransId": tbl.get("TransId"), "Resp": tbl["Cmd"]}
+        if tbl["Cmd"] == "CmdQ":
+            resp["Id"] = tbl.get("Id")
+        device_id = "chip:loadgen-ip:127.0.0.1"
+        if self.is_bin:
+            msg = bin_encode({"JsonTag": resp, "MyDeviceId": device_id})
+        else:
+            msg = json.dumps({"JsonTag": json.dumps(resp), "MyDeviceId": device_id}).encode()
+        self.back.sendall(msg)
+
+
+def cmd_device(args):
+    try:
+        Device(args).serve()
+    except KeyboardInterrupt:
+        pass
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description="Cayenn load generator and stand-in controller")
+    sub = ap.add_subparsers(dest="sub")
+
+    r = sub.add_parser("run", help="send a command mix to a device and report latency")
+    r.add_argument("--device", required=True, help="device ip")
+    r.add_argument("--device-port", type=int, default=CAYENN_PORT)
+    r.add_argument("--listen-port", type=int, default=CAYENN_PORT, help="where the device connects back to us")
+    r.add_argument("--server-ip", help="our ip as the device should see it, if not the one we connect from")
+    r.add_argument("--rate", type=float, default=50, help="commands per second")
+    r.add_argument("--duration", type=float, default=10, help="seconds to send for")
+    r.add_argument("--mix", default="CmdQ=60,JogFreq=30,StatusGet=10", help="Cmd=weight,...")
+    r.add_argument("--framing", choices=["json", "bin"], default="json")
+    r.add_argument("--max-inflight", type=int, default=64, help="unanswered commands before we wait")
+    r.add_argument("--timeout", type=float, default=3, help="seconds to wait for stragglers")
+    r.add_argument("--gap-ms", type=float, default=0, help="pause after each send so JSON commands don't share a segment")
+    r.add_argument("--settle", type=float, default=0.5, help="seconds to let the device connect back")
+    r.add_argument("--seed", type=int, default=1)
+    r.set_defaults(fn=cmd_run)
+
+    d = sub.add_parser("discover", help="list devices that answer a Cayenn Discover")
+    d.add_argument("--broadcast", default="255.255.255.255")
+    d.add_argument("--wait", type=float, default=2)
+    d.set_defaults(fn=cmd_discover)
+
+    s = sub.add_parser("device", help="run a stand-in device on this machine")
+    s.add_argument("--port", type=int, default=9000)
+    s.add_argument("--server-port", type=int, default=CAYENN_PORT)
+    s.add_argument("--service-ms", type=float, default=1, help="time spent on each command")
+    s.set_defaults(fn=cmd_device)
+
+    args = ap.parse_args(argv)
+    if not hasattr(args, "fn"):
+        ap.print_help()
+        return 1
+    args.fn(args)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
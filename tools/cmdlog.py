@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""Read and write cmdlog_v1 command logs on a PC.
+
+The board keeps its command queue (queue.log) and recorded gcode
+(gcode.log) in the record format of lua/cmdlog_v1.lua. Pull one off the
+board and this dumps it, checks it, compacts it, or writes one from JSON
+lines to put back. It's also the library tests use to make logs, torn
+ones included, and check what the board wrote.
+
+    ./cmdlog.py dump queue.log              # one JSON command per line
+    ./cmdlog.py verify gcode.log            # records, bytes, torn tail
+    ./cmdlog.py compact queue.log --out q2.log
+    ./cmdlog.py write gcode.log < moves.jsonl
+    ./cmdlog.py write gcode.log --json < moves.jsonl   # JSON records
+
+    import cmdlog
+    log = cmdlog.CmdLog("gcode.log")
+    log.append({"Step": 100, "Fr": 200, "Acc": 50})
+    log.flush()
+    for off, cmd in log.records(): ...
+
+File layout, all little endian:
+    "CLG" 0x01
+    then records of  u16 len | u8 type | payload | u32 crc32(len, type, payload)
+    type 1 is JSON text, type 2 is a cayennbin frame.
+Needs nothing but Python 3.
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+import zlib
+
+from cayenn_loadgen import MAGIC, bin_encode, _dec_value
+
+HDR = b"CLG\x01"
+TYPE_JSON = 1
+TYPE_BIN = 2
+REC_HDR_LEN = 3
+REC_CRC_LEN = 4
+MAX_PAYLOAD = 1024  # same as lua/cmdlog_v1.lua, the board decodes into a buffer this big
+
+
+def bin_decode(frame):
+    """One cayennbin frame, header included, to a Python value."""
+    if len(frame) < 4 or frame[0] != MAGIC:
+        raise ValueError("not a cayennbin frame")
+    n = struct.unpack_from("<H", frame, 2)[0]
+    if len(frame) < 4 + n:
+        raise ValueError("short cayennbin frame")
+    v, i = _dec_value(frame, 4)
+    if i != 4 + n:
+        raise ValueError("cayennbin frame length doesn't match its value")
+    return v
+
+
+def encode_record(typ, payload):
+    if len(payload) > MAX_PAYLOAD:
+        raise ValueError("record payload of %d bytes is over %d" % (len(payload), MAX_PAYLOAD))
+    hdr = struct.pack("<HB", len(payload), typ)
+    return hdr + payload + struct.pack("<I", zlib.crc32(hdr + payload) & 0xFFFFFFFF)
+
+
+def encode_cmd(cmd, is_json=False):
+    """A command, dict or JSON string, to one record."""
+    if isinstance(cmd, str):
+        return encode_record(TYPE_JSON, cmd.encode())
+    if is_json:
+        return encode_record(TYPE_JSON, json.dumps(cmd, separators=(",", ":")).encode())
+    return encode_record(TYPE_BIN, bin_encode(cmd))
+
+
+def decode_payload(typ, payload):
+    if typ == TYPE_BIN:
+        return bin_decode(payload)
+    if typ == TYPE_JSON:
+        return json.loads(payload.decode())
+    raise ValueError("unknown record type %d" % typ)
+
+
+def scan(data):
+    """Walk the records of a whole log. Yields (offset, type, payload) for
+    each good one and stops at the first short or bad one, the same place
+    the board cuts the file back to when it opens it."""
+    if data[:len(HDR)] != HDR:
+        return
+    off = len(HDR)
+    while off + REC_HDR_LEN <= len(data):
+        n, typ = struct.unpack_from("<HB", data, off)
+        end = off + REC_HDR_LEN + n + REC_CRC_LEN
+        if end > len(data):
+            return
+        crc = struct.unpack_from("<I", data, end - REC_CRC_LEN)[0]
+        if zlib.crc32(data[off:end - REC_CRC_LEN]) & 0xFFFFFFFF != crc:
+            return
+        yield off, typ, data[off + REC_HDR_LEN:end - REC_CRC_LEN]
+        off = end
+
+
+def good_length(data):
+    """Bytes of data up to the end of the last good record."""
+    if data[:len(HDR)] != HDR:
+        return 0
+    end = len(HDR)
+    for off, typ, payload in scan(data):
+        end = off + REC_HDR_LEN + len(payload) + REC_CRC_LEN
+    return end
+
+
+class CmdLog:
+    """A log file on the PC. Opening it cuts off a torn tail like the board
+    does, appends are held until flush(), and compact() rewrites it."""
+
+    def __init__(self, path, is_json=False):
+        self.path = path
+        self.is_json = is_json
+        self._buf = []
+        self.truncated = 0
+        self.recover()
+
+    def recover(self):
+        if not os.path.exists(self.path):
+            with open(self.path, "wb") as f:
+                f.write(HDR)
+            return
+        with open(self.path, "rb") as f:
+            data = f.read()
+        good = good_length(data)
+        if good == len(data):
+            return
+        self.truncated = len(data) - good
+        with open(self.path, "wb") as f:
+            f.write(data[:good] if good else HDR)
+
+    def size(self):
+        return os.path.getsize(self.path) + sum(len(r) for r in self._buf)
+
+    def append(self, cmd):
+        """Queue a command and return the offset its record will be at."""
+        off = self.size()
+        self._buf.append(encode_cmd(cmd, self.is_json))
+        return off
+
+    def flush(self):
+        if not self._buf:
+            return
+        with open(self.path, "ab") as f:
+            f.write(b"".join(self._buf))
+        self._buf = []
+
+    def records(self):
+        """(offset, command) of every good record."""
+        self.flush()
+        with open(self.path, "rb") as f:
+            data = f.read()
+        for off, typ, payload in scan(data):
+            yield off, decode_payload(typ, payload)
+
+    def read_at(self, off):
+        self.flush()
+        with open(self.path, "rb") as f:
+            data = f.read()
+        for o, typ, payload in scan(data):
+            if o == off:
+                return decode_payload(typ, payload)
+        return None
+
+    def compact(self, keep=None, out=None):
+        """Rewrite with only the records keep(cmd) is true for. Writes to out
+        if given, otherwise in place. Returns (kept, dropped)."""
+        self.flush()
+        with open(self.path, "rb") as f:
+            data = f.read()
+        recs = [HDR]
+        kept = dropped = 0
+        for off, typ, payload in scan(data):
+            if keep is None or keep(decode_payload(typ, payload)):
+                recs.append(encode_record(typ, payload))
+                kept += 1
+            else:
+                dropped += 1
+        dst = out or self.path
+        tmp = dst + ".tmp"
+        with open(tmp, "wb") as f:
+            f.write(b"".join(recs))
+        os.replace(tmp, dst)
+        return kept, dropped
+
+
+def cmd_dump(args):
+    with open(args.log, "rb") as f:
+        data = f.read()
+    for off, typ, payload in scan(data):
+        cmd = decode_payload(typ, payload)
+        if args.offsets:
+            print(off, json.dumps(cmd, separators=(",", ":")))
+        else:
+            print(json.dumps(cmd, separators=(",", ":")))
+    return 0
+
+
+def cmd_verify(args):
+    with open(args.log, "rb") as f:
+        data = f.read()
+    if data[:len(HDR)] != HDR:
+        print("%s: no CLG header" % args.log)
+        return 1
+    cnt = {TYPE_JSON: 0, TYPE_BIN: 0}
+    for off, typ, payload in scan(data):
+        cnt[typ] = cnt.get(typ, 0) + 1
+    good = good_length(data)
+    print("%s: %d records (%d bin, %d json), %d bytes, %d bytes of torn tail" % (
+        args.log, sum(cnt.values()), cnt.get(TYPE_BIN, 0), cnt.get(TYPE_JSON, 0),
+        good, len(data) - good))
+    return 0 if good == len(data) else 2
+
+
+def cmd_compact(args):
+    log = CmdLog(args.log)
+    keep = None
+    if args.drop_cmd:
+        drop = set(args.drop_cmd)
+        keep = lambda c: not (isinstance(c, dict) and c.get("Cmd") in drop)
+    kept, dropped = log.compact(keep, args.out)
+    print("kept %d, dropped %d" % (kept, dropped))
+    return 0
+
+
+def cmd_write(args):
+    if args.new and os.path.exists(args.log):
+        os.remove(args.log)
+    log = CmdLog(args.log, args.json)
+    for line in sys.stdin:
+        line = line.strip()
+        if line:
+            log.append(json.loads(line))
+    log.flush()
+    return 0
+
+
+def main(argv=None):
+    ap = argparse.ArgumentParser(description="Read and write cmdlog_v1 command logs")
+    sub = ap.add_subparsers(dest="sub")
+
+    d = sub.add_parser("dump", help="print every good record as a JSON line")
+    d.add_argument("log")
+    d.add_argument("--offsets", action="store_true", help="put each record's offset in front")
+    d.set_defaults(fn=cmd_dump)
+
+    v = sub.add_parser("verify", help="count records and report a torn tail, exits 2 if there is one")
+    v.add_argument("log")
+    v.set_defaults(fn=cmd_verify)
+
+    c = sub.add_parser("compact", help="rewrite without the torn tail, and without --drop-cmd commands")
+    c.add_argument("log")
+    c.add_argument("--out", help="write here rather than in place")
+    c.add_argument("--drop-cmd", action="append", help="drop records with this Cmd, can repeat")
+    c.set_defaults(fn=cmd_compact)
+
+    w = sub.add_parser("write", help="append JSON lines from stdin")
+    w.add_argument("log")
+    w.add_argument("--json", action="store_true", help="JSON records rather than cayennbin frames")
+    w.add_argument("--new", action="store_true", help="start a new log rather than appending")
+    w.set_defaults(fn=cmd_write)
+
+    args = ap.parse_args(argv)
+    if not hasattr(args, "fn"):
+        ap.print_help()
+        return 1
+    return args.fn(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())